@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <unistd.h>
+#include "NkeBenchmark.h"
+
+//--------------------------------------------------------------------
+
+const int NkeBenchmarkThreadCounts[] = { 0x1, 0x2, 0x4, 0x8, 0x10 };
+const int NkeBenchmarkThreadCountsNumber = sizeof( NkeBenchmarkThreadCounts ) / sizeof( NkeBenchmarkThreadCounts[ 0x0 ] );
+
+//--------------------------------------------------------------------
+
+UInt64 NkeBenchmarkNow()
+{
+    struct timespec  ts;
+    
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (UInt64)ts.tv_sec * 1000000000ULL + (UInt64)ts.tv_nsec;
+}
+
+//--------------------------------------------------------------------
+
+void NkeBenchmarkPrintHeader( __in const char* name )
+{
+    printf( "%s, %ld online processor(s)\n", name, sysconf( _SC_NPROCESSORS_ONLN ) );
+}
+
+//--------------------------------------------------------------------
+
+typedef struct _BenchmarkThreads{
+    
+    pthread_barrier_t           startBarrier;
+    NkeBenchmarkThreadRoutine   routine;
+    void*                       context;
+    volatile int                nextIndex;
+    
+} BenchmarkThreads;
+
+static void* BenchmarkThreadRoutine( void* parameter )
+{
+    BenchmarkThreads*  threads = (BenchmarkThreads*)parameter;
+    int                index = __sync_fetch_and_add( &threads->nextIndex, 0x1 );
+    
+    pthread_barrier_wait( &threads->startBarrier );
+    threads->routine( index, threads->context );
+    
+    return NULL;
+}
+
+UInt64 NkeBenchmarkRunThreads( __in int threadsNumber, __in NkeBenchmarkThreadRoutine routine, __in void* context )
+{
+    BenchmarkThreads  threads;
+    pthread_t         handles[ NKE_BENCHMARK_MAX_THREADS ];
+    
+    NKE_BENCHMARK_CHECK( threadsNumber > 0x0 && threadsNumber <= NKE_BENCHMARK_MAX_THREADS, "threads number" );
+    
+    threads.routine = routine;
+    threads.context = context;
+    threads.nextIndex = 0x0;
+    
+    //
+    // the calling thread passes the barrier with the benchmark threads to start the clock
+    //
+    pthread_barrier_init( &threads.startBarrier, NULL, threadsNumber + 0x1 );
+    
+    for( int i = 0x0; i < threadsNumber; ++i ){
+        
+        int  error = pthread_create( &handles[ i ], NULL, BenchmarkThreadRoutine, &threads );
+        NKE_BENCHMARK_CHECK( 0x0 == error, "pthread_create" );
+    }
+    
+    pthread_barrier_wait( &threads.startBarrier );
+    UInt64  startTime = NkeBenchmarkNow();
+    
+    for( int i = 0x0; i < threadsNumber; ++i )
+        pthread_join( handles[ i ], NULL );
+    
+    UInt64  elapsed = NkeBenchmarkNow() - startTime;
+    
+    pthread_barrier_destroy( &threads.startBarrier );
+    return elapsed;
+}
+
+//--------------------------------------------------------------------
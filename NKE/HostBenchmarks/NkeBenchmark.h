@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEBENCHMARK_H
+#define _NKEBENCHMARK_H
+
+#include "NkeHostKernel.h"
+#include "NkeCommon.h"
+
+//--------------------------------------------------------------------
+
+//
+// the thread counts the scaling benchmarks are run with
+//
+#define NKE_BENCHMARK_MAX_THREADS   0x10
+
+extern const int NkeBenchmarkThreadCounts[];
+extern const int NkeBenchmarkThreadCountsNumber;
+
+//--------------------------------------------------------------------
+
+//
+// called on each of the benchmark threads, threadIndex is in [0, threadsNumber)
+//
+typedef void (*NkeBenchmarkThreadRoutine)( __in int threadIndex, __in void* context );
+
+//
+// starts threadsNumber threads, releases them at once and waits for all of them to return,
+// returns the time in nanoseconds from the release to the return of the last thread
+//
+UInt64 NkeBenchmarkRunThreads( __in int threadsNumber, __in NkeBenchmarkThreadRoutine routine, __in void* context );
+
+//
+// the monotonic time in nanoseconds
+//
+UInt64 NkeBenchmarkNow();
+
+//
+// a xorshift generator, one state per thread
+//
+inline UInt32 NkeBenchmarkRandom( __inout UInt32* state )
+{
+    UInt32  x = *state;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    
+    *state = x;
+    return x;
+}
+
+//
+// prints the number of the processors the results were measured on, the scaling figures
+// above this number show the cost of the contention and the preemption, not the parallelism
+//
+void NkeBenchmarkPrintHeader( __in const char* name );
+
+//
+// fails the benchmark with the message if the condition is false, the checks stay
+// in the release build
+//
+#define NKE_BENCHMARK_CHECK( _condition, _message ) do{ \
+    if( !( _condition ) ){ \
+        fprintf( stderr, "%s:%d: check failed: %s: %s\n", __FILE__, __LINE__, #_condition, _message ); \
+        exit( 0x1 ); \
+    } \
+}while(0)
+
+//--------------------------------------------------------------------
+
+#endif // _NKEBENCHMARK_H
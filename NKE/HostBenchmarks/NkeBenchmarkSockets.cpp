@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmarkSockets.h"
+
+//--------------------------------------------------------------------
+
+#define NKE_BENCHMARK_SOCKETS_BASE      0xffffff8034a00000ULL
+#define NKE_BENCHMARK_SOCKET_SIZE       0x300
+
+//--------------------------------------------------------------------
+
+void NkeBenchmarkInitSockets()
+{
+    static bool  initialized = false;
+    
+    if( initialized )
+        return;
+    
+    NKE_BENCHMARK_CHECK( KERN_SUCCESS == NkeSocketObject::InitSocketObjectsSubsystem(), "socket objects subsystem" );
+    initialized = true;
+}
+
+//--------------------------------------------------------------------
+
+socket_t NkeBenchmarkSocket( __in UInt32 index )
+{
+    return (socket_t)( NKE_BENCHMARK_SOCKETS_BASE + (UInt64)index * NKE_BENCHMARK_SOCKET_SIZE );
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketStub* NkeBenchmarkAttachSocket( __in socket_t so )
+{
+    NkeSocketStub*  stub = NkeSocketObject::AllocateSocketStub( so, 0x1, AF_INET );
+    
+    NKE_BENCHMARK_CHECK( stub, "socket stub" );
+    return stub;
+}
+
+//--------------------------------------------------------------------
+
+void NkeBenchmarkDetachSocket( __in NkeSocketStub* stub )
+{
+    NkeSocketObject*  sockObj = NkeSocketStubToSocketObject( stub );
+    
+    if( sockObj ){
+        
+        sockObj->retain();
+        {
+            sockObj->removeFromSocketsList();
+            sockObj->acquireDetachingLockForRemoval();
+            sockObj->purgePendingQueue( NkeSocketObject::NkeSocketDataAll );
+            sockObj->checkForInjectionCompletion( NkeSocketObject::NkeSocketDataAll, true );
+        }
+        sockObj->release();
+    }
+    
+    NkeSocketObject::FreeSocketStub( stub );
+}
+
+//--------------------------------------------------------------------
+
+void NkeBenchmarkReleaseRetiredSockets()
+{
+    NkeSocketObjectBenchmarkAccess::ReleaseRetiredObjects();
+}
+
+//--------------------------------------------------------------------
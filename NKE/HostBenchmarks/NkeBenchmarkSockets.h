@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEBENCHMARKSOCKETS_H
+#define _NKEBENCHMARKSOCKETS_H
+
+#include "NkeBenchmark.h"
+#include "NkeSocketObject.h"
+
+//--------------------------------------------------------------------
+
+//
+// the socket benchmarks measure the private paths, the object's private members they use
+// are reached through this class, NkeSocketObject declares it a friend
+//
+class NkeSocketObjectBenchmarkAccess{
+
+public:
+
+    typedef NkeSocketObject::PendingPktQueueItem    PendingPktQueueItem;
+    typedef NkeSocketObject::PktPendingQueueHead    PktPendingQueueHead;
+
+    static const size_t  MemoryHeaderSize = sizeof( NkeSocketObject::NkeSocketObjectMemoryHeader );
+    static const size_t  SocketSlotSize = sizeof( NkeSocketObject::NkeSocketSlot );
+
+    static IORWLock* SocketsListLock(){ return NkeSocketObject::SocketsListLock; }
+    static SInt32* RetiredSocketsCount(){ return &NkeSocketObject::RetiredSocketsCount; }
+    static void ReleaseRetiredObjects(){ NkeSocketObject::ReleaseRetiredObjects(); }
+
+    //
+    // the lists are traversed under SocketsListLock
+    //
+    static NkeSocketObject* FirstInList(){ return TAILQ_FIRST( &NkeSocketObject::SocketsList ); }
+    static NkeSocketObject* NextInList( __in NkeSocketObject* sockObj ){ return TAILQ_NEXT( sockObj, socketListEntry ); }
+
+    static UInt32 SocketToHashIndex( __in socket_t so ){ return NkeSocketObject::SocketToHashIndex( so ); }
+    static NkeSocketObject* FirstInHash( __in UInt32 hashIndex ){ return TAILQ_FIRST( &NkeSocketObject::SocketsHash[ hashIndex ] ); }
+    static NkeSocketObject* NextInHash( __in NkeSocketObject* sockObj ){ return TAILQ_NEXT( sockObj, socketHashEntry ); }
+
+    static socket_t Socket( __in NkeSocketObject* sockObj ){ return sockObj->socket; }
+    static const NkeSocketID* SocketId( __in NkeSocketObject* sockObj ){ return &sockObj->socketId; }
+
+    static void LockExclusive( __in NkeSocketObject* sockObj ){ sockObj->LockExclusive(); }
+    static void UnlockExclusive( __in NkeSocketObject* sockObj ){ sockObj->UnlockExclusive(); }
+
+    //
+    // the pending queues are changed under the object's lock
+    //
+    static int PendingQueueIndex( __in bool dataInbound ){ return NkeSocketObject::PendingQueueIndex( dataInbound ); }
+    static PktPendingQueueHead* PendingQueue( __in NkeSocketObject* sockObj, __in int index ){ return &sockObj->pendingQueues[ index ]; }
+
+    static PendingPktQueueItem* AllocatePkt( __in NkeSocketObject* sockObj, __in mbuf_t mbuf, __in bool dataInbound )
+    {
+        return sockObj->allocatePkt( mbuf, NULL, (sflt_data_flag_t)0x0, dataInbound );
+    }
+
+    static void IndexPendingPkt( __in NkeSocketObject* sockObj, __in PendingPktQueueItem* pendingPkt ){ sockObj->indexPendingPkt( pendingPkt ); }
+    static UInt32 PendingIndexSize( __in NkeSocketObject* sockObj ){ return sockObj->pendingIndexSize; }
+    static UInt32 PendingUnindexedPackets( __in NkeSocketObject* sockObj ){ return sockObj->pendingUnindexedPackets; }
+};
+
+//--------------------------------------------------------------------
+
+//
+// initializes the socket objects subsystem once for the process
+//
+void NkeBenchmarkInitSockets();
+
+//
+// returns a socket_t value for the index, the values are spaced as the kernel's socket
+// allocations so the hash function sees the same low bits as in the kernel
+//
+socket_t NkeBenchmarkSocket( __in UInt32 index );
+
+//
+// the filter's attach callback, only a stub is allocated
+//
+NkeSocketStub* NkeBenchmarkAttachSocket( __in socket_t so );
+
+//
+// the filter's detach callback, the stub's object is detached as NkeSocketFilter::DetachSocketObject
+// does and the stub is freed, the object is released by NkeBenchmarkReleaseRetiredSockets
+//
+void NkeBenchmarkDetachSocket( __in NkeSocketStub* stub );
+
+//
+// releases the detached objects after a grace period as the injection thread does
+//
+void NkeBenchmarkReleaseRetiredSockets();
+
+//--------------------------------------------------------------------
+
+#endif // _NKEBENCHMARKSOCKETS_H
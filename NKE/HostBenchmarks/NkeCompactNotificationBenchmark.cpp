@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmark.h"
+#include "NkeNotificationRing.h"
+#include "NkeUserToKernel.h"
+
+//--------------------------------------------------------------------
+
+//
+// the notifications a socket filter queue holds for the connection mixes with the full and
+// the compact notifications, the notifications are enqueued by the ring into an empty queue of
+// the driver's default size until a reservation fails as the socket filter does when the client
+// doesn't dequeue, then the queue is drained as the client does and the notifications are checked,
+// the wasted space at the queue's end is included
+//
+#define BENCHMARK_QUEUE_SIZE        0x100000
+#define BENCHMARK_MAX_PROFILES      0x4
+#define BENCHMARK_MAX_EVENTS        0x30
+#define BENCHMARK_STREAM_RING       0x8
+
+typedef struct _BenchmarkEvent{
+    NkeSocketFilterEvent    event;
+
+    //
+    // the slices of a data notification or BENCHMARK_STREAM_RING for the data in a stream ring
+    //
+    UInt32                  slicesNumber;
+} BenchmarkEvent;
+
+//
+// the notifications of a connection in the order the socket filter reports them
+//
+typedef struct _BenchmarkProfile{
+    UInt32          eventsNumber;
+    BenchmarkEvent  events[ BENCHMARK_MAX_EVENTS ];
+} BenchmarkProfile;
+
+typedef struct _BenchmarkMix{
+    const char*              name;
+    const BenchmarkProfile*  profiles[ BENCHMARK_MAX_PROFILES ];
+    UInt32                   percents[ BENCHMARK_MAX_PROFILES ];
+} BenchmarkMix;
+
+#define BENCHMARK_OPEN      { NkeSocketFilterEventConnected, 0x0 }, { NkeSocketFilterEventDataOut, 0x1 }
+#define BENCHMARK_CLOSE     { NkeSocketFilterEventCantrecvmore, 0x0 }, { NkeSocketFilterEventDisconnected, 0x0 }, \
+                            { NkeSocketFilterEventClosing, 0x0 }
+#define BENCHMARK_IN(n)     { NkeSocketFilterEventDataIn, n }
+#define BENCHMARK_RING      BENCHMARK_IN( BENCHMARK_STREAM_RING )
+
+//
+// a request and a response of a few segments, one of them split between two slices by the arena,
+// a transfer through the stream ring, a connection refused by the peer
+//
+static const BenchmarkProfile  ProfileRequest = { 0x9, { BENCHMARK_OPEN, BENCHMARK_IN( 0x1 ), BENCHMARK_IN( 0x1 ),
+                                                         BENCHMARK_IN( 0x2 ), BENCHMARK_IN( 0x1 ), BENCHMARK_CLOSE } };
+
+static const BenchmarkProfile  ProfileTransfer = { 0x25, { BENCHMARK_OPEN,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING, BENCHMARK_RING,
+                                                           BENCHMARK_CLOSE } };
+
+static const BenchmarkProfile  ProfileRefused = { 0x2, { { NkeSocketFilterEventDisconnected, 0x0 },
+                                                         { NkeSocketFilterEventClosing, 0x0 } } };
+
+static const BenchmarkMix  BenchmarkMixes[] = {
+    { "requests",  { &ProfileRequest }, { 100 } },
+    { "transfers", { &ProfileTransfer }, { 100 } },
+    { "web",       { &ProfileRequest, &ProfileTransfer, &ProfileRefused }, { 75, 15, 10 } }
+};
+
+//--------------------------------------------------------------------
+
+//
+// NkeIOUserClient::GetCompactNotificationSize(), the user client is not built on the host
+//
+static UInt32 GetCompactNotificationSize( __in NkeSocketFilterEvent event, __in UInt32 slicesNumber )
+{
+    UInt32  headerSize = __offsetof( NkeSocketFilterNotification, eventData );
+
+    switch( event ){
+
+        case NkeSocketFilterEventConnected:
+            return headerSize + sizeof( NkeSocketFilterEventConnectedData );
+
+        case NkeSocketFilterEventDataIn:
+        case NkeSocketFilterEventDataOut:
+            return headerSize + __offsetof( NkeSocketFilterEventIoData, slices ) + slicesNumber * sizeof( NkeDataSlice );
+
+        case NkeSocketFilterEventDataArenaResized:
+            return headerSize + sizeof( NkeSocketFilterEventDataArenaResizedData );
+
+        default:
+            return headerSize;
+    } // end switch
+}
+
+//--------------------------------------------------------------------
+
+static const BenchmarkProfile* NextProfile( __in const BenchmarkMix* mix, __inout UInt32* random )
+{
+    UInt32  percent = NkeBenchmarkRandom( random ) % 100;
+
+    for( int i = 0x0; i < BENCHMARK_MAX_PROFILES && mix->profiles[ i ]; ++i ){
+
+        if( percent < mix->percents[ i ] )
+            return mix->profiles[ i ];
+
+        percent -= mix->percents[ i ];
+    }
+
+    NKE_BENCHMARK_CHECK( false, "the mix percents" );
+    return NULL;
+}
+
+//
+// a notification as the socket filter builds it
+//
+static void BuildNotification( __in const BenchmarkEvent* event, __in UInt32 connection, __out NkeSocketFilterNotification* notification )
+{
+    bzero( notification, sizeof( *notification ) );
+
+    notification->event = event->event;
+    notification->size = sizeof( *notification );
+    notification->socketId.slotIndex = connection;
+    notification->socketId.generation = 0x1;
+
+    if( NkeSocketFilterEventConnected == event->event ){
+
+        notification->eventData.connected.sa_family = AF_INET;
+
+    } else if( NkeSocketFilterEventDataIn == event->event || NkeSocketFilterEventDataOut == event->event ){
+
+        NkeSocketFilterEventIoData*  data = &notification->eventData.inputoutput;
+
+        data->dataSize = 0x5a8;
+        data->copiedSize = data->dataSize;
+        data->packetsNumber = 0x1;
+
+        if( BENCHMARK_STREAM_RING == event->slicesNumber ){
+
+            data->streamRing.length = kt_NkeSocketBufferSizeDefault;
+
+        } else {
+
+            for( UInt32 i = 0x0; i < event->slicesNumber; ++i )
+                data->slices[ i ].length = data->dataSize / event->slicesNumber;
+        }
+    }
+}
+
+//--------------------------------------------------------------------
+
+//
+// IODataQueueDequeue() of the client, returns NULL if the queue is empty
+//
+static IODataQueueEntry* QueueDequeue( __in IODataQueueMemory* queue, __out UInt32* newHead )
+{
+    const UInt32  head = queue->head;
+    const UInt32  tail = queue->tail;
+
+    if( head == tail )
+        return NULL;
+
+    IODataQueueEntry*  entry;
+
+    if( ( head + DATA_QUEUE_ENTRY_HEADER_SIZE ) > queue->queueSize ||
+        ( head + DATA_QUEUE_ENTRY_HEADER_SIZE + ((IODataQueueEntry*)( (UInt8*)queue->queue + head ))->size ) > queue->queueSize ){
+
+        entry = queue->queue;
+        *newHead = entry->size + DATA_QUEUE_ENTRY_HEADER_SIZE;
+
+    } else {
+
+        entry = (IODataQueueEntry*)( (UInt8*)queue->queue + head );
+        *newHead = head + entry->size + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    }
+
+    return entry;
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in const BenchmarkMix* mix, __in bool compact )
+{
+    IODataQueueMemory*  queue = (IODataQueueMemory*)calloc( 0x1, DATA_QUEUE_MEMORY_HEADER_SIZE + BENCHMARK_QUEUE_SIZE );
+
+    NKE_BENCHMARK_CHECK( queue, "queue allocation" );
+    queue->queueSize = BENCHMARK_QUEUE_SIZE;
+
+    NkeNotificationRing*  ring = NkeNotificationRing::withQueueMemory( queue );
+    NKE_BENCHMARK_CHECK( ring, "ring allocation" );
+
+    UInt32                   random = 0x2545F491;
+    UInt32                   connection = 0x0;
+    const BenchmarkProfile*  profile = NextProfile( mix, &random );
+    UInt32                   eventIndex = 0x0;
+    UInt32                   enqueued = 0x0;
+    UInt32                   dataNotifications = 0x0;
+    UInt64                   dataBytes = 0x0;
+    UInt64                   start = NkeBenchmarkNow();
+
+    while( true ){
+
+        if( profile->eventsNumber == eventIndex ){
+
+            profile = NextProfile( mix, &random );
+            eventIndex = 0x0;
+            connection += 0x1;
+        }
+
+        const BenchmarkEvent*        event = &profile->events[ eventIndex ];
+        NkeSocketFilterNotification  notification;
+
+        BuildNotification( event, connection, &notification );
+
+        if( compact )
+            notification.size = GetCompactNotificationSize( event->event,
+                                                            BENCHMARK_STREAM_RING == event->slicesNumber ? 0x0 : event->slicesNumber );
+
+        NkeNotificationReservation  reservation;
+        UInt32                      published;
+        bool                        queueWasEmpty;
+
+        if( ! ring->reserve( notification.size, &reservation ) )
+            break;
+
+        memcpy( reservation.data, &notification, notification.size );
+        ring->commit( &reservation, &published, &queueWasEmpty );
+
+        NKE_BENCHMARK_CHECK( 0x1 == published, "the entry was not published" );
+
+        if( NkeSocketFilterEventDataIn == event->event || NkeSocketFilterEventDataOut == event->event ){
+
+            dataNotifications += 0x1;
+            dataBytes += notification.eventData.inputoutput.dataSize;
+        }
+
+        enqueued += 0x1;
+        eventIndex += 0x1;
+    } // end while
+
+    UInt64  elapsed = NkeBenchmarkNow() - start;
+    UInt32  dequeued = 0x0;
+    UInt64  entriesBytes = 0x0;
+
+    //
+    // the client copies a notification in a zeroed structure
+    //
+    while( true ){
+
+        UInt32                       newHead;
+        IODataQueueEntry*            entry = QueueDequeue( queue, &newHead );
+        NkeSocketFilterNotification  notification;
+
+        if( ! entry )
+            break;
+
+        bzero( &notification, sizeof( notification ) );
+        memcpy( &notification, entry->data, entry->size );
+
+        NKE_BENCHMARK_CHECK( notification.size == entry->size, "entry size" );
+        NKE_BENCHMARK_CHECK( NkeSocketFilterEventUnknown != notification.event, "entry event" );
+
+        entriesBytes += entry->size + DATA_QUEUE_ENTRY_HEADER_SIZE;
+        queue->head = newHead;
+        dequeued += 0x1;
+    }
+
+    NKE_BENCHMARK_CHECK( dequeued == enqueued, "the queue lost notifications" );
+
+    printf( "%-9s %-7s: %6u notifications in the queue, %5.1f bytes per entry, %5.1f%% of the queue used, "
+            "%5u connections, %7.2f MB of data reported, %5.1f ns per notification\n",
+            mix->name,
+            compact ? "compact" : "full",
+            enqueued,
+            (double)entriesBytes / enqueued,
+            (double)entriesBytes * 100.0 / BENCHMARK_QUEUE_SIZE,
+            connection,
+            (double)dataBytes / ( 1024.0 * 1024.0 ),
+            (double)elapsed / enqueued );
+
+    NKE_BENCHMARK_CHECK( 0x0 != dataNotifications, "no data notifications" );
+
+    ring->release();
+    free( queue );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    NkeBenchmarkPrintHeader( "compact notifications in a 1 MB queue" );
+
+    for( int i = 0x0; i < (int)( sizeof( BenchmarkMixes ) / sizeof( BenchmarkMixes[ 0x0 ] ) ); ++i ){
+
+        RunBenchmark( &BenchmarkMixes[ i ], false );
+        RunBenchmark( &BenchmarkMixes[ i ], true );
+    }
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
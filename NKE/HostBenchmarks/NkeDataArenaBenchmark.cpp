@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmark.h"
+#include "NkeDataArena.h"
+
+//--------------------------------------------------------------------
+
+//
+// the in-flight capacity of the data arena and the allocation cost for the segment size mixes,
+// a segment's data is placed in slices as NkeSocketFilter does, the arena has the default
+// windows and doesn't grow so the capacity is compared with the fixed 64 KB buffers that held
+// one segment each before the arena, the arena is filled until a segment is not placed, then
+// a half of the segments are kept in flight while the random segments are released and the new
+// ones are allocated as the client returns the data and the sockets report new data, then
+// the arena is filled again to show the capacity left by the fragmentation
+//
+#define BENCHMARK_WINDOW_SIZE       kt_NkeSocketBufferSizeDefault
+#define BENCHMARK_WINDOWS           kt_NkeSocketBuffersNumberDefault
+#define BENCHMARK_OPERATIONS        0x100000
+#define BENCHMARK_MAX_SEGMENTS      0x10000
+#define BENCHMARK_MAX_SIZES         0x4
+
+typedef struct _BenchmarkSize{
+    UInt32  size;
+    UInt32  percent;
+} BenchmarkSize;
+
+typedef struct _BenchmarkMix{
+    const char*     name;
+    BenchmarkSize   sizes[ BENCHMARK_MAX_SIZES ];
+} BenchmarkMix;
+
+//
+// the small segments of the interactive and the request-response protocols, the full
+// segments of a transfer, a web mix of the requests, the segments and the coalesced
+// writes, the maximal writes of a bulk transfer
+//
+static const BenchmarkMix  BenchmarkMixes[] = {
+    { "small", { { 0x40, 50 }, { 0x100, 50 } } },
+    { "mss",   { { 0x5a8, 100 } } },
+    { "web",   { { 0x64, 30 }, { 0x5a8, 50 }, { 0x4000, 20 } } },
+    { "bulk",  { { 0x10000, 100 } } }
+};
+
+typedef struct _Segment{
+    UInt32        size;
+    UInt32        slicesNumber;
+    NkeDataSlice  slices[ kt_NkeSocketDataSlicesNumber ];
+} Segment;
+
+//--------------------------------------------------------------------
+
+static UInt32 NextSize( __in const BenchmarkMix* mix, __inout UInt32* random )
+{
+    UInt32  percent = NkeBenchmarkRandom( random ) % 100;
+
+    for( int i = 0x0; i < BENCHMARK_MAX_SIZES && 0x0 != mix->sizes[ i ].size; ++i ){
+
+        if( percent < mix->sizes[ i ].percent )
+            return mix->sizes[ i ].size;
+
+        percent -= mix->sizes[ i ].percent;
+    }
+
+    NKE_BENCHMARK_CHECK( false, "the mix percents" );
+    return 0x0;
+}
+
+//
+// the data is split between slices if there is no free range of the data size,
+// the segment is not placed if it needs more slices than a notification has
+//
+static bool AllocateSegment( __in NkeDataArena* arena, __in UInt32 size, __out Segment* segment )
+{
+    UInt32  residual = size;
+
+    segment->size = size;
+    segment->slicesNumber = 0x0;
+
+    while( 0x0 != residual ){
+
+        if( kt_NkeSocketDataSlicesNumber == segment->slicesNumber ||
+            ! arena->allocateSlice( residual, &segment->slices[ segment->slicesNumber ] ) ){
+
+            for( UInt32 i = 0x0; i < segment->slicesNumber; ++i )
+                NKE_BENCHMARK_CHECK( arena->releaseSlice( &segment->slices[ i ] ), "slice release" );
+
+            return false;
+        }
+
+        residual -= segment->slices[ segment->slicesNumber ].length;
+        segment->slicesNumber += 0x1;
+    } // end while
+
+    return true;
+}
+
+static void ReleaseSegment( __in NkeDataArena* arena, __in Segment* segment )
+{
+    for( UInt32 i = 0x0; i < segment->slicesNumber; ++i )
+        NKE_BENCHMARK_CHECK( arena->releaseSlice( &segment->slices[ i ] ), "slice release" );
+}
+
+//--------------------------------------------------------------------
+
+static UInt32 FillArena( __in const BenchmarkMix* mix,
+                         __in NkeDataArena* arena,
+                         __in Segment* segments,
+                         __in UInt32 segmentsNumber,
+                         __inout UInt32* random,
+                         __in const char* phase )
+{
+    UInt64  start = NkeBenchmarkNow();
+    UInt32  allocated = 0x0;
+
+    while( segmentsNumber < BENCHMARK_MAX_SEGMENTS &&
+           AllocateSegment( arena, NextSize( mix, random ), &segments[ segmentsNumber ] ) ){
+
+        segmentsNumber += 0x1;
+        allocated += 0x1;
+    }
+
+    UInt64  elapsed = NkeBenchmarkNow() - start;
+    UInt64  dataBytes = 0x0;
+    UInt64  slicesNumber = 0x0;
+    UInt32  inFlight = 0x0;
+
+    //
+    // a segment dropped by the churn has no slices
+    //
+    for( UInt32 i = 0x0; i < segmentsNumber; ++i ){
+
+        dataBytes += segments[ i ].size;
+        slicesNumber += segments[ i ].slicesNumber;
+        inFlight += ( 0x0 != segments[ i ].slicesNumber ) ? 0x1 : 0x0;
+    }
+
+    printf( "%-5s %-6s: %6u segments in flight, %5.2f slices per segment, %5.1f%% of the arena is data, "
+            "%5.1f%% allocated, %6.1f ns per segment\n",
+            mix->name,
+            phase,
+            inFlight,
+            (double)slicesNumber / inFlight,
+            (double)dataBytes * 100.0 / ( BENCHMARK_WINDOW_SIZE * BENCHMARK_WINDOWS ),
+            (double)arena->getBytesInUse() * 100.0 / ( BENCHMARK_WINDOW_SIZE * BENCHMARK_WINDOWS ),
+            (double)elapsed / MAX( allocated, 0x1 ) );
+
+    return segmentsNumber;
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in const BenchmarkMix* mix )
+{
+    NkeDataArena*  arena = NkeDataArena::withWindows( BENCHMARK_WINDOW_SIZE, BENCHMARK_WINDOWS, BENCHMARK_WINDOWS );
+    Segment*       segments = (Segment*)malloc( BENCHMARK_MAX_SEGMENTS * sizeof( Segment ) );
+    UInt32         random = 0x2545F491;
+
+    NKE_BENCHMARK_CHECK( arena && segments, "arena" );
+    NKE_BENCHMARK_CHECK( arena->reserveWindows(), "windows" );
+
+    UInt32  segmentsNumber = FillArena( mix, arena, segments, 0x0, &random, "fill" );
+
+    NKE_BENCHMARK_CHECK( segmentsNumber < BENCHMARK_MAX_SEGMENTS, "the arena was not filled" );
+
+    //
+    // the random segments are released down to a half of the capacity
+    //
+    for( UInt32 target = segmentsNumber / 0x2; segmentsNumber > target; ){
+
+        UInt32  index = NkeBenchmarkRandom( &random ) % segmentsNumber;
+
+        ReleaseSegment( arena, &segments[ index ] );
+        segments[ index ] = segments[ --segmentsNumber ];
+    }
+
+    UInt32  notAllocated = 0x0;
+    UInt64  start = NkeBenchmarkNow();
+
+    for( UInt32 i = 0x0; i < BENCHMARK_OPERATIONS; ++i ){
+
+        UInt32  index = NkeBenchmarkRandom( &random ) % segmentsNumber;
+
+        ReleaseSegment( arena, &segments[ index ] );
+
+        if( ! AllocateSegment( arena, NextSize( mix, &random ), &segments[ index ] ) ){
+
+            //
+            // the segment is dropped as the filter drops the data it can't report
+            //
+            segments[ index ].size = 0x0;
+            segments[ index ].slicesNumber = 0x0;
+            notAllocated += 0x1;
+        }
+    } // end for
+
+    UInt64  elapsed = NkeBenchmarkNow() - start;
+
+    printf( "%-5s %-6s: %6u segments in flight, %6.1f ns per segment released and allocated, %u segments not placed\n",
+            mix->name,
+            "churn",
+            segmentsNumber,
+            (double)elapsed / BENCHMARK_OPERATIONS,
+            notAllocated );
+
+    segmentsNumber = FillArena( mix, arena, segments, segmentsNumber, &random, "refill" );
+
+    for( UInt32 i = 0x0; i < segmentsNumber; ++i )
+        ReleaseSegment( arena, &segments[ i ] );
+
+    free( segments );
+    arena->release();
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    NkeBenchmarkPrintHeader( "NkeDataArena in-flight segments" );
+
+    printf( "fixed buffers: %u segments in flight, one segment of up to %u bytes per buffer\n",
+            (unsigned)BENCHMARK_WINDOWS, (unsigned)BENCHMARK_WINDOW_SIZE );
+
+    for( int i = 0x0; i < (int)( sizeof( BenchmarkMixes ) / sizeof( BenchmarkMixes[ 0x0 ] ) ); ++i )
+        RunBenchmark( &BenchmarkMixes[ i ] );
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
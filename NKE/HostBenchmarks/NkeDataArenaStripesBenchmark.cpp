@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmark.h"
+#include "NkeDataArena.h"
+
+//--------------------------------------------------------------------
+
+//
+// the stripes are private, NkeDataArena declares this class a friend
+//
+class NkeDataArenaBenchmarkAccess{
+
+public:
+
+    //
+    // all windows are placed in one stripe as the arena was before the stripes were added,
+    // the windows are not active yet so the stripe's geometry is all there is to change
+    //
+    static void UseOneStripe( __in NkeDataArena* arena )
+    {
+        arena->stripesNumber = 0x1;
+        arena->windowsPerStripe = arena->windowsNumber;
+        arena->stripes[ 0x0 ].granulesNumber = arena->granulesNumber;
+    }
+};
+
+//--------------------------------------------------------------------
+
+//
+// the slice allocation and release throughput for a number of threads, a thread keeps a few
+// segments in flight as a processor does while the client returns the data of the reported
+// segments, the striped arena is compared with the same arena with all windows in one stripe
+// as the arena was before the stripes were added, a stripe is chosen by the processor so
+// the threads running on one processor share the home stripe
+//
+#define BENCHMARK_WINDOW_SIZE       kt_NkeSocketBufferSizeDefault
+#define BENCHMARK_WINDOWS           kt_NkeSocketBuffersNumberDefault
+#define BENCHMARK_SEGMENT_SIZE      0x5a8
+#define BENCHMARK_IN_FLIGHT         0x8
+#define BENCHMARK_OPERATIONS        0x200000
+
+typedef struct _Benchmark{
+    NkeDataArena*   arena;
+    int             threadsNumber;
+} Benchmark;
+
+//--------------------------------------------------------------------
+
+static void ThreadRoutine( __in int threadIndex, __in void* context )
+{
+    Benchmark*    benchmark = (Benchmark*)context;
+    NkeDataSlice  slices[ BENCHMARK_IN_FLIGHT ];
+    int           operations = BENCHMARK_OPERATIONS / benchmark->threadsNumber;
+
+    for( int i = 0x0; i < BENCHMARK_IN_FLIGHT; ++i )
+        NKE_BENCHMARK_CHECK( benchmark->arena->allocateSlice( BENCHMARK_SEGMENT_SIZE, &slices[ i ] ), "allocation" );
+
+    //
+    // the oldest segment is returned by the client first
+    //
+    for( int i = 0x0; i < operations; ++i ){
+
+        NkeDataSlice*  slice = &slices[ i % BENCHMARK_IN_FLIGHT ];
+
+        NKE_BENCHMARK_CHECK( benchmark->arena->releaseSlice( slice ), "release" );
+        NKE_BENCHMARK_CHECK( benchmark->arena->allocateSlice( BENCHMARK_SEGMENT_SIZE, slice ), "allocation" );
+        NKE_BENCHMARK_CHECK( BENCHMARK_SEGMENT_SIZE == slice->length, "slice length" );
+    } // end for
+
+    for( int i = 0x0; i < BENCHMARK_IN_FLIGHT; ++i )
+        NKE_BENCHMARK_CHECK( benchmark->arena->releaseSlice( &slices[ i ] ), "release" );
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in bool striped, __in int threadsNumber, __in bool print )
+{
+    Benchmark  benchmark;
+
+    benchmark.arena = NkeDataArena::withWindows( BENCHMARK_WINDOW_SIZE, BENCHMARK_WINDOWS, BENCHMARK_WINDOWS );
+    benchmark.threadsNumber = threadsNumber;
+
+    NKE_BENCHMARK_CHECK( benchmark.arena, "arena" );
+
+    if( ! striped )
+        NkeDataArenaBenchmarkAccess::UseOneStripe( benchmark.arena );
+
+    NKE_BENCHMARK_CHECK( benchmark.arena->reserveWindows(), "windows" );
+
+    UInt64  elapsed = NkeBenchmarkRunThreads( threadsNumber, ThreadRoutine, &benchmark );
+    UInt64  operations = (UInt64)threadsNumber * ( BENCHMARK_OPERATIONS / threadsNumber );
+
+    NKE_BENCHMARK_CHECK( 0x0 == benchmark.arena->getBytesInUse(), "slices leaked" );
+
+    if( print )
+        printf( "%-10s threads %2d: %6.1f ns per release and allocation, %10.0f pairs/s\n",
+                striped ? "stripes" : "one stripe",
+                threadsNumber,
+                (double)elapsed / operations,
+                (double)operations * 1e9 / elapsed );
+
+    benchmark.arena->release();
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    NkeBenchmarkPrintHeader( "NkeDataArena stripes" );
+
+    //
+    // the first run warms up the allocator and the processor, its result is not printed
+    //
+    RunBenchmark( true, 0x1, false );
+
+    for( int i = 0x0; i < NkeBenchmarkThreadCountsNumber; ++i ){
+
+        RunBenchmark( false, NkeBenchmarkThreadCounts[ i ], true );
+        RunBenchmark( true, NkeBenchmarkThreadCounts[ i ], true );
+    }
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <sched.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "NkeHostKernel.h"
+
+//--------------------------------------------------------------------
+
+//
+// the same locked operation on a shared variable as the driver's barrier in NkeIOUserClient.cpp
+//
+static volatile SInt32 memoryBarrier = 0x0;
+
+void NkeMemoryBarrier()
+{
+    OSIncrementAtomic( &memoryBarrier );
+}
+
+//--------------------------------------------------------------------
+
+extern "C" int cpu_number( void )
+{
+    int  cpu = sched_getcpu();
+
+    return ( cpu < 0x0 ) ? 0x0 : cpu;
+}
+
+//--------------------------------------------------------------------
+
+void IOLog( const char* format, ... )
+{
+    static bool  enabled = ( NULL != getenv( "NKE_HOST_LOG" ) );
+
+    if( ! enabled )
+        return;
+
+    va_list  arguments;
+
+    va_start( arguments, format );
+    vfprintf( stderr, format, arguments );
+    va_end( arguments );
+}
+
+//--------------------------------------------------------------------
+
+void IOSleep( unsigned int milliseconds )
+{
+    usleep( milliseconds * 1000 );
+}
+
+//--------------------------------------------------------------------
+
+void clock_get_uptime( uint64_t* result )
+{
+    struct timespec  ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    *result = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t mach_absolute_time( void )
+{
+    uint64_t  result;
+
+    clock_get_uptime( &result );
+    return result;
+}
+
+//--------------------------------------------------------------------
+
+IOLock* IOLockAlloc( void )
+{
+    IOLock*  lock = (IOLock*)malloc( sizeof( *lock ) );
+
+    if( lock )
+        pthread_mutex_init( &lock->mutex, NULL );
+
+    return lock;
+}
+
+void IOLockFree( IOLock* lock )
+{
+    pthread_mutex_destroy( &lock->mutex );
+    free( lock );
+}
+
+//--------------------------------------------------------------------
+
+IOSimpleLock* IOSimpleLockAlloc( void )
+{
+    IOSimpleLock*  lock = (IOSimpleLock*)malloc( sizeof( *lock ) );
+
+    if( lock )
+        pthread_spin_init( &lock->spin, PTHREAD_PROCESS_PRIVATE );
+
+    return lock;
+}
+
+void IOSimpleLockFree( IOSimpleLock* lock )
+{
+    pthread_spin_destroy( &lock->spin );
+    free( lock );
+}
+
+//
+// the kernel disables the preemption while a simple lock is held, a host thread might be
+// preempted with the lock held so a waiter yields the processor instead of spinning for
+// the rest of its quantum
+//
+void IOSimpleLockLock( IOSimpleLock* lock )
+{
+    for( int spins = 0x0; 0x0 != pthread_spin_trylock( &lock->spin ); ++spins ){
+
+        if( spins >= 0x40 ){
+
+            sched_yield();
+            spins = 0x0;
+        }
+    } // end for
+}
+
+//--------------------------------------------------------------------
+
+IORWLock* IORWLockAlloc( void )
+{
+    IORWLock*  lock = (IORWLock*)malloc( sizeof( *lock ) );
+
+    if( lock )
+        pthread_rwlock_init( &lock->rwlock, NULL );
+
+    return lock;
+}
+
+void IORWLockFree( IORWLock* lock )
+{
+    pthread_rwlock_destroy( &lock->rwlock );
+    free( lock );
+}
+
+//--------------------------------------------------------------------
+
+//
+// a wait channel is hashed to a bucket, a wakeup advances the bucket's generation,
+// a waiter samples the generation before it releases the interlock so a wakeup
+// issued after the interlock is released is not lost, the waiters of the other
+// channels in the bucket are woken up spuriously as the kernel allows
+//
+#define NKE_HOST_WAIT_BUCKETS   0x40
+
+typedef struct _WaitBucket{
+    pthread_mutex_t     mutex;
+    pthread_cond_t      condition;
+    UInt64              generation;
+} WaitBucket;
+
+static WaitBucket   WaitBuckets[ NKE_HOST_WAIT_BUCKETS ];
+static bool         WaitBucketsInitialized = ( [](){
+
+    for( int i = 0x0; i < NKE_HOST_WAIT_BUCKETS; ++i ){
+
+        pthread_condattr_t  attributes;
+
+        pthread_mutex_init( &WaitBuckets[ i ].mutex, NULL );
+        pthread_condattr_init( &attributes );
+        pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+        pthread_cond_init( &WaitBuckets[ i ].condition, &attributes );
+        pthread_condattr_destroy( &attributes );
+    }
+
+    return true;
+} )();
+
+static WaitBucket* GetWaitBucket( void* channel )
+{
+    return &WaitBuckets[ ( ( (uintptr_t)channel ) >> 3 ) % NKE_HOST_WAIT_BUCKETS ];
+}
+
+int msleep( void* channel, lck_mtx_t* mutex, int priority, const char* message, struct timespec* timeout )
+{
+    WaitBucket*      bucket = GetWaitBucket( channel );
+    struct timespec  deadline;
+    int              error = 0x0;
+
+    assert( WaitBucketsInitialized );
+
+    if( timeout ){
+
+        clock_gettime( CLOCK_MONOTONIC, &deadline );
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec = deadline.tv_nsec % 1000000000L;
+    }
+
+    pthread_mutex_lock( &bucket->mutex );
+
+    UInt64  generation = bucket->generation;
+
+    if( mutex )
+        pthread_mutex_unlock( &mutex->mutex );
+
+    while( generation == bucket->generation && 0x0 == error ){
+
+        if( timeout )
+            error = pthread_cond_timedwait( &bucket->condition, &bucket->mutex, &deadline );
+        else
+            error = pthread_cond_wait( &bucket->condition, &bucket->mutex );
+    }
+
+    pthread_mutex_unlock( &bucket->mutex );
+
+    if( mutex )
+        pthread_mutex_lock( &mutex->mutex );
+
+    return ( ETIMEDOUT == error ) ? EWOULDBLOCK : 0x0;
+}
+
+void wakeup( void* channel )
+{
+    WaitBucket*  bucket = GetWaitBucket( channel );
+
+    pthread_mutex_lock( &bucket->mutex );
+    bucket->generation += 0x1;
+    pthread_cond_broadcast( &bucket->condition );
+    pthread_mutex_unlock( &bucket->mutex );
+}
+
+//--------------------------------------------------------------------
+
+typedef struct _ThreadStart{
+    thread_continue_t   continuation;
+    void*               parameter;
+} ThreadStart;
+
+static void* ThreadStartRoutine( void* context )
+{
+    ThreadStart  start = *(ThreadStart*)context;
+
+    free( context );
+    start.continuation( start.parameter, 0x0 );
+
+    return NULL;
+}
+
+kern_return_t kernel_thread_start( thread_continue_t continuation, void* parameter, thread_t* newThread )
+{
+    ThreadStart*  start = (ThreadStart*)malloc( sizeof( *start ) );
+
+    if( ! start )
+        return ENOMEM;
+
+    start->continuation = continuation;
+    start->parameter = parameter;
+
+    int  error = pthread_create( newThread, NULL, ThreadStartRoutine, start );
+    if( error ){
+
+        free( start );
+        return error;
+    }
+
+    pthread_detach( *newThread );
+    return KERN_SUCCESS;
+}
+
+void thread_terminate( thread_t thread )
+{
+    assert( pthread_equal( thread, pthread_self() ) );
+    pthread_exit( NULL );
+}
+
+//--------------------------------------------------------------------
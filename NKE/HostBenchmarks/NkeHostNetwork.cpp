@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <sys/kpi_mbuf.h>
+#include <sys/kpi_socket.h>
+#include <libkern/OSMalloc.h>
+
+//--------------------------------------------------------------------
+
+//
+// a host mbuf is a single buffer with a packet header and room for one tag,
+// the chains are built with mbuf_setnext and freed by mbuf_freem
+//
+struct __mbuf{
+    mbuf_t              next;
+    mbuf_t              nextpkt;
+    mbuf_flags_t        flags;
+    size_t              len;
+    size_t              pkthdrLen;
+    ifnet_t             rcvif;
+    UInt8*              data;
+
+    bool                tagAllocated;
+    mbuf_tag_id_t       tagId;
+    mbuf_tag_type_t     tagType;
+    size_t              tagLength;
+    void*               tagData;
+};
+
+size_t mbuf_pkthdr_len( const mbuf_t mbuf )
+{
+    return mbuf->pkthdrLen;
+}
+
+void mbuf_pkthdr_setlen( mbuf_t mbuf, size_t len )
+{
+    mbuf->pkthdrLen = len;
+}
+
+errno_t mbuf_pkthdr_setrcvif( mbuf_t mbuf, ifnet_t ifp )
+{
+    mbuf->rcvif = ifp;
+    return 0x0;
+}
+
+size_t mbuf_len( const mbuf_t mbuf )
+{
+    return mbuf->len;
+}
+
+void mbuf_setlen( mbuf_t mbuf, size_t len )
+{
+    mbuf->len = len;
+}
+
+mbuf_t mbuf_next( const mbuf_t mbuf )
+{
+    return mbuf->next;
+}
+
+errno_t mbuf_setnext( mbuf_t mbuf, mbuf_t next )
+{
+    mbuf->next = next;
+    return 0x0;
+}
+
+mbuf_t mbuf_nextpkt( const mbuf_t mbuf )
+{
+    return mbuf->nextpkt;
+}
+
+void mbuf_setnextpkt( mbuf_t mbuf, mbuf_t nextpkt )
+{
+    mbuf->nextpkt = nextpkt;
+}
+
+mbuf_flags_t mbuf_flags( const mbuf_t mbuf )
+{
+    return mbuf->flags;
+}
+
+errno_t mbuf_gethdr( mbuf_how_t how, mbuf_type_t type, mbuf_t* mbuf )
+{
+    *mbuf = (mbuf_t)calloc( 0x1, sizeof( struct __mbuf ) );
+    if( ! *mbuf )
+        return ENOMEM;
+
+    (*mbuf)->flags = MBUF_PKTHDR;
+    return 0x0;
+}
+
+errno_t mbuf_copydata( const mbuf_t mbuf, size_t offset, size_t length, void* out_data )
+{
+    UInt8*  out = (UInt8*)out_data;
+
+    for( mbuf_t current = mbuf; current && length; current = current->next ){
+
+        if( offset >= current->len ){
+
+            offset -= current->len;
+            continue;
+        }
+
+        size_t  bytes = MIN( length, current->len - offset );
+
+        memcpy( out, current->data + offset, bytes );
+        out += bytes;
+        length -= bytes;
+        offset = 0x0;
+    }
+
+    return ( 0x0 == length ) ? 0x0 : EINVAL;
+}
+
+void mbuf_freem( mbuf_t mbuf )
+{
+    while( mbuf ){
+
+        mbuf_t  next = mbuf->next;
+
+        free( mbuf->tagData );
+        free( mbuf->data );
+        free( mbuf );
+
+        mbuf = next;
+    }
+}
+
+errno_t mbuf_tag_allocate( mbuf_t mbuf, mbuf_tag_id_t module_id, mbuf_tag_type_t type, size_t length,
+                           mbuf_how_t how, void** data_p )
+{
+    if( 0x0 == ( mbuf->flags & MBUF_PKTHDR ) )
+        return EINVAL;
+
+    if( mbuf->tagAllocated )
+        return EEXIST;
+
+    mbuf->tagData = calloc( 0x1, length );
+    if( ! mbuf->tagData )
+        return ENOMEM;
+
+    mbuf->tagAllocated = true;
+    mbuf->tagId = module_id;
+    mbuf->tagType = type;
+    mbuf->tagLength = length;
+
+    *data_p = mbuf->tagData;
+    return 0x0;
+}
+
+errno_t mbuf_tag_find( mbuf_t mbuf, mbuf_tag_id_t module_id, mbuf_tag_type_t type, size_t* length, void** data_p )
+{
+    if( ! mbuf->tagAllocated || module_id != mbuf->tagId || type != mbuf->tagType )
+        return ENOENT;
+
+    *length = mbuf->tagLength;
+    *data_p = mbuf->tagData;
+    return 0x0;
+}
+
+mbuf_t NkeHostAllocatePacket( size_t length, UInt8 fill )
+{
+    mbuf_t  mbuf;
+
+    if( 0x0 != mbuf_gethdr( MBUF_WAITOK, MBUF_TYPE_DATA, &mbuf ) )
+        return NULL;
+
+    mbuf->data = (UInt8*)malloc( length ? length : 0x1 );
+    if( ! mbuf->data ){
+
+        mbuf_freem( mbuf );
+        return NULL;
+    }
+
+    memset( mbuf->data, fill, length );
+    mbuf->len = length;
+    mbuf->pkthdrLen = length;
+
+    return mbuf;
+}
+
+//--------------------------------------------------------------------
+
+//
+// the host sockets are opaque values, a socket has the default receive buffer,
+// the injected data is consumed as the stack would do
+//
+#define NKE_HOST_SOCKET_RCVBUF  0x20000
+
+errno_t sock_getsockopt( socket_t so, int level, int optname, void* optval, int* optlen )
+{
+    if( SOL_SOCKET != level || SO_RCVBUF != optname || *optlen < (int)sizeof( int ) )
+        return ENOPROTOOPT;
+
+    *(int*)optval = NKE_HOST_SOCKET_RCVBUF;
+    *optlen = sizeof( int );
+    return 0x0;
+}
+
+errno_t sock_setsockopt( socket_t so, int level, int optname, const void* optval, int optlen )
+{
+    return ( SOL_SOCKET == level && SO_RCVBUF == optname ) ? 0x0 : ENOPROTOOPT;
+}
+
+errno_t sock_inject_data_in( socket_t so, const struct sockaddr* from, mbuf_t data, mbuf_t control, sflt_data_flag_t flags )
+{
+    mbuf_freem( data );
+    mbuf_freem( control );
+    return 0x0;
+}
+
+errno_t sock_inject_data_out( socket_t so, const struct sockaddr* to, mbuf_t data, mbuf_t control, sflt_data_flag_t flags )
+{
+    mbuf_freem( data );
+    mbuf_freem( control );
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
+
+struct __OSMallocTag{
+    char    name[ 0x40 ];
+};
+
+OSMallocTag OSMalloc_Tagalloc( const char* name, UInt32 flags )
+{
+    OSMallocTag  tag = (OSMallocTag)calloc( 0x1, sizeof( *tag ) );
+
+    if( tag )
+        strncpy( tag->name, name, sizeof( tag->name ) - 0x1 );
+
+    return tag;
+}
+
+void OSMalloc_Tagfree( OSMallocTag tag )
+{
+    free( tag );
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeSocketFilter.h"
+
+//--------------------------------------------------------------------
+
+//
+// the socket objects are built without the socket filter and the user client, gSocketFilter
+// is never set so the injection thread idles and the socket filter's methods are not reached,
+// a benchmark that reaches them is broken
+//
+NkeSocketFilter*     gSocketFilter = NULL;
+
+#define NKE_HOST_NOT_REACHED()  do{ fprintf( stderr, "%s is not available on the host\n", __PRETTY_FUNCTION__ ); abort(); }while(0)
+
+NkeIOUserClient* NkeSocketFilter::getUserClient()
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+void NkeSocketFilter::releaseUserClient()
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+errno_t NkeSocketFilter::copyDataToSlices( __in const mbuf_t* mbufs,
+                                           __in UInt32 mbufsNumber,
+                                           __in size_t bytesToCopy,
+                                           __inout NkeDataSlice*  slices )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+void NkeSocketFilter::releaseDataSlicesAndDeliverNotifications( __inout NkeDataSlice*  slices )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+bool NkeSocketFilter::allocateStreamRing( __in UInt32 size, __out NkeDataSlice* ring )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+void NkeSocketFilter::releaseStreamRing( __inout NkeDataSlice* ring )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+errno_t NkeSocketFilter::copyDataToStreamRing( __in const NkeDataSlice* ring,
+                                               __in UInt32 ringOffset,
+                                               __in const mbuf_t* mbufs,
+                                               __in UInt32 mbufsNumber,
+                                               __in size_t bytesToCopy )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+UInt32 NkeSocketFilter::getCapturePolicy( __in UInt16 localPort, __in UInt16 remotePort, __out NkeCapturePolicy* policy )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+NkeSocketFilterNotification* NkeSocketFilter::ReserveSocketNotification( __in NkeIOUserClient* userClient,
+                                                                         __in NkeSocketObject* socketObject,
+                                                                         __in NkeSocketFilterEvent event,
+                                                                         __in UInt32 slicesNumber,
+                                                                         __out NkeSocketFilterReservation* reservation )
+{
+    NKE_HOST_NOT_REACHED();
+}
+
+//--------------------------------------------------------------------
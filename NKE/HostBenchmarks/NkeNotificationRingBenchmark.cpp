@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <sched.h>
+#include "NkeBenchmark.h"
+#include "NkeNotificationRing.h"
+#include "NkeWakeupModerator.h"
+
+//--------------------------------------------------------------------
+
+//
+// the producers enqueue the notifications to a socket filter queue, a consumer thread dequeues them
+// as the client does, the ring with and without the wakeup moderator is compared with the enqueueing
+// under the queue lock the ring replaced, the notification has the size of a data notification with one slice
+//
+#define BENCHMARK_QUEUE_SIZE            0x100000
+#define BENCHMARK_NOTIFICATION_SIZE     0x60
+#define BENCHMARK_NOTIFICATIONS         0x100000
+
+typedef struct _BenchmarkNotification{
+    
+    UInt32      producer;
+    UInt32      counter;
+    UInt8       body[ BENCHMARK_NOTIFICATION_SIZE - 0x8 ];
+    
+} BenchmarkNotification;
+
+typedef enum _BenchmarkMode{
+    BenchmarkModeLockedQueue = 0x0,
+    BenchmarkModeRing,
+    BenchmarkModeModeratedRing
+} BenchmarkMode;
+
+typedef struct _Benchmark{
+    
+    BenchmarkMode           mode;
+    int                     producersNumber;
+    UInt32                  notificationsPerProducer;
+    
+    IODataQueueMemory*      queue;
+    NkeNotificationRing*    ring;
+    NkeWakeupModerator*     moderator;
+    
+    //
+    // the queue lock for the locked mode, the wakeup lock for the ring mode
+    //
+    IOLock*                 lock;
+    
+    volatile SInt64         wakeups;
+    volatile SInt64         queueFull;
+    volatile bool           producersDone;
+    
+} Benchmark;
+
+//--------------------------------------------------------------------
+
+//
+// IODataQueue::enqueue() with the barrier the kernel gets from the x86 store order,
+// returns false if the queue is full, sendWakeup is set as the data available message
+// would be sent
+//
+static bool LockedQueueEnqueue( __in IODataQueueMemory* queue, __in void* data, __in UInt32 dataSize, __out bool* sendWakeup )
+{
+    const UInt32  head = queue->head;
+    const UInt32  tail = queue->tail;
+    const UInt32  entrySize = dataSize + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    UInt32        newTail;
+    
+    if( tail >= head ){
+        
+        if( ( tail + entrySize ) <= queue->queueSize ){
+            
+            IODataQueueEntry*  entry = (IODataQueueEntry*)( (UInt8*)queue->queue + tail );
+            
+            entry->size = dataSize;
+            memcpy( &entry->data, data, dataSize );
+            newTail = tail + entrySize;
+            
+        } else if( head > entrySize ){
+            
+            queue->queue->size = dataSize;
+            
+            if( ( queue->queueSize - tail ) >= DATA_QUEUE_ENTRY_HEADER_SIZE )
+                ((IODataQueueEntry*)( (UInt8*)queue->queue + tail ))->size = dataSize;
+            
+            memcpy( &queue->queue->data, data, dataSize );
+            newTail = entrySize;
+            
+        } else {
+            
+            return false;
+        }
+        
+    } else {
+        
+        if( ( head - tail ) > entrySize ){
+            
+            IODataQueueEntry*  entry = (IODataQueueEntry*)( (UInt8*)queue->queue + tail );
+            
+            entry->size = dataSize;
+            memcpy( &entry->data, data, dataSize );
+            newTail = tail + entrySize;
+            
+        } else {
+            
+            return false;
+        }
+    }
+    
+    __sync_synchronize();
+    queue->tail = newTail;
+    
+    *sendWakeup = ( head == tail || queue->head == tail );
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+//
+// IODataQueueDequeue() of the client, returns NULL if the queue is empty
+//
+static IODataQueueEntry* QueueDequeue( __in IODataQueueMemory* queue, __out UInt32* newHead )
+{
+    const UInt32  head = queue->head;
+    const UInt32  tail = queue->tail;
+    
+    if( head == tail )
+        return NULL;
+    
+    __sync_synchronize();
+    
+    IODataQueueEntry*  entry;
+    
+    if( ( head + DATA_QUEUE_ENTRY_HEADER_SIZE ) > queue->queueSize ||
+        ( head + DATA_QUEUE_ENTRY_HEADER_SIZE + ((IODataQueueEntry*)( (UInt8*)queue->queue + head ))->size ) > queue->queueSize ){
+        
+        //
+        // the entry has been wrapped to the beginning
+        //
+        entry = queue->queue;
+        *newHead = entry->size + DATA_QUEUE_ENTRY_HEADER_SIZE;
+        
+    } else {
+        
+        entry = (IODataQueueEntry*)( (UInt8*)queue->queue + head );
+        *newHead = head + entry->size + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    }
+    
+    return entry;
+}
+
+//--------------------------------------------------------------------
+
+static void* ConsumerRoutine( void* context )
+{
+    Benchmark*  benchmark = (Benchmark*)context;
+    UInt32      expectedCounters[ NKE_BENCHMARK_MAX_THREADS ] = { 0x0 };
+    UInt64      total = (UInt64)benchmark->producersNumber * benchmark->notificationsPerProducer;
+    UInt64      consumed = 0x0;
+    
+    while( consumed < total ){
+        
+        UInt32             newHead;
+        IODataQueueEntry*  entry = QueueDequeue( benchmark->queue, &newHead );
+        
+        if( ! entry ){
+            
+            sched_yield();
+            continue;
+        }
+        
+        BenchmarkNotification*  notification = (BenchmarkNotification*)entry->data;
+        
+        //
+        // the entries of a producer are published in the order they were reserved
+        //
+        NKE_BENCHMARK_CHECK( BENCHMARK_NOTIFICATION_SIZE == entry->size, "entry size" );
+        NKE_BENCHMARK_CHECK( notification->producer < (UInt32)benchmark->producersNumber, "producer index" );
+        NKE_BENCHMARK_CHECK( notification->counter == expectedCounters[ notification->producer ], "producer order" );
+        NKE_BENCHMARK_CHECK( notification->body[ sizeof( notification->body ) - 0x1 ] == (UInt8)notification->counter, "entry body" );
+        
+        expectedCounters[ notification->producer ] += 0x1;
+        
+        __sync_synchronize();
+        benchmark->queue->head = newHead;
+        
+        consumed += 0x1;
+    }
+    
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+
+static void FillNotification( __out BenchmarkNotification* notification, __in int producer, __in UInt32 counter )
+{
+    notification->producer = producer;
+    notification->counter = counter;
+    memset( notification->body, (UInt8)counter, sizeof( notification->body ) );
+}
+
+static void ProducerRoutine( __in int threadIndex, __in void* context )
+{
+    Benchmark*  benchmark = (Benchmark*)context;
+    
+    for( UInt32 counter = 0x0; counter < benchmark->notificationsPerProducer; ++counter ){
+        
+        if( BenchmarkModeLockedQueue == benchmark->mode ){
+            
+            //
+            // a notification is built on the stack and copied to the queue under the lock
+            //
+            BenchmarkNotification  notification;
+            bool                   sendWakeup;
+            
+            FillNotification( &notification, threadIndex, counter );
+            
+            IOLockLock( benchmark->lock );
+            { // start of the lock
+                
+                while( !LockedQueueEnqueue( benchmark->queue, &notification, sizeof( notification ), &sendWakeup ) ){
+                    
+                    OSIncrementAtomic64( &benchmark->queueFull );
+                    
+                    IOLockUnlock( benchmark->lock );
+                    sched_yield();
+                    IOLockLock( benchmark->lock );
+                }
+                
+                if( sendWakeup )
+                    OSIncrementAtomic64( &benchmark->wakeups );
+                
+            } // end of the lock
+            IOLockUnlock( benchmark->lock );
+            
+        } else {
+            
+            //
+            // a notification is built in place, the wakeups are sent as NkeIOUserClient::commitNotification() sends them
+            //
+            NkeNotificationReservation  reservation;
+            UInt32                      published;
+            bool                        queueWasEmpty;
+            
+            while( !benchmark->ring->reserve( BENCHMARK_NOTIFICATION_SIZE, &reservation ) ){
+                
+                OSIncrementAtomic64( &benchmark->queueFull );
+                sched_yield();
+            }
+            
+            FillNotification( (BenchmarkNotification*)reservation.data, threadIndex, counter );
+            
+            benchmark->ring->commit( &reservation, &published, &queueWasEmpty );
+            
+            for( UInt32 i = 0x0; i < published; ++i ){
+                
+                //
+                // without the moderator the client is woken up when the queue was empty
+                //
+                if( benchmark->moderator ){
+                    
+                    if( !benchmark->moderator->eventEnqueued( 0x0 == i && queueWasEmpty ) )
+                        continue;
+                    
+                } else if( !( 0x0 == i && queueWasEmpty ) ){
+                    
+                    continue;
+                }
+                
+                IOLockLock( benchmark->lock );
+                { // start of the lock
+                    
+                    OSIncrementAtomic64( &benchmark->wakeups );
+                    
+                } // end of the lock
+                IOLockUnlock( benchmark->lock );
+            } // end for
+        }
+    } // end for
+}
+
+//--------------------------------------------------------------------
+
+static void ModeratorCallback( __in void* context )
+{
+    Benchmark*  benchmark = (Benchmark*)context;
+    
+    IOLockLock( benchmark->lock );
+    { // start of the lock
+        
+        OSIncrementAtomic64( &benchmark->wakeups );
+        
+    } // end of the lock
+    IOLockUnlock( benchmark->lock );
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in BenchmarkMode mode, __in int producersNumber )
+{
+    Benchmark  benchmark;
+    
+    bzero( &benchmark, sizeof( benchmark ) );
+    
+    benchmark.mode = mode;
+    benchmark.producersNumber = producersNumber;
+    benchmark.notificationsPerProducer = BENCHMARK_NOTIFICATIONS / producersNumber;
+    
+    benchmark.queue = (IODataQueueMemory*)calloc( 0x1, DATA_QUEUE_MEMORY_HEADER_SIZE + BENCHMARK_QUEUE_SIZE );
+    NKE_BENCHMARK_CHECK( benchmark.queue, "queue allocation" );
+    benchmark.queue->queueSize = BENCHMARK_QUEUE_SIZE;
+    
+    benchmark.lock = IOLockAlloc();
+    NKE_BENCHMARK_CHECK( benchmark.lock, "lock allocation" );
+    
+    if( BenchmarkModeLockedQueue != mode ){
+        
+        benchmark.ring = NkeNotificationRing::withQueueMemory( benchmark.queue );
+        NKE_BENCHMARK_CHECK( benchmark.ring, "ring allocation" );
+    }
+    
+    if( BenchmarkModeModeratedRing == mode ){
+        
+        benchmark.moderator = NkeWakeupModerator::withCallback( ModeratorCallback, &benchmark );
+        NKE_BENCHMARK_CHECK( benchmark.moderator, "moderator allocation" );
+    }
+    
+    pthread_t  consumer;
+    UInt64     startTime = NkeBenchmarkNow();
+    
+    NKE_BENCHMARK_CHECK( 0x0 == pthread_create( &consumer, NULL, ConsumerRoutine, &benchmark ), "pthread_create" );
+    
+    NkeBenchmarkRunThreads( producersNumber, ProducerRoutine, &benchmark );
+    pthread_join( consumer, NULL );
+    
+    UInt64  elapsed = NkeBenchmarkNow() - startTime;
+    UInt64  total = (UInt64)producersNumber * benchmark.notificationsPerProducer;
+    
+    if( benchmark.moderator ){
+        
+        benchmark.moderator->stop();
+        benchmark.moderator->release();
+    }
+    
+    if( benchmark.ring )
+        benchmark.ring->release();
+    
+    static const char*  modeNames[] = { "locked", "ring", "ring+moderator" };
+    
+    printf( "%-14s producers %2d: %8.0f ns/notification %10.0f notifications/s, %6.2f wakeups per 1k notifications, %lld queue full retries\n",
+            modeNames[ mode ],
+            producersNumber,
+            (double)elapsed / total,
+            (double)total * 1e9 / elapsed,
+            (double)benchmark.wakeups * 1000.0 / total,
+            (long long)benchmark.queueFull );
+    
+    IOLockFree( benchmark.lock );
+    free( benchmark.queue );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    NkeBenchmarkPrintHeader( "NkeNotificationRing" );
+    
+    for( int i = 0x0; i < NkeBenchmarkThreadCountsNumber; ++i ){
+        
+        RunBenchmark( BenchmarkModeLockedQueue, NkeBenchmarkThreadCounts[ i ] );
+        RunBenchmark( BenchmarkModeRing, NkeBenchmarkThreadCounts[ i ] );
+        RunBenchmark( BenchmarkModeModeratedRing, NkeBenchmarkThreadCounts[ i ] );
+    }
+    
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
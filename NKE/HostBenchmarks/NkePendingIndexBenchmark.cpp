@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmarkSockets.h"
+
+//--------------------------------------------------------------------
+
+//
+// the cost of applying a verdict to one of the reported packets pending on a socket,
+// setDeferredDataProperties finds the packet through the dataIndex addressed index,
+// it is compared with the pending queues scan the verdict did before the index was added,
+// the verdicts are applied in the arrival order, in the reverse order and in a random order,
+// a verdict only marks the packet so all verdicts are applied a number of times
+//
+#define BENCHMARK_VERDICTS          0x100000
+#define BENCHMARK_SCANNED_PACKETS   0x8000000
+#define BENCHMARK_SEGMENT_SIZE      0x5a8
+
+typedef enum _BenchmarkOrder{
+    BenchmarkOrderArrival = 0x0,
+    BenchmarkOrderReverse,
+    BenchmarkOrderRandom
+} BenchmarkOrder;
+
+typedef NkeSocketObjectBenchmarkAccess::PendingPktQueueItem  PendingPktQueueItem;
+
+static const char*  BenchmarkOrderNames[] = { "arrival", "reverse", "random" };
+
+//--------------------------------------------------------------------
+
+//
+// the verdict before the index, the queues are scanned up to the first not reported packet
+//
+static void SetDeferredDataPropertiesByScan( __in NkeSocketObject* sockObj, __in NkeSocketDataProperty* property )
+{
+    NkeSocketObjectBenchmarkAccess::LockExclusive( sockObj );
+    { // start of the lock
+
+        for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i ){
+
+            PendingPktQueueItem*  pendingPkt;
+
+            TAILQ_FOREACH( pendingPkt, NkeSocketObjectBenchmarkAccess::PendingQueue( sockObj, i ), pendingQueueEntry )
+            {
+                if( pendingPkt->needToBeReported )
+                    break;
+
+                if( pendingPkt->dataIndex != property->dataIndex )
+                    continue;
+
+                pendingPkt->allowData = property->value.permission.allowData ? true : false;
+                pendingPkt->responseReceived = true;
+                goto __exit;
+            } // end TAILQ_FOREACH
+        } // end for
+
+    __exit:;
+    } // end of the lock
+    NkeSocketObjectBenchmarkAccess::UnlockExclusive( sockObj );
+}
+
+//--------------------------------------------------------------------
+
+static void RunVerdicts( __in NkeSocketObject* sockObj,
+                         __in SInt32* dataIndices,
+                         __in UInt32 packetsNumber,
+                         __in BenchmarkOrder order,
+                         __in bool scan )
+{
+    SInt32*  verdictIndices = (SInt32*)malloc( packetsNumber * sizeof( SInt32 ) );
+    UInt32   random = 0x2545F491;
+
+    NKE_BENCHMARK_CHECK( verdictIndices, "verdicts array" );
+
+    for( UInt32 i = 0x0; i < packetsNumber; ++i )
+        verdictIndices[ i ] = dataIndices[ ( BenchmarkOrderReverse == order ) ? ( packetsNumber - i - 0x1 ) : i ];
+
+    if( BenchmarkOrderRandom == order ){
+
+        for( UInt32 i = packetsNumber - 0x1; i > 0x0; --i ){
+
+            UInt32  j = NkeBenchmarkRandom( &random ) % ( i + 0x1 );
+            SInt32  index = verdictIndices[ i ];
+
+            verdictIndices[ i ] = verdictIndices[ j ];
+            verdictIndices[ j ] = index;
+        }
+    }
+
+    UInt32  verdicts = BENCHMARK_VERDICTS;
+
+    if( scan )
+        verdicts = MIN( verdicts, BENCHMARK_SCANNED_PACKETS / packetsNumber );
+
+    UInt32  rounds = MAX( verdicts / packetsNumber, 0x1 );
+    UInt64  start = NkeBenchmarkNow();
+
+    for( UInt32 round = 0x0; round < rounds; ++round ){
+
+        for( UInt32 i = 0x0; i < packetsNumber; ++i ){
+
+            NkeSocketDataProperty  property;
+
+            property.type = NkeSocketDataPropertyTypePermission;
+            property.dataIndex = verdictIndices[ i ];
+            property.socketId = *NkeSocketObjectBenchmarkAccess::SocketId( sockObj );
+            property.value.permission.allowData = 0x1 & ( round + 0x1 );
+
+            if( scan )
+                SetDeferredDataPropertiesByScan( sockObj, &property );
+            else
+                sockObj->setDeferredDataProperties( &property );
+        } // end for
+    } // end for
+
+    UInt64  elapsed = NkeBenchmarkNow() - start;
+
+    //
+    // the last round's verdict is on each packet
+    //
+    for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i ){
+
+        PendingPktQueueItem*  pendingPkt;
+
+        TAILQ_FOREACH( pendingPkt, NkeSocketObjectBenchmarkAccess::PendingQueue( sockObj, i ), pendingQueueEntry )
+        {
+            NKE_BENCHMARK_CHECK( pendingPkt->responseReceived && pendingPkt->allowData == ( 0x1 == ( 0x1 & rounds ) ), "verdict" );
+            pendingPkt->responseReceived = false;
+        }
+    }
+
+    printf( "%5u pending %-5s %-7s: %9.1f ns per verdict\n",
+            packetsNumber,
+            scan ? "scan" : "index",
+            BenchmarkOrderNames[ order ],
+            (double)elapsed / ( rounds * packetsNumber ) );
+
+    free( verdictIndices );
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in UInt32 packetsNumber )
+{
+    NkeSocketStub*    stub = NkeBenchmarkAttachSocket( NkeBenchmarkSocket( 0x0 ) );
+    NkeSocketObject*  sockObj = NkeSocketObject::PromoteSocketStub( stub );
+    SInt32*           dataIndices = (SInt32*)malloc( packetsNumber * sizeof( SInt32 ) );
+
+    NKE_BENCHMARK_CHECK( sockObj && dataIndices, "socket" );
+
+    //
+    // the segments of both directions are made pending as the data callbacks do and
+    // reported to the service, the deadline timers are not armed, 1000 segments is about
+    // the most a socket can have pending as the hard quota is 0x200 packets per direction
+    //
+    for( UInt32 i = 0x0; i < packetsNumber; ++i ){
+
+        mbuf_t                mbuf = NkeHostAllocatePacket( BENCHMARK_SEGMENT_SIZE, (UInt8)i );
+        PendingPktQueueItem*  pendingPkt;
+
+        NKE_BENCHMARK_CHECK( mbuf, "mbuf" );
+
+        pendingPkt = NkeSocketObjectBenchmarkAccess::AllocatePkt( sockObj, mbuf, 0x0 == ( i % 0x2 ) );
+        NKE_BENCHMARK_CHECK( pendingPkt, "pending packet" );
+
+        NkeSocketObjectBenchmarkAccess::LockExclusive( sockObj );
+        { // start of the lock
+
+            TAILQ_INSERT_TAIL( NkeSocketObjectBenchmarkAccess::PendingQueue( sockObj, NkeSocketObjectBenchmarkAccess::PendingQueueIndex( pendingPkt->dataInbound ) ),
+                               pendingPkt,
+                               pendingQueueEntry );
+            NkeSocketObjectBenchmarkAccess::IndexPendingPkt( sockObj, pendingPkt );
+
+        } // end of the lock
+        NkeSocketObjectBenchmarkAccess::UnlockExclusive( sockObj );
+
+        dataIndices[ i ] = pendingPkt->dataIndex;
+    } // end for
+
+    printf( "%5u pending, %u index slots, %u packets not indexed\n",
+            packetsNumber, NkeSocketObjectBenchmarkAccess::PendingIndexSize( sockObj ), NkeSocketObjectBenchmarkAccess::PendingUnindexedPackets( sockObj ) );
+
+    for( int order = BenchmarkOrderArrival; order <= BenchmarkOrderRandom; ++order ){
+
+        RunVerdicts( sockObj, dataIndices, packetsNumber, (BenchmarkOrder)order, false );
+        RunVerdicts( sockObj, dataIndices, packetsNumber, (BenchmarkOrder)order, true );
+    }
+
+    NkeBenchmarkDetachSocket( stub );
+    NkeBenchmarkReleaseRetiredSockets();
+
+    free( dataIndices );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    static const UInt32  packetsNumbers[] = { 100, 1000 };
+
+    NkeBenchmarkPrintHeader( "NkeSocketObject verdicts for pending packets" );
+    NkeBenchmarkInitSockets();
+
+    for( int i = 0x0; i < (int)( sizeof( packetsNumbers ) / sizeof( packetsNumbers[ 0x0 ] ) ); ++i )
+        RunBenchmark( packetsNumbers[ i ] );
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmark.h"
+#include "NkeSlabAllocator.h"
+
+//--------------------------------------------------------------------
+
+//
+// the allocator is compared with malloc and free for the elements of the size of a pending packet,
+// a thread keeps a number of the elements allocated as a socket keeps its pending packets,
+// the local pattern frees the elements on the allocating thread, the remote pattern passes
+// the batches of the allocated elements to the other threads as the verdicts free the packets
+// allocated on the filter threads
+//
+#define BENCHMARK_ELEMENT_SIZE      0x90
+#define BENCHMARK_OPERATIONS        0x400000
+#define BENCHMARK_MAX_THREADS       0x8
+#define BENCHMARK_MAX_BATCH         0x400
+
+typedef enum _BenchmarkAllocator{
+    BenchmarkAllocatorMalloc = 0x0,
+    BenchmarkAllocatorSlab
+} BenchmarkAllocator;
+
+typedef struct _Benchmark{
+    
+    BenchmarkAllocator  allocator;
+    NkeSlabAllocator*   slabAllocator;
+    int                 threadsNumber;
+    int                 batchSize;
+    bool                remoteFree;
+    
+    //
+    // the batches passed between the threads for the remote pattern, a slot is either empty or holds a batch
+    //
+    pthread_mutex_t     exchangeLock;
+    void**              exchange[ BENCHMARK_MAX_THREADS ];
+    
+} Benchmark;
+
+//--------------------------------------------------------------------
+
+static void* Allocate( __in Benchmark* benchmark )
+{
+    void*  element;
+    
+    if( BenchmarkAllocatorSlab == benchmark->allocator )
+        element = benchmark->slabAllocator->allocate();
+    else
+        element = malloc( BENCHMARK_ELEMENT_SIZE );
+    
+    NKE_BENCHMARK_CHECK( element, "allocation" );
+    
+    //
+    // the packet's header is initialized after the allocation
+    //
+    *(volatile UInt64*)element = (UInt64)element;
+    
+    return element;
+}
+
+static void Deallocate( __in Benchmark* benchmark, __in void* element )
+{
+    NKE_BENCHMARK_CHECK( *(UInt64*)element == (UInt64)element, "element corrupted" );
+    
+    if( BenchmarkAllocatorSlab == benchmark->allocator )
+        benchmark->slabAllocator->deallocate( element );
+    else
+        free( element );
+}
+
+//--------------------------------------------------------------------
+
+static void ThreadRoutine( __in int threadIndex, __in void* context )
+{
+    Benchmark*  benchmark = (Benchmark*)context;
+    void**      batch = (void**)malloc( benchmark->batchSize * sizeof( void* ) );
+    int         batches = BENCHMARK_OPERATIONS / benchmark->threadsNumber / benchmark->batchSize;
+    
+    NKE_BENCHMARK_CHECK( batch, "batch allocation" );
+    
+    for( int i = 0x0; i < batches; ++i ){
+        
+        for( int j = 0x0; j < benchmark->batchSize; ++j )
+            batch[ j ] = Allocate( benchmark );
+        
+        if( benchmark->remoteFree && benchmark->threadsNumber > 0x1 ){
+            
+            //
+            // the batch is left for the next thread and the batch left by the previous thread is taken,
+            // if the next thread has not taken the batch left before the elements are freed locally
+            //
+            int  next = ( threadIndex + 0x1 ) % benchmark->threadsNumber;
+            
+            pthread_mutex_lock( &benchmark->exchangeLock );
+            {
+                if( NULL == benchmark->exchange[ next ] ){
+                    
+                    benchmark->exchange[ next ] = batch;
+                    batch = benchmark->exchange[ threadIndex ];
+                    benchmark->exchange[ threadIndex ] = NULL;
+                }
+            }
+            pthread_mutex_unlock( &benchmark->exchangeLock );
+            
+            if( ! batch ){
+                
+                batch = (void**)malloc( benchmark->batchSize * sizeof( void* ) );
+                NKE_BENCHMARK_CHECK( batch, "batch allocation" );
+                continue;
+            }
+        }
+        
+        for( int j = 0x0; j < benchmark->batchSize; ++j )
+            Deallocate( benchmark, batch[ j ] );
+    } // end for
+    
+    free( batch );
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in BenchmarkAllocator allocator, __in int threadsNumber, __in int batchSize, __in bool remoteFree )
+{
+    Benchmark  benchmark;
+    
+    bzero( &benchmark, sizeof( benchmark ) );
+    
+    benchmark.allocator = allocator;
+    benchmark.threadsNumber = threadsNumber;
+    benchmark.batchSize = batchSize;
+    benchmark.remoteFree = remoteFree;
+    pthread_mutex_init( &benchmark.exchangeLock, NULL );
+    
+    if( BenchmarkAllocatorSlab == allocator ){
+        
+        benchmark.slabAllocator = NkeSlabAllocator::withElementSize( BENCHMARK_ELEMENT_SIZE );
+        NKE_BENCHMARK_CHECK( benchmark.slabAllocator, "slab allocator" );
+    }
+    
+    UInt64  elapsed = NkeBenchmarkRunThreads( threadsNumber, ThreadRoutine, &benchmark );
+    UInt64  operations = (UInt64)threadsNumber * ( BENCHMARK_OPERATIONS / threadsNumber / batchSize ) * batchSize;
+    
+    //
+    // the batches left in the exchange are freed after the clock has been stopped
+    //
+    for( int i = 0x0; i < BENCHMARK_MAX_THREADS; ++i ){
+        
+        if( ! benchmark.exchange[ i ] )
+            continue;
+        
+        for( int j = 0x0; j < batchSize; ++j )
+            Deallocate( &benchmark, benchmark.exchange[ i ][ j ] );
+        
+        free( benchmark.exchange[ i ] );
+    }
+    
+    printf( "%-6s %-6s batch %4d threads %d: %6.1f ns per allocate and free, %10.0f pairs/s",
+            ( BenchmarkAllocatorSlab == allocator ) ? "slab" : "malloc",
+            remoteFree ? "remote" : "local",
+            batchSize,
+            threadsNumber,
+            (double)elapsed / operations,
+            (double)operations * 1e9 / elapsed );
+    
+    if( benchmark.slabAllocator ){
+        
+        NKE_BENCHMARK_CHECK( 0x0 == benchmark.slabAllocator->getElementsInUse(), "elements leaked" );
+        
+        printf( ", %.2f depot accesses per 1k pairs, %u slabs",
+                (double)benchmark.slabAllocator->getDepotAccesses() * 1000.0 / operations,
+                benchmark.slabAllocator->getSlabsCount() );
+        
+        benchmark.slabAllocator->release();
+    }
+    
+    printf( "\n" );
+    
+    pthread_mutex_destroy( &benchmark.exchangeLock );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    static const int  batchSizes[] = { 0x10, BENCHMARK_MAX_BATCH };
+    
+    NkeBenchmarkPrintHeader( "NkeSlabAllocator" );
+    
+    for( int remote = 0x0; remote < 0x2; ++remote ){
+        
+        for( int b = 0x0; b < (int)( sizeof( batchSizes ) / sizeof( batchSizes[ 0x0 ] ) ); ++b ){
+            
+            for( int i = 0x0; i < NkeBenchmarkThreadCountsNumber; ++i ){
+                
+                if( NkeBenchmarkThreadCounts[ i ] > BENCHMARK_MAX_THREADS )
+                    continue;
+                
+                //
+                // a single thread frees its own elements
+                //
+                if( remote && 0x1 == NkeBenchmarkThreadCounts[ i ] )
+                    continue;
+                
+                RunBenchmark( BenchmarkAllocatorMalloc, NkeBenchmarkThreadCounts[ i ], batchSizes[ b ], 0x0 != remote );
+                RunBenchmark( BenchmarkAllocatorSlab, NkeBenchmarkThreadCounts[ i ], batchSizes[ b ], 0x0 != remote );
+            }
+        }
+    }
+    
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmarkSockets.h"
+
+//--------------------------------------------------------------------
+
+//
+// the lookup throughput for a number of the lookup threads while the other threads attach,
+// promote and detach sockets, the epoch read section lookup is compared with the same hash
+// walk under SocketsListLock held shared as the lookup did before the epoch reclamation,
+// the insertion and the removal hold SocketsListLock exclusive so the locked lookup
+// contends with the churn, the detached objects are released by a thread that does
+// what the injection thread does
+//
+#define BENCHMARK_SOCKETS           10000
+#define BENCHMARK_LOOKUPS           0x200000
+#define BENCHMARK_CHURN_THREADS     0x2
+#define BENCHMARK_CHURN_SOCKETS     0x1000
+
+typedef struct _Benchmark{
+
+    bool                locked;
+    int                 threadsNumber;
+    NkeSocketStub**     stubs;
+
+    volatile bool       stop;
+    volatile SInt64     churnedSockets;
+    volatile bool       reclaimerStopped;
+
+} Benchmark;
+
+//--------------------------------------------------------------------
+
+//
+// the lookup before the epoch reclamation
+//
+static NkeSocketObject* GetSocketObjectRefLocked( __in socket_t so )
+{
+    NkeSocketObject*  sockObj;
+    UInt32            hashIndex = NkeSocketObjectBenchmarkAccess::SocketToHashIndex( so );
+
+    IORWLockRead( NkeSocketObjectBenchmarkAccess::SocketsListLock() );
+    { // start of the lock
+
+        for( sockObj = NkeSocketObjectBenchmarkAccess::FirstInHash( hashIndex ); sockObj; sockObj = NkeSocketObjectBenchmarkAccess::NextInHash( sockObj ) ){
+
+            if( NkeSocketObjectBenchmarkAccess::Socket( sockObj ) == so )
+                break;
+        } // end for
+
+        if( sockObj )
+            sockObj->retain();
+
+    } // end of the lock
+    IORWLockUnlock( NkeSocketObjectBenchmarkAccess::SocketsListLock() );
+
+    return sockObj;
+}
+
+//--------------------------------------------------------------------
+
+static void LookupThreadRoutine( __in int threadIndex, __in void* context )
+{
+    Benchmark*  benchmark = (Benchmark*)context;
+    UInt32      random = 0x2545F491 + threadIndex;
+    int         lookups = BENCHMARK_LOOKUPS / benchmark->threadsNumber;
+
+    for( int i = 0x0; i < lookups; ++i ){
+
+        NkeSocketStub*    stub = benchmark->stubs[ NkeBenchmarkRandom( &random ) % BENCHMARK_SOCKETS ];
+        NkeSocketObject*  sockObj;
+
+        if( benchmark->locked )
+            sockObj = GetSocketObjectRefLocked( stub->socket );
+        else
+            sockObj = NkeSocketObject::GetSocketObjectRef( stub->socket );
+
+        NKE_BENCHMARK_CHECK( sockObj && sockObj->toSocket() == stub->socket, "lookup" );
+        sockObj->release();
+    } // end for
+}
+
+//--------------------------------------------------------------------
+
+typedef struct _ChurnThread{
+    Benchmark*  benchmark;
+    int         index;
+} ChurnThread;
+
+//
+// a socket is attached, promoted as it is connected and detached, the socket
+// values are reused as the kernel reuses the socket memory
+//
+static void* ChurnThreadRoutine( void* parameter )
+{
+    ChurnThread*  thread = (ChurnThread*)parameter;
+    UInt32        base = BENCHMARK_SOCKETS + thread->index * BENCHMARK_CHURN_SOCKETS;
+
+    for( UInt32 i = 0x0; ! thread->benchmark->stop; ++i ){
+
+        NkeSocketStub*  stub = NkeBenchmarkAttachSocket( NkeBenchmarkSocket( base + i % BENCHMARK_CHURN_SOCKETS ) );
+
+        NKE_BENCHMARK_CHECK( NkeSocketObject::PromoteSocketStub( stub ), "promotion" );
+        NkeBenchmarkDetachSocket( stub );
+
+        OSIncrementAtomic64( &thread->benchmark->churnedSockets );
+    } // end for
+
+    return NULL;
+}
+
+//
+// the injection thread is woken up when the retired objects reach the threshold
+//
+static void ReclaimerThreadRoutine( void* parameter, wait_result_t result )
+{
+    Benchmark*  benchmark = (Benchmark*)parameter;
+
+    while( ! benchmark->stop ){
+
+        struct timespec ts = { 0, 10000000 }; // 10 ms
+
+        (void)msleep( NkeSocketObjectBenchmarkAccess::RetiredSocketsCount(), // wait channel
+                      NULL,                          // mutex
+                      PUSER,                         // priority
+                      "ReclaimerThreadRoutine()",    // wait message
+                      &ts );                         // sleep interval
+
+        NkeBenchmarkReleaseRetiredSockets();
+    } // end while
+
+    benchmark->reclaimerStopped = true;
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in NkeSocketStub** stubs, __in bool locked, __in bool churn, __in int threadsNumber )
+{
+    Benchmark   benchmark;
+    pthread_t   churnThreads[ BENCHMARK_CHURN_THREADS ];
+    ChurnThread churnParameters[ BENCHMARK_CHURN_THREADS ];
+    thread_t    reclaimer;
+
+    bzero( &benchmark, sizeof( benchmark ) );
+
+    benchmark.locked = locked;
+    benchmark.threadsNumber = threadsNumber;
+    benchmark.stubs = stubs;
+
+    NKE_BENCHMARK_CHECK( KERN_SUCCESS == kernel_thread_start( ReclaimerThreadRoutine, &benchmark, &reclaimer ), "reclaimer" );
+
+    if( churn ){
+
+        for( int i = 0x0; i < BENCHMARK_CHURN_THREADS; ++i ){
+
+            churnParameters[ i ].benchmark = &benchmark;
+            churnParameters[ i ].index = i;
+            NKE_BENCHMARK_CHECK( 0x0 == pthread_create( &churnThreads[ i ], NULL, ChurnThreadRoutine, &churnParameters[ i ] ), "churn thread" );
+        }
+    }
+
+    UInt64  elapsed = NkeBenchmarkRunThreads( threadsNumber, LookupThreadRoutine, &benchmark );
+    SInt64  churnedSockets = benchmark.churnedSockets;
+    UInt64  lookups = (UInt64)threadsNumber * ( BENCHMARK_LOOKUPS / threadsNumber );
+
+    benchmark.stop = true;
+
+    if( churn ){
+
+        for( int i = 0x0; i < BENCHMARK_CHURN_THREADS; ++i )
+            pthread_join( churnThreads[ i ], NULL );
+    }
+
+    while( ! benchmark.reclaimerStopped )
+        IOSleep( 0x1 );
+
+    NkeBenchmarkReleaseRetiredSockets();
+
+    printf( "%-6s %-5s lookup threads %2d: %10.0f lookups/s, %7.1f ns per lookup",
+            locked ? "locked" : "epoch",
+            churn ? "churn" : "quiet",
+            threadsNumber,
+            (double)lookups * 1e9 / elapsed,
+            (double)elapsed / lookups );
+
+    if( churn )
+        printf( ", %8.0f sockets/s churned", (double)churnedSockets * 1e9 / elapsed );
+
+    printf( "\n" );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    NkeSocketStub*  stubs[ BENCHMARK_SOCKETS ];
+
+    NkeBenchmarkPrintHeader( "NkeSocketObject lookup under attach/detach churn" );
+    NkeBenchmarkInitSockets();
+
+    for( UInt32 i = 0x0; i < BENCHMARK_SOCKETS; ++i ){
+
+        stubs[ i ] = NkeBenchmarkAttachSocket( NkeBenchmarkSocket( i ) );
+        NKE_BENCHMARK_CHECK( NkeSocketObject::PromoteSocketStub( stubs[ i ] ), "promotion" );
+    }
+
+    for( int churn = 0x0; churn < 0x2; ++churn ){
+
+        for( int i = 0x0; i < NkeBenchmarkThreadCountsNumber; ++i ){
+
+            RunBenchmark( stubs, true, 0x0 != churn, NkeBenchmarkThreadCounts[ i ] );
+            RunBenchmark( stubs, false, 0x0 != churn, NkeBenchmarkThreadCounts[ i ] );
+        }
+    }
+
+    for( UInt32 i = 0x0; i < BENCHMARK_SOCKETS; ++i )
+        NkeBenchmarkDetachSocket( stubs[ i ] );
+
+    NkeBenchmarkReleaseRetiredSockets();
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
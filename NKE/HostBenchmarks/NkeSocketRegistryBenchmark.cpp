@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmarkSockets.h"
+
+//--------------------------------------------------------------------
+
+//
+// the lookup cost for a number of the registered sockets, the hashed lookup is compared
+// with the SocketsList walk the lookup did before the hash table was added, the walk is
+// the removed GetSocketObjectRef code run over the same SocketsList, a miss is the lookup
+// done by the attach callback for a new socket, the lookup by ID is the verdict's lookup
+//
+#define BENCHMARK_LOOKUPS           0x100000
+#define BENCHMARK_WALKED_OBJECTS    0x4000000
+
+typedef enum _BenchmarkLookup{
+    BenchmarkLookupHashHit = 0x0,
+    BenchmarkLookupHashMiss,
+    BenchmarkLookupById,
+    BenchmarkLookupListWalk
+} BenchmarkLookup;
+
+static const char*  BenchmarkLookupNames[] = { "hash hit", "hash miss", "by ID", "list walk" };
+
+//--------------------------------------------------------------------
+
+//
+// the lookup before the hash table, the whole list is walked under the list lock
+//
+static NkeSocketObject* GetSocketObjectRefByListWalk( __in socket_t so )
+{
+    NkeSocketObject*  sockObj;
+
+    IORWLockRead( NkeSocketObjectBenchmarkAccess::SocketsListLock() );
+    { // start of the lock
+
+        for( sockObj = NkeSocketObjectBenchmarkAccess::FirstInList(); sockObj; sockObj = NkeSocketObjectBenchmarkAccess::NextInList( sockObj ) ){
+
+            if( NkeSocketObjectBenchmarkAccess::Socket( sockObj ) == so )
+                break;
+        } // end for
+
+        if( sockObj )
+            sockObj->retain();
+
+    } // end of the lock
+    IORWLockUnlock( NkeSocketObjectBenchmarkAccess::SocketsListLock() );
+
+    return sockObj;
+}
+
+//--------------------------------------------------------------------
+
+static void RunLookups( __in BenchmarkLookup lookup, __in NkeSocketStub** stubs, __in UInt32 socketsNumber )
+{
+    UInt32  random = 0x2545F491;
+    UInt32  lookups = BENCHMARK_LOOKUPS;
+
+    if( BenchmarkLookupListWalk == lookup )
+        lookups = MIN( lookups, BENCHMARK_WALKED_OBJECTS / socketsNumber );
+
+    UInt64  start = NkeBenchmarkNow();
+
+    for( UInt32 i = 0x0; i < lookups; ++i ){
+
+        UInt32            index = NkeBenchmarkRandom( &random ) % socketsNumber;
+        NkeSocketObject*  sockObj = NULL;
+
+        switch( lookup ){
+
+            case BenchmarkLookupHashHit:
+                sockObj = NkeSocketObject::GetSocketObjectRef( stubs[ index ]->socket );
+                NKE_BENCHMARK_CHECK( sockObj && sockObj->toSocket() == stubs[ index ]->socket, "hash lookup" );
+                break;
+
+            case BenchmarkLookupHashMiss:
+                sockObj = NkeSocketObject::GetSocketObjectRef( NkeBenchmarkSocket( socketsNumber + index ) );
+                NKE_BENCHMARK_CHECK( ! sockObj, "hash miss" );
+                break;
+
+            case BenchmarkLookupById:
+                sockObj = NkeSocketObject::GetSocketObjectRefById( NkeSocketObjectBenchmarkAccess::SocketId( stubs[ index ]->object ) );
+                NKE_BENCHMARK_CHECK( sockObj == stubs[ index ]->object, "ID lookup" );
+                break;
+
+            case BenchmarkLookupListWalk:
+                sockObj = GetSocketObjectRefByListWalk( stubs[ index ]->socket );
+                NKE_BENCHMARK_CHECK( sockObj && sockObj->toSocket() == stubs[ index ]->socket, "list walk" );
+                break;
+        }
+
+        if( sockObj )
+            sockObj->release();
+    } // end for
+
+    UInt64  elapsed = NkeBenchmarkNow() - start;
+
+    printf( "%6u sockets %-9s: %10.1f ns per lookup\n",
+            socketsNumber,
+            BenchmarkLookupNames[ lookup ],
+            (double)elapsed / lookups );
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in UInt32 socketsNumber )
+{
+    NkeSocketStub**  stubs = (NkeSocketStub**)malloc( socketsNumber * sizeof( NkeSocketStub* ) );
+    UInt32*          order = (UInt32*)malloc( socketsNumber * sizeof( UInt32 ) );
+    UInt32           random = 0x9E3779B9;
+
+    NKE_BENCHMARK_CHECK( stubs && order, "sockets array" );
+
+    //
+    // the sockets are attached in the address order and promoted in a random order
+    // so the list and the hash chains are not in the address order
+    //
+    for( UInt32 i = 0x0; i < socketsNumber; ++i ){
+
+        stubs[ i ] = NkeBenchmarkAttachSocket( NkeBenchmarkSocket( i ) );
+        order[ i ] = i;
+    }
+
+    for( UInt32 i = socketsNumber - 0x1; i > 0x0; --i ){
+
+        UInt32  j = NkeBenchmarkRandom( &random ) % ( i + 0x1 );
+        UInt32  index = order[ i ];
+
+        order[ i ] = order[ j ];
+        order[ j ] = index;
+    }
+
+    for( UInt32 i = 0x0; i < socketsNumber; ++i )
+        NKE_BENCHMARK_CHECK( NkeSocketObject::PromoteSocketStub( stubs[ order[ i ] ] ), "promotion" );
+
+    RunLookups( BenchmarkLookupHashHit, stubs, socketsNumber );
+    RunLookups( BenchmarkLookupHashMiss, stubs, socketsNumber );
+    RunLookups( BenchmarkLookupById, stubs, socketsNumber );
+    RunLookups( BenchmarkLookupListWalk, stubs, socketsNumber );
+
+    for( UInt32 i = 0x0; i < socketsNumber; ++i )
+        NkeBenchmarkDetachSocket( stubs[ i ] );
+
+    NkeBenchmarkReleaseRetiredSockets();
+
+    free( order );
+    free( stubs );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    static const UInt32  socketsNumbers[] = { 1000, 10000, 100000 };
+
+    NkeBenchmarkPrintHeader( "NkeSocketObject registry lookup" );
+    NkeBenchmarkInitSockets();
+
+    for( int i = 0x0; i < (int)( sizeof( socketsNumbers ) / sizeof( socketsNumbers[ 0x0 ] ) ); ++i )
+        RunBenchmark( socketsNumbers[ i ] );
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
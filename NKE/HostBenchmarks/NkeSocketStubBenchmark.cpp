@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmarkSockets.h"
+
+//--------------------------------------------------------------------
+
+//
+// the memory and the attach and detach latency of a socket that never carries data, the stub
+// allocated by the attach callback is compared with the object that the attach callback created
+// before the lazy promotion, the object is created and inserted in the lists as the promotion
+// does and is detached and released after a grace period, the sockets are attached and detached
+// in batches of the retired objects threshold so the grace period is waited once per batch
+// as the injection thread does
+//
+#define BENCHMARK_BATCH         NKE_RETIRED_SOCKETS_THRESHOLD
+#define BENCHMARK_BATCHES       0x100
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in bool promote )
+{
+    NkeSocketStub*  stubs[ BENCHMARK_BATCH ];
+    UInt64          attachTime = 0x0;
+    UInt64          detachTime = 0x0;
+
+    for( int batch = 0x0; batch < BENCHMARK_BATCHES; ++batch ){
+
+        UInt64  start = NkeBenchmarkNow();
+
+        for( int i = 0x0; i < BENCHMARK_BATCH; ++i ){
+
+            stubs[ i ] = NkeBenchmarkAttachSocket( NkeBenchmarkSocket( i ) );
+
+            if( promote )
+                NKE_BENCHMARK_CHECK( NkeSocketObject::PromoteSocketStub( stubs[ i ] ), "promotion" );
+        }
+
+        UInt64  attached = NkeBenchmarkNow();
+
+        for( int i = 0x0; i < BENCHMARK_BATCH; ++i )
+            NkeBenchmarkDetachSocket( stubs[ i ] );
+
+        NkeBenchmarkReleaseRetiredSockets();
+
+        UInt64  detached = NkeBenchmarkNow();
+
+        attachTime += attached - start;
+        detachTime += detached - attached;
+    } // end for
+
+    printf( "%-6s: %7.1f ns per attach, %7.1f ns per detach\n",
+            promote ? "object" : "stub",
+            (double)attachTime / ( BENCHMARK_BATCH * BENCHMARK_BATCHES ),
+            (double)detachTime / ( BENCHMARK_BATCH * BENCHMARK_BATCHES ) );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    NkeBenchmarkPrintHeader( "NkeSocketStub versus NkeSocketObject" );
+    NkeBenchmarkInitSockets();
+
+    //
+    // the object's memory is preceded by the recycling cache header, the locks are allocated
+    // separately and their host sizes are the pthread sizes, not the kernel's
+    //
+    printf( "stub  : %4u bytes\n", (unsigned)sizeof( NkeSocketStub ) );
+    printf( "object: %4u bytes, %u bytes header, %u bytes RW lock, %u bytes mutex, %u bytes slot\n",
+            (unsigned)sizeof( NkeSocketObject ),
+            (unsigned)NkeSocketObjectBenchmarkAccess::MemoryHeaderSize,
+            (unsigned)sizeof( IORWLock ),
+            (unsigned)sizeof( IOLock ),
+            (unsigned)NkeSocketObjectBenchmarkAccess::SocketSlotSize );
+
+    //
+    // the first run warms up the objects cache and the slot table
+    //
+    RunBenchmark( true );
+
+    RunBenchmark( false );
+    RunBenchmark( true );
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
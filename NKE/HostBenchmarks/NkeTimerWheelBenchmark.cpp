@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <sys/resource.h>
+#include <algorithm>
+#include "NkeBenchmark.h"
+#include "NkeTimerWheel.h"
+
+//--------------------------------------------------------------------
+
+//
+// the accuracy run arms the timers with random timeouts that cover the first two levels
+// of the wheel and checks that no timer expires early, the cost runs arm, rearm and cancel
+// the timers with a number of the timers armed and expire a burst of timers in one pass
+//
+#define BENCHMARK_ACCURACY_TIMERS       10000
+#define BENCHMARK_ACCURACY_MAX_TIMEOUT  5000
+#define BENCHMARK_BURST_TIMERS          100000
+#define BENCHMARK_COST_OPERATIONS       1000000
+
+typedef struct _BenchmarkTimer{
+    
+    NkeTimerWheelEntry  entry;
+    
+    UInt64              armTime;
+    UInt64              expiryTime;
+    UInt32              timeoutMs;
+    
+} BenchmarkTimer;
+
+typedef struct _Benchmark{
+    
+    NkeTimerWheel*      wheel;
+    
+    //
+    // set by the callbacks with the wheel lock held or on the wheel thread
+    //
+    UInt64              expired;
+    UInt64              passes;
+    UInt64              passStartTime;
+    UInt64              passTime;
+    UInt64              maxPassTime;
+    
+} Benchmark;
+
+//--------------------------------------------------------------------
+
+static void ExpiryCallback( __in NkeTimerWheelEntry* entry, __in void* context )
+{
+    Benchmark*       benchmark = (Benchmark*)context;
+    BenchmarkTimer*  timer = (BenchmarkTimer*)entry;
+    UInt64           now = NkeBenchmarkNow();
+    
+    if( 0x0 == benchmark->passStartTime )
+        benchmark->passStartTime = now;
+    
+    timer->expiryTime = now;
+    benchmark->expired += 0x1;
+}
+
+static void PassCallback( __in void* context )
+{
+    Benchmark*  benchmark = (Benchmark*)context;
+    UInt64      passTime = NkeBenchmarkNow() - benchmark->passStartTime;
+    
+    benchmark->passStartTime = 0x0;
+    benchmark->passTime += passTime;
+    benchmark->passes += 0x1;
+    
+    if( passTime > benchmark->maxPassTime )
+        benchmark->maxPassTime = passTime;
+}
+
+//--------------------------------------------------------------------
+
+static UInt64 GetProcessCpuTime()
+{
+    struct rusage  usage;
+    
+    getrusage( RUSAGE_SELF, &usage );
+    
+    return ( (UInt64)usage.ru_utime.tv_sec + (UInt64)usage.ru_stime.tv_sec ) * 1000000000ULL +
+           ( (UInt64)usage.ru_utime.tv_usec + (UInt64)usage.ru_stime.tv_usec ) * 1000ULL;
+}
+
+static void WaitForExpired( __in Benchmark* benchmark, __in UInt64 expected, __in UInt32 timeoutMs )
+{
+    UInt64  deadline = NkeBenchmarkNow() + (UInt64)timeoutMs * 1000000ULL;
+    
+    while( __sync_fetch_and_add( &benchmark->expired, 0x0 ) < expected ){
+        
+        NKE_BENCHMARK_CHECK( NkeBenchmarkNow() < deadline, "the timers have not expired" );
+        IOSleep( 0xA );
+    } // end while
+}
+
+//--------------------------------------------------------------------
+
+static void RunAccuracy( __in Benchmark* benchmark )
+{
+    BenchmarkTimer*  timers = (BenchmarkTimer*)calloc( BENCHMARK_ACCURACY_TIMERS, sizeof( BenchmarkTimer ) );
+    UInt64*          lateness = (UInt64*)calloc( BENCHMARK_ACCURACY_TIMERS, sizeof( UInt64 ) );
+    UInt32           random = 0x12345678;
+    
+    NKE_BENCHMARK_CHECK( timers && lateness, "allocation" );
+    
+    benchmark->expired = 0x0;
+    benchmark->passes = 0x0;
+    benchmark->passTime = 0x0;
+    benchmark->maxPassTime = 0x0;
+    
+    UInt64  cpuTime = GetProcessCpuTime();
+    UInt64  startTime = NkeBenchmarkNow();
+    
+    for( int i = 0x0; i < BENCHMARK_ACCURACY_TIMERS; ++i ){
+        
+        timers[ i ].timeoutMs = NkeBenchmarkRandom( &random ) % ( BENCHMARK_ACCURACY_MAX_TIMEOUT + 0x1 );
+        timers[ i ].armTime = NkeBenchmarkNow();
+        
+        benchmark->wheel->arm( &timers[ i ].entry, timers[ i ].timeoutMs );
+    }
+    
+    WaitForExpired( benchmark, BENCHMARK_ACCURACY_TIMERS, BENCHMARK_ACCURACY_MAX_TIMEOUT * 0x2 );
+    
+    UInt64  elapsed = NkeBenchmarkNow() - startTime;
+    
+    cpuTime = GetProcessCpuTime() - cpuTime;
+    
+    UInt64  lateTimers = 0x0;
+    UInt64  latenessSum = 0x0;
+    
+    for( int i = 0x0; i < BENCHMARK_ACCURACY_TIMERS; ++i ){
+        
+        UInt64  deadline = timers[ i ].armTime + (UInt64)timers[ i ].timeoutMs * 1000000ULL;
+        
+        NKE_BENCHMARK_CHECK( ! timers[ i ].entry.armed, "an expired timer is armed" );
+        NKE_BENCHMARK_CHECK( timers[ i ].expiryTime >= deadline, "a timer expired early" );
+        
+        lateness[ i ] = timers[ i ].expiryTime - deadline;
+        latenessSum += lateness[ i ];
+        
+        //
+        // the wheel bounds the lateness by two ticks plus the thread's scheduling latency
+        //
+        if( lateness[ i ] > 0x2 * NKE_TIMER_WHEEL_TICK_MS * 1000000ULL )
+            lateTimers += 0x1;
+    }
+    
+    std::sort( lateness, lateness + BENCHMARK_ACCURACY_TIMERS );
+    
+    printf( "accuracy: %d timers, timeouts 0-%d ms, no early expiry, lateness avg %.2f ms p50 %.2f ms p99 %.2f ms max %.2f ms, "
+            "%llu over two ticks\n",
+            BENCHMARK_ACCURACY_TIMERS, BENCHMARK_ACCURACY_MAX_TIMEOUT,
+            (double)latenessSum / BENCHMARK_ACCURACY_TIMERS / 1e6,
+            (double)lateness[ BENCHMARK_ACCURACY_TIMERS / 0x2 ] / 1e6,
+            (double)lateness[ BENCHMARK_ACCURACY_TIMERS * 99 / 100 ] / 1e6,
+            (double)lateness[ BENCHMARK_ACCURACY_TIMERS - 0x1 ] / 1e6,
+            (unsigned long long)lateTimers );
+    
+    printf( "accuracy: %llu passes, %.2f us per pass, max pass %.2f us, the process used %.2f%% of a processor\n",
+            (unsigned long long)benchmark->passes,
+            benchmark->passes ? (double)benchmark->passTime / benchmark->passes / 1e3 : 0.0,
+            (double)benchmark->maxPassTime / 1e3,
+            (double)cpuTime * 100.0 / elapsed );
+    
+    free( lateness );
+    free( timers );
+}
+
+//--------------------------------------------------------------------
+
+static void RunBurst( __in Benchmark* benchmark )
+{
+    BenchmarkTimer*  timers = (BenchmarkTimer*)calloc( BENCHMARK_BURST_TIMERS, sizeof( BenchmarkTimer ) );
+    
+    NKE_BENCHMARK_CHECK( timers, "allocation" );
+    
+    //
+    // the timers are armed on the second level and cascaded to the first one before they expire
+    //
+    const UInt32  timeoutMs = 0x3E8;
+    
+    benchmark->expired = 0x0;
+    benchmark->passes = 0x0;
+    benchmark->passTime = 0x0;
+    benchmark->maxPassTime = 0x0;
+    
+    for( int i = 0x0; i < BENCHMARK_BURST_TIMERS; ++i )
+        benchmark->wheel->arm( &timers[ i ].entry, timeoutMs );
+    
+    WaitForExpired( benchmark, BENCHMARK_BURST_TIMERS, timeoutMs * 0x4 );
+    
+    printf( "burst: %d timers expired in %llu passes, %.1f ns per expired timer\n",
+            BENCHMARK_BURST_TIMERS,
+            (unsigned long long)benchmark->passes,
+            (double)benchmark->passTime / BENCHMARK_BURST_TIMERS );
+    
+    free( timers );
+}
+
+//--------------------------------------------------------------------
+
+static void RunCost( __in Benchmark* benchmark, __in int armedTimers )
+{
+    BenchmarkTimer*  timers = (BenchmarkTimer*)calloc( armedTimers, sizeof( BenchmarkTimer ) );
+    UInt32           random = 0x9E3779B9;
+    
+    NKE_BENCHMARK_CHECK( timers, "allocation" );
+    
+    //
+    // the timeouts are long enough for the timers not to expire during the run,
+    // they are spread over the second and the third levels
+    //
+    UInt64  startTime = NkeBenchmarkNow();
+    
+    for( int i = 0x0; i < armedTimers; ++i )
+        benchmark->wheel->arm( &timers[ i ].entry, 0x7530 + NkeBenchmarkRandom( &random ) % 0x927C0 );
+    
+    UInt64  armTime = NkeBenchmarkNow() - startTime;
+    
+    startTime = NkeBenchmarkNow();
+    
+    for( int i = 0x0; i < BENCHMARK_COST_OPERATIONS; ++i )
+        benchmark->wheel->arm( &timers[ NkeBenchmarkRandom( &random ) % armedTimers ].entry, 0x7530 + NkeBenchmarkRandom( &random ) % 0x927C0 );
+    
+    UInt64  rearmTime = NkeBenchmarkNow() - startTime;
+    
+    startTime = NkeBenchmarkNow();
+    
+    for( int i = 0x0; i < armedTimers; ++i )
+        NKE_BENCHMARK_CHECK( benchmark->wheel->cancel( &timers[ i ].entry ), "a timer was not armed" );
+    
+    UInt64  cancelTime = NkeBenchmarkNow() - startTime;
+    
+    printf( "cost: %6d armed timers, arm %5.1f ns, rearm %5.1f ns, cancel %5.1f ns\n",
+            armedTimers,
+            (double)armTime / armedTimers,
+            (double)rearmTime / BENCHMARK_COST_OPERATIONS,
+            (double)cancelTime / armedTimers );
+    
+    free( timers );
+}
+
+//--------------------------------------------------------------------
+
+typedef struct _ThreadsBenchmark{
+    
+    Benchmark*          benchmark;
+    BenchmarkTimer*     timers;
+    int                 timersPerThread;
+    int                 operationsPerThread;
+    
+} ThreadsBenchmark;
+
+static void RearmRoutine( __in int threadIndex, __in void* context )
+{
+    ThreadsBenchmark*  threads = (ThreadsBenchmark*)context;
+    BenchmarkTimer*    timers = threads->timers + threadIndex * threads->timersPerThread;
+    UInt32             random = 0x2545F491 + threadIndex;
+    
+    //
+    // a pending packet's timer is armed when the packet is queued and cancelled when the verdict arrives
+    //
+    for( int i = 0x0; i < threads->operationsPerThread; ++i ){
+        
+        BenchmarkTimer*  timer = &timers[ NkeBenchmarkRandom( &random ) % threads->timersPerThread ];
+        
+        if( timer->entry.armed )
+            threads->benchmark->wheel->cancel( &timer->entry );
+        else
+            threads->benchmark->wheel->arm( &timer->entry, 0x7530 + NkeBenchmarkRandom( &random ) % 0x927C0 );
+    }
+}
+
+static void RunThreads( __in Benchmark* benchmark, __in int threadsNumber )
+{
+    ThreadsBenchmark  threads;
+    
+    threads.benchmark = benchmark;
+    threads.timersPerThread = 0x400;
+    threads.operationsPerThread = BENCHMARK_COST_OPERATIONS / threadsNumber;
+    threads.timers = (BenchmarkTimer*)calloc( threadsNumber * threads.timersPerThread, sizeof( BenchmarkTimer ) );
+    
+    NKE_BENCHMARK_CHECK( threads.timers, "allocation" );
+    
+    UInt64  elapsed = NkeBenchmarkRunThreads( threadsNumber, RearmRoutine, &threads );
+    UInt64  operations = (UInt64)threadsNumber * threads.operationsPerThread;
+    
+    printf( "threads %2d: arm or cancel %6.1f ns per operation, %10.0f operations/s\n",
+            threadsNumber, (double)elapsed / operations, (double)operations * 1e9 / elapsed );
+    
+    for( int i = 0x0; i < threadsNumber * threads.timersPerThread; ++i )
+        benchmark->wheel->cancel( &threads.timers[ i ].entry );
+    
+    free( threads.timers );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    Benchmark  benchmark;
+    
+    bzero( &benchmark, sizeof( benchmark ) );
+    
+    NkeBenchmarkPrintHeader( "NkeTimerWheel" );
+    
+    benchmark.wheel = NkeTimerWheel::withCallbacks( ExpiryCallback, PassCallback, &benchmark );
+    NKE_BENCHMARK_CHECK( benchmark.wheel, "wheel allocation" );
+    
+    RunAccuracy( &benchmark );
+    RunBurst( &benchmark );
+    
+    RunCost( &benchmark, 1000 );
+    RunCost( &benchmark, 10000 );
+    RunCost( &benchmark, 100000 );
+    
+    for( int i = 0x0; i < NkeBenchmarkThreadCountsNumber; ++i )
+        RunThreads( &benchmark, NkeBenchmarkThreadCounts[ i ] );
+    
+    benchmark.wheel->stop();
+    benchmark.wheel->release();
+    
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeBenchmark.h"
+#include "NkeWakeupModerator.h"
+
+//--------------------------------------------------------------------
+
+//
+// the wakeups sent to the client and the delay the moderation adds to the events for a number
+// of the event rates, a producer enqueues the events at a fixed interval, the client drains the
+// queue at once when it is woken up so without the moderation each event wakes up the client
+// with no delay, the delay of an event is the time from its enqueueing to the wakeup that covers it,
+// the scheduling of the client's thread is not included
+//
+#define BENCHMARK_DURATION_NS       200000000ULL
+#define BENCHMARK_MAX_EVENTS        0x40000
+#define BENCHMARK_SLEEP_INTERVAL_NS 50000ULL
+#define BENCHMARK_DRAIN_TIMEOUT_MS  1000
+
+typedef struct _Benchmark{
+
+    NkeWakeupModerator*     moderator;
+
+    //
+    // the queue of the events, protects the fields below
+    //
+    pthread_mutex_t         lock;
+
+    UInt64*                 enqueueTimes;
+    UInt32                  published;
+    UInt32                  consumed;
+
+    UInt64                  wakeups;
+    UInt64                  delaySum;
+    UInt64                  delayMax;
+
+} Benchmark;
+
+//--------------------------------------------------------------------
+
+//
+// the client is woken up and drains the queue
+//
+static void Wakeup( __in Benchmark* benchmark )
+{
+    pthread_mutex_lock( &benchmark->lock );
+    {
+        //
+        // the time is taken under the lock so the drained events are older
+        //
+        UInt64  now = NkeBenchmarkNow();
+
+        for( UInt32 i = benchmark->consumed; i < benchmark->published; ++i ){
+
+            UInt64  delay = now - benchmark->enqueueTimes[ i ];
+
+            benchmark->delaySum += delay;
+            if( delay > benchmark->delayMax )
+                benchmark->delayMax = delay;
+        }
+
+        benchmark->consumed = benchmark->published;
+        benchmark->wakeups += 0x1;
+    }
+    pthread_mutex_unlock( &benchmark->lock );
+}
+
+static void ModeratorCallback( __in void* context )
+{
+    Wakeup( (Benchmark*)context );
+}
+
+//--------------------------------------------------------------------
+
+//
+// the long intervals are slept, the short ones are spun as the sleep overshoots them
+//
+static void WaitUntil( __in UInt64 time )
+{
+    UInt64  now = NkeBenchmarkNow();
+
+    if( time > now + BENCHMARK_SLEEP_INTERVAL_NS ){
+
+        struct timespec  ts;
+
+        ts.tv_sec = (time_t)( time / 1000000000ULL );
+        ts.tv_nsec = (long)( time % 1000000000ULL );
+
+        clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+    }
+
+    while( NkeBenchmarkNow() < time )
+        ;
+}
+
+//--------------------------------------------------------------------
+
+static void RunBenchmark( __in bool moderated, __in UInt64 interval )
+{
+    Benchmark  benchmark;
+    UInt32     events = BENCHMARK_MAX_EVENTS;
+
+    if( 0x0 != interval && BENCHMARK_DURATION_NS / interval < events )
+        events = (UInt32)( BENCHMARK_DURATION_NS / interval );
+
+    bzero( &benchmark, sizeof( benchmark ) );
+    pthread_mutex_init( &benchmark.lock, NULL );
+
+    benchmark.enqueueTimes = (UInt64*)malloc( events * sizeof( UInt64 ) );
+    NKE_BENCHMARK_CHECK( benchmark.enqueueTimes, "events array" );
+
+    if( moderated ){
+
+        benchmark.moderator = NkeWakeupModerator::withCallback( ModeratorCallback, &benchmark );
+        NKE_BENCHMARK_CHECK( benchmark.moderator, "moderator" );
+    }
+
+    UInt64  start = NkeBenchmarkNow();
+
+    for( UInt32 i = 0x0; i < events; ++i ){
+
+        WaitUntil( start + i * interval );
+
+        bool  queueWasEmpty;
+
+        pthread_mutex_lock( &benchmark.lock );
+        {
+            benchmark.enqueueTimes[ benchmark.published ] = NkeBenchmarkNow();
+            queueWasEmpty = ( benchmark.consumed == benchmark.published );
+            benchmark.published += 0x1;
+        }
+        pthread_mutex_unlock( &benchmark.lock );
+
+        bool  wakeupNow = moderated ? benchmark.moderator->eventEnqueued( queueWasEmpty ) : queueWasEmpty;
+
+        if( wakeupNow )
+            Wakeup( &benchmark );
+    } // end for
+
+    UInt64  elapsed = NkeBenchmarkNow() - start;
+
+    //
+    // the last deferred wakeup is sent by the moderator's thread
+    //
+    for( int i = 0x0; i < BENCHMARK_DRAIN_TIMEOUT_MS; ++i ){
+
+        pthread_mutex_lock( &benchmark.lock );
+        bool  drained = ( benchmark.consumed == benchmark.published );
+        pthread_mutex_unlock( &benchmark.lock );
+
+        if( drained )
+            break;
+
+        IOSleep( 0x1 );
+    }
+
+    NKE_BENCHMARK_CHECK( benchmark.consumed == events, "the events were not delivered" );
+
+    if( moderated ){
+
+        benchmark.moderator->stop();
+        benchmark.moderator->release();
+    }
+
+    printf( "%-9s %7.1f us interval: %9.0f events/s, %9.0f wakeups/s, %6.2f events per wakeup, "
+            "%7.1f us mean delay, %7.1f us max delay\n",
+            moderated ? "moderated" : "immediate",
+            (double)interval / 1000.0,
+            (double)events * 1e9 / elapsed,
+            (double)benchmark.wakeups * 1e9 / elapsed,
+            (double)events / benchmark.wakeups,
+            (double)benchmark.delaySum / events / 1000.0,
+            (double)benchmark.delayMax / 1000.0 );
+
+    free( benchmark.enqueueTimes );
+    pthread_mutex_destroy( &benchmark.lock );
+}
+
+//--------------------------------------------------------------------
+
+int main( int argc, char* argv[] )
+{
+    //
+    // from the sparse events of idle connections to the back to back events of a transfer
+    //
+    static const UInt64  intervals[] = { 1000000, 200000, 50000, 10000, 2000, 0 };
+
+    NkeBenchmarkPrintHeader( "NkeWakeupModerator" );
+
+    for( int i = 0x0; i < (int)( sizeof( intervals ) / sizeof( intervals[ 0x0 ] ) ); ++i ){
+
+        RunBenchmark( false, intervals[ i ] );
+        RunBenchmark( true, intervals[ i ] );
+    }
+
+    return 0x0;
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IOBUFFERMEMORYDESCRIPTOR_H
+#define _NKEHOST_IOKIT_IOBUFFERMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+class IOBufferMemoryDescriptor: public IOMemoryDescriptor{
+    
+    OSDeclareDefaultStructors( IOBufferMemoryDescriptor )
+    
+private:
+    
+    void*   buffer;
+    
+protected:
+    
+    virtual void free(){ ::free( this->buffer ); IOMemoryDescriptor::free(); }
+    
+public:
+    
+    static IOBufferMemoryDescriptor* withOptions( IOOptionBits options, vm_size_t capacity, vm_offset_t alignment = 0x1 )
+    {
+        IOBufferMemoryDescriptor*  descriptor = new IOBufferMemoryDescriptor();
+        
+        if( 0x0 != posix_memalign( &descriptor->buffer, alignment < sizeof( void* ) ? sizeof( void* ) : alignment, capacity ) ){
+            
+            descriptor->buffer = NULL;
+            descriptor->release();
+            return NULL;
+        }
+        
+        descriptor->length = capacity;
+        return descriptor;
+    }
+    
+    void* getBytesNoCopy(){ return this->buffer; }
+};
+
+#endif // _NKEHOST_IOKIT_IOBUFFERMEMORYDESCRIPTOR_H
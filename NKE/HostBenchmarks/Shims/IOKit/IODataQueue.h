@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IODATAQUEUE_H
+#define _NKEHOST_IOKIT_IODATAQUEUE_H
+
+#include <IOKit/IODataQueueShared.h>
+
+class IODataQueue: public OSObject{
+    
+    OSDeclareDefaultStructors( IODataQueue )
+};
+
+#endif // _NKEHOST_IOKIT_IODATAQUEUE_H
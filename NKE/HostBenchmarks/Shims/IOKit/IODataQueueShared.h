@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IODATAQUEUESHARED_H
+#define _NKEHOST_IOKIT_IODATAQUEUESHARED_H
+
+#include "NkeHostKernel.h"
+
+//
+// the layout of the queue shared with the client, the same as the kernel's one
+//
+typedef struct _IODataQueueEntry{
+    UInt32  size;
+    UInt8   data[ 4 ];
+} IODataQueueEntry;
+
+typedef struct _IODataQueueMemory{
+    UInt32              queueSize;
+    volatile UInt32     head;
+    volatile UInt32     tail;
+    IODataQueueEntry    queue[ 1 ];
+} IODataQueueMemory;
+
+#define DATA_QUEUE_ENTRY_HEADER_SIZE    ( sizeof( IODataQueueEntry ) - 4 )
+#define DATA_QUEUE_MEMORY_HEADER_SIZE   ( sizeof( IODataQueueMemory ) - sizeof( IODataQueueEntry ) )
+
+#endif // _NKEHOST_IOKIT_IODATAQUEUESHARED_H
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IOMEMORYDESCRIPTOR_H
+#define _NKEHOST_IOKIT_IOMEMORYDESCRIPTOR_H
+
+#include "NkeHostKernel.h"
+
+typedef UInt32  IODirection;
+
+#define kIODirectionNone            0x0
+#define kIODirectionIn              0x1
+#define kIODirectionOut             0x2
+#define kIODirectionInOut           ( kIODirectionIn | kIODirectionOut )
+#define kIOMemoryKernelUserShared   0x00010000
+
+class IOMemoryMap;
+
+//
+// the memory descriptors describe the host memory, the mapping is not supported
+//
+class IOMemoryDescriptor: public OSObject{
+    
+    OSDeclareDefaultStructors( IOMemoryDescriptor )
+    
+protected:
+    
+    vm_size_t   length;
+    
+public:
+    
+    virtual vm_size_t getLength(){ return this->length; }
+};
+
+class IOMemoryMap: public OSObject{
+    
+    OSDeclareDefaultStructors( IOMemoryMap )
+};
+
+#endif // _NKEHOST_IOKIT_IOMEMORYDESCRIPTOR_H
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IOMULTIMEMORYDESCRIPTOR_H
+#define _NKEHOST_IOKIT_IOMULTIMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+class IOMultiMemoryDescriptor: public IOMemoryDescriptor{
+    
+    OSDeclareDefaultStructors( IOMultiMemoryDescriptor )
+    
+private:
+    
+    IOMemoryDescriptor**    descriptors;
+    UInt32                  descriptorsNumber;
+    
+protected:
+    
+    virtual void free()
+    {
+        for( UInt32 i = 0x0; i < this->descriptorsNumber; ++i )
+            this->descriptors[ i ]->release();
+        
+        ::free( this->descriptors );
+        IOMemoryDescriptor::free();
+    }
+    
+public:
+    
+    static IOMultiMemoryDescriptor* withDescriptors( IOMemoryDescriptor** descriptors, UInt32 withCount,
+                                                     IODirection withDirection, bool asReference = false )
+    {
+        IOMultiMemoryDescriptor*  descriptor = new IOMultiMemoryDescriptor();
+        
+        descriptor->descriptors = (IOMemoryDescriptor**)::malloc( withCount * sizeof( IOMemoryDescriptor* ) );
+        descriptor->descriptorsNumber = withCount;
+        
+        for( UInt32 i = 0x0; i < withCount; ++i ){
+            
+            descriptors[ i ]->retain();
+            descriptor->descriptors[ i ] = descriptors[ i ];
+            descriptor->length += descriptors[ i ]->getLength();
+        }
+        
+        return descriptor;
+    }
+};
+
+#endif // _NKEHOST_IOKIT_IOMULTIMEMORYDESCRIPTOR_H
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IOSERVICE_H
+#define _NKEHOST_IOKIT_IOSERVICE_H
+
+#include "NkeHostKernel.h"
+
+//
+// the services are not started on the host, the class is a base for the driver's declarations
+//
+class IOService: public OSObject{
+    
+    OSDeclareDefaultStructors( IOService )
+    
+public:
+    
+    virtual bool start( IOService* provider ){ return true; }
+    virtual void stop( IOService* provider ){}
+    virtual bool terminate( IOOptionBits options = 0x0 ){ return true; }
+};
+
+#endif // _NKEHOST_IOKIT_IOSERVICE_H
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_IOKIT_IOUSERCLIENT_H
+#define _NKEHOST_IOKIT_IOUSERCLIENT_H
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOMemoryDescriptor.h>
+
+//
+// the declarations the driver's headers need, the user client is not built on the host
+//
+typedef struct IOExternalMethod  IOExternalMethod;
+
+class IOUserClient: public IOService{
+    
+    OSDeclareDefaultStructors( IOUserClient )
+};
+
+#endif // _NKEHOST_IOKIT_IOUSERCLIENT_H
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOSTKERNEL_H
+#define _NKEHOSTKERNEL_H
+
+//
+// the kernel interfaces used by the driver's self-contained modules implemented over
+// pthreads so the modules are built and measured on a Linux host, the shim headers
+// with the kernel names include this file, the semantic is the one the modules rely on,
+// not a complete emulation of the kernel
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+//--------------------------------------------------------------------
+
+typedef uint8_t         UInt8;
+typedef int8_t          SInt8;
+typedef uint16_t        UInt16;
+typedef int16_t         SInt16;
+typedef uint32_t        UInt32;
+typedef int32_t         SInt32;
+typedef uint64_t        UInt64;
+typedef int64_t         SInt64;
+typedef unsigned char   Boolean;
+
+typedef int             kern_return_t;
+typedef int             errno_t;
+typedef int             IOReturn;
+typedef UInt32          IOOptionBits;
+typedef uintptr_t       vm_size_t;
+typedef uintptr_t       vm_address_t;
+typedef uintptr_t       vm_offset_t;
+typedef UInt64          mach_vm_address_t;
+typedef UInt64          mach_vm_size_t;
+typedef UInt32          mach_port_t;
+typedef void*           task_t;
+typedef void*           proc_t;
+typedef pthread_t       thread_t;
+typedef int             wait_result_t;
+typedef void (*thread_continue_t)( void* parameter, wait_result_t result );
+
+#define KERN_SUCCESS            0
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn)0xe00002bd)
+#define kIOReturnBadArgument    ((IOReturn)0xe00002c2)
+#define kIOReturnNoSpace        ((IOReturn)0xe00002c4)
+#define kIOReturnUnderrun       ((IOReturn)0xe00002e7)
+
+#define EJUSTRETURN             (-2)
+
+#ifndef PAGE_SIZE
+    #define PAGE_SIZE           4096
+#endif
+
+#define PUSER                   50
+
+#ifndef __offsetof
+    #define __offsetof( _type, _field )  offsetof( _type, _field )
+#endif
+
+//
+// the BSD list macros missing in glibc
+//
+#ifndef TAILQ_FOREACH_REVERSE
+    #define TAILQ_FOREACH_REVERSE( var, head, headname, field ) \
+        for( (var) = (*(((struct headname *)((head)->tqh_last))->tqh_last)); \
+             (var); \
+             (var) = (*(((struct headname *)((var)->field.tqe_prev))->tqh_last)) )
+#endif
+
+#ifndef TAILQ_CONCAT
+    #define TAILQ_CONCAT( head1, head2, field ) do { \
+        if( !TAILQ_EMPTY( head2 ) ){ \
+            *(head1)->tqh_last = (head2)->tqh_first; \
+            (head2)->tqh_first->field.tqe_prev = (head1)->tqh_last; \
+            (head1)->tqh_last = (head2)->tqh_last; \
+            TAILQ_INIT( (head2) ); \
+        } \
+    } while( 0 )
+#endif
+
+//--------------------------------------------------------------------
+
+//
+// the memory and the logging
+//
+#define IOMalloc( _size )           ::malloc( _size )
+#define IOFree( _ptr, _size )       ::free( _ptr )
+
+//
+// the driver's log is written to stderr if NKE_HOST_LOG is set in the environment,
+// the packet flow is logged for each packet so it is discarded by default
+//
+void IOLog( const char* format, ... ) __attribute__((format(printf, 1, 2)));
+
+void IOSleep( unsigned int milliseconds );
+
+//
+// the host threads are always preemptible
+//
+#define preemption_enabled()        ( true )
+
+extern "C" int cpu_number( void );
+
+//--------------------------------------------------------------------
+
+//
+// the atomic operations, the kernel's versions are full barriers on x86 and return the old value
+//
+#define OSIncrementAtomic( _addr )              __sync_fetch_and_add( (volatile SInt32*)(_addr), 0x1 )
+#define OSDecrementAtomic( _addr )              __sync_fetch_and_sub( (volatile SInt32*)(_addr), 0x1 )
+#define OSAddAtomic( _amount, _addr )           __sync_fetch_and_add( (volatile SInt32*)(_addr), (SInt32)(_amount) )
+#define OSIncrementAtomic64( _addr )            __sync_fetch_and_add( (volatile SInt64*)(_addr), 0x1 )
+#define OSDecrementAtomic64( _addr )            __sync_fetch_and_sub( (volatile SInt64*)(_addr), 0x1 )
+#define OSAddAtomic64( _amount, _addr )         __sync_fetch_and_add( (volatile SInt64*)(_addr), (SInt64)(_amount) )
+#define OSCompareAndSwap( _old, _new, _addr )   __sync_bool_compare_and_swap( (volatile UInt32*)(_addr), (UInt32)(_old), (UInt32)(_new) )
+#define OSCompareAndSwap64( _old, _new, _addr ) __sync_bool_compare_and_swap( (volatile UInt64*)(_addr), (UInt64)(_old), (UInt64)(_new) )
+#define OSCompareAndSwapPtr( _old, _new, _addr ) __sync_bool_compare_and_swap( (void* volatile*)(_addr), (void*)(_old), (void*)(_new) )
+
+//--------------------------------------------------------------------
+
+//
+// the locks, a mutex is also a msleep interlock
+//
+typedef struct _IOLock{
+    pthread_mutex_t     mutex;
+} IOLock, lck_mtx_t;
+
+typedef struct _IOSimpleLock{
+    pthread_spinlock_t  spin;
+} IOSimpleLock;
+
+typedef struct _IORWLock{
+    pthread_rwlock_t    rwlock;
+} IORWLock;
+
+IOLock* IOLockAlloc( void );
+void IOLockFree( IOLock* lock );
+#define IOLockLock( _lock )             pthread_mutex_lock( &(_lock)->mutex )
+#define IOLockUnlock( _lock )           pthread_mutex_unlock( &(_lock)->mutex )
+#define IOLockGetMachLock( _lock )      (_lock)
+
+IOSimpleLock* IOSimpleLockAlloc( void );
+void IOSimpleLockFree( IOSimpleLock* lock );
+void IOSimpleLockLock( IOSimpleLock* lock );
+#define IOSimpleLockUnlock( _lock )     pthread_spin_unlock( &(_lock)->spin )
+
+IORWLock* IORWLockAlloc( void );
+void IORWLockFree( IORWLock* lock );
+#define IORWLockRead( _lock )           pthread_rwlock_rdlock( &(_lock)->rwlock )
+#define IORWLockWrite( _lock )          pthread_rwlock_wrlock( &(_lock)->rwlock )
+#define IORWLockUnlock( _lock )         pthread_rwlock_unlock( &(_lock)->rwlock )
+
+//
+// the wait channels, a NULL timeout is an infinite wait, the mutex is released for the wait
+//
+int msleep( void* channel, lck_mtx_t* mutex, int priority, const char* message, struct timespec* timeout );
+void wakeup( void* channel );
+
+//--------------------------------------------------------------------
+
+//
+// the threads
+//
+kern_return_t kernel_thread_start( thread_continue_t continuation, void* parameter, thread_t* newThread );
+#define thread_deallocate( _thread )    do{ (void)(_thread); }while(0)
+#define current_thread()                pthread_self()
+void thread_terminate( thread_t thread );
+
+//--------------------------------------------------------------------
+
+//
+// the absolute time is in nanoseconds
+//
+void clock_get_uptime( uint64_t* result );
+uint64_t mach_absolute_time( void );
+#define nanoseconds_to_absolutetime( _ns, _result )     do{ *(_result) = (_ns); }while(0)
+#define absolutetime_to_nanoseconds( _abs, _result )    do{ *(_result) = (_abs); }while(0)
+
+//--------------------------------------------------------------------
+
+//
+// the reference counted objects, the memory is zeroed by operator new as in the kernel
+//
+class OSObject{
+
+private:
+
+    volatile SInt32     retainCount;
+
+protected:
+
+    virtual ~OSObject(){}
+    virtual void free(){ delete this; }
+
+public:
+
+    OSObject(){ this->retainCount = 0x1; }
+
+    static void* operator new( size_t size ){ return calloc( 0x1, size ); }
+    static void operator delete( void* mem ){ ::free( mem ); }
+
+    virtual bool init(){ return true; }
+
+    void retain() const { OSIncrementAtomic( &((OSObject*)this)->retainCount ); }
+    void release() const
+    {
+        if( 0x1 == OSDecrementAtomic( &((OSObject*)this)->retainCount ) )
+            ((OSObject*)this)->free();
+    }
+
+    int getRetainCount() const { return this->retainCount; }
+};
+
+#define OSDeclareDefaultStructors( _class ) \
+    public: \
+        _class() {} \
+    protected: \
+        virtual ~_class() {} \
+    private:
+
+#define OSDefineMetaClassAndStructors( _class, _super )
+
+//--------------------------------------------------------------------
+
+#endif // _NKEHOSTKERNEL_H
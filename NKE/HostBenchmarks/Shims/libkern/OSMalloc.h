@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_LIBKERN_OSMALLOC_H
+#define _NKEHOST_LIBKERN_OSMALLOC_H
+
+#include "NkeHostKernel.h"
+
+typedef struct __OSMallocTag*   OSMallocTag;
+
+#define OSMT_DEFAULT    0x00
+#define OSMT_PAGEABLE   0x01
+
+OSMallocTag OSMalloc_Tagalloc( const char* name, UInt32 flags );
+void OSMalloc_Tagfree( OSMallocTag tag );
+
+#define OSMalloc( _size, _tag )         ( (void)(_tag), ::malloc( _size ) )
+#define OSMalloc_nowait( _size, _tag )  ( (void)(_tag), ::malloc( _size ) )
+#define OSFree( _ptr, _size, _tag )     ( (void)(_tag), ::free( _ptr ) )
+
+#endif // _NKEHOST_LIBKERN_OSMALLOC_H
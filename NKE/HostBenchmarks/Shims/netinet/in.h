@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_NETINET_IN_H
+#define _NKEHOST_NETINET_IN_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+//
+// the BSD internet address layouts with the length byte, shadows the host's header
+//
+typedef uint16_t    in_port_t;
+typedef uint32_t    in_addr_t;
+
+#define IPPROTO_IP      0
+#define IPPROTO_TCP     6
+#define IPPROTO_UDP     17
+
+struct in_addr{
+    in_addr_t       s_addr;
+};
+
+struct sockaddr_in{
+    uint8_t         sin_len;
+    sa_family_t     sin_family;
+    in_port_t       sin_port;
+    struct in_addr  sin_addr;
+    char            sin_zero[ 8 ];
+};
+
+struct in6_addr{
+    union{
+        uint8_t     __u6_addr8[ 16 ];
+        uint16_t    __u6_addr16[ 8 ];
+        uint32_t    __u6_addr32[ 4 ];
+    } __u6_addr;
+};
+
+#define s6_addr     __u6_addr.__u6_addr8
+
+struct sockaddr_in6{
+    uint8_t         sin6_len;
+    sa_family_t     sin6_family;
+    in_port_t       sin6_port;
+    uint32_t        sin6_flowinfo;
+    struct in6_addr sin6_addr;
+    uint32_t        sin6_scope_id;
+};
+
+#define htons( _x )     __builtin_bswap16( _x )
+#define ntohs( _x )     __builtin_bswap16( _x )
+#define htonl( _x )     __builtin_bswap32( _x )
+#define ntohl( _x )     __builtin_bswap32( _x )
+
+#endif // _NKEHOST_NETINET_IN_H
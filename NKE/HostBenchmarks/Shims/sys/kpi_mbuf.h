@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_SYS_KPI_MBUF_H
+#define _NKEHOST_SYS_KPI_MBUF_H
+
+#include "NkeHostKernel.h"
+
+//
+// the mbuf KPI over a host mbuf that is a single buffer with one tag, see NkeHostNetwork.cpp
+//
+typedef struct __mbuf*      mbuf_t;
+typedef struct __ifnet*     ifnet_t;
+typedef UInt32              mbuf_tag_id_t;
+typedef UInt16              mbuf_tag_type_t;
+typedef UInt32              mbuf_flags_t;
+
+typedef enum{
+    MBUF_WAITOK = 0,
+    MBUF_DONTWAIT = 1
+} mbuf_how_t;
+
+typedef enum{
+    MBUF_TYPE_FREE = 0,
+    MBUF_TYPE_DATA = 1,
+    MBUF_TYPE_HEADER = 2
+} mbuf_type_t;
+
+#define MBUF_EXT        0x0001
+#define MBUF_PKTHDR     0x0002
+
+size_t mbuf_pkthdr_len( const mbuf_t mbuf );
+void mbuf_pkthdr_setlen( mbuf_t mbuf, size_t len );
+errno_t mbuf_pkthdr_setrcvif( mbuf_t mbuf, ifnet_t ifp );
+size_t mbuf_len( const mbuf_t mbuf );
+void mbuf_setlen( mbuf_t mbuf, size_t len );
+mbuf_t mbuf_next( const mbuf_t mbuf );
+errno_t mbuf_setnext( mbuf_t mbuf, mbuf_t next );
+mbuf_t mbuf_nextpkt( const mbuf_t mbuf );
+void mbuf_setnextpkt( mbuf_t mbuf, mbuf_t nextpkt );
+mbuf_flags_t mbuf_flags( const mbuf_t mbuf );
+errno_t mbuf_gethdr( mbuf_how_t how, mbuf_type_t type, mbuf_t* mbuf );
+errno_t mbuf_copydata( const mbuf_t mbuf, size_t offset, size_t length, void* out_data );
+void mbuf_freem( mbuf_t mbuf );
+errno_t mbuf_tag_allocate( mbuf_t mbuf, mbuf_tag_id_t module_id, mbuf_tag_type_t type, size_t length,
+                           mbuf_how_t how, void** data_p );
+errno_t mbuf_tag_find( mbuf_t mbuf, mbuf_tag_id_t module_id, mbuf_tag_type_t type, size_t* length, void** data_p );
+
+//
+// creates a packet of the length with the data bytes set to the fill value, the host's helper
+//
+mbuf_t NkeHostAllocatePacket( size_t length, UInt8 fill );
+
+#endif // _NKEHOST_SYS_KPI_MBUF_H
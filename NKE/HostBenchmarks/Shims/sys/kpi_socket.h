@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_SYS_KPI_SOCKET_H
+#define _NKEHOST_SYS_KPI_SOCKET_H
+
+#include <sys/socket.h>
+#include "NkeHostKernel.h"
+#include <sys/kpi_mbuf.h>
+
+//
+// the socket KPI, a host socket is an opaque value, the injected data is freed
+//
+typedef struct socket*      socket_t;
+
+typedef enum{
+    sock_data_filt_flag_oob = 1,
+    sock_data_filt_flag_record = 2
+} sflt_data_flag_t;
+
+errno_t sock_getsockopt( socket_t so, int level, int optname, void* optval, int* optlen );
+errno_t sock_setsockopt( socket_t so, int level, int optname, const void* optval, int optlen );
+errno_t sock_inject_data_in( socket_t so, const struct sockaddr* from, mbuf_t data, mbuf_t control, sflt_data_flag_t flags );
+errno_t sock_inject_data_out( socket_t so, const struct sockaddr* to, mbuf_t data, mbuf_t control, sflt_data_flag_t flags );
+
+#endif // _NKEHOST_SYS_KPI_SOCKET_H
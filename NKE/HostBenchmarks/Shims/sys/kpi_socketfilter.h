@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_SYS_KPI_SOCKETFILTER_H
+#define _NKEHOST_SYS_KPI_SOCKETFILTER_H
+
+#include <sys/kpi_socket.h>
+
+typedef UInt32              sflt_handle;
+typedef struct sockopt*     sockopt_t;
+
+typedef enum{
+    sock_evt_connecting = 1,
+    sock_evt_connected = 2,
+    sock_evt_disconnecting = 3,
+    sock_evt_disconnected = 4,
+    sock_evt_flush_read = 5,
+    sock_evt_shutdown = 6,
+    sock_evt_cantrecvmore = 7,
+    sock_evt_cantsendmore = 8,
+    sock_evt_closing = 9,
+    sock_evt_bound = 10
+} sflt_event_t;
+
+struct sflt_filter;
+
+#endif // _NKEHOST_SYS_KPI_SOCKETFILTER_H
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_SYS_SOCKET_H
+#define _NKEHOST_SYS_SOCKET_H
+
+#include <stdint.h>
+
+//
+// the BSD socket address layout with the length byte, shadows the host's header
+//
+typedef uint8_t     sa_family_t;
+typedef uint32_t    socklen_t;
+
+#define AF_UNSPEC   0
+#define AF_INET     2
+#define AF_INET6    30
+
+#define SOL_SOCKET  0xffff
+#define SO_RCVBUF   0x1002
+#define SO_SNDBUF   0x1001
+
+struct sockaddr{
+    uint8_t         sa_len;
+    sa_family_t     sa_family;
+    char            sa_data[ 14 ];
+};
+
+struct sockaddr_storage{
+    uint8_t         ss_len;
+    sa_family_t     ss_family;
+    char            __ss_pad1[ 6 ];
+    int64_t         __ss_align;
+    char            __ss_pad2[ 112 ];
+};
+
+#endif // _NKEHOST_SYS_SOCKET_H
@@ -0,0 +1,10 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEHOST_SYS_SYSTM_H
+#define _NKEHOST_SYS_SYSTM_H
+
+#include "NkeHostKernel.h"
+
+#endif // _NKEHOST_SYS_SYSTM_H
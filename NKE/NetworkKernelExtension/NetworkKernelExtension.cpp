@@ -38,7 +38,13 @@ bool NetworkKernelExtension::start( __in IOService *provider)
     // Start network filtering
     if( KERN_SUCCESS == NkeSocketFilter::InitSocketFilterSubsystem() ){
         
-        gSocketFilter = NkeSocketFilter::withDefault();
+        UInt32  dataBufferSize;
+        UInt32  dataBuffersNumber;
+        UInt32  dataBuffersNumberMax;
+        
+        this->getDataArenaGeometry( &dataBufferSize, &dataBuffersNumber, &dataBuffersNumberMax );
+        
+        gSocketFilter = NkeSocketFilter::withDefault( dataBufferSize, dataBuffersNumber, dataBuffersNumberMax );
         assert( gSocketFilter );
         if( NULL == gSocketFilter ){
             
@@ -94,6 +100,49 @@ void NetworkKernelExtension::stop( __in IOService * provider )
 
 //--------------------------------------------------------------------
 
+void NetworkKernelExtension::getDataArenaGeometry( __out UInt32* bufferSize, __out UInt32* buffersNumber, __out UInt32* buffersNumberMax )
+{
+    OSNumber*  sizeProperty = OSDynamicCast( OSNumber, this->getProperty( kNkeDataBufferSizeProperty ) );
+    OSNumber*  numberProperty = OSDynamicCast( OSNumber, this->getProperty( kNkeDataBuffersNumberProperty ) );
+    OSNumber*  numberMaxProperty = OSDynamicCast( OSNumber, this->getProperty( kNkeDataBuffersNumberMaxProperty ) );
+    
+    *bufferSize = sizeProperty ? sizeProperty->unsigned32BitValue() : kt_NkeSocketBufferSizeDefault;
+    *buffersNumber = numberProperty ? numberProperty->unsigned32BitValue() : kt_NkeSocketBuffersNumberDefault;
+    *buffersNumberMax = numberMaxProperty ? numberMaxProperty->unsigned32BitValue() : kt_NkeSocketBuffersNumberMaxDefault;
+    
+    if( *bufferSize < kt_NkeSocketBufferSizeMin ||
+        *bufferSize > kt_NkeSocketBufferSizeMax ||
+        0x0 != *bufferSize % kt_NkeSocketBufferSizeMin ||
+        0x0 == *buffersNumber ||
+        *buffersNumber > kt_NkeSocketBuffersNumberMax ||
+        (UInt64)*bufferSize * *buffersNumber > kt_NkeSocketDataArenaSizeMax ){
+        
+        DBG_PRINT_ERROR(("invalid data arena geometry, bufferSize = 0x%x, buffersNumber = %u, the default one is used\n",
+                         (unsigned int)*bufferSize, (unsigned int)*buffersNumber));
+        
+        *bufferSize = kt_NkeSocketBufferSizeDefault;
+        *buffersNumber = kt_NkeSocketBuffersNumberDefault;
+    }
+    
+    //
+    // the arena doesn't grow if the maximum is not above the initial number
+    //
+    if( *buffersNumberMax < *buffersNumber ||
+        *buffersNumberMax > kt_NkeSocketBuffersNumberMax ||
+        (UInt64)*bufferSize * *buffersNumberMax > kt_NkeSocketDataArenaSizeMax ){
+        
+        DBG_PRINT_ERROR(("invalid data arena maximal buffers number %u, the arena will not grow\n",
+                         (unsigned int)*buffersNumberMax));
+        
+        *buffersNumberMax = *buffersNumber;
+    }
+    
+    DBG_PRINT(("data arena geometry, bufferSize = 0x%x, buffersNumber = %u, buffersNumberMax = %u\n",
+               (unsigned int)*bufferSize, (unsigned int)*buffersNumber, (unsigned int)*buffersNumberMax));
+}
+
+//--------------------------------------------------------------------
+
 bool NetworkKernelExtension::init()
 {
     if(! super::init() )
@@ -14,6 +14,13 @@
 
 #include "NkeCommon.h"
 
+//
+// the personality properties to set the data arena geometry when the driver is loaded
+//
+#define kNkeDataBufferSizeProperty     "NkeDataBufferSize"
+#define kNkeDataBuffersNumberProperty  "NkeDataBuffersNumber"
+#define kNkeDataBuffersNumberMaxProperty  "NkeDataBuffersNumberMax"
+
 //--------------------------------------------------------------------
 
 // I/O Kit driver class
@@ -43,6 +50,12 @@ private:
     
     static NetworkKernelExtension* Instance;
     
+    //
+    // returns the data arena geometry from the personality or the default one, the arena starts
+    // with buffersNumber buffers and grows up to buffersNumberMax buffers
+    //
+    void getDataArenaGeometry( __out UInt32* bufferSize, __out UInt32* buffersNumber, __out UInt32* buffersNumberMax );
+    
 };
 
 //--------------------------------------------------------------------
@@ -148,6 +148,23 @@ extern SInt32 gLogIndx;
 
 //--------------------------------------------------------------------
 
+//
+// the same as TAILQ_INSERT_HEAD but the element is made visible to the lock-free readers
+// traversing the list in the forward direction only after the element has been initialized
+//
+#define TAILQ_INSERT_HEAD_WITH_BARRIER(head, elm, field) do {	\
+    if (((elm)->field.tqe_next = (head)->tqh_first) != NULL)	\
+        (head)->tqh_first->field.tqe_prev =			\
+            &(elm)->field.tqe_next;				\
+    else							\
+        (head)->tqh_last = &(elm)->field.tqe_next;		\
+    (elm)->field.tqe_prev = &(head)->tqh_first;			\
+    NkeMemoryBarrier();						\
+    (head)->tqh_first = (elm);					\
+} while (0)
+
+//--------------------------------------------------------------------
+
 #define FIELD_OFFSET(Type,Field) (reinterpret_cast<unsigned long long>( (&(((Type *)(0))->Field)) ) )
 
 //--------------------------------------------------------------------
@@ -294,6 +311,50 @@ AppendTailList(
 
 //--------------------------------------------------------------------
 
+//
+// the barriers below and the lock-free code that uses them rely on the x86 memory ordering,
+// a locked instruction is a full barrier and the stores are not reordered with the older stores,
+// the driver must be ported to the C11 release and acquire semantic for another architecture
+//
+#if !defined(__x86_64__) && !defined(__i386__)
+    #error "the memory barriers rely on the x86 memory ordering"
+#endif
+
+//
+// a full memory barrier, see the implementation in NkeIOUserClient.cpp
+//
+void NkeMemoryBarrier();
+
+//
+// x86 does not reorder a store with an older store or a load with an older load or store,
+// so publishing the data needs only the compiler not to reorder the accesses, a store
+// followed by a load of another variable needs NkeMemoryBarrier()
+//
+#define NkeCompilerBarrier()    __asm__ __volatile__( "" ::: "memory" )
+
+//--------------------------------------------------------------------
+
+//
+// the number of slots for the per-CPU data, a processor number is mapped to a slot
+//
+#define NKE_PER_CPU_SLOTS   0x40
+
+extern "C" int cpu_number(void);
+
+//
+// returns a slot for the current processor, the value is only a hint as the thread
+// might be preempted and moved to another processor, so the per-CPU data must be
+// protected by atomic operations or a lock
+//
+inline
+unsigned int
+NkeCurrentCpuSlot()
+{
+    return ((unsigned int)cpu_number()) % NKE_PER_CPU_SLOTS;
+}
+
+//--------------------------------------------------------------------
+
 #ifndef OSCompareAndSwapPtr
     /*
      10.5 SDK doesn't define OSCompareAndSwapPtr, so this is an easy way to find that this is a 10.5 compilation,
@@ -0,0 +1,1209 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <kern/clock.h>
+#include <sys/proc.h>
+#include "NkeDataArena.h"
+
+//--------------------------------------------------------------------
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors( NkeDataArena, OSObject )
+
+//--------------------------------------------------------------------
+
+NkeDataArena* NkeDataArena::withWindows( __in UInt32 windowSize, __in UInt32 windowsNumber, __in UInt32 activeWindowsNumber )
+{
+    //
+    // a window is mapped by pages, a bitmap word never crosses a window boundary,
+    // a slice's granules count must fit in slicesGranules below the chunk flag
+    //
+    assert( 0x0 != windowsNumber && 0x0 != activeWindowsNumber && activeWindowsNumber <= windowsNumber );
+    assert( 0x0 == windowSize % PAGE_SIZE && 0x0 == windowSize % ( NKE_DATA_ARENA_GRANULE_SIZE * 0x40 ) );
+    assert( windowSize / NKE_DATA_ARENA_GRANULE_SIZE < NKE_DATA_ARENA_CHUNK_FLAG );
+    
+    if( 0x0 == windowsNumber ||
+        0x0 == activeWindowsNumber ||
+        activeWindowsNumber > windowsNumber ||
+        0x0 == windowSize ||
+        0x0 != windowSize % PAGE_SIZE ||
+        0x0 != windowSize % ( NKE_DATA_ARENA_GRANULE_SIZE * 0x40 ) ||
+        windowSize / NKE_DATA_ARENA_GRANULE_SIZE >= NKE_DATA_ARENA_CHUNK_FLAG ){
+        
+        DBG_PRINT_ERROR(("invalid arena geometry, windowSize = %u, windowsNumber = %u, activeWindowsNumber = %u\n",
+                         (unsigned int)windowSize, (unsigned int)windowsNumber, (unsigned int)activeWindowsNumber));
+        return NULL;
+    }
+    
+    NkeDataArena*  newArena = new NkeDataArena();
+    assert( newArena );
+    if( ! newArena ){
+        
+        DBG_PRINT_ERROR(("operator new failed\n"));
+        return NULL;
+    }
+    
+    if( ! newArena->init() ){
+        
+        DBG_PRINT_ERROR(("init() failed\n"));
+        newArena->release();
+        return NULL;
+    }
+    
+    newArena->windowSize = windowSize;
+    newArena->windowsNumber = windowsNumber;
+    newArena->granulesPerWindow = windowSize / NKE_DATA_ARENA_GRANULE_SIZE;
+    newArena->granulesNumber = newArena->granulesPerWindow * windowsNumber;
+    
+    //
+    // split the windows between stripes, the last stripe takes the remaining windows
+    //
+    newArena->stripesNumber = ( windowsNumber < NKE_DATA_ARENA_STRIPES ) ? windowsNumber : NKE_DATA_ARENA_STRIPES;
+    newArena->windowsPerStripe = windowsNumber / newArena->stripesNumber;
+    
+    for( UInt32 i = 0x0; i < newArena->stripesNumber; ++i ){
+        
+        Stripe*  stripe = &newArena->stripes[ i ];
+        UInt32   stripeWindows = ( i == ( newArena->stripesNumber - 0x1 ) ) ?
+                                 ( windowsNumber - i * newArena->windowsPerStripe ) : newArena->windowsPerStripe;
+        
+        stripe->firstGranule = i * newArena->windowsPerStripe * newArena->granulesPerWindow;
+        stripe->granulesNumber = stripeWindows * newArena->granulesPerWindow;
+        stripe->nextFitGranule = stripe->firstGranule;
+        stripe->packingChunk = NKE_DATA_ARENA_NO_CHUNK;
+    } // end for
+    
+    newArena->size = (vm_size_t)windowSize * windowsNumber;
+    
+    newArena->granulesBitmapSize = ( newArena->granulesNumber / 0x40 ) * sizeof( newArena->granulesBitmap[ 0x0 ] );
+    newArena->granulesBitmap = (UInt64*)IOMalloc( newArena->granulesBitmapSize );
+    assert( newArena->granulesBitmap );
+    if( ! newArena->granulesBitmap ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the granules bitmap failed\n"));
+        newArena->release();
+        return NULL;
+    }
+    
+    //
+    // all windows are inactive until they are added
+    //
+    memset( newArena->granulesBitmap, 0xFF, newArena->granulesBitmapSize );
+    
+    newArena->slicesGranulesSize = newArena->granulesNumber * sizeof( newArena->slicesGranules[ 0x0 ] );
+    newArena->slicesGranules = (UInt16*)IOMalloc( newArena->slicesGranulesSize );
+    assert( newArena->slicesGranules );
+    if( ! newArena->slicesGranules ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the slices granules failed\n"));
+        newArena->release();
+        return NULL;
+    }
+    
+    bzero( newArena->slicesGranules, newArena->slicesGranulesSize );
+    
+    newArena->chunksSlicesSize = ( newArena->granulesNumber / NKE_DATA_ARENA_CHUNK_GRANULES ) * sizeof( newArena->chunksSlices[ 0x0 ] );
+    newArena->chunksSlices = (UInt64*)IOMalloc( newArena->chunksSlicesSize );
+    assert( newArena->chunksSlices );
+    if( ! newArena->chunksSlices ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the chunks slices failed\n"));
+        newArena->release();
+        return NULL;
+    }
+    
+    bzero( newArena->chunksSlices, newArena->chunksSlicesSize );
+    
+    newArena->pinnedSlicesSize = newArena->granulesBitmapSize;
+    newArena->pinnedSlices = (UInt64*)IOMalloc( newArena->pinnedSlicesSize );
+    assert( newArena->pinnedSlices );
+    if( ! newArena->pinnedSlices ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the pinned slices failed\n"));
+        newArena->release();
+        return NULL;
+    }
+    
+    bzero( newArena->pinnedSlices, newArena->pinnedSlicesSize );
+    
+    newArena->windowBuffersSize = windowsNumber * sizeof( newArena->windowBuffers[ 0x0 ] );
+    newArena->windowBuffers = (IOBufferMemoryDescriptor**)IOMalloc( newArena->windowBuffersSize );
+    assert( newArena->windowBuffers );
+    if( ! newArena->windowBuffers ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the window buffers failed\n"));
+        newArena->release();
+        return NULL;
+    }
+    
+    bzero( newArena->windowBuffers, newArena->windowBuffersSize );
+    
+    //
+    // the initial windows are added by reserveWindows()
+    //
+    newArena->initialWindowsNumber = activeWindowsNumber;
+    newArena->minWindowsNumber = 0x0;
+    
+    return newArena;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::reserveWindows()
+{
+    bool  added = true;
+    
+    IOLockLock( this->resizeLock );
+    { // start of the lock
+        
+        //
+        // the windows that were not removed after the previous release are reused
+        //
+        this->minWindowsNumber = this->initialWindowsNumber;
+        this->idleIntervals = 0x0;
+        
+        while( this->activeWindowsNumber < this->minWindowsNumber && added )
+            added = this->addWindow();
+        
+        if( ! added )
+            this->minWindowsNumber = 0x0;
+        
+    } // end of the lock
+    IOLockUnlock( this->resizeLock );
+    
+    assert( added );
+    if( ! added )
+        DBG_PRINT_ERROR(("the initial windows were not added\n"));
+    
+    return added;
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::releaseWindows()
+{
+    IOLockLock( this->resizeLock );
+    { // start of the lock
+        
+        this->minWindowsNumber = 0x0;
+        
+        bool  removed;
+        
+        do{
+            removed = this->removeWindow();
+        } while( removed );
+        
+        //
+        // the arena descriptor retains the window of zeroes if it has not been released
+        //
+        if( this->inactiveWindow ){
+            
+            this->inactiveWindow->release();
+            this->inactiveWindow = NULL;
+        }
+        
+    } // end of the lock
+    IOLockUnlock( this->resizeLock );
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::init()
+{
+    if( ! super::init() ){
+        
+        assert( !"super::init() failed" );
+        DBG_PRINT_ERROR(( "super::init() failed\n" ));
+        return false;
+    }
+    
+    for( int i = 0x0; i < NKE_DATA_ARENA_STRIPES; ++i ){
+        
+        this->stripes[ i ].lock = IOSimpleLockAlloc();
+        assert( this->stripes[ i ].lock );
+        if( ! this->stripes[ i ].lock ){
+            
+            DBG_PRINT_ERROR(("this->stripes[ %d ].lock = IOSimpleLockAlloc() failed\n", i));
+            return false;
+        }
+    } // end for
+    
+    this->resizeLock = IOLockAlloc();
+    assert( this->resizeLock );
+    if( ! this->resizeLock ){
+        
+        DBG_PRINT_ERROR(("this->resizeLock = IOLockAlloc() failed\n"));
+        return false;
+    }
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::free()
+{
+    //
+    // the thread references the object so it must have been stopped
+    //
+    assert( ! this->threadStarted || this->threadExited );
+    
+    //
+    // the chunks being filled are released when they have no slices
+    //
+    for( UInt32 i = 0x0; i < this->stripesNumber; ++i ){
+        
+        Stripe*  stripe = &this->stripes[ i ];
+        
+        if( NKE_DATA_ARENA_NO_CHUNK == stripe->packingChunk )
+            continue;
+        
+        assert( 0x0 == this->chunksSlices[ stripe->packingChunk / NKE_DATA_ARENA_CHUNK_GRANULES ] );
+        if( 0x0 == this->chunksSlices[ stripe->packingChunk / NKE_DATA_ARENA_CHUNK_GRANULES ] )
+            this->freeGranules( stripe, stripe->packingChunk, NKE_DATA_ARENA_CHUNK_GRANULES );
+        
+        stripe->packingChunk = NKE_DATA_ARENA_NO_CHUNK;
+    } // end for
+    
+    assert( 0x0 == this->getBytesInUse() );
+    
+    //
+    // the memory of a window mapped by the client is freed when the client unmaps it
+    //
+    if( this->arenaDescriptor )
+        this->arenaDescriptor->release();
+    
+    if( this->inactiveWindow )
+        this->inactiveWindow->release();
+    
+    if( this->windowBuffers ){
+        
+        for( UInt32 i = 0x0; i < this->windowsNumber; ++i ){
+            
+            if( this->windowBuffers[ i ] )
+                this->windowBuffers[ i ]->release();
+        } // end for
+        
+        IOFree( this->windowBuffers, this->windowBuffersSize );
+    }
+    
+    if( this->granulesBitmap )
+        IOFree( this->granulesBitmap, this->granulesBitmapSize );
+    
+    if( this->slicesGranules )
+        IOFree( this->slicesGranules, this->slicesGranulesSize );
+    
+    if( this->chunksSlices )
+        IOFree( this->chunksSlices, this->chunksSlicesSize );
+    
+    if( this->pinnedSlices )
+        IOFree( this->pinnedSlices, this->pinnedSlicesSize );
+    
+    for( int i = 0x0; i < NKE_DATA_ARENA_STRIPES; ++i ){
+        
+        if( this->stripes[ i ].lock )
+            IOSimpleLockFree( this->stripes[ i ].lock );
+    } // end for
+    
+    if( this->resizeLock )
+        IOLockFree( this->resizeLock );
+    
+    super::free();
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::setGranules( __in UInt32 firstGranule, __in UInt32 granulesCount, __in bool allocated )
+{
+    for( UInt32 granule = firstGranule; granule < ( firstGranule + granulesCount ); ++granule ){
+        
+        assert( allocated != this->isGranuleAllocated( granule ) );
+        
+        if( allocated )
+            this->granulesBitmap[ granule / 0x40 ] |= ( 0x1ULL << ( granule % 0x40 ) );
+        else
+            this->granulesBitmap[ granule / 0x40 ] &= ~( 0x1ULL << ( granule % 0x40 ) );
+    } // end for
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::findFreeGranules( __in Stripe* stripe,
+                                     __in UInt32 granulesCount,
+                                     __in UInt32 granulesAlignment,
+                                     __out UInt32* firstGranule )
+{
+    assert( 0x0 != granulesCount && granulesCount <= this->granulesPerWindow );
+    assert( 0x0 != granulesAlignment && 0x0 == this->granulesPerWindow % granulesAlignment );
+    
+    UInt32  stripeEnd = stripe->firstGranule + stripe->granulesNumber;
+    UInt32  granule = stripe->nextFitGranule;
+    UInt32  scanned = 0x0;
+    
+    while( scanned < stripe->granulesNumber ){
+        
+        if( granule >= stripeEnd )
+            granule = stripe->firstGranule;
+        
+        if( 0x0 != granule % granulesAlignment ){
+            
+            UInt32  alignedGranule = ( granule / granulesAlignment + 0x1 ) * granulesAlignment;
+            
+            scanned += alignedGranule - granule;
+            granule = alignedGranule;
+            continue;
+        }
+        
+        //
+        // a slice can't cross a window boundary
+        //
+        UInt32  windowEnd = ( granule / this->granulesPerWindow + 0x1 ) * this->granulesPerWindow;
+        
+        if( ( granule + granulesCount ) > windowEnd ){
+            
+            scanned += windowEnd - granule;
+            granule = windowEnd;
+            continue;
+        }
+        
+        //
+        // skip a bitmap word with all granules allocated
+        //
+        if( 0x0 == granule % 0x40 && ~0x0ULL == this->granulesBitmap[ granule / 0x40 ] ){
+            
+            scanned += 0x40;
+            granule += 0x40;
+            continue;
+        }
+
+        //
+        // skip the allocated granules up to the next free one in the word, the bits shifted
+        // in are free so the run ends at the word end at the latest, a word with all granules
+        // allocated has been skipped above so the inverted word is not zero
+        //
+        UInt64  word = this->granulesBitmap[ granule / 0x40 ] >> ( granule % 0x40 );
+
+        if( 0x0 != ( word & 0x1 ) ){
+
+            UInt32  allocatedGranules = (UInt32)__builtin_ctzll( ~word );
+
+            scanned += allocatedGranules;
+            granule += allocatedGranules;
+            continue;
+        }
+
+        UInt32  freeGranules = 0x0;
+        
+        while( freeGranules < granulesCount && ! this->isGranuleAllocated( granule + freeGranules ) )
+            freeGranules += 0x1;
+        
+        if( freeGranules == granulesCount ){
+            
+            *firstGranule = granule;
+            stripe->nextFitGranule = granule + granulesCount;
+            return true;
+        }
+        
+        //
+        // continue after the allocated granule
+        //
+        scanned += freeGranules + 0x1;
+        granule += freeGranules + 0x1;
+        
+    } // end while
+    
+    return false;
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::updateHighWaterMark( __in SInt32 inUse )
+{
+    SInt32  highWaterMark;
+    
+    do{
+        
+        highWaterMark = this->bytesHighWaterMark;
+        if( inUse <= highWaterMark )
+            break;
+            
+    } while( ! OSCompareAndSwap( highWaterMark, inUse, &this->bytesHighWaterMark ) );
+}
+
+//--------------------------------------------------------------------
+
+UInt32 NkeDataArena::getBytesInUse()
+{
+    SInt32  inUse = 0x0;
+    
+    //
+    // the stripes are read without their locks, the sum is a snapshot
+    //
+    for( UInt32 i = 0x0; i < this->stripesNumber; ++i )
+        inUse += this->stripes[ i ].bytesInUse;
+    
+    return (UInt32)inUse;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::allocateGranules( __in Stripe* stripe,
+                                     __in UInt32 granulesCount,
+                                     __in UInt32 granulesAlignment,
+                                     __in UInt16 sliceFlags,
+                                     __out UInt32* firstGranule,
+                                     __out bool* newMaximum )
+{
+    if( ! this->findFreeGranules( stripe, granulesCount, granulesAlignment, firstGranule ) )
+        return false;
+    
+    this->setGranules( *firstGranule, granulesCount, true );
+    this->slicesGranules[ *firstGranule ] = (UInt16)granulesCount | sliceFlags;
+    
+    stripe->bytesInUse += (SInt32)( granulesCount * NKE_DATA_ARENA_GRANULE_SIZE );
+    if( stripe->bytesInUse > stripe->bytesHighWaterMark ){
+        
+        stripe->bytesHighWaterMark = stripe->bytesInUse;
+        *newMaximum = true;
+    }
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::freeGranules( __in Stripe* stripe, __in UInt32 firstGranule, __in UInt32 granulesCount )
+{
+    this->slicesGranules[ firstGranule ] = 0x0;
+    this->setGranules( firstGranule, granulesCount, false );
+    
+    stripe->bytesInUse -= (SInt32)( granulesCount * NKE_DATA_ARENA_GRANULE_SIZE );
+    assert( stripe->bytesInUse >= 0x0 );
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::allocateInStripe( __in Stripe* stripe, __in UInt32 granulesCount, __in bool pinned, __out UInt32* firstGranule )
+{
+    bool    found;
+    bool    newMaximum = false;
+    
+    IOSimpleLockLock( stripe->lock );
+    { // start of the lock
+        
+        found = this->allocateGranules( stripe, granulesCount, 0x1, 0x0, firstGranule, &newMaximum );
+        if( found && pinned )
+            this->pinnedSlices[ *firstGranule / 0x40 ] |= ( 0x1ULL << ( *firstGranule % 0x40 ) );
+        
+    } // end of the lock
+    IOSimpleLockUnlock( stripe->lock );
+    
+    //
+    // the other stripes are read only when this one grows, this keeps
+    // the cache lines of the other processors' stripes in place
+    //
+    if( newMaximum )
+        this->updateHighWaterMark( (SInt32)this->getBytesInUse() );
+    
+    return found;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::allocatePackedSlice( __in UInt32 size, __out NkeDataSlice* slice )
+{
+    assert( 0x0 != size && size <= NKE_DATA_ARENA_CHUNK_SIZE );
+    
+    Stripe*  stripe = &this->stripes[ NkeCurrentCpuSlot() % this->stripesNumber ];
+    UInt32   packedBytes = ( ( size + NKE_DATA_ARENA_PACKING_UNIT - 0x1 ) / NKE_DATA_ARENA_PACKING_UNIT ) * NKE_DATA_ARENA_PACKING_UNIT;
+    bool     found = false;
+    bool     newMaximum = false;
+    
+    IOSimpleLockLock( stripe->lock );
+    { // start of the lock
+        
+        if( NKE_DATA_ARENA_NO_CHUNK != stripe->packingChunk ){
+            
+            UInt64*  chunkSlices = &this->chunksSlices[ stripe->packingChunk / NKE_DATA_ARENA_CHUNK_GRANULES ];
+            
+            if( 0x0 == *chunkSlices ){
+                
+                //
+                // all slices have been released, the chunk is reused from the start
+                //
+                stripe->packingOffset = 0x0;
+                
+            } else if( ( stripe->packingOffset + packedBytes ) > NKE_DATA_ARENA_CHUNK_SIZE ){
+                
+                //
+                // the chunk is full, it is released with its last slice
+                //
+                stripe->packingChunk = NKE_DATA_ARENA_NO_CHUNK;
+            }
+        }
+        
+        if( NKE_DATA_ARENA_NO_CHUNK == stripe->packingChunk ){
+            
+            UInt32  chunkGranule;
+            
+            if( this->allocateGranules( stripe,
+                                        NKE_DATA_ARENA_CHUNK_GRANULES,
+                                        NKE_DATA_ARENA_CHUNK_GRANULES,
+                                        NKE_DATA_ARENA_CHUNK_FLAG,
+                                        &chunkGranule,
+                                        &newMaximum ) ){
+                
+                assert( 0x0 == this->chunksSlices[ chunkGranule / NKE_DATA_ARENA_CHUNK_GRANULES ] );
+                
+                stripe->packingChunk = chunkGranule;
+                stripe->packingOffset = 0x0;
+            }
+        }
+        
+        if( NKE_DATA_ARENA_NO_CHUNK != stripe->packingChunk ){
+            
+            this->chunksSlices[ stripe->packingChunk / NKE_DATA_ARENA_CHUNK_GRANULES ] |=
+                ( 0x1ULL << ( stripe->packingOffset / NKE_DATA_ARENA_PACKING_UNIT ) );
+            
+            slice->offset = stripe->packingChunk * NKE_DATA_ARENA_GRANULE_SIZE + stripe->packingOffset;
+            slice->length = size;
+            
+            stripe->packingOffset += packedBytes;
+            found = true;
+        }
+        
+    } // end of the lock
+    IOSimpleLockUnlock( stripe->lock );
+    
+    if( newMaximum )
+        this->updateHighWaterMark( (SInt32)this->getBytesInUse() );
+    
+    return found;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::allocateSlice( __in UInt32 size, __out NkeDataSlice* slice )
+{
+    assert( 0x0 != size );
+    
+    if( size > this->windowSize )
+        size = this->windowSize;
+    
+    //
+    // a small slice is packed with other small slices, if there is no memory for
+    // a chunk in the home stripe then the slice is allocated from any stripe
+    //
+    if( size <= NKE_DATA_ARENA_PACKING_THRESHOLD && this->allocatePackedSlice( size, slice ) )
+        return true;
+    
+    UInt32  granulesCount = ( size + NKE_DATA_ARENA_GRANULE_SIZE - 0x1 ) / NKE_DATA_ARENA_GRANULE_SIZE;
+    UInt32  homeStripe = NkeCurrentCpuSlot() % this->stripesNumber;
+    UInt32  firstGranule;
+    bool    found = false;
+    
+    while( ! found ){
+        
+        //
+        // the home stripe is tried first, then the other stripes in order
+        //
+        for( UInt32 i = 0x0; i < this->stripesNumber && ! found; ++i )
+            found = this->allocateInStripe( &this->stripes[ ( homeStripe + i ) % this->stripesNumber ], granulesCount, false, &firstGranule );
+        
+        //
+        // a shorter range is looked for if there is no range of the size, a caller
+        // splits the data between slices
+        //
+        if( ! found ){
+            
+            if( 0x1 == granulesCount )
+                break;
+            
+            granulesCount = granulesCount / 0x2;
+        }
+    } // end while
+    
+    if( ! found ){
+        
+        OSIncrementAtomic64( &this->allocationFailures );
+        this->requestGrowth();
+        return false;
+    }
+    
+    UInt32  sliceBytes = granulesCount * NKE_DATA_ARENA_GRANULE_SIZE;
+    
+    slice->offset = firstGranule * NKE_DATA_ARENA_GRANULE_SIZE;
+    slice->length = ( size < sliceBytes ) ? size : sliceBytes;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::allocatePinnedSlice( __in UInt32 size, __out NkeDataSlice* slice )
+{
+    assert( 0x0 != size );
+    
+    if( size > this->windowSize )
+        return false;
+    
+    //
+    // the range is never shorter than requested, the size is not split between ranges
+    //
+    UInt32  granulesCount = ( size + NKE_DATA_ARENA_GRANULE_SIZE - 0x1 ) / NKE_DATA_ARENA_GRANULE_SIZE;
+    UInt32  homeStripe = NkeCurrentCpuSlot() % this->stripesNumber;
+    UInt32  firstGranule;
+    bool    found = false;
+    
+    for( UInt32 i = 0x0; i < this->stripesNumber && ! found; ++i )
+        found = this->allocateInStripe( &this->stripes[ ( homeStripe + i ) % this->stripesNumber ], granulesCount, true, &firstGranule );
+    
+    if( ! found ){
+        
+        OSIncrementAtomic64( &this->allocationFailures );
+        this->requestGrowth();
+        return false;
+    }
+    
+    slice->offset = firstGranule * NKE_DATA_ARENA_GRANULE_SIZE;
+    slice->length = size;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::releaseSliceInternal( __in const NkeDataSlice* slice, __in bool pinned )
+{
+    //
+    // the slices come from the client so they are validated
+    //
+    if( 0x0 == slice->length ||
+        slice->offset >= this->size ||
+        slice->length > this->windowSize ){
+        
+        DBG_PRINT_ERROR(("an invalid slice, offset = 0x%x, length = 0x%x\n",
+                         (unsigned int)slice->offset, (unsigned int)slice->length));
+        return false;
+    }
+    
+    UInt32  firstGranule = slice->offset / NKE_DATA_ARENA_GRANULE_SIZE;
+    UInt32  granulesCount = ( slice->length + NKE_DATA_ARENA_GRANULE_SIZE - 0x1 ) / NKE_DATA_ARENA_GRANULE_SIZE;
+    UInt32  chunkGranule = ( slice->offset / NKE_DATA_ARENA_CHUNK_SIZE ) * NKE_DATA_ARENA_CHUNK_GRANULES;
+    Stripe* stripe = this->getStripeForGranule( firstGranule );
+    bool    allocated;
+    
+    IOSimpleLockLock( stripe->lock );
+    { // start of the lock
+        
+        if( ( NKE_DATA_ARENA_CHUNK_FLAG | NKE_DATA_ARENA_CHUNK_GRANULES ) == this->slicesGranules[ chunkGranule ] ){
+            
+            //
+            // a packed slice, the chunk is released with its last slice unless the chunk is being filled
+            //
+            UInt32   offsetInChunk = slice->offset % NKE_DATA_ARENA_CHUNK_SIZE;
+            UInt64   sliceBit = ( 0x1ULL << ( offsetInChunk / NKE_DATA_ARENA_PACKING_UNIT ) );
+            UInt64*  chunkSlices = &this->chunksSlices[ chunkGranule / NKE_DATA_ARENA_CHUNK_GRANULES ];
+            
+            allocated = ( 0x0 == offsetInChunk % NKE_DATA_ARENA_PACKING_UNIT &&
+                          ( offsetInChunk + slice->length ) <= NKE_DATA_ARENA_CHUNK_SIZE &&
+                          0x0 != ( *chunkSlices & sliceBit ) );
+            if( allocated ){
+                
+                *chunkSlices &= ~sliceBit;
+                
+                if( 0x0 == *chunkSlices && chunkGranule != stripe->packingChunk )
+                    this->freeGranules( stripe, chunkGranule, NKE_DATA_ARENA_CHUNK_GRANULES );
+            }
+            
+        } else {
+            
+            allocated = ( 0x0 == slice->offset % NKE_DATA_ARENA_GRANULE_SIZE &&
+                          granulesCount == this->slicesGranules[ firstGranule ] &&
+                          pinned == this->isSlicePinned( firstGranule ) );
+            if( allocated ){
+                
+                this->pinnedSlices[ firstGranule / 0x40 ] &= ~( 0x1ULL << ( firstGranule % 0x40 ) );
+                this->freeGranules( stripe, firstGranule, granulesCount );
+            }
+        }
+        
+    } // end of the lock
+    IOSimpleLockUnlock( stripe->lock );
+    
+    if( ! allocated ){
+        
+        //
+        // an attempt to free an already freed slice or a slice that has never been allocated
+        //
+        DBG_PRINT_ERROR(("the slice at 0x%x of 0x%x bytes was not allocated\n",
+                         (unsigned int)slice->offset, (unsigned int)slice->length));
+        return false;
+    }
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+errno_t NkeDataArena::copyDataMbuf( __in const NkeDataSlice* slice,
+                                    __in size_t offsetInSlice,
+                                    __in size_t bytesToCopy,
+                                    __in size_t offsetInMbuf,
+                                    __in const mbuf_t mbuf,
+                                    __out size_t* bytesCopied )
+{
+    errno_t error;
+    
+    assert( offsetInSlice <= slice->length );
+    assert( ( slice->offset + slice->length ) <= this->size );
+    assert( ( offsetInMbuf + bytesToCopy ) <= mbuf_pkthdr_len( mbuf ) );
+    
+    if( ( offsetInSlice + bytesToCopy ) > slice->length )
+        bytesToCopy = slice->length - offsetInSlice;
+    
+    //
+    // the window can't be removed while the slice is allocated
+    //
+    IOBufferMemoryDescriptor*  window = this->windowBuffers[ slice->offset / this->windowSize ];
+    assert( window );
+    
+    error = mbuf_copydata( mbuf,
+                           offsetInMbuf,
+                           bytesToCopy,
+                           (void*)( (vm_address_t)window->getBytesNoCopy() + slice->offset % this->windowSize + offsetInSlice ) );
+    if( 0x0 == error )
+        *bytesCopied = bytesToCopy;
+    
+    return error;
+}
+
+//--------------------------------------------------------------------
+
+//
+// returns a referenced descriptor or NULL
+//
+IOMemoryDescriptor* NkeDataArena::getArenaMemoryDescriptor()
+{
+    assert( preemption_enabled() );
+    
+    IOMemoryDescriptor*  descriptor;
+    
+    IOLockLock( this->resizeLock );
+    { // start of the lock
+        
+        if( ! this->arenaDescriptor )
+            this->arenaDescriptor = this->createArenaMemoryDescriptor();
+        
+        descriptor = this->arenaDescriptor;
+        if( descriptor )
+            descriptor->retain();
+        
+    } // end of the lock
+    IOLockUnlock( this->resizeLock );
+    
+    return descriptor;
+}
+
+//--------------------------------------------------------------------
+
+//
+// must be called with resizeLock held
+//
+IOMemoryDescriptor* NkeDataArena::createArenaMemoryDescriptor()
+{
+    //
+    // the client never gets a slice in an inactive window so the inactive windows share the memory
+    //
+    if( this->activeWindowsNumber < this->windowsNumber && ! this->inactiveWindow ){
+        
+        this->inactiveWindow = IOBufferMemoryDescriptor::withOptions( kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                                      this->windowSize,
+                                                                      PAGE_SIZE );
+        assert( this->inactiveWindow );
+        if( ! this->inactiveWindow ){
+            
+            DBG_PRINT_ERROR(("IOBufferMemoryDescriptor::withOptions() failed\n"));
+            return NULL;
+        }
+        
+        bzero( this->inactiveWindow->getBytesNoCopy(), this->windowSize );
+    }
+    
+    vm_size_t             descriptorsSize = this->windowsNumber * sizeof( IOMemoryDescriptor* );
+    IOMemoryDescriptor**  descriptors = (IOMemoryDescriptor**)IOMalloc( descriptorsSize );
+    assert( descriptors );
+    if( ! descriptors ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the descriptors failed\n"));
+        return NULL;
+    }
+    
+    for( UInt32 i = 0x0; i < this->windowsNumber; ++i )
+        descriptors[ i ] = this->windowBuffers[ i ] ? this->windowBuffers[ i ] : this->inactiveWindow;
+    
+    //
+    // the multi descriptor retains the windows' descriptors
+    //
+    IOMultiMemoryDescriptor*  descriptor = IOMultiMemoryDescriptor::withDescriptors( descriptors,
+                                                                                     this->windowsNumber,
+                                                                                     kIODirectionInOut,
+                                                                                     false );
+    assert( descriptor );
+    if( ! descriptor )
+        DBG_PRINT_ERROR(("IOMultiMemoryDescriptor::withDescriptors() failed\n"));
+    
+    IOFree( descriptors, descriptorsSize );
+    
+    return descriptor;
+}
+
+//--------------------------------------------------------------------
+
+//
+// must be called with resizeLock held
+//
+void NkeDataArena::windowsChanged()
+{
+    //
+    // the descriptor is recreated when the client maps the arena again,
+    // the existing mappings keep the descriptor and the windows' memory
+    //
+    if( this->arenaDescriptor ){
+        
+        this->arenaDescriptor->release();
+        this->arenaDescriptor = NULL;
+    }
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::requestGrowth()
+{
+    //
+    // the thread is woken up once for a check, the failures before the check are one exhaustion event,
+    // the thread is not woken up if the arena can't grow
+    //
+    if( OSCompareAndSwap( 0x0, 0x1, &this->growthRequested ) &&
+        0x0 != this->minWindowsNumber &&
+        this->activeWindowsNumber < this->windowsNumber )
+        wakeup( (void*)&this->growthRequested );
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::addWindow()
+{
+    if( this->activeWindowsNumber == this->windowsNumber )
+        return false;
+    
+    //
+    // the window is taken from the stripe with the fewest active windows so the stripes grow evenly
+    //
+    Stripe*  stripe = NULL;
+    
+    for( UInt32 i = 0x0; i < this->stripesNumber; ++i ){
+        
+        Stripe*  candidate = &this->stripes[ i ];
+        
+        if( candidate->activeWindows == ( candidate->granulesNumber / this->granulesPerWindow ) )
+            continue;
+        
+        if( ! stripe || candidate->activeWindows < stripe->activeWindows )
+            stripe = candidate;
+    } // end for
+    
+    assert( stripe );
+    
+    UInt32  window = stripe->firstGranule / this->granulesPerWindow;
+    
+    while( this->windowBuffers[ window ] )
+        window += 0x1;
+    
+    assert( window < this->windowsNumber && stripe == this->getStripeForGranule( window * this->granulesPerWindow ) );
+    
+    IOBufferMemoryDescriptor*  buffer;
+    
+    buffer = IOBufferMemoryDescriptor::withOptions( kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                    this->windowSize,
+                                                    PAGE_SIZE );
+    assert( buffer );
+    if( ! buffer ){
+        
+        DBG_PRINT_ERROR(("IOBufferMemoryDescriptor::withOptions() failed\n"));
+        return false;
+    }
+    
+    //
+    // the memory is shared with the client so it must not keep the kernel data
+    //
+    bzero( buffer->getBytesNoCopy(), this->windowSize );
+    
+    //
+    // the client learns about the new memory before any slice is allocated in it
+    //
+    if( this->resizeCallback &&
+        ! this->resizeCallback( window, true, this->activeWindowsNumber + 0x1, this->resizeContext ) ){
+        
+        buffer->release();
+        return false;
+    }
+    
+    this->windowBuffers[ window ] = buffer;
+    this->windowsChanged();
+    
+    IOSimpleLockLock( stripe->lock );
+    { // start of the lock
+        
+        //
+        // the granules of an inactive window are marked as allocated
+        //
+        this->setGranules( window * this->granulesPerWindow, this->granulesPerWindow, false );
+        stripe->activeWindows += 0x1;
+        
+    } // end of the lock
+    IOSimpleLockUnlock( stripe->lock );
+    
+    this->activeWindowsNumber += 0x1;
+    OSIncrementAtomic64( &this->windowsAdded );
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::removeWindowInStripe( __in Stripe* stripe )
+{
+    UInt32  firstWindow = stripe->firstGranule / this->granulesPerWindow;
+    UInt32  window = firstWindow + stripe->granulesNumber / this->granulesPerWindow;
+    
+    //
+    // the windows are checked from the stripe's end as the next fit search wraps to the stripe's start
+    //
+    while( window > firstWindow ){
+        
+        window -= 0x1;
+        
+        if( ! this->windowBuffers[ window ] )
+            continue;
+        
+        UInt32  firstWord = ( window * this->granulesPerWindow ) / 0x40;
+        UInt32  lastWord = firstWord + this->granulesPerWindow / 0x40;
+        bool    removed = true;
+        
+        IOSimpleLockLock( stripe->lock );
+        { // start of the lock
+            
+            //
+            // a chunk being filled doesn't keep the window if it has no slices
+            //
+            if( NKE_DATA_ARENA_NO_CHUNK != stripe->packingChunk &&
+                window == stripe->packingChunk / this->granulesPerWindow &&
+                0x0 == this->chunksSlices[ stripe->packingChunk / NKE_DATA_ARENA_CHUNK_GRANULES ] ){
+                
+                this->freeGranules( stripe, stripe->packingChunk, NKE_DATA_ARENA_CHUNK_GRANULES );
+                stripe->packingChunk = NKE_DATA_ARENA_NO_CHUNK;
+            }
+            
+            for( UInt32 word = firstWord; word < lastWord && removed; ++word )
+                removed = ( 0x0 == this->granulesBitmap[ word ] );
+            
+            if( removed ){
+                
+                for( UInt32 word = firstWord; word < lastWord; ++word )
+                    this->granulesBitmap[ word ] = ~0x0ULL;
+                
+                stripe->activeWindows -= 0x1;
+            }
+            
+        } // end of the lock
+        IOSimpleLockUnlock( stripe->lock );
+        
+        if( ! removed )
+            continue;
+        
+        //
+        // the client's mapping retains the memory until the window is unmapped
+        //
+        this->windowBuffers[ window ]->release();
+        this->windowBuffers[ window ] = NULL;
+        this->windowsChanged();
+        
+        this->activeWindowsNumber -= 0x1;
+        OSIncrementAtomic64( &this->windowsRemoved );
+        
+        if( this->resizeCallback )
+            (void)this->resizeCallback( window, false, this->activeWindowsNumber, this->resizeContext );
+        
+        return true;
+    } // end while
+    
+    return false;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::removeWindow()
+{
+    if( this->activeWindowsNumber <= this->minWindowsNumber )
+        return false;
+    
+    //
+    // the stripe with the most active windows is tried first
+    //
+    UInt32  firstStripe = 0x0;
+    
+    for( UInt32 i = 0x1; i < this->stripesNumber; ++i ){
+        
+        if( this->stripes[ i ].activeWindows > this->stripes[ firstStripe ].activeWindows )
+            firstStripe = i;
+    } // end for
+    
+    for( UInt32 i = 0x0; i < this->stripesNumber; ++i ){
+        
+        if( this->removeWindowInStripe( &this->stripes[ ( firstStripe + i ) % this->stripesNumber ] ) )
+            return true;
+    } // end for
+    
+    return false;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeDataArena::startResizing( __in NkeDataArenaResizeCallback callback, __in void* context )
+{
+    assert( ! this->threadStarted );
+    
+    //
+    // the callback must be set before the thread starts
+    //
+    this->resizeCallback = callback;
+    this->resizeContext = context;
+    
+    thread_t   thread;
+    kern_return_t  error = kernel_thread_start( ( thread_continue_t ) &NkeDataArena::ResizeThreadRoutine,
+                                                this,
+                                                &thread );
+    assert( KERN_SUCCESS == error );
+    if( KERN_SUCCESS != error ){
+        
+        DBG_PRINT_ERROR(("kernel_thread_start() failed with an error %d\n", error));
+        this->resizeCallback = NULL;
+        return false;
+    }
+    
+    //
+    // release the thread object
+    //
+    thread_deallocate( thread );
+    
+    this->threadStarted = true;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::stopResizing()
+{
+    if( ! this->threadStarted )
+        return;
+    
+    IOLockLock( this->resizeLock );
+    { // start of the lock
+        
+        this->terminate = true;
+        wakeup( (void*)&this->growthRequested );
+        
+        while( ! this->threadExited ){
+            
+            (void)msleep( &this->threadExited,                       // wait channel
+                          (lck_mtx_t*)IOLockGetMachLock( this->resizeLock ), // mutex
+                          PUSER,                                     // priority
+                          "NkeDataArena::stopResizing()",            // wait message
+                          NULL );                                    // sleep interval
+        } // end while
+        
+    } // end of the lock
+    IOLockUnlock( this->resizeLock );
+}
+
+//--------------------------------------------------------------------
+
+void NkeDataArena::ResizeThreadRoutine( __in NkeDataArena* arena )
+{
+    IOLockLock( arena->resizeLock );
+    
+    while( ! arena->terminate ){
+        
+        UInt64  activeBytes = (UInt64)arena->activeWindowsNumber * arena->windowSize;
+        UInt64  inUse = arena->getBytesInUse();
+        bool    exhausted = OSCompareAndSwap( 0x1, 0x0, &arena->growthRequested );
+        bool    added = false;
+        
+        if( exhausted )
+            OSIncrementAtomic64( &arena->exhaustionEvents );
+        
+        if( 0x0 == arena->minWindowsNumber ){
+            
+            //
+            // the windows are not reserved, the windows kept by slices are removed after the slices are released
+            //
+            bool  removed;
+            
+            arena->idleIntervals = 0x0;
+            
+            do{
+                removed = arena->removeWindow();
+            } while( removed );
+            
+        } else if( exhausted || inUse * 100 > activeBytes * NKE_DATA_ARENA_HIGH_WATERMARK ){
+            
+            arena->idleIntervals = 0x0;
+            added = arena->addWindow();
+            
+        } else if( inUse * 100 < activeBytes * NKE_DATA_ARENA_LOW_WATERMARK ){
+            
+            arena->idleIntervals += 0x1;
+            
+            if( arena->idleIntervals >= NKE_DATA_ARENA_SHRINK_INTERVALS ){
+                
+                arena->idleIntervals = 0x0;
+                (void)arena->removeWindow();
+            }
+            
+        } else {
+            
+            arena->idleIntervals = 0x0;
+        }
+        
+        //
+        // the arena grows without waiting while the bytes in use are over the high watermark
+        //
+        if( added )
+            continue;
+        
+        struct timespec   ts;
+        
+        ts.tv_sec = NKE_DATA_ARENA_RESIZE_INTERVAL_MS / 1000;
+        ts.tv_nsec = ( NKE_DATA_ARENA_RESIZE_INTERVAL_MS % 1000 ) * 1000000;
+        
+        (void)msleep( (void*)&arena->growthRequested,                   // wait channel
+                      (lck_mtx_t*)IOLockGetMachLock( arena->resizeLock ), // mutex
+                      PUSER,                                            // priority
+                      "NkeDataArena::ResizeThreadRoutine()",            // wait message
+                      &ts );                                            // sleep interval
+        
+    } // end while
+    
+    arena->threadExited = true;
+    wakeup( &arena->threadExited );
+    
+    IOLockUnlock( arena->resizeLock );
+    
+    thread_terminate( current_thread() );
+}
+
+//--------------------------------------------------------------------
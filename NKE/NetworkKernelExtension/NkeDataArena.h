@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEDATAARENA_H
+#define _NKEDATAARENA_H
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <IOKit/IOLocks.h>
+#include <sys/kpi_mbuf.h>
+
+#include "NkeCommon.h"
+#include "NkeUserToKernel.h"
+
+//--------------------------------------------------------------------
+
+//
+// an allocation unit of the arena, a slice occupies a whole number of granules
+//
+#define NKE_DATA_ARENA_GRANULE_SIZE    0x100
+
+//
+// a maximum number of the arena stripes, each stripe is a range of whole windows
+// with its own lock, a processor allocates from its home stripe
+//
+#define NKE_DATA_ARENA_STRIPES         0x8
+
+//
+// the slices not longer than NKE_DATA_ARENA_PACKING_THRESHOLD are packed back to back
+// in a chunk, a packed slice starts on a packing unit, a chunk is aligned on its size
+// so the chunk is found from a slice's offset
+//
+#define NKE_DATA_ARENA_PACKING_THRESHOLD  0x200
+#define NKE_DATA_ARENA_PACKING_UNIT       0x40
+#define NKE_DATA_ARENA_CHUNK_SIZE         ( NKE_DATA_ARENA_PACKING_UNIT * 0x40 )
+#define NKE_DATA_ARENA_CHUNK_GRANULES     ( NKE_DATA_ARENA_CHUNK_SIZE / NKE_DATA_ARENA_GRANULE_SIZE )
+
+//
+// marks a chunk start in slicesGranules
+//
+#define NKE_DATA_ARENA_CHUNK_FLAG         0x8000
+#define NKE_DATA_ARENA_NO_CHUNK           0xFFFFFFFF
+
+//
+// the resizing thread checks the arena each NKE_DATA_ARENA_RESIZE_INTERVAL_MS or when a slice allocation
+// fails, a window is added if an allocation failed or the bytes in use are over the high watermark, a window
+// is removed if the bytes in use stay under the low watermark for NKE_DATA_ARENA_SHRINK_INTERVALS checks,
+// the watermarks are percents of the active windows size
+//
+#define NKE_DATA_ARENA_RESIZE_INTERVAL_MS  1000
+#define NKE_DATA_ARENA_SHRINK_INTERVALS    10
+#define NKE_DATA_ARENA_HIGH_WATERMARK      75
+#define NKE_DATA_ARENA_LOW_WATERMARK       25
+
+//--------------------------------------------------------------------
+
+//
+// called by the resizing thread, an added window is not used for slices until the callback returns
+// and is not added if the callback returns false, for a removed window the callback is called after
+// the window has been removed and the returned value is ignored
+//
+typedef bool (*NkeDataArenaResizeCallback)( __in UInt32 windowIndex,
+                                            __in bool active,
+                                            __in UInt32 activeWindowsNumber,
+                                            __in void* context );
+
+//--------------------------------------------------------------------
+
+//
+// a memory shared with the client and split in slices of variable length, the arena consists of
+// windows of equal size that the client maps as one range, a slice never crosses a window boundary, the allocation
+// is a next fit search in a granules bitmap, the slices returned by the client are validated
+// against the recorded slices starts so a wrong slice can't release the memory used by another one,
+// the windows are split between stripes so processors allocating and releasing slices don't
+// contend on a single lock, a stripe is chosen by the processor and a slice is released to
+// the stripe that contains it, other stripes are searched only if the home stripe has no free range,
+// small slices are packed in a stripe's chunk that is released when all its slices are released
+// and another chunk has replaced it, the arena's range is reserved for the maximal number of windows
+// but only the active windows have memory, the granules of an inactive window are marked as allocated
+// so the search skips them, a window is added by the resizing thread when the arena runs short of
+// memory and a window without slices is removed when the arena stays idle
+//
+
+class NkeDataArena: public OSObject{
+    
+    OSDeclareDefaultStructors( NkeDataArena );
+    
+    //
+    // the host benchmarks change the stripes geometry through this class, see HostBenchmarks
+    //
+    friend class NkeDataArenaBenchmarkAccess;
+    
+private:
+    
+    //
+    // the size of the range reserved for all windows
+    //
+    vm_size_t            size;
+    
+    UInt32               windowSize;
+    UInt32               windowsNumber;
+    
+    //
+    // the windows with memory, the arena is never shrunk below minWindowsNumber, changed under resizeLock,
+    // minWindowsNumber is zero while the windows are not reserved
+    //
+    UInt32               activeWindowsNumber;
+    UInt32               minWindowsNumber;
+    UInt32               initialWindowsNumber;
+    
+    UInt32               granulesNumber;
+    UInt32               granulesPerWindow;
+    
+    //
+    // a bit for each granule, a set bit is an allocated granule, protected by the lock
+    // of the stripe that contains the granule
+    //
+    UInt64*              granulesBitmap;
+    vm_size_t            granulesBitmapSize;
+    
+    //
+    // a number of granules in a slice starting at the granule or zero, protected by the lock
+    // of the stripe that contains the granule
+    //
+    UInt16*              slicesGranules;
+    vm_size_t            slicesGranulesSize;
+    
+    //
+    // a bit for each packing unit where a packed slice starts, a word for each chunk
+    // in the arena indexed by the chunk number, protected by the stripe's lock
+    //
+    UInt64*              chunksSlices;
+    vm_size_t            chunksSlicesSize;
+    
+    //
+    // a bit for each granule where a pinned slice starts, a pinned slice is not released
+    // by releaseSlice() so the client can't release it, protected by the stripe's lock
+    //
+    UInt64*              pinnedSlices;
+    vm_size_t            pinnedSlicesSize;
+    
+    //
+    // the fields are protected by the stripe's lock, a stripe occupies its own cache line
+    //
+    typedef struct _Stripe{
+        
+        IOSimpleLock*    lock;
+        
+        UInt32           firstGranule;
+        UInt32           granulesNumber;
+        
+        //
+        // a granule the next search starts from
+        //
+        UInt32           nextFitGranule;
+        
+        SInt32           bytesInUse;
+        SInt32           bytesHighWaterMark;
+        
+        //
+        // a first granule of the chunk being filled or NKE_DATA_ARENA_NO_CHUNK
+        // and a number of bytes used in the chunk
+        //
+        UInt32           packingChunk;
+        UInt32           packingOffset;
+        
+        //
+        // the stripe's windows with memory
+        //
+        UInt32           activeWindows;
+        
+    } __attribute__((aligned(64))) Stripe;
+    
+    Stripe               stripes[ NKE_DATA_ARENA_STRIPES ];
+    UInt32               stripesNumber;
+    UInt32               windowsPerStripe;
+    
+    //
+    // the memory of the active windows, NULL for an inactive window, changed under resizeLock,
+    // a window's memory is read without the lock when a slice is copied as a window with
+    // allocated granules is not removed, the client's mapping keeps the memory of a removed
+    // window until the client unmaps it
+    //
+    IOBufferMemoryDescriptor** windowBuffers;
+    vm_size_t            windowBuffersSize;
+    
+    //
+    // the client maps the whole arena, the descriptor is created when the client maps the arena
+    // and is recreated after the windows have changed, the inactive windows are mapped to one
+    // window of zeroes, protected by resizeLock
+    //
+    IOMemoryDescriptor*  arenaDescriptor;
+    IOBufferMemoryDescriptor* inactiveWindow;
+    
+    //
+    // serializes the windows adding and removing, protects the resizing thread's state
+    //
+    IOLock*              resizeLock;
+    
+    NkeDataArenaResizeCallback  resizeCallback;
+    void*                resizeContext;
+    
+    bool                 terminate;
+    bool                 threadStarted;
+    bool                 threadExited;
+    
+    //
+    // the consecutive checks with the bytes in use under the low watermark
+    //
+    UInt32               idleIntervals;
+    
+    //
+    // set by a failed allocation and cleared by the resizing thread's check, also a wait channel for the thread
+    //
+    volatile UInt32      growthRequested;
+    
+    volatile SInt64      exhaustionEvents;
+    volatile SInt64      windowsAdded;
+    volatile SInt64      windowsRemoved;
+    
+    //
+    // the high water mark is updated when a stripe reaches its own maximum,
+    // so it might be lower than the real maximum
+    //
+    volatile SInt32      bytesHighWaterMark;
+    volatile SInt64      allocationFailures;
+    
+    bool isGranuleAllocated( __in UInt32 granule )
+    {
+        return ( 0x0 != ( this->granulesBitmap[ granule / 0x40 ] & ( 0x1ULL << ( granule % 0x40 ) ) ) );
+    }
+    
+    bool isSlicePinned( __in UInt32 firstGranule )
+    {
+        return ( 0x0 != ( this->pinnedSlices[ firstGranule / 0x40 ] & ( 0x1ULL << ( firstGranule % 0x40 ) ) ) );
+    }
+    
+    void setGranules( __in UInt32 firstGranule, __in UInt32 granulesCount, __in bool allocated );
+    
+    Stripe* getStripeForGranule( __in UInt32 granule )
+    {
+        UInt32  stripeIndex = ( granule / this->granulesPerWindow ) / this->windowsPerStripe;
+        
+        //
+        // the last stripe takes the remaining windows
+        //
+        return &this->stripes[ ( stripeIndex < this->stripesNumber ) ? stripeIndex : ( this->stripesNumber - 0x1 ) ];
+    }
+    
+    //
+    // the following functions must be called with the stripe's lock held
+    //
+    
+    //
+    // looks for a free range in one window of the stripe, the range starts on a multiple of granulesAlignment
+    //
+    bool findFreeGranules( __in Stripe* stripe,
+                           __in UInt32 granulesCount,
+                           __in UInt32 granulesAlignment,
+                           __out UInt32* firstGranule );
+    
+    //
+    // newMaximum is set to true if the stripe's bytes in use reached a new maximum
+    //
+    bool allocateGranules( __in Stripe* stripe,
+                           __in UInt32 granulesCount,
+                           __in UInt32 granulesAlignment,
+                           __in UInt16 sliceFlags,
+                           __out UInt32* firstGranule,
+                           __out bool* newMaximum );
+    
+    void freeGranules( __in Stripe* stripe, __in UInt32 firstGranule, __in UInt32 granulesCount );
+    
+    //
+    // allocates a range of the size in the stripe, false is returned if there is no free range
+    //
+    bool allocateInStripe( __in Stripe* stripe, __in UInt32 granulesCount, __in bool pinned, __out UInt32* firstGranule );
+    
+    //
+    // allocates a slice in the home stripe's chunk, false is returned if there is no memory for a chunk
+    //
+    bool allocatePackedSlice( __in UInt32 size, __out NkeDataSlice* slice );
+    
+    void updateHighWaterMark( __in SInt32 inUse );
+    
+    //
+    // the following functions must be called with resizeLock held
+    //
+    bool addWindow();
+    bool removeWindow();
+    bool removeWindowInStripe( __in Stripe* stripe );
+    IOMemoryDescriptor* createArenaMemoryDescriptor();
+    void windowsChanged();
+    
+    static void ResizeThreadRoutine( __in NkeDataArena* arena );
+    
+    //
+    // wakes up the resizing thread after a failed allocation
+    //
+    void requestGrowth();
+    
+    bool releaseSliceInternal( __in const NkeDataSlice* slice, __in bool pinned );
+    
+protected:
+    
+    virtual bool init();
+    virtual void free();
+    
+public:
+    
+    //
+    // the arena has no memory until reserveWindows() is called, then it has activeWindowsNumber
+    // windows with memory and grows up to windowsNumber windows
+    //
+    static NkeDataArena* withWindows( __in UInt32 windowSize, __in UInt32 windowsNumber, __in UInt32 activeWindowsNumber );
+    
+    //
+    // adds the initial windows and keeps the arena from shrinking below them
+    //
+    bool reserveWindows();
+    
+    //
+    // removes the free windows, a window with allocated slices is removed by the resizing thread
+    // after the slices have been released
+    //
+    void releaseWindows();
+    
+    //
+    // starts the resizing thread, stopResizing() must be called before the last reference is released,
+    // the callback is not called after stopResizing() returns
+    //
+    bool startResizing( __in NkeDataArenaResizeCallback callback, __in void* context );
+    void stopResizing();
+    
+    //
+    // allocates a slice of up to size bytes, the slice is shorter if there is no free range
+    // of the size, a slice is never longer than a window, false is returned if there is no memory
+    //
+    bool allocateSlice( __in UInt32 size, __out NkeDataSlice* slice );
+    
+    //
+    // false is returned if the slice was not allocated or is pinned
+    //
+    bool releaseSlice( __in const NkeDataSlice* slice ){ return this->releaseSliceInternal( slice, false ); }
+    
+    //
+    // allocates a pinned slice of exactly size bytes, false is returned if there is no free range of the size,
+    // a pinned slice is released only by releasePinnedSlice()
+    //
+    bool allocatePinnedSlice( __in UInt32 size, __out NkeDataSlice* slice );
+    bool releasePinnedSlice( __in const NkeDataSlice* slice ){ return this->releaseSliceInternal( slice, true ); }
+    
+    errno_t copyDataMbuf( __in const NkeDataSlice* slice,
+                          __in size_t offsetInSlice,
+                          __in size_t bytesToCopy,
+                          __in size_t offsetInMbuf,
+                          __in const mbuf_t mbuf,
+                          __out size_t* bytesCopied );
+    
+    //
+    // returns a referenced descriptor of the whole arena or NULL
+    //
+    IOMemoryDescriptor* getArenaMemoryDescriptor();
+    
+    UInt32 getWindowSize(){ return this->windowSize; }
+    UInt32 getWindowsNumber(){ return this->windowsNumber; }
+    UInt32 getActiveWindowsNumber(){ return this->activeWindowsNumber; }
+    
+    UInt32 getBytesInUse();
+    UInt32 getBytesHighWaterMark(){ return this->bytesHighWaterMark; }
+    UInt64 getAllocationFailures(){ return this->allocationFailures; }
+    
+    //
+    // an exhaustion event is a resizing check that followed at least one failed allocation
+    //
+    UInt64 getExhaustionEvents(){ return this->exhaustionEvents; }
+    UInt64 getWindowsAdded(){ return this->windowsAdded; }
+    UInt64 getWindowsRemoved(){ return this->windowsRemoved; }
+};
+
+//--------------------------------------------------------------------
+
+#endif // _NKEDATAARENA_H
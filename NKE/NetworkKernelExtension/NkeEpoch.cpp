@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeEpoch.h"
+
+//--------------------------------------------------------------------
+
+NkeEpoch::ReadersCounter  NkeEpoch::ReadersCounters[ 0x2 ][ NKE_PER_CPU_SLOTS ];
+volatile UInt32           NkeEpoch::CurrentEpoch = 0x0;
+IOLock*                   NkeEpoch::GracePeriodLock = NULL;
+
+//--------------------------------------------------------------------
+
+errno_t NkeEpoch::InitEpochSubsystem()
+{
+    assert( NULL == NkeEpoch::GracePeriodLock );
+    
+    bzero( NkeEpoch::ReadersCounters, sizeof( NkeEpoch::ReadersCounters ) );
+    
+    NkeEpoch::GracePeriodLock = IOLockAlloc();
+    assert( NkeEpoch::GracePeriodLock );
+    if( ! NkeEpoch::GracePeriodLock ){
+        
+        DBG_PRINT_ERROR(("NkeEpoch::GracePeriodLock = IOLockAlloc() failed\n"));
+        return ENOMEM;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+//--------------------------------------------------------------------
+
+void NkeEpoch::RemoveEpochSubsystem()
+{
+    if( NkeEpoch::GracePeriodLock ){
+        
+        IOLockFree( NkeEpoch::GracePeriodLock );
+        NkeEpoch::GracePeriodLock = NULL;
+    }
+}
+
+//--------------------------------------------------------------------
+
+UInt32 NkeEpoch::EnterReadSection()
+{
+    while( true ){
+        
+        UInt32  epochIndex = NkeEpoch::CurrentEpoch & 0x1;
+        UInt32  cpuSlot = NkeCurrentCpuSlot();
+        
+        //
+        // the locked increment is a full barrier so the epoch is rechecked after the reader
+        // has been accounted, if the epoch has not changed then a concurrent WaitForGracePeriod
+        // either sees the reader or the reader sees the new epoch and retries, in both cases
+        // the reader can't access an object unlinked before the grace period has been started
+        //
+        OSIncrementAtomic( &NkeEpoch::ReadersCounters[ epochIndex ][ cpuSlot ].count );
+        
+        if( epochIndex == ( NkeEpoch::CurrentEpoch & 0x1 ) )
+            return ( epochIndex << 0x10 ) | cpuSlot;
+            
+        OSDecrementAtomic( &NkeEpoch::ReadersCounters[ epochIndex ][ cpuSlot ].count );
+        
+    } // end while
+}
+
+//--------------------------------------------------------------------
+
+void NkeEpoch::ExitReadSection( __in UInt32 token )
+{
+    UInt32  epochIndex = token >> 0x10;
+    UInt32  cpuSlot = token & 0xFFFF;
+    
+    assert( epochIndex < 0x2 && cpuSlot < NKE_PER_CPU_SLOTS );
+    assert( NkeEpoch::ReadersCounters[ epochIndex ][ cpuSlot ].count > 0x0 );
+    
+    //
+    // the counter is for the processor where the section was entered, the thread
+    // might have been moved to another processor since then
+    //
+    OSDecrementAtomic( &NkeEpoch::ReadersCounters[ epochIndex ][ cpuSlot ].count );
+}
+
+//--------------------------------------------------------------------
+
+void NkeEpoch::WaitForGracePeriod()
+{
+    assert( preemption_enabled() );
+    assert( NkeEpoch::GracePeriodLock );
+    
+    IOLockLock( NkeEpoch::GracePeriodLock );
+    { // start of the lock
+        
+        //
+        // start a new epoch, the new readers are accounted in the other counters,
+        // the locked increment is a full barrier
+        //
+        UInt32  previousIndex = ( (UInt32)OSIncrementAtomic( (volatile SInt32*)&NkeEpoch::CurrentEpoch ) ) & 0x1;
+        
+        //
+        // wait for the readers from the previous epoch
+        //
+        while( true ){
+            
+            SInt32  readers = 0x0;
+            
+            for( int i = 0x0; i < NKE_PER_CPU_SLOTS; ++i )
+                readers += NkeEpoch::ReadersCounters[ previousIndex ][ i ].count;
+                
+            if( 0x0 == readers )
+                break;
+                
+            //
+            // the read sections are short, do not spin
+            //
+            IOSleep( 1 );
+            
+        } // end while
+        
+    } // end of the lock
+    IOLockUnlock( NkeEpoch::GracePeriodLock );
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEEPOCH_H
+#define _NKEEPOCH_H
+
+#include "NkeCommon.h"
+
+//--------------------------------------------------------------------
+
+//
+// an epoch based reclamation, readers enter a read section without acquiring any lock,
+// a writer unlinks an object and then waits for a grace period after which no reader
+// can hold a pointer to the unlinked object,
+// a read section must not sleep and must be short, the grace period is not bounded
+// if a reader doesn't leave the section
+//
+
+class NkeEpoch{
+
+private:
+    
+    //
+    // a readers counter, aligned and padded to a cache line to avoid the false sharing
+    //
+    typedef struct _ReadersCounter{
+        volatile SInt32   count;
+        UInt8             padding[ 64 - sizeof( SInt32 ) ];
+    } __attribute__((aligned(64))) ReadersCounter;
+    
+    //
+    // the counters for the current and the previous epoch, the epoch's low bit is an index,
+    // a reader increments a counter for the current processor, the counters for an epoch
+    // sum up to a number of readers in the epoch
+    //
+    static ReadersCounter   ReadersCounters[ 0x2 ][ NKE_PER_CPU_SLOTS ];
+    
+    //
+    // the current epoch, changed only by WaitForGracePeriod
+    //
+    static volatile UInt32  CurrentEpoch;
+    
+    //
+    // serializes grace period waits
+    //
+    static IOLock*          GracePeriodLock;
+    
+public:
+    
+    static errno_t InitEpochSubsystem();
+    static void RemoveEpochSubsystem();
+    
+    //
+    // returns a token that must be provided to ExitReadSection
+    //
+    static UInt32 EnterReadSection();
+    static void ExitReadSection( __in UInt32 token );
+    
+    //
+    // returns when all read sections entered before the call have been exited,
+    // must be called at a passive level
+    //
+    static void WaitForGracePeriod();
+};
+
+//--------------------------------------------------------------------
+
+#endif // _NKEEPOCH_H
@@ -20,6 +20,23 @@ OSDefineMetaClassAndStructors( NkeIOUserClient, IOUserClient )
 
 //--------------------------------------------------------------------
 
+class IODataQueueWrapper: public IODataQueue
+{
+public:
+    
+    IODataQueueMemory* getQueueMemory()
+    {
+        return dataQueue;
+    }
+    
+    void forceSendDataAvailableNotification( UInt32 msgSize )
+    {
+        sendDataAvailableNotification();
+    };
+};
+
+//--------------------------------------------------------------------
+
 //#define kAny ((IOByteCount) -1 )
 /*
  a call stack for a client's function invokation
@@ -42,8 +59,8 @@ static const IOExternalMethod sMethods[ kt_NkeUserClientMethodsMax ] =
         NULL,
         (IOMethod)&NkeIOUserClient::open,
         kIOUCScalarIScalarO,
-        0,
-        0
+        3,
+        2
     },
     // 0x1 kt_NkeUserClientClose
     {
@@ -60,11 +77,32 @@ static const IOExternalMethod sMethods[ kt_NkeUserClientMethodsMax ] =
         kIOUCStructIStructO,
         kIOUCVariableStructureSize,
         kIOUCVariableStructureSize
+    },
+    // 0x3 kt_NkeUserClientGetStatistics
+    {
+        NULL,
+        (IOMethod)&NkeIOUserClient::getFilterStatistics,
+        kIOUCStructIStructO,
+        0,
+        sizeof( NkeFilterStatistics )
+    },
+    // 0x4 kt_NkeUserClientSetCapturePolicies
+    {
+        NULL,
+        (IOMethod)&NkeIOUserClient::setCapturePolicies,
+        kIOUCStructIStructO,
+        sizeof( NkeCapturePolicies ),
+        0
     }
 };
 
 //--------------------------------------------------------------------
 
+volatile SInt64 NkeIOUserClient::NotificationsEnqueued = 0x0;
+volatile SInt64 NkeIOUserClient::NotificationsBytesEnqueued = 0x0;
+
+//--------------------------------------------------------------------
+
 NkeIOUserClient* NkeIOUserClient::withTask( __in task_t owningTask )
 {
     NkeIOUserClient* client;
@@ -89,7 +127,9 @@ NkeIOUserClient* NkeIOUserClient::withTask( __in task_t owningTask )
     }
     
     // The network data notification, the data send in separate mapped buffers
-    client->fQueueSize[ kt_NkeNotifyTypeSocketFilter ] = 0x100000; //kt_NkeNotifyTypeSocketFilter is memory identifier for mapping buffers
+    for( int type = kt_NkeNotifyTypeSocketFilter; type <= kt_NkeNotifyTypeSocketFilterLast; ++type ){
+        client->fQueueSize[ type ] = 0x100000; //kt_NkeNotifyTypeSocketFilter is memory identifier for mapping buffers
+    }
     
     client->fClient = owningTask;
     
@@ -119,43 +159,13 @@ bool NkeIOUserClient::start( __in IOService *provider )
             continue;
         
         //
-        // allocate a lock
+        // the socket filter queues after the first one are allocated when the client
+        // requests them in open()
         //
-        this->fLock[ type ] = IOLockAlloc();
-        assert( this->fLock[ type ] );
-        if( !this->fLock[ type ] ){
-            
-            DBG_PRINT_ERROR(("this->fLock[ %u ]->IOLockAlloc() failed\n", type));
-            
-            super::stop( provider );
-            return false;
-        }        
-        
-        // Allocate a queue
-        this->fDataQueue[ type ] = IODataQueue::withCapacity( this->fQueueSize[ type ] );
-        assert( this->fDataQueue[ type ] );
-        while( !this->fDataQueue[ type ] && this->fQueueSize[ type ] > 0x8000){
-            
-            // Try to decrease the queue size until the low boundary of 32 Kb is reached
-            this->fQueueSize[ type ] = this->fQueueSize[ type ]/2;
-            this->fDataQueue[ type ] = IODataQueue::withCapacity( this->fQueueSize[ type ]/2 );
-        }
-        
-        assert( this->fDataQueue[ type ] );
-        if( !this->fDataQueue[ type ] ){
-            
-            DBG_PRINT_ERROR(("this->fDataQueue[ %u ]->withCapacity( %u ) failed\n", type, (int)this->fQueueSize[ type ]));
-            
-            super::stop( provider );
-            return false;
-        }
+        if( type > kt_NkeNotifyTypeSocketFilter && type <= kt_NkeNotifyTypeSocketFilterLast )
+            continue;
         
-        // Get the queue's memory descriptor
-        this->fSharedMemory[ type ] = this->fDataQueue[ type ]->getMemoryDescriptor();
-        assert( this->fSharedMemory[ type ] ); // Shared memory between kernel and user space client
-        if( !this->fSharedMemory[ type ] ) {
-            
-            DBG_PRINT_ERROR(("this->fDataQueue[ %u ]->getMemoryDescriptor() failed\n", type));
+        if( !this->allocateQueue( type ) ){
             
             super::stop( provider );
             return false;
@@ -168,18 +178,139 @@ bool NkeIOUserClient::start( __in IOService *provider )
 
 //--------------------------------------------------------------------
 
-void NkeIOUserClient::freeAllocatedResources()
+bool NkeIOUserClient::allocateQueue( __in UInt32 type )
 {
+    assert( kt_NkeNotifyTypeUnknown != type && type < kt_NkeNotifyTypeMax );
+    
+    if( this->fDataQueue[ type ] )
+        return true;
+    
+    //
+    // allocate a lock
+    //
+    this->fLock[ type ] = IOLockAlloc();
+    assert( this->fLock[ type ] );
+    if( !this->fLock[ type ] ){
+        
+        DBG_PRINT_ERROR(("this->fLock[ %u ]->IOLockAlloc() failed\n", type));
+        return false;
+    }
+    
+    // Allocate a queue
+    this->fDataQueue[ type ] = IODataQueue::withCapacity( this->fQueueSize[ type ] );
+    assert( this->fDataQueue[ type ] );
+    while( !this->fDataQueue[ type ] && this->fQueueSize[ type ] > 0x8000){
+        
+        // Try to decrease the queue size until the low boundary of 32 Kb is reached
+        this->fQueueSize[ type ] = this->fQueueSize[ type ]/2;
+        this->fDataQueue[ type ] = IODataQueue::withCapacity( this->fQueueSize[ type ]/2 );
+    }
+    
+    assert( this->fDataQueue[ type ] );
+    if( !this->fDataQueue[ type ] ){
+        
+        DBG_PRINT_ERROR(("this->fDataQueue[ %u ]->withCapacity( %u ) failed\n", type, (int)this->fQueueSize[ type ]));
+        return false;
+    }
     
+    // Get the queue's memory descriptor
+    this->fSharedMemory[ type ] = this->fDataQueue[ type ]->getMemoryDescriptor();
+    assert( this->fSharedMemory[ type ] ); // Shared memory between kernel and user space client
+    if( !this->fSharedMemory[ type ] ) {
+        
+        DBG_PRINT_ERROR(("this->fDataQueue[ %u ]->getMemoryDescriptor() failed\n", type));
+        return false;
+    }
+    
+    if( type < kt_NkeNotifyTypeSocketFilter || type > kt_NkeNotifyTypeSocketFilterLast )
+        return true;
+    
+    //
+    // the socket filter notifications are enqueued by the ring that shares the queue's memory
+    //
+    this->fNotificationRing[ type ] = NkeNotificationRing::withQueueMemory(
+                                        ((IODataQueueWrapper*)this->fDataQueue[ type ])->getQueueMemory() );
+    assert( this->fNotificationRing[ type ] );
+    if( !this->fNotificationRing[ type ] ){
+        
+        DBG_PRINT_ERROR(("NkeNotificationRing::withQueueMemory() failed for the queue %u\n", type));
+        return false;
+    }
+    
+    this->fWakeupContext[ type ].client = this;
+    this->fWakeupContext[ type ].type = type;
+    
+    this->fWakeupModerator[ type ] = NkeWakeupModerator::withCallback( &NkeIOUserClient::DeferredWakeup,
+                                                                       &this->fWakeupContext[ type ] );
+    assert( this->fWakeupModerator[ type ] );
+    if( !this->fWakeupModerator[ type ] ){
+        
+        DBG_PRINT_ERROR(("NkeWakeupModerator::withCallback() failed for the queue %u\n", type));
+        return false;
+    }
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeIOUserClient::DeferredWakeup( __in void* context )
+{
+    NkeIOUserClient*  client = ((WakeupContext*)context)->client;
+    UInt32            type = ((WakeupContext*)context)->type;
+    
+    IOLockLock( client->fLock[ type ] );
+    {// start of the lock
+        
+        ((IODataQueueWrapper*)client->fDataQueue[ type ])->forceSendDataAvailableNotification( 0x0 );
+        
+    }//end of the lock
+    IOLockUnlock( client->fLock[ type ] );
+}
+
+//--------------------------------------------------------------------
+
+void NkeIOUserClient::freeAllocatedResources()
+{
     for( int type = 0x0; type < kt_NkeNotifyTypeMax; ++type ){
         
+        //
+        // the moderator's thread uses the queue
+        //
+        if( this->fWakeupModerator[ type ] ){
+            
+            this->fWakeupModerator[ type ]->stop();
+            this->fWakeupModerator[ type ]->release();
+            this->fWakeupModerator[ type ] = NULL;
+        }
+        
         if( this->fDataQueue[ type ] ){
             
             //
             // send a termination notification to the user client
             //
             UInt32 message = kt_NkeStopListeningToMessages;
-            this->fDataQueue[ type ]->enqueue(&message, sizeof(message));
+            
+            if( this->fNotificationRing[ type ] ){
+                
+                NkeNotificationReservation  reservation;
+                UInt32                      published;
+                bool                        queueWasEmpty;
+                
+                if( this->fNotificationRing[ type ]->reserve( sizeof(message), &reservation ) ){
+                    
+                    memcpy( reservation.data, &message, sizeof(message) );
+                    this->fNotificationRing[ type ]->commit( &reservation, &published, &queueWasEmpty );
+                    ((IODataQueueWrapper*)this->fDataQueue[ type ])->forceSendDataAvailableNotification( 0x0 );
+                }
+                
+                this->fNotificationRing[ type ]->release();
+                this->fNotificationRing[ type ] = NULL;
+                
+            } else {
+                
+                this->fDataQueue[ type ]->enqueue(&message, sizeof(message));
+            }
         }
         
         if( this->fSharedMemory[ type ] ) {
@@ -224,11 +355,47 @@ void NkeIOUserClient::stop( __in IOService *provider )
 
 //--------------------------------------------------------------------
 
-IOReturn NkeIOUserClient::open(void)
+IOReturn NkeIOUserClient::open(
+    __in  void *vInterfaceVersion,
+    __in  void *vOpenFlags,
+    __in  void *vQueuesNumber,
+    __out void *vBufferSizeP,
+    __out void *vBuffersNumberP,
+    void *)
 {
     if( this->isInactive() )
         return kIOReturnNotAttached;
     
+    //
+    // a client built with an old interface passes no version and is rejected
+    // by the scalar arguments check, a client with another version is rejected here
+    //
+    if( NkeDriverInterfaceVersion != (UInt32)(uintptr_t)vInterfaceVersion ){
+        
+        DBG_PRINT_ERROR(("a client interface version %u doesn't match the driver version %u\n",
+                         (unsigned int)(uintptr_t)vInterfaceVersion, (unsigned int)NkeDriverInterfaceVersion));
+        return kIOReturnUnsupported;
+    }
+    
+    UInt32  queuesNumber = (UInt32)(uintptr_t)vQueuesNumber;
+    
+    if( 0x0 == queuesNumber || queuesNumber > kt_NkeSocketFilterQueuesMax ){
+        
+        DBG_PRINT_ERROR(("the socket filter queues number %u is out of range\n", (unsigned int)queuesNumber));
+        return kIOReturnBadArgument;
+    }
+    
+    //
+    // the producers select a queue by the number, it can't be changed while the client is registered
+    //
+    if( 0x0 != this->fSocketFilterQueuesNumber && queuesNumber != this->fSocketFilterQueuesNumber )
+        return kIOReturnBadArgument;
+    
+    if( ! gSocketFilter )
+        return kIOReturnNotReady;
+    
+    gSocketFilter->getDataArenaGeometry( (UInt32*)vBufferSizeP, (UInt32*)vBuffersNumberP );
+    
     //
     // only one user client allowed
     //
@@ -238,6 +405,26 @@ IOReturn NkeIOUserClient::open(void)
     this->fClientProc = current_proc();
     this->fClientPID  = proc_pid( current_proc() );
     
+    //
+    // the encoding is set before the first notification is sent
+    //
+    this->fCompactNotifications = ( 0x0 != ( (UInt32)(uintptr_t)vOpenFlags & kt_NkeOpenFlagCompactNotifications ) );
+    
+    //
+    // the queues are allocated before the client is registered with the filter,
+    // the first queue has been allocated by start()
+    //
+    for( UInt32 type = kt_NkeNotifyTypeSocketFilter; type < kt_NkeNotifyTypeSocketFilter + queuesNumber; ++type ){
+        
+        if( !this->allocateQueue( type ) ){
+            
+            fProvider->close(this);
+            return kIOReturnNoMemory;
+        }
+    } // end for
+    
+    this->fSocketFilterQueuesNumber = queuesNumber;
+    
     return this->startLogging();
 }
 
@@ -370,7 +557,9 @@ IOReturn
 NkeIOUserClient::stopLogging(void)
 {
     
-    this->fNotificationPorts[ kt_NkeNotifyTypeSocketFilter ] = 0x0;
+    for( int type = kt_NkeNotifyTypeSocketFilter; type <= kt_NkeNotifyTypeSocketFilterLast; ++type ){
+        this->fNotificationPorts[ type ] = 0x0;
+    }
 
     if( gSocketFilter )
         gSocketFilter->unregisterUserClient( this );
@@ -412,23 +601,16 @@ NkeIOUserClient::clientMemoryForType( __in UInt32 type, __in IOOptionBits *optio
     *options = 0;
     
     //
-    // check for socket data notification type
+    // check for the data arena type
     //
-    if( type >= (UInt32)kt_NkeAclTypeSocketDataBase && type < (UInt32)(kt_NkeAclTypeSocketDataBase + kt_NkeSocketBuffersNumber) ){
+    if( type == (UInt32)kt_NkeAclTypeSocketData ){
         
         if( ! gSocketFilter )
             return kIOReturnNoMemory;
         
-        IOMemoryDescriptor* memoryDescr = gSocketFilter->getSocketBufferMemoryDescriptor( (UInt32)( type - kt_NkeAclTypeSocketDataBase ) );
-        if( NULL == memoryDescr ){
-            
-            //
-            // in most of the cases this is not an error, the buffer for the index doesn't exist,
-            // but we cannot tell a caller that the buffer just doesn't exist so return an error,
-            // a caller should ignor the error and continue execution
-            //
-            return kIOReturnNoDevice;
-        }
+        IOMemoryDescriptor* memoryDescr = gSocketFilter->getDataArenaMemoryDescriptor();
+        if( NULL == memoryDescr )
+            return kIOReturnNoMemory;
         
         *memory = memoryDescr;
         return kIOReturnSuccess;
@@ -439,7 +621,9 @@ NkeIOUserClient::clientMemoryForType( __in UInt32 type, __in IOOptionBits *optio
     //
     if( (UInt32)kt_NkeNotifyTypeUnknown != type && type < (UInt32)kt_NkeNotifyTypeMax ){
         
-        assert( this->fSharedMemory[ type ] );
+        //
+        // a socket filter queue the client has not requested has no memory
+        //
         if (!this->fSharedMemory[ type ])
             return kIOReturnNoMemory;
         
@@ -491,104 +675,123 @@ NkeMemoryBarrier()
 
 //--------------------------------------------------------------------
 
-class IODataQueueWrapper: public IODataQueue
+UInt32 NkeIOUserClient::GetCompactNotificationSize( __in const NkeSocketFilterNotification* notification )
 {
-public:
+    UInt32  slicesNumber = 0x0;
     
-    Boolean enqueueWithBarrier(void * data, UInt32 dataSize)
-    {
-        const UInt32       head      = dataQueue->head;  // volatile
-        const UInt32       tail      = dataQueue->tail;
-        const UInt32       entrySize = dataSize + DATA_QUEUE_ENTRY_HEADER_SIZE;
-        IODataQueueEntry * entry;
-        
-        assert( preemption_enabled() );
-        
-        if ( tail >= head )
-        {
-            // Is there enough room at the end for the entry?
-            if ( (tail + entrySize) <= dataQueue->queueSize )
-            {
-                entry = (IODataQueueEntry *)((UInt8 *)dataQueue->queue + tail);
-                
-                entry->size = dataSize;
-                memcpy(&entry->data, data, dataSize);
-                
-                // The tail can be out of bound when the size of the new entry
-                // exactly matches the available space at the end of the queue.
-                // The tail can range from 0 to dataQueue->queueSize inclusive.
-                NkeMemoryBarrier();
-                dataQueue->tail += entrySize;
-            }
-            else if ( head > entrySize ) 	// Is there enough room at the beginning?
-            {
-                // Wrap around to the beginning, but do not allow the tail to catch
-                // up to the head.
-                
-                dataQueue->queue->size = dataSize;
-                
-                // We need to make sure that there is enough room to set the size before
-                // doing this. The user client checks for this and will look for the size
-                // at the beginning if there isn't room for it at the end.
-                
-                if ( ( dataQueue->queueSize - tail ) >= DATA_QUEUE_ENTRY_HEADER_SIZE )
-                {
-                    ((IODataQueueEntry *)((UInt8 *)dataQueue->queue + tail))->size = dataSize;
-                }
-                
-                memcpy(&dataQueue->queue->data, data, dataSize);
-                NkeMemoryBarrier();
-                dataQueue->tail = entrySize;
-            }
-            else
-            {
-                return false;	// queue is full
-            }
-        }
-        else
-        {
-            // Do not allow the tail to catch up to the head when the queue is full.
-            // That's why the comparison uses a '>' rather than '>='.
+    if( NkeSocketFilterEventDataIn == notification->event || NkeSocketFilterEventDataOut == notification->event ){
+        
+        //
+        // the data in a stream ring has no slices
+        //
+        while( slicesNumber < kt_NkeSocketDataSlicesNumber &&
+               0x0 != notification->eventData.inputoutput.slices[ slicesNumber ].length )
+            slicesNumber += 0x1;
+    }
+    
+    return NkeIOUserClient::GetCompactNotificationSize( notification->event, slicesNumber );
+}
+
+//--------------------------------------------------------------------
+
+UInt32 NkeIOUserClient::GetCompactNotificationSize( __in NkeSocketFilterEvent event, __in UInt32 slicesNumber )
+{
+    UInt32  headerSize = __offsetof( NkeSocketFilterNotification, eventData );
+    
+    assert( slicesNumber <= kt_NkeSocketDataSlicesNumber );
+    
+    switch( event ){
             
-            if ( (head - tail) > entrySize )
-            {
-                entry = (IODataQueueEntry *)((UInt8 *)dataQueue->queue + tail);
-                
-                entry->size = dataSize;
-                memcpy(&entry->data, data, dataSize);
-                NkeMemoryBarrier();
-                dataQueue->tail += entrySize;
-            }
-            else
-            {
-                return false;	// queue is full
-            }
-        }
+        case NkeSocketFilterEventConnected:
+            return headerSize + sizeof( NkeSocketFilterEventConnectedData );
+            
+        case NkeSocketFilterEventDisconnected:
+        case NkeSocketFilterEventShutdown:
+        case NkeSocketFilterEventCantrecvmore:
+        case NkeSocketFilterEventCantsendmore:
+        case NkeSocketFilterEventClosing:
+        case NkeSocketFilterEventBound:
+            return headerSize;
+            
+        case NkeSocketFilterEventDataIn:
+        case NkeSocketFilterEventDataOut:
+            //
+            // the slices are the last field
+            //
+            return headerSize + __offsetof( NkeSocketFilterEventIoData, slices ) + slicesNumber * sizeof( NkeDataSlice );
+            
+        case NkeSocketFilterEventDataArenaResized:
+            return headerSize + sizeof( NkeSocketFilterEventDataArenaResizedData );
+            
+        default:
+            return sizeof( NkeSocketFilterNotification );
+    } // end switch
+}
+
+//--------------------------------------------------------------------
+
+void NkeIOUserClient::GetStatistics( __inout NkeFilterStatistics* statistics )
+{
+    statistics->notificationsEnqueued = NkeIOUserClient::NotificationsEnqueued;
+    statistics->notificationsBytesEnqueued = NkeIOUserClient::NotificationsBytesEnqueued;
+    
+    NkeWakeupModerator::GetStatistics( statistics );
+}
+
+//--------------------------------------------------------------------
+
+UInt32 NkeIOUserClient::getSocketFilterQueueType( __in const NkeSocketID* socketId )
+{
+    assert( 0x0 != this->fSocketFilterQueuesNumber );
+    
+    //
+    // a multiplicative hash of the socket ID, the high bits of the product with the queues
+    // number select the queue so the sockets of the consecutive slots are spread over the queues
+    //
+    UInt32  hash = ( socketId->slotIndex ^ ( socketId->generation << 16 ) ) * 0x9E3779B1;
+    
+    return kt_NkeNotifyTypeSocketFilter + (UInt32)( ( (UInt64)hash * this->fSocketFilterQueuesNumber ) >> 32 );
+}
+
+//--------------------------------------------------------------------
+
+IOReturn NkeIOUserClient::socketFilterNotification( __inout NkeSocketFilterNotification* data )
+{
+    assert( preemption_enabled() );
+    
+    if( this->fCompactNotifications ){
         
-        // Send notification (via mach message) that data is available.
+        assert( data->size == sizeof( *data ) );
+        data->size = NkeIOUserClient::GetCompactNotificationSize( data );
+    }
+    
+    //
+    // the data arena notification must be received by each consumer before the consumer
+    // finds the added buffer's slices in its queue, if a queue is full the buffer is not added
+    // and the queues that have received the notification make the client map the arena for nothing,
+    // the next report has a greater generation so the client doesn't skip it on any queue
+    //
+    if( NkeSocketFilterEventDataArenaResized == data->event ){
         
-        if ( ( head == tail )                /* queue was empty prior to enqueue() */
-            ||   ( dataQueue->head == tail ) )   /* queue was emptied during enqueue() */
-        {
-            sendDataAvailableNotification();
-        }
+        for( UInt32 type = kt_NkeNotifyTypeSocketFilter; type < kt_NkeNotifyTypeSocketFilter + this->fSocketFilterQueuesNumber; ++type ){
+            
+            IOReturn  RC = this->enqueueSocketFilterNotification( type, data );
+            if( kIOReturnSuccess != RC )
+                return RC;
+        } // end for
         
-        return true;
+        return kIOReturnSuccess;
     }
     
-    void forceSendDataAvailableNotification( UInt32 msgSize )
-    {
-        sendDataAvailableNotification();
-    };
-};
+    return this->enqueueSocketFilterNotification( this->getSocketFilterQueueType( &data->socketId ), data );
+}
 
 //--------------------------------------------------------------------
 
-IOReturn NkeIOUserClient::socketFilterNotification( __in NkeSocketFilterNotification* data )
+IOReturn NkeIOUserClient::enqueueSocketFilterNotification( __in UInt32 type, __in const NkeSocketFilterNotification* data )
 {
-    assert( preemption_enabled() );
-    assert( this->fDataQueue[ kt_NkeNotifyTypeSocketFilter ] );
-    assert( this->fLock[ kt_NkeNotifyTypeSocketFilter ] );
+    assert( this->fDataQueue[ type ] );
+    assert( this->fLock[ type ] );
     
     //
     // enqueue must be able to send a message to a client or else
@@ -599,42 +802,127 @@ IOReturn NkeIOUserClient::socketFilterNotification( __in NkeSocketFilterNotifica
     // in failing to release data buffers
     // 
 #ifndef DBG
-    if( 0x0 == this->fNotificationPorts[ kt_NkeNotifyTypeSocketFilter ] )
+    if( 0x0 == this->fNotificationPorts[ type ] )
         return kIOReturnError;
 #endif
     
-    bool enqueued;
-    
     //
-    // the function is called from an arbitrary context, so the access
-    // serialization to the queue is required, the lock must not
-    // disable the preemtion as IODataQueue::sendDataAvailableNotification
-    // can block on the mutex
+    // the function is called from an arbitrary context, the notification is copied
+    // in the reserved entry without any lock held
     //
-    // Lock mutex while other threads use resource (shared buffers)
-    IOLockLock( this->fLock[ kt_NkeNotifyTypeSocketFilter ] );
-    {// start of the lock
+    NkeNotificationReservation  reservation;
+    
+    void* entry = this->reserveNotification( type, data->size, &reservation );
+    if( !entry ){
         
-        assert( preemption_enabled() );
-        enqueued = ((IODataQueueWrapper*)this->fDataQueue[ kt_NkeNotifyTypeSocketFilter ])->enqueueWithBarrier( data, data->size );
-#if defined( DBG )
-        /*if( !enqueued ){
-         
-         __asm__ volatile( "int $0x3" );
-         }*/
-#endif//DBG
+        DBG_PRINT_ERROR(("this->reserveNotification() failed, the queue %u is full\n", (unsigned int)type));
+        return kIOReturnNoMemory;
+    }
+    
+    memcpy( entry, data, data->size );
+    this->commitNotification( type, &reservation );
+    
+    return kIOReturnSuccess;
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketFilterNotification*
+NkeIOUserClient::reserveSocketFilterNotification(
+    __in NkeSocketFilterEvent event,
+    __in const NkeSocketID* socketId,
+    __in UInt32 slicesNumber,
+    __out NkeSocketFilterReservation* reservation
+    )
+{
+    assert( preemption_enabled() );
+    
+    reservation->type = this->getSocketFilterQueueType( socketId );
+    
+    //
+    // see enqueueSocketFilterNotification() for the reason to fail without a port
+    //
+#ifndef DBG
+    if( 0x0 == this->fNotificationPorts[ reservation->type ] )
+        return NULL;
+#endif
+    
+    UInt32  size = this->fCompactNotifications ?
+                   NkeIOUserClient::GetCompactNotificationSize( event, slicesNumber ) :
+                   sizeof( NkeSocketFilterNotification );
+    
+    NkeSocketFilterNotification*  notification;
+    
+    notification = (NkeSocketFilterNotification*)this->reserveNotification( reservation->type, size, &reservation->entry );
+    if( !notification ){
         
-    }//end of the lock
-    IOLockUnlock( this->fLock[ kt_NkeNotifyTypeSocketFilter ] );
+        DBG_PRINT_ERROR(("this->reserveNotification() failed, the queue %u is full\n", (unsigned int)reservation->type));
+        return NULL;
+    }
     
-    //assert( enqueued );
-    if( !enqueued ){
+    //
+    // the zeroed entry has the terminating slice for a not compact data notification
+    //
+    bzero( notification, size );
+    notification->event = event;
+    notification->size = size;
+    notification->socketId = *socketId;
+    
+    return notification;
+}
+
+//--------------------------------------------------------------------
+
+void NkeIOUserClient::commitSocketFilterNotification( __in const NkeSocketFilterReservation* reservation )
+{
+    this->commitNotification( reservation->type, &reservation->entry );
+}
+
+//--------------------------------------------------------------------
+
+void* NkeIOUserClient::reserveNotification( __in UInt32 type, __in UInt32 size, __out NkeNotificationReservation* reservation )
+{
+    assert( type >= kt_NkeNotifyTypeSocketFilter && type <= kt_NkeNotifyTypeSocketFilterLast );
+    assert( this->fNotificationRing[ type ] );
+    
+    if( !this->fNotificationRing[ type ]->reserve( size, reservation ) )
+        return NULL;
+    
+    return reservation->data;
+}
+
+//--------------------------------------------------------------------
+
+void NkeIOUserClient::commitNotification( __in UInt32 type, __in const NkeNotificationReservation* reservation )
+{
+    UInt32  published;
+    bool    queueWasEmpty;
+    
+    assert( preemption_enabled() );
+    
+    OSIncrementAtomic64( &NkeIOUserClient::NotificationsEnqueued );
+    OSAddAtomic64( reservation->size + DATA_QUEUE_ENTRY_HEADER_SIZE, &NkeIOUserClient::NotificationsBytesEnqueued );
+    
+    this->fNotificationRing[ type ]->commit( reservation, &published, &queueWasEmpty );
+    
+    //
+    // the producer that published the entries reports them to the moderator, the first entry
+    // might have been published to an empty queue, the lock serializes the messages only
+    // as IODataQueue::sendDataAvailableNotification can block on the mutex
+    //
+    for( UInt32 i = 0x0; i < published; ++i ){
         
-        DBG_PRINT_ERROR(("this->fDataQueue[ kt_NkeNotifyTypeSocketFilter ]->enqueue failed\n"));
+        if( !this->fWakeupModerator[ type ]->eventEnqueued( 0x0 == i && queueWasEmpty ) )
+            continue;
         
-    }//end if( !enqueued )
-    
-    return enqueued? kIOReturnSuccess: kIOReturnNoMemory;
+        IOLockLock( this->fLock[ type ] );
+        {// start of the lock
+            
+            ((IODataQueueWrapper*)this->fDataQueue[ type ])->forceSendDataAvailableNotification( 0x0 );
+            
+        }//end of the lock
+        IOLockUnlock( this->fLock[ type ] );
+    } // end for
 }
 
 //--------------------------------------------------------------------
@@ -706,6 +994,70 @@ NkeIOUserClient::processServiceSocketFilterResponse(
 
 //--------------------------------------------------------------------
 
+IOReturn
+NkeIOUserClient::getFilterStatistics(
+    __in  void *vInBuffer,
+    __out void *vOutBuffer, // NkeFilterStatistics
+    __in  void *vInSize,
+    __in  void *vOutSizeP,
+    void *, void *)
+{
+    NkeFilterStatistics*  statistics = (NkeFilterStatistics*)vOutBuffer;
+    
+    if( *(UInt32*)vOutSizeP < sizeof( *statistics ) ){
+        
+        DBG_PRINT_ERROR(("*vOutSizeP < sizeof(*statistics)\n"));
+        return kIOReturnBadArgument;
+    }
+    
+    if( ! gSocketFilter ){
+        
+        DBG_PRINT_ERROR(("gSocketFilter is NULL\n"));
+        return kIOReturnBadArgument;
+    }
+    
+    gSocketFilter->getStatistics( statistics );
+    
+    *(UInt32*)vOutSizeP = sizeof( *statistics );
+    
+    return kIOReturnSuccess;
+}
+
+//--------------------------------------------------------------------
+
+IOReturn
+NkeIOUserClient::setCapturePolicies(
+    __in  void *vInBuffer, // NkeCapturePolicies
+    __out void *vOutBuffer,
+    __in  void *vInSize,
+    __in  void *vOutSizeP,
+    void *, void *)
+{
+    NkeCapturePolicies*  policies = (NkeCapturePolicies*)vInBuffer;
+    vm_size_t            inSize = (vm_size_t)vInSize;
+    
+    //
+    // there is no output data
+    //
+    *(UInt32*)vOutSizeP = 0x0;
+    
+    if( inSize < sizeof( *policies ) ){
+        
+        DBG_PRINT_ERROR(("inSize < sizeof(*policies)\n"));
+        return kIOReturnBadArgument;
+    }
+    
+    if( ! gSocketFilter ){
+        
+        DBG_PRINT_ERROR(("gSocketFilter is NULL\n"));
+        return kIOReturnBadArgument;
+    }
+    
+    return gSocketFilter->setCapturePolicies( policies );
+}
+
+//--------------------------------------------------------------------
+
 IOReturn
 NkeIOUserClientRef::registerUserClient( __in NkeIOUserClient* client )
 {
@@ -13,6 +13,8 @@
 #include "NkeCommon.h"
 #include "NkeIOUserClientRef.h"
 #include "NkeUserToKernel.h"
+#include "NkeWakeupModerator.h"
+#include "NkeNotificationRing.h"
 #include "NetworkKernelExtension.h"
 
 //--------------------------------------------------------------------
@@ -21,6 +23,18 @@ class com_devicelock_driver_DeviceLockIOKitDriver;
 
 //--------------------------------------------------------------------
 
+//
+// a socket filter notification reserved in the queue of the type
+//
+typedef struct _NkeSocketFilterReservation{
+    
+    UInt32                      type;
+    NkeNotificationReservation  entry;
+    
+} NkeSocketFilterReservation;
+
+//--------------------------------------------------------------------
+
 class NkeIOUserClient : public IOUserClient
 {
     OSDeclareDefaultStructors( NkeIOUserClient )
@@ -46,7 +60,8 @@ private:
     mach_port_t                      fNotificationPorts[ kt_NkeNotifyTypeMax ];
     
     //
-    // locks to serialize access to the queues
+    // locks to serialize access to the queues, a socket filter queue's lock serializes
+    // the data available messages only as the notifications are enqueued by fNotificationRing
     //
     IOLock*                          fLock[ kt_NkeNotifyTypeMax ];
     
@@ -61,6 +76,55 @@ private:
     //
     Boolean                          clientClosedItself;
     
+    //
+    // the client passed kt_NkeOpenFlagCompactNotifications to kt_NkeUserClientOpen
+    //
+    Boolean                          fCompactNotifications;
+    
+    //
+    // the number of the socket filter queues requested by the client, the queues
+    // after the first one are allocated by open()
+    //
+    UInt32                           fSocketFilterQueuesNumber;
+    
+    //
+    // moderate the data available messages for the socket filter queues
+    //
+    NkeWakeupModerator*              fWakeupModerator[ kt_NkeNotifyTypeMax ];
+    
+    //
+    // the lock-free producers' side of the socket filter queues
+    //
+    NkeNotificationRing*             fNotificationRing[ kt_NkeNotifyTypeMax ];
+    
+    //
+    // a moderator's callback context, identifies the queue to wake up the client for
+    //
+    typedef struct _WakeupContext{
+        
+        NkeIOUserClient*  client;
+        UInt32            type;
+        
+    } WakeupContext;
+    
+    WakeupContext                    fWakeupContext[ kt_NkeNotifyTypeMax ];
+    
+    static void DeferredWakeup( __in void* context );
+    
+    //
+    // allocates the queue of the type and its lock, also the ring and the moderator for a socket
+    // filter queue, returns true if the queue has been allocated already
+    //
+    bool allocateQueue( __in UInt32 type );
+    
+    IOReturn enqueueSocketFilterNotification( __in UInt32 type, __in const NkeSocketFilterNotification* data );
+    
+    static volatile SInt64           NotificationsEnqueued;
+    static volatile SInt64           NotificationsBytesEnqueued;
+    
+    static UInt32 GetCompactNotificationSize( __in const NkeSocketFilterNotification* notification );
+    static UInt32 GetCompactNotificationSize( __in NkeSocketFilterEvent event, __in UInt32 slicesNumber );
+    
     //
     // an object to which this client is attached
     //
@@ -75,7 +139,12 @@ protected:
 public:
     virtual bool     start( __in IOService *provider );
     virtual void     stop( __in IOService *provider );
-    virtual IOReturn open(void);
+    virtual IOReturn open( __in  void *vInterfaceVersion,
+                           __in  void *vOpenFlags,
+                           __in  void *vQueuesNumber,
+                           __out void *vBufferSizeP,
+                           __out void *vBuffersNumberP,
+                           void * );
     virtual IOReturn clientClose(void);
     virtual IOReturn close(void);
     virtual bool     terminate(IOOptionBits options);
@@ -90,7 +159,35 @@ public:
     virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options,
                                          IOMemoryDescriptor **memory);
     
-    virtual IOReturn socketFilterNotification( __in NkeSocketFilterNotification* data );
+    //
+    // the notification's size is set to the size of the enqueued notification, the notification
+    // is enqueued in the socket's queue or in each queue if it is not related to a socket
+    //
+    virtual IOReturn socketFilterNotification( __inout NkeSocketFilterNotification* data );
+    
+    //
+    // returns the type of the socket filter queue for the socket's notifications
+    //
+    virtual UInt32 getSocketFilterQueueType( __in const NkeSocketID* socketId );
+    
+    //
+    // reserves an entry of the size in the socket filter queue, the caller builds the notification
+    // in the returned memory and commits it to the same queue, the memory is shared with the client,
+    // NULL is returned if the queue is full, a reserved entry must be committed
+    //
+    virtual void* reserveNotification( __in UInt32 type, __in UInt32 size, __out NkeNotificationReservation* reservation );
+    virtual void commitNotification( __in UInt32 type, __in const NkeNotificationReservation* reservation );
+    
+    //
+    // reserves a notification of the event in the socket's queue, the header is filled and the rest is zeroed,
+    // the caller fills the event data in place and commits the notification, a data notification has
+    // room for slicesNumber slices, NULL is returned if the notification can't be enqueued
+    //
+    virtual NkeSocketFilterNotification* reserveSocketFilterNotification( __in NkeSocketFilterEvent event,
+                                                                          __in const NkeSocketID* socketId,
+                                                                          __in UInt32 slicesNumber,
+                                                                          __out NkeSocketFilterReservation* reservation );
+    virtual void commitSocketFilterNotification( __in const NkeSocketFilterReservation* reservation );
     
     virtual IOReturn processServiceSocketFilterResponse( __in  void *vInBuffer, // NkeSocketFilterServiceResponse
                                                          __out void *vOutBuffer,
@@ -98,6 +195,18 @@ public:
                                                          __in  void *vOutSizeP,
                                                         void *, void *);
     
+    virtual IOReturn getFilterStatistics( __in  void *vInBuffer,
+                                          __out void *vOutBuffer, // NkeFilterStatistics
+                                          __in  void *vInSize,
+                                          __in  void *vOutSizeP,
+                                          void *, void *);
+    
+    virtual IOReturn setCapturePolicies( __in  void *vInBuffer, // NkeCapturePolicies
+                                         __out void *vOutBuffer,
+                                         __in  void *vInSize,
+                                         __in  void *vOutSizeP,
+                                         void *, void *);
+    
     virtual IOExternalMethod *getTargetAndMethodForIndex(IOService **target,
                                                          UInt32 index);
     
@@ -109,6 +218,8 @@ public:
     
     static NkeIOUserClient* withTask( __in task_t owningTask );
     
+    static void GetStatistics( __inout NkeFilterStatistics* statistics );
+    
 };
 
 //--------------------------------------------------------------------
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeNotificationRing.h"
+
+//--------------------------------------------------------------------
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors( NkeNotificationRing, OSObject )
+
+//--------------------------------------------------------------------
+
+NkeNotificationRing* NkeNotificationRing::withQueueMemory( __in IODataQueueMemory* queue )
+{
+    assert( queue );
+    
+    NkeNotificationRing*  newRing = new NkeNotificationRing();
+    assert( newRing );
+    if( ! newRing ){
+        
+        DBG_PRINT_ERROR(("operator new failed\n"));
+        return NULL;
+    }
+    
+    if( ! newRing->init() ){
+        
+        DBG_PRINT_ERROR(("init() failed\n"));
+        newRing->release();
+        return NULL;
+    }
+    
+    newRing->reservations = (Reservation*)IOMalloc( NKE_NOTIFICATION_RING_RESERVATIONS * sizeof( Reservation ) );
+    assert( newRing->reservations );
+    if( ! newRing->reservations ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the reservations failed\n"));
+        newRing->release();
+        return NULL;
+    }
+    
+    //
+    // a zero committedSequence never matches a sequence in the slot
+    //
+    bzero( newRing->reservations, NKE_NOTIFICATION_RING_RESERVATIONS * sizeof( Reservation ) );
+    
+    newRing->queue = queue;
+    newRing->reserveState = queue->tail;
+    newRing->publishSequence = 0x0;
+    
+    return newRing;
+}
+
+//--------------------------------------------------------------------
+
+void NkeNotificationRing::free()
+{
+    if( this->reservations ){
+        
+        IOFree( this->reservations, NKE_NOTIFICATION_RING_RESERVATIONS * sizeof( Reservation ) );
+        this->reservations = NULL;
+    }
+    
+    super::free();
+}
+
+//--------------------------------------------------------------------
+
+bool NkeNotificationRing::reserve( __in UInt32 size, __out NkeNotificationReservation* reservation )
+{
+    const UInt32  entrySize = size + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    const UInt32  queueSize = this->queue->queueSize;
+    UInt64        oldState;
+    UInt32        sequence;
+    UInt32        tail;
+    UInt32        entryOffset;
+    UInt32        newTail;
+    
+    do{
+        
+        oldState = this->reserveState;
+        sequence = (UInt32)( oldState >> 32 );
+        tail = (UInt32)oldState;
+        
+        //
+        // the reservation records are reused after the entries have been published
+        //
+        if( ( sequence - this->publishSequence ) >= NKE_NOTIFICATION_RING_RESERVATIONS )
+            return false;
+        
+        //
+        // the same space checks as in IODataQueue::enqueue() with the reserved tail,
+        // the client moves the head up to the published tail only
+        //
+        const UInt32  head = this->queue->head;  // volatile
+        
+        if( tail >= head ){
+            
+            if( ( tail + entrySize ) <= queueSize ){
+                
+                entryOffset = tail;
+                newTail = tail + entrySize;
+                
+            } else if( head > entrySize ){
+                
+                //
+                // wrap around to the beginning, the tail never catches up to the head
+                //
+                entryOffset = 0x0;
+                newTail = entrySize;
+                
+            } else {
+                
+                return false; // the queue is full
+            }
+            
+        } else {
+            
+            if( ( head - tail ) > entrySize ){
+                
+                entryOffset = tail;
+                newTail = tail + entrySize;
+                
+            } else {
+                
+                return false; // the queue is full
+            }
+        }
+        
+    } while( ! OSCompareAndSwap64( oldState,
+                                   ( ( (UInt64)( sequence + 0x1 ) ) << 32 ) | newTail,
+                                   &this->reserveState ) );
+    
+    IODataQueueEntry*  entry = (IODataQueueEntry*)( (UInt8*)this->queue->queue + entryOffset );
+    
+    entry->size = size;
+    
+    //
+    // the client looks for the size at the old tail to find that the entry has wrapped around,
+    // the space from the old tail to the queue's end belongs to this entry
+    //
+    if( entryOffset != tail && ( queueSize - tail ) >= DATA_QUEUE_ENTRY_HEADER_SIZE )
+        ((IODataQueueEntry*)( (UInt8*)this->queue->queue + tail ))->size = size;
+    
+    this->reservations[ sequence & ( NKE_NOTIFICATION_RING_RESERVATIONS - 0x1 ) ].entryEnd = newTail;
+    
+    reservation->sequence = sequence;
+    reservation->size = size;
+    reservation->data = &entry->data;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeNotificationRing::commit( __in const NkeNotificationReservation* reservation,
+                                  __out UInt32* publishedEntries,
+                                  __out bool* queueWasEmpty )
+{
+    Reservation*  record = &this->reservations[ reservation->sequence & ( NKE_NOTIFICATION_RING_RESERVATIONS - 0x1 ) ];
+    
+    *publishedEntries = 0x0;
+    *queueWasEmpty = false;
+    
+    //
+    // the entry's data must be visible before the entry is marked as committed
+    //
+    NkeCompilerBarrier();
+    record->committedSequence = reservation->sequence + 0x1;
+    
+    //
+    // the publishing producer checks for the committed entries after it has stopped publishing,
+    // so an entry committed while another producer publishes is not left unpublished, the compare
+    // and swap is a full barrier between the store above and the load of publisherActive
+    //
+    while( OSCompareAndSwap( 0x0, 0x1, &this->publisherActive ) ){
+        
+        while( this->isCommitted( this->publishSequence ) ){
+            
+            const UInt32  headBefore = this->queue->head;  // volatile
+            const UInt32  oldTail = this->queue->tail;
+            
+            //
+            // the client reads an entry only after the tail has been moved over it, the entry's data
+            // was stored before its committedSequence that has been loaded above
+            //
+            NkeCompilerBarrier();
+            this->queue->tail = this->reservations[ this->publishSequence & ( NKE_NOTIFICATION_RING_RESERVATIONS - 0x1 ) ].entryEnd;
+            NkeMemoryBarrier();
+            
+            if( headBefore == oldTail || this->queue->head == oldTail )
+                *queueWasEmpty = true;
+            
+            this->publishSequence += 0x1;
+            *publishedEntries += 0x1;
+        } // end while
+        
+        NkeCompilerBarrier();
+        this->publisherActive = 0x0;
+        NkeMemoryBarrier();
+        
+        if( ! this->isCommitted( this->publishSequence ) )
+            break;
+    } // end while
+}
+
+//--------------------------------------------------------------------
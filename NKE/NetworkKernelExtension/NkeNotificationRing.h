@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKENOTIFICATIONRING_H
+#define _NKENOTIFICATIONRING_H
+
+#include <IOKit/IODataQueueShared.h>
+
+#include "NkeCommon.h"
+
+//--------------------------------------------------------------------
+
+//
+// the maximal number of the reserved entries that have not been published, a power of two
+//
+#define NKE_NOTIFICATION_RING_RESERVATIONS   0x400
+
+//--------------------------------------------------------------------
+
+//
+// an entry reserved in the ring, the caller fills size bytes at data and commits the entry
+//
+typedef struct _NkeNotificationReservation{
+    
+    UInt32      sequence;
+    UInt32      size;
+    void*       data;
+    
+} NkeNotificationReservation;
+
+//--------------------------------------------------------------------
+
+//
+// a multi producer single consumer ring over the memory of an IODataQueue, the client dequeues
+// the entries by the IODataQueue client functions, a producer reserves an entry by a compare and swap
+// of the reservation state, fills the entry in place and commits it, the committed entries are
+// published by moving the queue's tail in the reservation order, the tail is moved by one producer
+// at a time, a producer that finds another producer publishing leaves its entry to that producer,
+// no producer waits for another one
+//
+
+class NkeNotificationRing: public OSObject{
+    
+    OSDeclareDefaultStructors( NkeNotificationRing );
+    
+private:
+    
+    IODataQueueMemory*  queue;
+    
+    //
+    // a sequence of the next reservation in the high 32 bits and an offset where the next entry
+    // starts in the low 32 bits, the offset is the queue's tail after all reserved entries are published
+    //
+    volatile UInt64     reserveState;
+    
+    //
+    // a sequence of the next entry to publish, changed by the publishing producer
+    //
+    volatile UInt32     publishSequence;
+    
+    //
+    // set by the producer that publishes the committed entries
+    //
+    volatile UInt32     publisherActive;
+    
+    //
+    // a record for each reservation that has not been published, indexed by the sequence
+    // modulo NKE_NOTIFICATION_RING_RESERVATIONS, committedSequence is the sequence plus one
+    // after the entry has been committed, entryEnd is the queue's tail after the entry
+    //
+    typedef struct _Reservation{
+        
+        volatile UInt32  committedSequence;
+        UInt32           entryEnd;
+        
+    } Reservation;
+    
+    Reservation*        reservations;
+    
+    bool isCommitted( __in UInt32 sequence )
+    {
+        return ( ( sequence + 0x1 ) == this->reservations[ sequence & ( NKE_NOTIFICATION_RING_RESERVATIONS - 0x1 ) ].committedSequence );
+    }
+    
+protected:
+    
+    virtual void free();
+    
+public:
+    
+    //
+    // the queue's memory must be valid until the ring is released, the queue must not be
+    // used by the IODataQueue enqueue functions while the ring is in use
+    //
+    static NkeNotificationRing* withQueueMemory( __in IODataQueueMemory* queue );
+    
+    //
+    // false is returned if the queue is full
+    //
+    bool reserve( __in UInt32 size, __out NkeNotificationReservation* reservation );
+    
+    //
+    // publishes the entry and the committed entries after it unless another producer is publishing,
+    // publishedEntries receives the number of entries this call published, queueWasEmpty is set
+    // to true if the client might have found the queue empty before the entries were published
+    //
+    void commit( __in const NkeNotificationReservation* reservation,
+                 __out UInt32* publishedEntries,
+                 __out bool* queueWasEmpty );
+};
+
+//--------------------------------------------------------------------
+
+#endif // _NKENOTIFICATIONRING_H
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include "NkeSlabAllocator.h"
+
+//--------------------------------------------------------------------
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors( NkeSlabAllocator, OSObject )
+
+//--------------------------------------------------------------------
+
+NkeSlabAllocator* NkeSlabAllocator::withElementSize( __in vm_size_t elementSize )
+{
+    //
+    // a free element keeps a link in its first bytes, the size is rounded to keep the elements aligned
+    //
+    if( elementSize < sizeof( FreeElement ) )
+        elementSize = sizeof( FreeElement );
+    
+    elementSize = ( elementSize + 0xF ) & ~((vm_size_t)0xF);
+    
+    assert( elementSize <= ( NKE_SLAB_SIZE - sizeof( Slab ) ) );
+    if( elementSize > ( NKE_SLAB_SIZE - sizeof( Slab ) ) ){
+        
+        DBG_PRINT_ERROR(("an element size %u is too big for a slab\n", (unsigned int)elementSize));
+        return NULL;
+    }
+    
+    NkeSlabAllocator*  newAllocator = new NkeSlabAllocator();
+    assert( newAllocator );
+    if( ! newAllocator ){
+        
+        DBG_PRINT_ERROR(("operator new failed\n"));
+        return NULL;
+    }
+    
+    if( ! newAllocator->init() ){
+        
+        DBG_PRINT_ERROR(("init() failed\n"));
+        newAllocator->release();
+        return NULL;
+    }
+    
+    newAllocator->elementSize = elementSize;
+    newAllocator->elementsPerSlab = (UInt32)( ( NKE_SLAB_SIZE - sizeof( Slab ) ) / elementSize );
+    
+    return newAllocator;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeSlabAllocator::init()
+{
+    if( ! super::init() ){
+        
+        assert( !"super::init() failed" );
+        DBG_PRINT_ERROR(( "super::init() failed\n" ));
+        return false;
+    }
+    
+    this->depotLock = IOSimpleLockAlloc();
+    assert( this->depotLock );
+    if( ! this->depotLock ){
+        
+        DBG_PRINT_ERROR(("this->depotLock = IOSimpleLockAlloc() failed\n"));
+        return false;
+    }
+    
+    for( int i = 0x0; i < NKE_PER_CPU_SLOTS; ++i ){
+        
+        this->cpuCaches[ i ].lock = IOSimpleLockAlloc();
+        assert( this->cpuCaches[ i ].lock );
+        if( ! this->cpuCaches[ i ].lock ){
+            
+            DBG_PRINT_ERROR(("this->cpuCaches[ %d ].lock = IOSimpleLockAlloc() failed\n", i));
+            return false;
+        }
+        
+        this->cpuCaches[ i ].loaded = this->allocateMagazine();
+        if( ! this->cpuCaches[ i ].loaded )
+            return false;
+        
+        //
+        // an empty magazine in the depot for each processor, so a full magazine can be parked
+        //
+        Magazine*  empty = this->allocateMagazine();
+        if( ! empty )
+            return false;
+        
+        empty->next = this->emptyMagazines;
+        this->emptyMagazines = empty;
+        
+    } // end for
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeSlabAllocator::free()
+{
+    assert( 0x0 == this->elementsInUse );
+    
+    for( int i = 0x0; i < NKE_PER_CPU_SLOTS; ++i ){
+        
+        if( this->cpuCaches[ i ].loaded ){
+            
+            IOFree( this->cpuCaches[ i ].loaded, sizeof( Magazine ) );
+            this->cpuCaches[ i ].loaded = NULL;
+        }
+        
+        if( this->cpuCaches[ i ].lock ){
+            
+            IOSimpleLockFree( this->cpuCaches[ i ].lock );
+            this->cpuCaches[ i ].lock = NULL;
+        }
+    } // end for
+    
+    Magazine*  lists[] = { this->fullMagazines, this->emptyMagazines };
+    
+    for( int i = 0x0; i < (int)( sizeof( lists ) / sizeof( lists[ 0x0 ] ) ); ++i ){
+        
+        Magazine*  magazine = lists[ i ];
+        
+        while( magazine ){
+            
+            Magazine*  next = magazine->next;
+            
+            IOFree( magazine, sizeof( *magazine ) );
+            magazine = next;
+        } // end while
+    } // end for
+    
+    this->fullMagazines = NULL;
+    this->emptyMagazines = NULL;
+    
+    //
+    // the elements are in the slabs' memory so there is nothing to free for them
+    //
+    this->freeElements = NULL;
+    
+    while( this->slabs ){
+        
+        Slab*  next = this->slabs->next;
+        
+        IOFree( this->slabs, NKE_SLAB_SIZE );
+        this->slabs = next;
+    } // end while
+    
+    if( this->depotLock ){
+        
+        IOSimpleLockFree( this->depotLock );
+        this->depotLock = NULL;
+    }
+    
+    super::free();
+}
+
+//--------------------------------------------------------------------
+
+NkeSlabAllocator::Magazine* NkeSlabAllocator::allocateMagazine()
+{
+    Magazine*  magazine = (Magazine*)IOMalloc( sizeof( *magazine ) );
+    assert( magazine );
+    if( ! magazine ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for a magazine failed\n"));
+        return NULL;
+    }
+    
+    bzero( magazine, sizeof( *magazine ) );
+    
+    return magazine;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeSlabAllocator::growSlabs()
+{
+    assert( preemption_enabled() );
+    assert( 0x0 != this->elementsPerSlab );
+    
+    Slab*  slab = (Slab*)IOMalloc( NKE_SLAB_SIZE );
+    assert( slab );
+    if( ! slab ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for a slab failed\n"));
+        return false;
+    }
+    
+    //
+    // link the elements in the address order, the first element follows the header
+    //
+    vm_address_t   firstElement = (vm_address_t)( slab + 0x1 );
+    FreeElement*   head = (FreeElement*)firstElement;
+    FreeElement*   tail = head;
+    
+    for( UInt32 i = 0x1; i < this->elementsPerSlab; ++i ){
+        
+        FreeElement*  element = (FreeElement*)( firstElement + i * this->elementSize );
+        
+        tail->next = element;
+        tail = element;
+    } // end for
+    
+    IOSimpleLockLock( this->depotLock );
+    { // start of the lock
+        
+        slab->next = this->slabs;
+        this->slabs = slab;
+        
+        tail->next = this->freeElements;
+        this->freeElements = head;
+        
+    } // end of the lock
+    IOSimpleLockUnlock( this->depotLock );
+    
+    OSIncrementAtomic( &this->slabsCount );
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void* NkeSlabAllocator::allocateFromDepot( __in CpuCache* cache )
+{
+    Magazine*  magazine = cache->loaded;
+    void*      element = NULL;
+    
+    assert( 0x0 == magazine->rounds );
+    
+    IOSimpleLockLock( this->depotLock );
+    { // start of the lock
+        
+        if( this->fullMagazines ){
+            
+            //
+            // exchange the processor's empty magazine for a full one
+            //
+            Magazine*  full = this->fullMagazines;
+            
+            this->fullMagazines = full->next;
+            
+            magazine->next = this->emptyMagazines;
+            this->emptyMagazines = magazine;
+            
+            full->next = NULL;
+            cache->loaded = full;
+            magazine = full;
+            
+        } else {
+            
+            //
+            // load the empty magazine from the slabs' free elements
+            //
+            while( this->freeElements && magazine->rounds < NKE_SLAB_MAGAZINE_SIZE ){
+                
+                magazine->round[ magazine->rounds ] = this->freeElements;
+                magazine->rounds += 0x1;
+                
+                this->freeElements = this->freeElements->next;
+            } // end while
+        }
+        
+    } // end of the lock
+    IOSimpleLockUnlock( this->depotLock );
+    
+    OSIncrementAtomic64( &this->depotAccesses );
+    
+    if( magazine->rounds > 0x0 ){
+        
+        magazine->rounds -= 0x1;
+        element = magazine->round[ magazine->rounds ];
+    }
+    
+    return element;
+}
+
+//--------------------------------------------------------------------
+
+void NkeSlabAllocator::freeToDepot( __in CpuCache* cache, __in void* element )
+{
+    Magazine*  magazine = cache->loaded;
+    
+    assert( NKE_SLAB_MAGAZINE_SIZE == magazine->rounds );
+    
+    IOSimpleLockLock( this->depotLock );
+    { // start of the lock
+        
+        if( this->emptyMagazines ){
+            
+            //
+            // exchange the processor's full magazine for an empty one
+            //
+            Magazine*  empty = this->emptyMagazines;
+            
+            this->emptyMagazines = empty->next;
+            
+            magazine->next = this->fullMagazines;
+            this->fullMagazines = magazine;
+            
+            assert( 0x0 == empty->rounds );
+            
+            empty->next = NULL;
+            empty->round[ 0x0 ] = element;
+            empty->rounds = 0x1;
+            
+            cache->loaded = empty;
+            
+        } else {
+            
+            //
+            // all magazines are full, return the element to the slabs' free list
+            //
+            ((FreeElement*)element)->next = this->freeElements;
+            this->freeElements = (FreeElement*)element;
+        }
+        
+    } // end of the lock
+    IOSimpleLockUnlock( this->depotLock );
+    
+    OSIncrementAtomic64( &this->depotAccesses );
+}
+
+//--------------------------------------------------------------------
+
+void NkeSlabAllocator::updateHighWaterMark( __in SInt32 inUse )
+{
+    SInt32  highWaterMark;
+    
+    do{
+        
+        highWaterMark = this->elementsHighWaterMark;
+        if( inUse <= highWaterMark )
+            break;
+            
+    } while( ! OSCompareAndSwap( highWaterMark, inUse, &this->elementsHighWaterMark ) );
+}
+
+//--------------------------------------------------------------------
+
+void* NkeSlabAllocator::allocate()
+{
+    assert( preemption_enabled() );
+    
+    void*  element = NULL;
+    
+    while( true ){
+        
+        CpuCache*  cache = &this->cpuCaches[ NkeCurrentCpuSlot() ];
+        
+        IOSimpleLockLock( cache->lock );
+        { // start of the lock
+            
+            Magazine*  magazine = cache->loaded;
+            
+            if( magazine->rounds > 0x0 ){
+                
+                magazine->rounds -= 0x1;
+                element = magazine->round[ magazine->rounds ];
+                
+            } else {
+                
+                element = this->allocateFromDepot( cache );
+            }
+            
+        } // end of the lock
+        IOSimpleLockUnlock( cache->lock );
+        
+        if( element )
+            break;
+        
+        //
+        // the depot is exhausted, the slab is allocated without any lock held and then
+        // the allocation is retried, a concurrent allocation might consume the new elements
+        //
+        if( ! this->growSlabs() )
+            return NULL;
+            
+    } // end while
+    
+    //
+    // OSIncrementAtomic returns the value before increment
+    //
+    this->updateHighWaterMark( OSIncrementAtomic( &this->elementsInUse ) + 0x1 );
+    
+    return element;
+}
+
+//--------------------------------------------------------------------
+
+void NkeSlabAllocator::deallocate( __in void* element )
+{
+    assert( element );
+    assert( this->elementsInUse > 0x0 );
+    
+    CpuCache*  cache = &this->cpuCaches[ NkeCurrentCpuSlot() ];
+    
+    IOSimpleLockLock( cache->lock );
+    { // start of the lock
+        
+        Magazine*  magazine = cache->loaded;
+        
+        if( magazine->rounds < NKE_SLAB_MAGAZINE_SIZE ){
+            
+            magazine->round[ magazine->rounds ] = element;
+            magazine->rounds += 0x1;
+            
+        } else {
+            
+            this->freeToDepot( cache, element );
+        }
+        
+    } // end of the lock
+    IOSimpleLockUnlock( cache->lock );
+    
+    OSDecrementAtomic( &this->elementsInUse );
+}
+
+//--------------------------------------------------------------------
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKESLABALLOCATOR_H
+#define _NKESLABALLOCATOR_H
+
+#include "NkeCommon.h"
+
+//--------------------------------------------------------------------
+
+//
+// a size of a memory chunk carved into elements
+//
+#define NKE_SLAB_SIZE            0x4000
+
+//
+// a number of elements kept by a magazine
+//
+#define NKE_SLAB_MAGAZINE_SIZE   0x20
+
+//--------------------------------------------------------------------
+
+//
+// a fixed size elements allocator, the elements are carved from slabs and cached
+// in per-CPU magazines, a magazine is a bounded stack of free elements, when a processor's
+// magazine becomes empty or full it is exchanged with the depot for a full or an empty one,
+// so the depot lock is taken once per NKE_SLAB_MAGAZINE_SIZE operations on the processor,
+// the slabs are never returned to the system until the allocator is freed
+//
+
+class NkeSlabAllocator: public OSObject{
+    
+    OSDeclareDefaultStructors( NkeSlabAllocator );
+    
+private:
+    
+    typedef struct _FreeElement{
+        struct _FreeElement*  next;
+    } FreeElement;
+    
+    //
+    // a header at the start of each slab, links all slabs for release
+    //
+    typedef struct _Slab{
+        struct _Slab*  next;
+    } __attribute__((aligned(16))) Slab;
+    
+    typedef struct _Magazine{
+        struct _Magazine*  next;
+        UInt32             rounds;
+        void*              round[ NKE_SLAB_MAGAZINE_SIZE ];
+    } Magazine;
+    
+    //
+    // a processor's loaded magazine, never NULL after init
+    //
+    typedef struct _CpuCache{
+        IOSimpleLock*  lock;
+        Magazine*      loaded;
+    } __attribute__((aligned(64))) CpuCache;
+    
+    CpuCache          cpuCaches[ NKE_PER_CPU_SLOTS ];
+    
+    //
+    // the depot, protected by depotLock, the lock order is a processor's lock then depotLock
+    //
+    IOSimpleLock*     depotLock;
+    Magazine*         fullMagazines;
+    Magazine*         emptyMagazines;
+    FreeElement*      freeElements;
+    Slab*             slabs;
+    
+    vm_size_t         elementSize;
+    UInt32            elementsPerSlab;
+    
+    //
+    // the accounting, the high water mark is the maximum number of elements in use
+    // since the allocator was created
+    //
+    volatile SInt32   elementsInUse;
+    volatile SInt32   elementsHighWaterMark;
+    volatile SInt32   slabsCount;
+    volatile SInt64   depotAccesses;
+    
+    Magazine* allocateMagazine();
+    
+    //
+    // allocates a slab and adds its elements to the depot's free list,
+    // must be called without any lock being held
+    //
+    bool growSlabs();
+    
+    //
+    // returns an element from the depot, a full magazine might be exchanged for the
+    // processor's empty one, called with the processor's lock held
+    //
+    void* allocateFromDepot( __in CpuCache* cache );
+    
+    //
+    // returns an element to the depot, an empty magazine might be exchanged for the
+    // processor's full one, called with the processor's lock held
+    //
+    void freeToDepot( __in CpuCache* cache, __in void* element );
+    
+    void updateHighWaterMark( __in SInt32 inUse );
+    
+protected:
+    
+    virtual bool init();
+    virtual void free();
+    
+public:
+    
+    static NkeSlabAllocator* withElementSize( __in vm_size_t elementSize );
+    
+    //
+    // the returned memory is not zeroed, NULL is returned if there is no memory
+    //
+    void* allocate();
+    void  deallocate( __in void* element );
+    
+    UInt32 getElementsInUse(){ return this->elementsInUse; }
+    UInt32 getElementsHighWaterMark(){ return this->elementsHighWaterMark; }
+    UInt32 getSlabsCount(){ return this->slabsCount; }
+    UInt64 getDepotAccesses(){ return this->depotAccesses; }
+};
+
+//--------------------------------------------------------------------
+
+#endif // _NKESLABALLOCATOR_H
@@ -86,7 +86,7 @@ errno_t NkeSocketFilter::InitSocketFilterSubsystem()
 
 //--------------------------------------------------------------------
 
-NkeSocketFilter* NkeSocketFilter::withDefault()
+NkeSocketFilter* NkeSocketFilter::withDefault( __in UInt32 dataBufferSize, __in UInt32 dataBuffersNumber, __in UInt32 dataBuffersNumberMax )
 {
     NkeSocketFilter*  newFilter;
     
@@ -105,59 +105,36 @@ NkeSocketFilter* NkeSocketFilter::withDefault()
         return NULL;
     }
     
-    //
-    // create an empty array for buffer objects
-    //
-    newFilter->dataBuffers = OSArray::withCapacity( kt_NkeSocketBuffersNumber );
-    assert( newFilter->dataBuffers );
-    if( ! newFilter->dataBuffers ){
+    newFilter->capturePoliciesLock = IOLockAlloc();
+    assert( newFilter->capturePoliciesLock );
+    if( ! newFilter->capturePoliciesLock ){
         
-        DBG_PRINT_ERROR(( "OSArray::withCapacity() fauled\n" ));
+        DBG_PRINT_ERROR(( "IOLockAlloc() failed\n" ));
         newFilter->release();
         return NULL;
     }
     
-    //
-    // set a free buffer list
-    //
-    newFilter->freeBuffersHead = UINT8_MAX;
-    for( int i = 0x0; i < NKE_STATIC_ARRAY_SIZE( newFilter->freeBuffers ); ++i ){
-        
-        newFilter->freeBuffers[ i ] = UINT8_MAX;
-    } // end for
+    newFilter->setDefaultCapturePolicies();
     
     //
-    // create the buffers
+    // create the data arena, the memory is allocated when a client connects,
+    // in case of 40 buffers of 64 KB the arena starts with 2.5 MB
     //
-    for( int i = 0x0; i < newFilter->dataBuffers->getCapacity(); ++i ){
-        
-        //
-        // create a buffer, in case of 40 buffers each one will be of 64 KB size
-        //
-        NkeDataBuffer*  dataBuffer = NkeDataBuffer::withSize( 0x280000/kt_NkeSocketBuffersNumber, (UInt32)i );
-        assert( dataBuffer );
-        if( ! dataBuffer ){
-            
-            DBG_PRINT_ERROR(( "NkeDataBuffer::withSize() failed\n" ));
-            break;
-        }
-        
-        //
-        // insert in the list of free buffers
-        //
-        newFilter->freeBuffers[ i ] = newFilter->freeBuffersHead;
-        newFilter->freeBuffersHead = i;
+    newFilter->dataArena = NkeDataArena::withWindows( dataBufferSize, dataBuffersNumberMax, dataBuffersNumber );
+    assert( newFilter->dataArena );
+    if( ! newFilter->dataArena ){
         
-        //
-        // add the buffer in the array
-        //
-        newFilter->dataBuffers->setObject( dataBuffer );
+        DBG_PRINT_ERROR(( "NkeDataArena::withWindows() failed\n" ));
+        newFilter->release();
+        return NULL;
+    }
+    
+    if( ! newFilter->dataArena->startResizing( &NkeSocketFilter::DataArenaResized, newFilter ) ){
         
-        //
-        // the object is retained by the array
-        //
-        dataBuffer->release();
-    } // end for
+        DBG_PRINT_ERROR(( "startResizing() failed\n" ));
+        newFilter->release();
+        return NULL;
+    }
     
     return newFilter;
 }
@@ -166,17 +143,56 @@ NkeSocketFilter* NkeSocketFilter::withDefault()
 
 void NkeSocketFilter::free()
 {
-    if( this->dataBuffers ){
+    if( this->dataArena ){
         
-        this->dataBuffers->flushCollection();
-        this->dataBuffers->release();
+        //
+        // the resize callback uses the filter
+        //
+        this->dataArena->stopResizing();
+        this->dataArena->release();
     }
     
+    if( this->capturePoliciesLock )
+        IOLockFree( this->capturePoliciesLock );
+    
     super::free();
 }
 
 //--------------------------------------------------------------------
 
+void NkeSocketFilter::setDefaultCapturePolicies()
+{
+    //
+    // ssh, telnet, RDP and VNC
+    //
+    static const UInt16  interactivePorts[] = { 22, 23, 3389, 5900 };
+    
+    bzero( &this->capturePolicies, sizeof( this->capturePolicies ) );
+    
+    this->capturePolicies.defaultPolicy.firstPort = 0x0;
+    this->capturePolicies.defaultPolicy.lastPort = 0xFFFF;
+    this->capturePolicies.defaultPolicy.verdictTimeout = NKE_DEFAULT_VERDICT_TIMEOUT;
+    this->capturePolicies.defaultPolicy.coalescingMaxBytes = NKE_DEFAULT_COALESCING_BYTES;
+    this->capturePolicies.defaultPolicy.coalescingMaxMicroseconds = NKE_DEFAULT_COALESCING_MICROSECONDS;
+    this->capturePolicies.defaultPolicy.allowDataOnTimeout = 0x0;
+    
+    for( int i = 0x0; i < NKE_STATIC_ARRAY_SIZE( interactivePorts ); ++i ){
+        
+        NkeCapturePolicy*  policy = &this->capturePolicies.policies[ i ];
+        
+        policy->firstPort = interactivePorts[ i ];
+        policy->lastPort = interactivePorts[ i ];
+        policy->verdictTimeout = NKE_INTERACTIVE_VERDICT_TIMEOUT;
+        policy->allowDataOnTimeout = 0x1;
+        
+        this->capturePolicies.count += 0x1;
+    } // end for
+    
+    this->capturePoliciesGeneration = 0x1;
+}
+
+//--------------------------------------------------------------------
+
 /* Dispatch vector for IPv4 socket functions */
 struct sflt_filter NkeSocketFilter::SfltIPv4 = {
 	NKE_SOCK_FLT_HANDLE_IP4,/* sflt_handle - use a registered creator type - <http://developer.apple.com/datatype/> */
@@ -351,40 +367,33 @@ NkeSocketFilter::FltAttach(void **cookie, socket_t so, sa_family_t sa_family)
         return ENOENT;
     
     //
-    // it happened that sometimes the detach callback was not called, the reasons are still not known
+    // it happened that sometimes the detach callback was not called, the reasons are still not known,
+    // a stale stub that has not been promoted can't be found and is leaked
     //
-    if( NkeIsSocketObjectInList( so ) ){
+    NkeSocketObject* oldSoObj;
+    oldSoObj = NkeSocketObject::GetSocketObjectRef( so );
+    if( oldSoObj ){
         
-        NkeSocketObject* oldSoObj;
-        oldSoObj = NkeSocketObject::GetSocketObjectRef( so );
-        if( oldSoObj ){
-            
-            NkeSocketFilter::FltDetach( NkeSocketObjectToCookie( oldSoObj ), so );
-            oldSoObj->release();
-            NKE_DBG_MAKE_POINTER_INVALID( oldSoObj );
-        }
+        NkeSocketFilter::DetachSocketObject( oldSoObj );
+        oldSoObj->release();
+        NKE_DBG_MAKE_POINTER_INVALID( oldSoObj );
     }
     
-    NkeSocketObject* soObj;
-        
-    soObj = NkeSocketObject::withSocket( so, NkeSocketFilter::gidtag, sa_family );
-    assert( soObj );
-    if( soObj ){
-        
-        soObj->insertInSocketsList();
-        
-        //
-        // release the object, the sockets list takes its own reference
-        //
-        soObj->release();
-        
-    } else {
+    //
+    // only a stub is allocated, the socket object is created when the socket
+    // is connected or the first data arrives, see NkeSocketObject::PromoteSocketStub
+    //
+    NkeSocketStub* stub;
+    
+    stub = NkeSocketObject::AllocateSocketStub( so, NkeSocketFilter::gidtag, sa_family );
+    assert( stub );
+    if( ! stub ){
         
-        DBG_PRINT_ERROR(("NkeSocketObject::withSocket failed\n"));
+        DBG_PRINT_ERROR(("NkeSocketObject::AllocateSocketStub failed\n"));
         return ENOMEM;
     }
     
-    *cookie = NkeSocketObjectToCookie( soObj );
+    *cookie = NkeSocketStubToCookie( stub );
     
     return KERN_SUCCESS;
 }
@@ -411,9 +420,31 @@ NkeSocketFilter::FltAttachIPv6(void **cookie, socket_t so)
 void	
 NkeSocketFilter::FltDetach(void *cookie, socket_t so)
 {
-    NkeSocketObject* soObj = NkeCookieToSocketObject( cookie );
+    NkeSocketStub*   stub = NkeCookieToSocketStub( cookie );
+    NkeSocketObject* soObj = NkeSocketStubToSocketObject( stub );
     
-    assert( NkeIsSocketObjectInList( so ) && soObj->toSocket() == so );
+    assert( stub->socket == so );
+    assert( preemption_enabled() );
+    
+    //
+    // the stub might have never been promoted
+    //
+    if( soObj ){
+        
+        assert( NkeIsSocketObjectInList( so ) && soObj->toSocket() == so );
+        NkeSocketFilter::DetachSocketObject( soObj );
+        NKE_DBG_MAKE_POINTER_INVALID( soObj );
+    }
+    
+    NkeSocketObject::FreeSocketStub( stub );
+    NKE_DBG_MAKE_POINTER_INVALID( stub );
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketFilter::DetachSocketObject( __in NkeSocketObject* soObj )
+{
     assert( preemption_enabled() );
     
     //
@@ -517,9 +548,24 @@ NkeSocketFilter::FltNotify(void *cookie, socket_t so, sflt_event_t event, void *
      #11 0x004ed78d in unix_syscall (state=0x670c0e0) at /SourceCache/xnu/xnu-1504.7.4/bsd/dev/i386/systemcalls.c:205         
      */
     
-    NkeSocketObject* soObj = NkeSocketObject::GetSocketObjectRef( so );
+    NkeSocketStub*   stub = NkeCookieToSocketStub( cookie );
+    NkeSocketObject* soObj;
+    
+    assert( stub->socket == so );
+    
+    //
+    // the connected event is reported to the service so the object is required,
+    // the other events for a stub that has not been promoted are of no interest as
+    // there is neither deferred data nor the service knows about the socket
+    //
+    if( sock_evt_connected == event )
+        soObj = NkeSocketObject::PromoteSocketStub( stub );
+    else
+        soObj = NkeSocketStubToSocketObject( stub );
+    
     if( soObj ){
         
+        soObj->retain();
         soObj->logSocketPreEvent( event );
         
         NkeIOUserClient* userClient = gSocketFilter->getUserClient();
@@ -647,18 +693,24 @@ NkeSocketFilter::FltNotify(void *cookie, socket_t so, sflt_event_t event, void *
                 //
                 if( userClient ){
                     
-                    NkeSocketFilterNotification  notification;
-                    IOReturn  RC;
-                    
-                    INIT_SOCKET_NOTIFICATION( notification, soObj, NkeSocketFilterEventConnected );
+                    NkeSocketFilterReservation    reservation;
+                    NkeSocketFilterNotification*  notification;
                     
-                    // Send along information about the connection with the connected event message
-                    soObj->getLocalAddress( &notification.eventData.connected.localAddress );
-                    soObj->getRemoteAddress( &notification.eventData.connected.remoteAddress );
-                    notification.eventData.connected.sa_family = soObj->getProtocolFamily();
-                    
-                    RC = userClient->socketFilterNotification( &notification );
-                    assert( kIOReturnSuccess == RC );
+                    notification = NkeSocketFilter::ReserveSocketNotification( userClient,
+                                                                               soObj,
+                                                                               NkeSocketFilterEventConnected,
+                                                                               0x0,
+                                                                               &reservation );
+                    assert( notification );
+                    if( notification ){
+                        
+                        // Send along information about the connection with the connected event message
+                        soObj->getLocalAddress( &notification->eventData.connected.localAddress );
+                        soObj->getRemoteAddress( &notification->eventData.connected.remoteAddress );
+                        notification->eventData.connected.sa_family = soObj->getProtocolFamily();
+                        
+                        userClient->commitSocketFilterNotification( &reservation );
+                    }
                 } // end if( userClient )
                 
                 break;
@@ -679,13 +731,17 @@ NkeSocketFilter::FltNotify(void *cookie, socket_t so, sflt_event_t event, void *
                 //
                 if( userClient ){
                     
-                    NkeSocketFilterNotification  notification;
-                    IOReturn  RC;
-                    
-                    INIT_SOCKET_NOTIFICATION( notification, soObj, NkeSocketFilterEventClosing );
+                    NkeSocketFilterReservation    reservation;
+                    NkeSocketFilterNotification*  notification;
                     
-                    RC = userClient->socketFilterNotification( &notification );
-                    assert( kIOReturnSuccess == RC );
+                    notification = NkeSocketFilter::ReserveSocketNotification( userClient,
+                                                                               soObj,
+                                                                               NkeSocketFilterEventClosing,
+                                                                               0x0,
+                                                                               &reservation );
+                    assert( notification );
+                    if( notification )
+                        userClient->commitSocketFilterNotification( &reservation );
                 } // end if( userClient )
                 
                 break;
@@ -716,10 +772,15 @@ NkeSocketFilter::FltNotify(void *cookie, socket_t so, sflt_event_t event, void *
                 //
                 if( userClient ){
                     
-                    NkeSocketFilterNotification  notification;
-                    IOReturn  RC;
+                    NkeSocketFilterReservation    reservation;
+                    NkeSocketFilterNotification*  notification;
                     
-                    INIT_SOCKET_NOTIFICATION( notification, soObj, NkeSocketFilterEventDisconnected );
+                    notification = NkeSocketFilter::ReserveSocketNotification( userClient,
+                                                                               soObj,
+                                                                               NkeSocketFilterEventDisconnected,
+                                                                               0x0,
+                                                                               &reservation );
+                    assert( notification );
                     
                     //
                     // mark the socket as disconnected after notification initialization
@@ -728,8 +789,8 @@ NkeSocketFilter::FltNotify(void *cookie, socket_t so, sflt_event_t event, void *
                     //
                     soObj->markAsDisconnected();
                     
-                    RC = userClient->socketFilterNotification( &notification );
-                    assert( kIOReturnSuccess == RC );
+                    if( notification )
+                        userClient->commitSocketFilterNotification( &reservation );
                     
                 } else {
                     
@@ -832,7 +893,13 @@ NkeSocketFilter::FltDataIn(void *cookie, socket_t so, const struct sockaddr *fro
           mbuf_t *data, mbuf_t *control, sflt_data_flag_t flags)
 {
     errno_t  error;
-    NkeSocketObject* soObj = NkeCookieToSocketObject( cookie );
+    NkeSocketObject* soObj = NkeSocketObject::PromoteSocketStub( NkeCookieToSocketStub( cookie ) );
+    
+    //
+    // let the data pass through if the object can't be created
+    //
+    if( ! soObj )
+        return KERN_SUCCESS;
     
     assert( NkeIsSocketObjectInList( so ) && soObj->toSocket() == so );
     assert( preemption_enabled() );
@@ -893,7 +960,13 @@ NkeSocketFilter::FltDataOut(
     )
 {
     errno_t  error;
-    NkeSocketObject* soObj = NkeCookieToSocketObject( cookie );
+    NkeSocketObject* soObj = NkeSocketObject::PromoteSocketStub( NkeCookieToSocketStub( cookie ) );
+    
+    //
+    // let the data pass through if the object can't be created
+    //
+    if( ! soObj )
+        return KERN_SUCCESS;
     
     assert( NkeIsSocketObjectInList( so ) && soObj->toSocket() == so );
     assert( preemption_enabled() );
@@ -919,12 +992,12 @@ NkeSocketFilter::FltConnect(
     assert( ( from && ((from->sa_family == AF_INET) || (from->sa_family == AF_INET6))) ||
             ( to && ((to->sa_family == AF_INET) || (to->sa_family == AF_INET6))) );
     
-    NkeSocketObject* soObj = NkeCookieToSocketObject( cookie );
+    NkeSocketStub*   stub = NkeCookieToSocketStub( cookie );
     
-    assert( NkeIsSocketObjectInList( so ) && soObj->toSocket() == so );
+    assert( stub->socket == so );
     assert( preemption_enabled() );
     
-    soObj->setRemoteAddress( to ? to : from );
+    NkeSocketObject::SetSocketStubAddress( stub, false, to ? to : from );
     
     return KERN_SUCCESS;
 }
@@ -978,12 +1051,12 @@ NkeSocketFilter::FltConnectOut(void *cookie, socket_t so, const struct sockaddr
 errno_t	
 NkeSocketFilter::FltBind(void *cookie, socket_t so, const struct sockaddr *to)
 {
-    NkeSocketObject* soObj = NkeCookieToSocketObject( cookie );
+    NkeSocketStub*   stub = NkeCookieToSocketStub( cookie );
     
-    assert( NkeIsSocketObjectInList( so ) && soObj->toSocket() == so );
+    assert( stub->socket == so );
     assert( preemption_enabled() );
     
-    soObj->setLocalAddress( to );
+    NkeSocketObject::SetSocketStubAddress( stub, true, to );
     
     return KERN_SUCCESS;
 }
@@ -1023,14 +1096,36 @@ NkeSocketFilter::FltListen(void *cookie, socket_t so)
 
 IOReturn NkeSocketFilter::registerUserClient( __in NkeIOUserClient* client )
 {
-    return userClient.registerUserClient( client );
+    //
+    // the arena's memory is used only while there is a client
+    //
+    if( ! this->dataArena->reserveWindows() ){
+        
+        DBG_PRINT_ERROR(( "reserveWindows() failed\n" ));
+        this->dataArena->releaseWindows();
+        return kIOReturnNoMemory;
+    }
+    
+    IOReturn  RC = userClient.registerUserClient( client );
+    if( kIOReturnSuccess != RC )
+        this->dataArena->releaseWindows();
+    
+    return RC;
 }
 
 //--------------------------------------------------------------------
 
 IOReturn NkeSocketFilter::unregisterUserClient( __in NkeIOUserClient* client )
 {
-    return userClient.unregisterUserClient( client );
+    IOReturn  RC = userClient.unregisterUserClient( client );
+    
+    //
+    // the windows with the slices of the pending data are removed after the data has been delivered
+    //
+    if( kIOReturnSuccess == RC )
+        this->dataArena->releaseWindows();
+    
+    return RC;
 }
 
 //--------------------------------------------------------------------
@@ -1060,192 +1155,140 @@ void NkeSocketFilter::releaseUserClient()
 
 //--------------------------------------------------------------------
 
-IOMemoryDescriptor* NkeSocketFilter::getSocketBufferMemoryDescriptor( __in UInt32 index )
+IOMemoryDescriptor* NkeSocketFilter::getDataArenaMemoryDescriptor()
 {
-    assert( index < kt_NkeSocketBuffersNumber );
-    
-    if( index >= this->dataBuffers->getCount() )
-        return NULL;
-    
-    NkeDataBuffer*  dataBuffer;
-    
-    dataBuffer = OSDynamicCast( NkeDataBuffer, this->dataBuffers->getObject( index ) );
-    assert( dataBuffer );
-    
-    return dataBuffer->getMemoryDescriptor();
+    return this->dataArena->getArenaMemoryDescriptor();
 }
 
 //--------------------------------------------------------------------
 
 //
-// returns a referenced buffer object or NULL,
-// a caller must release the object
+// a caller must eventually release all slices by calling releaseDataSlices(),
+// this function might be called with a held socket lock
 //
-NkeDataBuffer* NkeSocketFilter::acquireSocketDataBufferForIO()
+errno_t
+NkeSocketFilter::copyDataToSlices(
+    __in const mbuf_t* mbufs,
+    __in UInt32 mbufsNumber,
+    __in size_t bytesToCopy,
+    __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
+    )
 {
-    //
-    // get a first free index
-    //
-    UInt8  freeIndex;
+    errno_t   error = KERN_SUCCESS;
+    size_t    totalbytes = 0x0;
+    int       i = 0x0;
     
-    //
-    // we do not suffer from ABA problem here as an array is used
-    //
-    do{
-        
-        freeIndex = this->freeBuffersHead;
-        assert( UINT8_MAX == freeIndex || freeIndex < NKE_STATIC_ARRAY_SIZE( this->freeBuffers ) );
-        
-    } while( UINT8_MAX != freeIndex && (! OSCompareAndSwap( freeIndex, this->freeBuffers[ freeIndex ], &this->freeBuffersHead )) );
+    slices[ 0 ].length = 0x0;
     
-    if( UINT8_MAX == freeIndex ){
+    for( UInt32 m = 0x0; m < mbufsNumber; ++m ){
         
-        //
-        // there are no free buffers left
-        //
-        return NULL;
-    }
+        if( mbufs[ m ] )
+            totalbytes += mbuf_pkthdr_len( mbufs[ m ] );
+    } // end for
     
     //
-    // mark as removed from the list
+    // only the data start is copied if the data is truncated
     //
-    this->freeBuffers[ freeIndex ] = UINT8_MAX;
-    
-    NkeDataBuffer*  dataBuffer;
-    
-    dataBuffer = OSDynamicCast( NkeDataBuffer, this->dataBuffers->getObject( freeIndex ) );
-    assert( dataBuffer );
-    
-    dataBuffer->retain();
-    
-#if DBG
-    assert( dataBuffer->acquireForIO() );
-#endif
-    
-    return dataBuffer;
-}
-
-//--------------------------------------------------------------------
-
-//
-// releases the buffer from IO thus allow it acquiring for another IO,
-// a caller must use the index returned by buffer's getIndex() method
-//
-void NkeSocketFilter::releaseSocketDataBufferFromIO( __in UInt32 index )
-{
-#if DBG
-    UInt8 nextFreeBuffer = this->freeBuffers[ index ];
-    assert( index < kt_NkeSocketBuffersNumber && UINT8_MAX == nextFreeBuffer );
-#endif
-    
-    if( index >= kt_NkeSocketBuffersNumber || UINT8_MAX != this->freeBuffers[ index ] ){
-        
-        //
-        // actually this is an error, an attempt to free an already freed buffer,
-        // but as the data comes from a user mode application we want some protection
-        //
-        DBG_PRINT_ERROR(("the index %d is out of range or an attempt to free an already freed network data buffer\n", (int)index));
-        return;
-    }
-    
-#if DBG
-    NkeDataBuffer*  dataBuffer;
-    
-    dataBuffer = OSDynamicCast( NkeDataBuffer, this->dataBuffers->getObject( index ) );
-    assert( dataBuffer );
-    dataBuffer->releaseFromIO();
-#endif
+    if( totalbytes > bytesToCopy )
+        totalbytes = bytesToCopy;
     
     //
-    // we do not suffer from ABA problem here as an array is used
+    // if there is no data then nothing to do
     //
-    do{
-        
-        this->freeBuffers[ index ] = this->freeBuffersHead;
-        
-    } while( ! OSCompareAndSwap( this->freeBuffers[ index ], index, &this->freeBuffersHead ) );
-}
-
-//--------------------------------------------------------------------
-
-//
-// a caller must eventually release all buffers by calling releaseSocketDataBufferFromIO(),
-// this function might be called with a held socket lock
-//
-errno_t
-NkeSocketFilter::copyDataToBuffers(
-    __in const mbuf_t mbuf,
-    __inout UInt8*    bufferIndices // an array bufferIndices[ kt_NkeSocketBuffersNumber ]
-    )
-{
-    assert( preemption_enabled() );
-    
-    bufferIndices[ 0 ] = UINT8_MAX;
+    if( 0x0 == totalbytes )
+        return KERN_SUCCESS;
     
     //
-    // if there is no mbuf then nothing to do
+    // allocate the slices for all data before copying, the data is split between slices
+    // if there is no free range of the data size
     //
-    if( ! mbuf )
-        return KERN_SUCCESS;
-    
-    errno_t  error = KERN_SUCCESS;
-    size_t   totalbytes = mbuf_pkthdr_len( mbuf );
-    size_t   residual = totalbytes;
-    size_t   offsetInMbuf = 0x0;
-    int      i = 0x0;
+    size_t    residual = totalbytes;
     
     while( 0x0 != residual ){
         
-        assert( i < kt_NkeSocketBuffersNumber );
-        
-        //
-        // write the data into the communication buffers and then notify the protocol dissectors and CAWL
-        //
-        NkeDataBuffer*  buffer = this->acquireSocketDataBufferForIO();
-        if( ! buffer ){
+        if( i == kt_NkeSocketDataSlicesNumber ){
             
             error = ENOMEM;
             break;
         }
         
-        size_t bytesCopied;
-        
-        error = buffer->copyDataMbuf( 0x0, residual, offsetInMbuf, mbuf, &bytesCopied );
-        assert( 0x0 == error );
-        if( error ){
+        if( ! this->dataArena->allocateSlice( (UInt32)residual, &slices[ i ] ) ){
             
-            DBG_PRINT_ERROR(( "copyDataMbuf returned an error = %d\n", error ));
-            this->releaseSocketDataBufferFromIO( buffer->getIndex() );
-            buffer->release();
+            error = ENOMEM;
             break;
         }
         
-        assert( residual >= bytesCopied );
-        offsetInMbuf = offsetInMbuf + bytesCopied;
-        residual = residual - bytesCopied;
-        
-        bufferIndices[ i ] = buffer->getIndex();
+        assert( slices[ i ].length <= residual );
+        residual -= slices[ i ].length;
         i += 0x1;
         
-        buffer->release();
-        
     } // end while( 0x0 != residual )
     
     //
     // set a terminator, if the entire array has been used the terminator is not required
     //
-    if( i < kt_NkeSocketBuffersNumber )
-        bufferIndices[ i ] = UINT8_MAX;
+    if( i < kt_NkeSocketDataSlicesNumber )
+        slices[ i ].length = 0x0;
+    
+    //
+    // write the data into the slices and then notify the protocol dissectors and CAWL
+    //
+    int       slice = 0x0;
+    size_t    offsetInSlice = 0x0;
+    
+    residual = totalbytes;
+    
+    for( UInt32 m = 0x0; m < mbufsNumber && 0x0 != residual && KERN_SUCCESS == error; ++m ){
+        
+        if( ! mbufs[ m ] )
+            continue;
+        
+        size_t   mbufResidual = mbuf_pkthdr_len( mbufs[ m ] );
+        size_t   offsetInMbuf = 0x0;
+        
+        if( mbufResidual > residual )
+            mbufResidual = residual;
+        
+        residual -= mbufResidual;
+        
+        while( 0x0 != mbufResidual ){
+            
+            assert( slice < i );
+            
+            if( offsetInSlice == slices[ slice ].length ){
+                
+                slice += 0x1;
+                offsetInSlice = 0x0;
+                continue;
+            }
+            
+            size_t bytesCopied;
+            
+            error = this->dataArena->copyDataMbuf( &slices[ slice ], offsetInSlice, mbufResidual, offsetInMbuf, mbufs[ m ], &bytesCopied );
+            assert( 0x0 == error );
+            if( error ){
+                
+                DBG_PRINT_ERROR(( "copyDataMbuf returned an error = %d\n", error ));
+                break;
+            }
+            
+            assert( mbufResidual >= bytesCopied );
+            offsetInMbuf = offsetInMbuf + bytesCopied;
+            offsetInSlice = offsetInSlice + bytesCopied;
+            mbufResidual = mbufResidual - bytesCopied;
+            
+        } // end while( 0x0 != mbufResidual )
+    } // end for
     
     if( error ){
         
         //
-        // in case of error release all acquired communication buffers,
-        // releaseDataBuffersAndDeliverNotifications() can't be called here as it calls
+        // in case of error release all allocated slices,
+        // releaseDataSlicesAndDeliverNotifications() can't be called here as it calls
         // calls NkeSocketObject::DeliverWaitingNotifications() that
         // might try to acquire a socket lock held by a caller
         //
-        this->releaseDataBuffers( bufferIndices );
+        this->releaseDataSlices( slices );
         
     } // end if( error )
     
@@ -1255,36 +1298,127 @@ NkeSocketFilter::copyDataToBuffers(
 //--------------------------------------------------------------------
 
 void
-NkeSocketFilter::releaseDataBuffers(
-    __inout UInt8*    bufferIndices // an array bufferIndices[ kt_NkeSocketBuffersNumber ]
+NkeSocketFilter::releaseDataSlices(
+    __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
     )
 {
-    for( int i = 0x0; i < kt_NkeSocketBuffersNumber; ++i ){
+    for( int i = 0x0; i < kt_NkeSocketDataSlicesNumber; ++i ){
         
         //
         // check for the terminating value
         //
-        if( UINT8_MAX == bufferIndices[ i ] )
+        if( 0x0 == slices[ i ].length )
             break;
         
-        this->releaseSocketDataBufferFromIO( bufferIndices[ i ] );
+        //
+        // the slices might come from a user mode application, a wrong slice is rejected by the arena
+        //
+        this->dataArena->releaseSlice( &slices[ i ] );
     } // end for
+    
+    slices[ 0 ].length = 0x0;
 }
 
 //--------------------------------------------------------------------
 
 void
-NkeSocketFilter::releaseDataBuffersAndDeliverNotifications(
-    __inout UInt8*    bufferIndices // an array bufferIndices[ kt_NkeSocketBuffersNumber ]
+NkeSocketFilter::releaseDataSlicesAndDeliverNotifications(
+    __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
     )
 {
-    this->releaseDataBuffers( bufferIndices );
+    this->releaseDataSlices( slices );
     
     NkeSocketObject::DeliverWaitingNotifications();
 }
 
 //--------------------------------------------------------------------
 
+bool
+NkeSocketFilter::allocateStreamRing(
+    __in UInt32 size,
+    __out NkeDataSlice* ring
+    )
+{
+    if( size > this->dataArena->getWindowSize() )
+        size = this->dataArena->getWindowSize();
+    
+    return this->dataArena->allocatePinnedSlice( size, ring );
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketFilter::releaseStreamRing(
+    __inout NkeDataSlice* ring
+    )
+{
+    assert( 0x0 != ring->length );
+    
+    this->dataArena->releasePinnedSlice( ring );
+    ring->length = 0x0;
+}
+
+//--------------------------------------------------------------------
+
+//
+// this function is called with a held socket lock
+//
+errno_t
+NkeSocketFilter::copyDataToStreamRing(
+    __in const NkeDataSlice* ring,
+    __in UInt32 ringOffset,
+    __in const mbuf_t* mbufs,
+    __in UInt32 mbufsNumber,
+    __in size_t bytesToCopy
+    )
+{
+    errno_t   error = KERN_SUCCESS;
+    size_t    residual = bytesToCopy;
+    size_t    offsetInRing = ringOffset;
+    
+    assert( bytesToCopy <= ring->length && ringOffset < ring->length );
+    
+    for( UInt32 m = 0x0; m < mbufsNumber && 0x0 != residual && KERN_SUCCESS == error; ++m ){
+        
+        if( ! mbufs[ m ] )
+            continue;
+        
+        size_t   mbufResidual = mbuf_pkthdr_len( mbufs[ m ] );
+        size_t   offsetInMbuf = 0x0;
+        
+        if( mbufResidual > residual )
+            mbufResidual = residual;
+        
+        residual -= mbufResidual;
+        
+        while( 0x0 != mbufResidual ){
+            
+            if( offsetInRing == ring->length )
+                offsetInRing = 0x0;
+            
+            size_t bytesCopied;
+            
+            error = this->dataArena->copyDataMbuf( ring, offsetInRing, mbufResidual, offsetInMbuf, mbufs[ m ], &bytesCopied );
+            assert( 0x0 == error );
+            if( error ){
+                
+                DBG_PRINT_ERROR(( "copyDataMbuf returned an error = %d\n", error ));
+                break;
+            }
+            
+            assert( mbufResidual >= bytesCopied );
+            offsetInMbuf = offsetInMbuf + bytesCopied;
+            offsetInRing = offsetInRing + bytesCopied;
+            mbufResidual = mbufResidual - bytesCopied;
+            
+        } // end while( 0x0 != mbufResidual )
+    } // end for
+    
+    return error;
+}
+
+//--------------------------------------------------------------------
+
 IOReturn
 NkeSocketFilter::processServiceResponse(
     __in  NkeSocketFilterServiceResponse* response
@@ -1293,10 +1427,12 @@ NkeSocketFilter::processServiceResponse(
     assert( preemption_enabled() );
     
     //
-    // at first release buffers
+    // at first release slices
     //
-    assert( NKE_STATIC_ARRAY_SIZE( response->buffersToRelease ) == kt_NkeSocketBuffersNumber );
-    gSocketFilter->releaseDataBuffersAndDeliverNotifications( response->buffersToRelease );
+    assert( NKE_STATIC_ARRAY_SIZE( response->slicesToRelease ) == kt_NkeSocketDataSlicesNumber );
+    gSocketFilter->releaseDataSlicesAndDeliverNotifications( response->slicesToRelease );
+    
+    bool  streamConsumed = false;
     
     //
     // process deferred data properties, there might be no any property as a request can only release buffers
@@ -1308,29 +1444,237 @@ NkeSocketFilter::processServiceResponse(
         if( NkeSocketDataPropertyTypeUnknown == property->type )
             break;
         
-        assert( 0x0 != property->socketId.socketSequence );
+        assert( 0x0 != property->socketId.generation );
         
         //
         // TO DO - optimize gere by remebering the last found object and deferring reinjection
         // untill the object changes
         //
-        NkeSocketObject* soObj = NkeSocketObject::GetSocketObjectRef( (socket_t)property->socketId.socket );
+        
+        //
+        // the slot generation check rejects requests for a closed socket even if the slot has been reused
+        //
+        NkeSocketObject* soObj = NkeSocketObject::GetSocketObjectRefById( &property->socketId );
         if( soObj ){
             
-            //
-            // check that the request is not for a closed socket, i.e. a socket structure has been reused
-            //
-            if( soObj->getSocketSequence() == property->socketId.socketSequence ){
-                
-                soObj->setDeferredDataProperties( property );
-                soObj->reinjectDeferredData( NkeSocketObject::NkeSocketDataAll );
-            }
+            soObj->setDeferredDataProperties( property );
+            soObj->reinjectDeferredData( NkeSocketObject::NkeSocketDataAll );
+            
             soObj->release();
             NKE_DBG_MAKE_POINTER_INVALID( soObj );
         }
+        
+        if( NkeSocketDataPropertyTypeStreamConsumed == property->type )
+            streamConsumed = true;
+        
     } // end for
     
+    //
+    // the data waiting for the stream rings space can be reported now
+    //
+    if( streamConsumed )
+        NkeSocketObject::DeliverWaitingNotifications();
+    
     return kIOReturnSuccess;
 }    
 //--------------------------------------------------------------------
 
+void
+NkeSocketFilter::getStatistics( __out NkeFilterStatistics* statistics )
+{
+    bzero( statistics, sizeof( *statistics ) );
+    
+    NkeSocketObject::GetStatistics( statistics );
+    NkeIOUserClient::GetStatistics( statistics );
+    
+    statistics->dataArenaBytesInUse = this->dataArena->getBytesInUse();
+    statistics->dataArenaBytesHighWaterMark = this->dataArena->getBytesHighWaterMark();
+    statistics->dataArenaAllocationFailures = this->dataArena->getAllocationFailures();
+    statistics->dataArenaExhaustionEvents = this->dataArena->getExhaustionEvents();
+    statistics->dataArenaBuffersAdded = this->dataArena->getWindowsAdded();
+    statistics->dataArenaBuffersRemoved = this->dataArena->getWindowsRemoved();
+    statistics->dataArenaActiveBuffers = this->dataArena->getActiveWindowsNumber();
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketFilterNotification*
+NkeSocketFilter::ReserveSocketNotification(
+    __in NkeIOUserClient* userClient,
+    __in NkeSocketObject* socketObject,
+    __in NkeSocketFilterEvent event,
+    __in UInt32 slicesNumber,
+    __out NkeSocketFilterReservation* reservation
+    )
+{
+    NkeSocketID                   socketId;
+    NkeSocketFilterNotification*  notification;
+    
+    socketObject->getSocketId( &socketId );
+    
+    notification = userClient->reserveSocketFilterNotification( event, &socketId, slicesNumber, reservation );
+    if( ! notification )
+        return NULL;
+    
+    notification->flags.separated.notificationForDisconnectedSocket = ( socketObject->isDisconnected() ) ? 0x1 : 0x0;
+    if( NkeSocketFilterEventDataIn == event || NkeSocketFilterEventDataOut == event )
+        notification->eventData.inputoutput.packetsNumber = 0x1;
+    
+    return notification;
+}
+
+//--------------------------------------------------------------------
+
+bool
+NkeSocketFilter::DataArenaResized(
+    __in UInt32 windowIndex,
+    __in bool active,
+    __in UInt32 activeWindowsNumber,
+    __in void* context
+    )
+{
+    NkeSocketFilter*             filter = (NkeSocketFilter*)context;
+    NkeSocketFilterNotification  notification;
+    
+    bzero( &notification, sizeof( notification ) );
+    notification.size = sizeof( notification );
+    notification.event = NkeSocketFilterEventDataArenaResized;
+    notification.eventData.arenaResized.bufferIndex = windowIndex;
+    notification.eventData.arenaResized.bufferActive = active ? 0x1 : 0x0;
+    notification.eventData.arenaResized.activeBuffersNumber = activeWindowsNumber;
+    
+    //
+    // a failed report is not repeated with the same generation so a queue that received
+    // the failed report never takes a later change for the one it has already seen
+    //
+    filter->dataArenaGeneration += 0x1;
+    notification.eventData.arenaResized.generation = filter->dataArenaGeneration;
+    
+    NkeIOUserClient* userClient = filter->getUserClient();
+    if( ! userClient ){
+        
+        //
+        // a client maps the buffers after it has connected so there is nothing to remap
+        //
+        return true;
+    }
+    
+    IOReturn  error = userClient->socketFilterNotification( &notification );
+    filter->releaseUserClient();
+    NKE_DBG_MAKE_POINTER_INVALID( userClient );
+    
+    //
+    // a buffer is not added if the client might not know about it
+    //
+    return ( kIOReturnSuccess == error );
+}
+
+//--------------------------------------------------------------------
+
+bool
+NkeSocketFilter::IsCapturePolicyValid( __in NkeCapturePolicy* policy )
+{
+    if( 0x0 == policy->verdictTimeout )
+        return false;
+    
+    if( policy->coalescingMaxBytes > kt_NkeCoalescingMaxBytes )
+        return false;
+    
+    if( policy->inspectionPrefixBytes > kt_NkeInspectionPrefixMaxBytes )
+        return false;
+    
+    if( 0x0 != policy->streamRingBytes &&
+        ( policy->streamRingBytes < kt_NkeStreamRingMinBytes || policy->streamRingBytes > kt_NkeSocketBufferSizeMax ) )
+        return false;
+    
+    //
+    // a window without a time limit would hold the last packets of a transfer until the verdict timeout
+    //
+    if( 0x0 != policy->coalescingMaxBytes && 0x0 == policy->coalescingMaxMicroseconds )
+        return false;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+IOReturn
+NkeSocketFilter::setCapturePolicies( __in NkeCapturePolicies* policies )
+{
+    if( policies->count > kt_NkeCapturePoliciesNumber ){
+        
+        DBG_PRINT_ERROR(("policies->count is %u\n", (unsigned int)policies->count));
+        return kIOReturnBadArgument;
+    }
+    
+    if( ! NkeSocketFilter::IsCapturePolicyValid( &policies->defaultPolicy ) ){
+        
+        DBG_PRINT_ERROR(("the default policy is invalid\n"));
+        return kIOReturnBadArgument;
+    }
+    
+    for( UInt32 i = 0x0; i < policies->count; ++i ){
+        
+        if( ! NkeSocketFilter::IsCapturePolicyValid( &policies->policies[ i ] ) ||
+            policies->policies[ i ].firstPort > policies->policies[ i ].lastPort ){
+            
+            DBG_PRINT_ERROR(("the policy %u is invalid\n", (unsigned int)i));
+            return kIOReturnBadArgument;
+        }
+    } // end for
+    
+    IOLockLock( this->capturePoliciesLock );
+    { // start of the lock
+        
+        this->capturePolicies = *policies;
+        
+        //
+        // skip 0x0 on the wrap around as this is an unresolved policy for a socket
+        //
+        this->capturePoliciesGeneration += 0x1;
+        if( 0x0 == this->capturePoliciesGeneration )
+            this->capturePoliciesGeneration = 0x1;
+        
+    } // end of the lock
+    IOLockUnlock( this->capturePoliciesLock );
+    
+    return kIOReturnSuccess;
+}
+
+//--------------------------------------------------------------------
+
+UInt32
+NkeSocketFilter::getCapturePolicy(
+    __in UInt16 localPort,
+    __in UInt16 remotePort,
+    __out NkeCapturePolicy* policy
+    )
+{
+    UInt32  generation;
+    
+    IOLockLock( this->capturePoliciesLock );
+    { // start of the lock
+        
+        *policy = this->capturePolicies.defaultPolicy;
+        
+        for( UInt32 i = 0x0; i < this->capturePolicies.count; ++i ){
+            
+            NkeCapturePolicy*  current = &this->capturePolicies.policies[ i ];
+            
+            if( ( 0x0 != localPort && localPort >= current->firstPort && localPort <= current->lastPort ) ||
+                ( 0x0 != remotePort && remotePort >= current->firstPort && remotePort <= current->lastPort ) ){
+                
+                *policy = *current;
+                break;
+            }
+        } // end for
+        
+        generation = this->capturePoliciesGeneration;
+        
+    } // end of the lock
+    IOLockUnlock( this->capturePoliciesLock );
+    
+    return generation;
+}
+
+//--------------------------------------------------------------------
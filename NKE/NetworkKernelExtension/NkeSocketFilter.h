@@ -29,7 +29,23 @@
 
 #include "NkeCommon.h"
 #include "NkeIOUserClient.h"
-#include "NkeDataBuffer.h"
+#include "NkeDataArena.h"
+
+class NkeSocketObject;
+
+//
+// the verdict timeouts in milliseconds for the built-in capture policies, the interactive
+// ports get a short timeout and the data is let through on the timeout to keep the latency low
+//
+#define NKE_DEFAULT_VERDICT_TIMEOUT        60000
+#define NKE_INTERACTIVE_VERDICT_TIMEOUT    200
+
+//
+// the default coalescing window, a bulk transfer is reported by one data buffer chunks,
+// the interactive ports are not coalesced
+//
+#define NKE_DEFAULT_COALESCING_BYTES           0x10000
+#define NKE_DEFAULT_COALESCING_MICROSECONDS    10000
 
 class NkeSocketFilter: public OSObject{
     
@@ -57,23 +73,35 @@ private:
     NkeIOUserClientRef userClient;
     
     //
-    // an array of NkeDataBuffer objects that are used for passing data to protocol dissectors and CAWL
+    // a memory shared with the client that is used for passing data to protocol dissectors and CAWL,
+    // the data is placed in slices that are allocated for the size of the data
     //
-    OSArray*  dataBuffers;
+    NkeDataArena*  dataArena;
     
     //
-    // an array that is used to create a free buffers list, UINT8_MAX means the end of the list,
-    // the interlocked functions can't be used with this array as the array antry is 8 bit value while
-    // all interlocked functions require 32 or 64 bit value
+    // the number of the data arena changes reported to the client, the resize callbacks
+    // are serialized by the arena so the counter is changed without a lock
     //
-    UInt8    freeBuffers[ kt_NkeSocketBuffersNumber ];
+    UInt32         dataArenaGeneration;
     
     //
-    // an index of the first free buffer in the freeBuffers array, UINT_MAX is an empty list,
-    // it is important to note that this value must be of 32 bit size as it is used by interlocked
-    // functions that accept a pointer to 32 bit value
+    // the capture policies set by the client, protected by capturePoliciesLock, the generation
+    // is changed on each update so a socket's cached policy can be validated without the lock
     //
-    UInt32    freeBuffersHead;
+    IOLock*             capturePoliciesLock;
+    NkeCapturePolicies  capturePolicies;
+    volatile UInt32     capturePoliciesGeneration;
+    
+    void setDefaultCapturePolicies();
+    static bool IsCapturePolicyValid( __in NkeCapturePolicy* policy );
+    
+    //
+    // the data arena's resize callback, notifies the client
+    //
+    static bool DataArenaResized( __in UInt32 windowIndex,
+                                  __in bool active,
+                                  __in UInt32 activeWindowsNumber,
+                                  __in void* context );
     
 public:
     
@@ -149,6 +177,12 @@ protected:
     static void	
     FltDetach(void *cookie, socket_t so);
     
+    //
+    // detaches the object created on the stub promotion
+    //
+    static void
+    DetachSocketObject( __in NkeSocketObject* soObj );
+    
     /*
         @typedef FltNotify
      
@@ -360,7 +394,7 @@ public:
     virtual errno_t startFilter();
     virtual errno_t stopFilter();
     
-    static NkeSocketFilter* withDefault();
+    static NkeSocketFilter* withDefault( __in UInt32 dataBufferSize, __in UInt32 dataBuffersNumber, __in UInt32 dataBuffersNumberMax );
     static errno_t InitSocketFilterSubsystem();
     
     virtual bool isUserClientPresent();
@@ -368,54 +402,93 @@ public:
     virtual IOReturn unregisterUserClient( __in NkeIOUserClient* client );
     
     //
-    // returns a referenced object or NULL
+    // returns a referenced descriptor of the whole data arena or NULL
     //
-    virtual IOMemoryDescriptor* getSocketBufferMemoryDescriptor( __in UInt32 index );
+    virtual IOMemoryDescriptor* getDataArenaMemoryDescriptor();
+    
+    void getDataArenaGeometry( __out UInt32* bufferSize, __out UInt32* buffersNumber )
+    {
+        *bufferSize = this->dataArena->getWindowSize();
+        *buffersNumber = this->dataArena->getWindowsNumber();
+    }
     
     //
-    // returns a referenced buffer object or NULL,
-    // a caller must release the object
+    // a caller must eventually release all slices by calling releaseDataSlices()
     //
-    virtual NkeDataBuffer* acquireSocketDataBufferForIO();
+    errno_t copyDataToSlices( __in const mbuf_t mbuf,
+                              __in size_t bytesToCopy,
+                              __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
+                            ){ return this->copyDataToSlices( &mbuf, 0x1, bytesToCopy, slices ); }
     
     //
-    // releases the buffer from IO thus allow it acquiring for another IO,
-    // a caller must use the index returned by buffer's getIndex() method
+    // the packets' data is placed in the slices one after another, NULL entries are skipped,
+    // only the first bytesToCopy bytes of the data are copied
     //
-    virtual void releaseSocketDataBufferFromIO( __in UInt32 index );
+    errno_t copyDataToSlices( __in const mbuf_t* mbufs,
+                              __in UInt32 mbufsNumber,
+                              __in size_t bytesToCopy,
+                              __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
+                            );
     
     //
-    // a caller must eventually release all buffers by calling releaseSocketDataBufferFromIO()
+    // releases slices allocated by copyDataToSlices
     //
-    errno_t copyDataToBuffers( __in const mbuf_t mbuf,
-                               __inout UInt8*    bufferIndices // an array bufferIndices[ kt_NkeSocketBuffersNumber ]
-                             );
+    void releaseDataSlices( __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
+                          );
+    void releaseDataSlicesAndDeliverNotifications( __inout NkeDataSlice*  slices // an array slices[ kt_NkeSocketDataSlicesNumber ]
+                          );
     
     //
-    // releases buffers acquired by copyDataToBuffers
+    // a stream ring is a pinned slice of the data arena, the size is reduced to the data buffer size,
+    // false is returned if there is no free range of the size
     //
-    void releaseDataBuffers( __inout UInt8*    bufferIndices // an array bufferIndices[ kt_NkeSocketBuffersNumber ]
-                            );
-    void releaseDataBuffersAndDeliverNotifications( __inout UInt8*    bufferIndices // an array bufferIndices[ kt_NkeSocketBuffersNumber ]
-                            );
+    bool allocateStreamRing( __in UInt32 size, __out NkeDataSlice* ring );
+    void releaseStreamRing( __inout NkeDataSlice* ring );
+    
+    //
+    // copies the first bytesToCopy bytes of the packets' data in the ring starting at ringOffset,
+    // the data continues at the ring start when it reaches the ring end, a caller checks
+    // that the ring has space for the data
+    //
+    errno_t copyDataToStreamRing( __in const NkeDataSlice* ring,
+                                  __in UInt32 ringOffset,
+                                  __in const mbuf_t* mbufs,
+                                  __in UInt32 mbufsNumber,
+                                  __in size_t bytesToCopy );
     IOReturn processServiceResponse( __in NkeSocketFilterServiceResponse*  response );
     
+    //
+    // reserves a notification of the event for the socket in the client's queue and fills its header and
+    // flags, the caller fills the event data in place and commits the notification by the client's
+    // commitSocketFilterNotification(), NULL is returned if the notification can't be enqueued
+    //
+    static NkeSocketFilterNotification* ReserveSocketNotification( __in NkeIOUserClient* userClient,
+                                                                   __in NkeSocketObject* socketObject,
+                                                                   __in NkeSocketFilterEvent event,
+                                                                   __in UInt32 slicesNumber,
+                                                                   __out NkeSocketFilterReservation* reservation );
+    
+    //
+    // collects the statistics from the filter's subsystems
+    //
+    void getStatistics( __out NkeFilterStatistics* statistics );
+    
+    //
+    // replaces the capture policies, the pending packets keep the timeouts they were armed with
+    //
+    IOReturn setCapturePolicies( __in NkeCapturePolicies* policies );
+    
+    //
+    // selects a policy for the ports, a zero port is unknown and never matches, returns the generation
+    // of the policies the policy has been selected from, a valid generation is never 0x0
+    //
+    UInt32 getCapturePolicy( __in UInt16 localPort, __in UInt16 remotePort, __out NkeCapturePolicy* policy );
+    UInt32 getCapturePoliciesGeneration(){ return this->capturePoliciesGeneration; }
+    
 };
 
 extern NkeSocketFilter*     gSocketFilter;
 
 //--------------------------------------------------------------------
 
-#define  INIT_SOCKET_NOTIFICATION( _notification, _socketObj, _event ) \
-    bzero( &_notification, sizeof( _notification ) ); \
-    _notification.size = sizeof( _notification ); \
-    _notification.event = _event; \
-    _notification.flags.separated.notificationForDisconnectedSocket = ( _socketObj->isDisconnected() ) ? 0x1 : 0x0; \
-    _socketObj->getSocketId( &_notification.socketId ); \
-    if( NkeSocketFilterEventDataIn == (_event) || NkeSocketFilterEventDataOut == (_event) ){ \
-        notification.eventData.inputoutput.buffers[ 0 ] = UINT8_MAX;\
-    }
-
-//--------------------------------------------------------------------
-
 #endif // _NKESOCKETFILTER_H
\ No newline at end of file
@@ -31,10 +31,30 @@ SInt32          NkeSocketObject::SocketObjectsCounter = 0x0;
 bool            NkeSocketObject::Initialized = false;
 NkeSocketObject::NkeSocketsListHead NkeSocketObject::SocketsList;
 IORWLock*       NkeSocketObject::SocketsListLock;
+NkeSocketObject::NkeSocketsHashBucketHead NkeSocketObject::SocketsHash[ NKE_SOCKETS_HASH_SIZE ];
+NkeSocketObject::NkeRetiredSocketsListHead NkeSocketObject::RetiredSocketsList;
+IOLock*         NkeSocketObject::RetiredSocketsListLock;
+SInt32          NkeSocketObject::RetiredSocketsCount = 0x0;
+NkeSocketObject::NkeSocketSlot*  NkeSocketObject::SocketSlots[ NKE_SOCKET_SLOTS_CHUNKS ];
+UInt32          NkeSocketObject::SocketSlotsFreeHead = NKE_INVALID_SLOT_INDEX;
+UInt32          NkeSocketObject::SocketSlotsCarved = 0x0;
 NkeSocketObject::NkeSocketsListToReportHead NkeSocketObject::SocketsListToReport;
 IORWLock*       NkeSocketObject::SocketsListToReportLock;
 OSMallocTag		NkeSocketObject::gOSMallocTag;
-SInt32          NkeSocketObject::gSocketSequence = 0x1;
+NkeSocketObject::NkeSocketObjectsCache  NkeSocketObject::ObjectsCache[ NKE_PER_CPU_SLOTS ];
+volatile SInt64 NkeSocketObject::ObjectsCacheHits = 0x0;
+volatile SInt64 NkeSocketObject::ObjectsCacheMisses = 0x0;
+volatile SInt64 NkeSocketObject::QuotaInboundThrottlings = 0x0;
+volatile SInt64 NkeSocketObject::QuotaOutboundBlocks = 0x0;
+volatile SInt64 NkeSocketObject::InspectionTruncatedNotifications = 0x0;
+volatile SInt64 NkeSocketObject::InspectionBytesNotCopied = 0x0;
+NkeSlabAllocator*  NkeSocketObject::PendingPktAllocator = NULL;
+NkeTimerWheel*     NkeSocketObject::DeadlineTimerWheel = NULL;
+NkeSocketObject::NkeDeadlinedSocketsListHead NkeSocketObject::DeadlinedSocketsList;
+IOSimpleLock*      NkeSocketObject::DeadlinedSocketsListLock = NULL;
+NkeTimerWheel*     NkeSocketObject::CoalescingTimerWheel = NULL;
+NkeSocketObject::NkeExpiredWindowsSocketsListHead NkeSocketObject::ExpiredWindowsSocketsList;
+IOSimpleLock*      NkeSocketObject::ExpiredWindowsSocketsListLock = NULL;
 
 //--------------------------------------------------------------------
 
@@ -122,9 +142,81 @@ errno_t NkeSocketObject::InitSocketObjectsSubsystem()
         return ENOMEM;
     }
     
+    for( int i = 0x0; i < NKE_SOCKETS_HASH_SIZE; ++i )
+        TAILQ_INIT( &NkeSocketObject::SocketsHash[ i ] );
+    
+    TAILQ_INIT( &NkeSocketObject::RetiredSocketsList );
+    
+    for( int i = 0x0; i < NKE_PER_CPU_SLOTS; ++i ){
+        
+        NkeSocketObject::ObjectsCache[ i ].lock = IOSimpleLockAlloc();
+        assert( NkeSocketObject::ObjectsCache[ i ].lock );
+        if( ! NkeSocketObject::ObjectsCache[ i ].lock ){
+            DBG_PRINT_ERROR(("NkeSocketObject::ObjectsCache[ %d ].lock = IOSimpleLockAlloc() failed\n", i));
+            return ENOMEM;
+        }
+    } // end for
+    
+    NkeSocketObject::RetiredSocketsListLock = IOLockAlloc();
+    assert( NkeSocketObject::RetiredSocketsListLock );
+    if( ! NkeSocketObject::RetiredSocketsListLock ){
+        DBG_PRINT_ERROR(("NkeSocketObject::RetiredSocketsListLock = IOLockAlloc() failed\n"));
+        return ENOMEM;
+    }
+    
+    NkeSocketObject::PendingPktAllocator = NkeSlabAllocator::withElementSize( sizeof( PendingPktQueueItem ) );
+    assert( NkeSocketObject::PendingPktAllocator );
+    if( ! NkeSocketObject::PendingPktAllocator ){
+        DBG_PRINT_ERROR(("NkeSlabAllocator::withElementSize() failed\n"));
+        return ENOMEM;
+    }
+    
+    TAILQ_INIT( &NkeSocketObject::DeadlinedSocketsList );
+    
+    NkeSocketObject::DeadlinedSocketsListLock = IOSimpleLockAlloc();
+    assert( NkeSocketObject::DeadlinedSocketsListLock );
+    if( ! NkeSocketObject::DeadlinedSocketsListLock ){
+        DBG_PRINT_ERROR(("NkeSocketObject::DeadlinedSocketsListLock = IOSimpleLockAlloc() failed\n"));
+        return ENOMEM;
+    }
+    
+    TAILQ_INIT( &NkeSocketObject::ExpiredWindowsSocketsList );
+    
+    NkeSocketObject::ExpiredWindowsSocketsListLock = IOSimpleLockAlloc();
+    assert( NkeSocketObject::ExpiredWindowsSocketsListLock );
+    if( ! NkeSocketObject::ExpiredWindowsSocketsListLock ){
+        DBG_PRINT_ERROR(("NkeSocketObject::ExpiredWindowsSocketsListLock = IOSimpleLockAlloc() failed\n"));
+        return ENOMEM;
+    }
+    
+    NkeSocketObject::DeadlineTimerWheel = NkeTimerWheel::withCallbacks( NkeSocketObject::DeadlineTimerExpired,
+                                                                        NkeSocketObject::ProcessDeadlinedSockets,
+                                                                        NULL );
+    assert( NkeSocketObject::DeadlineTimerWheel );
+    if( ! NkeSocketObject::DeadlineTimerWheel ){
+        DBG_PRINT_ERROR(("NkeTimerWheel::withCallbacks() failed\n"));
+        return ENOMEM;
+    }
+    
+    NkeSocketObject::CoalescingTimerWheel = NkeTimerWheel::withCallbacks( NkeSocketObject::CoalescingTimerExpired,
+                                                                          NkeSocketObject::CoalescingWindowsExpired,
+                                                                          NULL );
+    assert( NkeSocketObject::CoalescingTimerWheel );
+    if( ! NkeSocketObject::CoalescingTimerWheel ){
+        DBG_PRINT_ERROR(("NkeTimerWheel::withCallbacks() failed\n"));
+        return ENOMEM;
+    }
+    
     errno_t    error;
     thread_t   thread;
     
+    error = NkeEpoch::InitEpochSubsystem();
+    assert( KERN_SUCCESS == error );
+    if( KERN_SUCCESS != error ){
+        DBG_PRINT_ERROR(("NkeEpoch::InitEpochSubsystem() failed with an error %d\n", error));
+        return error;
+    }
+    
     error = kernel_thread_start ( ( thread_continue_t ) &NkeSocketObject::InjectionThreadRoutine,
                                   NULL,
                                   &thread );
@@ -217,12 +309,12 @@ NkeSocketObject::InjectionThreadRoutine( void* context )
             assert( sizeof( notification ) == dataSize );
             
             //
-            // release buffers
+            // release slices
             //
             
             if( NkeSocketFilterEventDataIn == notification.event || NkeSocketFilterEventDataOut == notification.event ){
                 
-                gSocketFilter->releaseDataBuffersAndDeliverNotifications( notification.eventData.inputoutput.buffers );
+                gSocketFilter->releaseDataSlicesAndDeliverNotifications( notification.eventData.inputoutput.slices );
             }
             
             dataSize = sizeof( notification );
@@ -231,16 +323,22 @@ NkeSocketObject::InjectionThreadRoutine( void* context )
         
 #endif // _NKE_SOCKET_FILTER_USER_EMULATION
         
-        IORWLockRead( NkeSocketObject::SocketsListLock );
-        { // start of the lock
+        UInt32  epochToken = NkeEpoch::EnterReadSection();
+        { // start of the read section
             
             NkeSocketObject*  sockObj;
             
+            //
+            // the list is traversed without the lock, an object removed concurrently
+            // is not released until the read section is exited so it can be retained
+            //
             TAILQ_FOREACH( sockObj, &NkeSocketObject::SocketsList, socketListEntry)
             {
-                assert( sockObj->flags.insertedInSocketsList );
+                if( 0x0 == sockObj->flags.insertedInSocketsList )
+                    continue;
                 
-                if( TAILQ_EMPTY( &sockObj->pendingQueue ) )
+                if( TAILQ_EMPTY( &sockObj->pendingQueues[ NKE_PENDING_QUEUE_INBOUND ] ) &&
+                    TAILQ_EMPTY( &sockObj->pendingQueues[ NKE_PENDING_QUEUE_OUTBOUND ] ) )
                     continue;
                 
                 //
@@ -253,11 +351,8 @@ NkeSocketObject::InjectionThreadRoutine( void* context )
                 
             } // end TAILQ_FOREACH
             
-            if( sockObj )
-                sockObj->retain();
-            
-        } // end of the lock
-        IORWLockUnlock( NkeSocketObject::SocketsListLock );
+        } // end of the read section
+        NkeEpoch::ExitReadSection( epochToken );
         
         while( ! TAILQ_EMPTY( &localSocketsList ) ){
             
@@ -287,12 +382,16 @@ NkeSocketObject::InjectionThreadRoutine( void* context )
         } // end while
         
         //
-        // sleep with a timeout
+        // release the objects removed from the sockets list after a grace period
+        //
+        NkeSocketObject::ReleaseRetiredObjects();
+        
+        //
+        // sleep with a timeout, the thread is woken up earlier if there are too many retired objects
         //
         struct timespec ts = { 1, 0 };       // one second
-        int    dummyEvent;
         
-        (void)msleep( &dummyEvent,                  // wait channel
+        (void)msleep( &NkeSocketObject::RetiredSocketsCount, // wait channel
                       NULL,                          // mutex
                       PUSER,                         // priority
                       "NkeSocketObject::InjectionThreadRoutine()", // wait message
@@ -316,6 +415,59 @@ NkeSocketObject::InjectionThreadRoutine( void* context )
 
 void NkeSocketObject::RemoveSocketObjectsSubsystem()
 {
+    //
+    // stop the timers first as the objects with armed coalescing timers and the deadlined objects are referenced
+    //
+    if( NkeSocketObject::CoalescingTimerWheel ){
+        
+        NkeSocketObject::CoalescingTimerWheel->stop();
+        NkeSocketObject::CoalescingTimerWheel->release();
+        NkeSocketObject::CoalescingTimerWheel = NULL;
+    }
+    
+    if( NkeSocketObject::DeadlineTimerWheel ){
+        
+        NkeSocketObject::DeadlineTimerWheel->stop();
+        NkeSocketObject::DeadlineTimerWheel->release();
+        NkeSocketObject::DeadlineTimerWheel = NULL;
+    }
+    
+    if( NkeSocketObject::DeadlinedSocketsListLock ){
+        
+        while( ! TAILQ_EMPTY( &NkeSocketObject::DeadlinedSocketsList ) ){
+            
+            NkeSocketObject*  sockObj = TAILQ_FIRST( &NkeSocketObject::DeadlinedSocketsList );
+            
+            TAILQ_REMOVE( &NkeSocketObject::DeadlinedSocketsList, sockObj, deadlinedSocketsListEntry );
+            sockObj->insertedInDeadlinedSocketsList = false;
+            sockObj->release();
+        } // end while
+        
+        IOSimpleLockFree( NkeSocketObject::DeadlinedSocketsListLock );
+        NkeSocketObject::DeadlinedSocketsListLock = NULL;
+    }
+    
+    if( NkeSocketObject::ExpiredWindowsSocketsListLock ){
+        
+        while( ! TAILQ_EMPTY( &NkeSocketObject::ExpiredWindowsSocketsList ) ){
+            
+            NkeSocketObject*  sockObj = TAILQ_FIRST( &NkeSocketObject::ExpiredWindowsSocketsList );
+            
+            TAILQ_REMOVE( &NkeSocketObject::ExpiredWindowsSocketsList, sockObj, expiredWindowsSocketsListEntry );
+            sockObj->insertedInExpiredWindowsSocketsList = false;
+            sockObj->release();
+        } // end while
+        
+        IOSimpleLockFree( NkeSocketObject::ExpiredWindowsSocketsListLock );
+        NkeSocketObject::ExpiredWindowsSocketsListLock = NULL;
+    }
+    
+    //
+    // the retired objects are counted in SocketObjectsCounter
+    //
+    if( NkeSocketObject::RetiredSocketsListLock )
+        NkeSocketObject::ReleaseRetiredObjects();
+    
     assert( 0x0 == NkeSocketObject::SocketObjectsCounter );
     
     if( NkeSocketObject::SocketsListLock ){
@@ -330,6 +482,45 @@ void NkeSocketObject::RemoveSocketObjectsSubsystem()
         NkeSocketObject::SocketsListToReportLock = NULL;
     }
     
+    if( NkeSocketObject::RetiredSocketsListLock ){
+        
+        assert( TAILQ_EMPTY( &NkeSocketObject::RetiredSocketsList ) );
+        
+        IOLockFree( NkeSocketObject::RetiredSocketsListLock );
+        NkeSocketObject::RetiredSocketsListLock = NULL;
+    }
+    
+    NkeEpoch::RemoveEpochSubsystem();
+    
+    NkeSocketObject::PurgeObjectsCache();
+    
+    if( NkeSocketObject::PendingPktAllocator ){
+        
+        NkeSocketObject::PendingPktAllocator->release();
+        NkeSocketObject::PendingPktAllocator = NULL;
+    }
+    
+    for( int i = 0x0; i < NKE_PER_CPU_SLOTS; ++i ){
+        
+        if( NkeSocketObject::ObjectsCache[ i ].lock ){
+            
+            IOSimpleLockFree( NkeSocketObject::ObjectsCache[ i ].lock );
+            NkeSocketObject::ObjectsCache[ i ].lock = NULL;
+        }
+    } // end for
+    
+    for( int i = 0x0; i < NKE_SOCKET_SLOTS_CHUNKS; ++i ){
+        
+        if( NkeSocketObject::SocketSlots[ i ] ){
+            
+            IOFree( NkeSocketObject::SocketSlots[ i ], sizeof( NkeSocketSlot ) * NKE_SOCKET_SLOTS_PER_CHUNK );
+            NkeSocketObject::SocketSlots[ i ] = NULL;
+        }
+    } // end for
+    
+    NkeSocketObject::SocketSlotsFreeHead = NKE_INVALID_SLOT_INDEX;
+    NkeSocketObject::SocketSlotsCarved = 0x0;
+    
     if (gOSMallocTag)
     {
         OSMalloc_Tagfree(gOSMallocTag);
@@ -343,8 +534,11 @@ bool NkeSocketObject::init()
 {
     assert( NkeSocketObject::Initialized );
     
-    TAILQ_INIT( &this->pendingQueue );
+    for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i )
+        TAILQ_INIT( &this->pendingQueues[ i ] );
     TAILQ_INIT( (NkeSocketsListHead*)&this->socketListEntry );
+    TAILQ_INIT( (NkeSocketsHashBucketHead*)&this->socketHashEntry );
+    TAILQ_INIT( (NkeRetiredSocketsListHead*)&this->retiredSocketListEntry );
     
     if( ! super::init() ){
         
@@ -352,22 +546,37 @@ bool NkeSocketObject::init()
         return false;
     }
     
-    this->rwLock = IORWLockAlloc();
-    assert( this->rwLock );
-    if( ! this->rwLock ){
+    //
+    // the locks of a recycled object are kept in the memory header,
+    // they are freed when the memory is released to the system
+    //
+    NkeSocketObjectMemoryHeader*  header = NkeSocketObject::MemoryToHeader( this );
+    
+    if( ! header->rwLock ){
         
-        DBG_PRINT_ERROR(("this->rwLock = IORWLockAlloc() failed\n"));
-        return false;
+        header->rwLock = IORWLockAlloc();
+        assert( header->rwLock );
+        if( ! header->rwLock ){
+            
+            DBG_PRINT_ERROR(("header->rwLock = IORWLockAlloc() failed\n"));
+            return false;
+        }
     }
     
-    this->injectionMutex = IOLockAlloc();
-    assert( this->injectionMutex );
-    if( ! this->injectionMutex ){
+    if( ! header->injectionMutex ){
         
-        DBG_PRINT_ERROR(("this->injectionMutex = IOLockAlloc() failed\n"));
-        return false;
+        header->injectionMutex = IOLockAlloc();
+        assert( header->injectionMutex );
+        if( ! header->injectionMutex ){
+            
+            DBG_PRINT_ERROR(("header->injectionMutex = IOLockAlloc() failed\n"));
+            return false;
+        }
     }
     
+    this->rwLock = header->rwLock;
+    this->injectionMutex = header->injectionMutex;
+    
     return true;
 }
 
@@ -396,17 +605,34 @@ bool NkeSocketObject::init()
 
 void NkeSocketObject::free()
 {
-    assert( TAILQ_EMPTY( &this->pendingQueue ) );
+    assert( TAILQ_EMPTY( &this->pendingQueues[ NKE_PENDING_QUEUE_INBOUND ] ) );
+    assert( TAILQ_EMPTY( &this->pendingQueues[ NKE_PENDING_QUEUE_OUTBOUND ] ) );
     assert( 0x0 == this->flags.insertedInSocketsList );
     assert( NkeSocketObject::SocketObjectsCounter > 0x0 );
     assert( ! this->insertedInSocketsListToReport );
+    assert( ! this->insertedInDeadlinedSocketsList );
+    assert( ! this->insertedInExpiredWindowsSocketsList );
+    assert( ! this->coalescingTimer.entry.armed );
     assert( 0x0 == this->packetsWaitingForReporting );
+    assert( 0x0 == this->pendingUnindexedPackets );
+    assert( NULL == this->firstUnreportedPkts[ NKE_PENDING_QUEUE_INBOUND ] );
+    assert( NULL == this->firstUnreportedPkts[ NKE_PENDING_QUEUE_OUTBOUND ] );
+    
+    if( this->pendingIndex ){
+        
+        IOFree( this->pendingIndex, this->pendingIndexSize * sizeof( this->pendingIndex[ 0x0 ] ) );
+        this->pendingIndex = NULL;
+    }
     
-    if( this->injectionMutex )
-        IOLockFree( this->injectionMutex );
+    for( unsigned int i = 0x0; i < NKE_STATIC_ARRAY_SIZE( this->streamRings ); ++i ){
+        
+        if( 0x0 != this->streamRings[ i ].ring.length && gSocketFilter )
+            gSocketFilter->releaseStreamRing( &this->streamRings[ i ].ring );
+    } // end for
     
-    if( this->rwLock )
-        IORWLockFree( this->rwLock );
+    //
+    // the locks are not freed, they are kept with the memory, see operator delete
+    //
     
     OSDecrementAtomic( &NkeSocketObject::SocketObjectsCounter );
     
@@ -415,6 +641,168 @@ void NkeSocketObject::free()
 
 //--------------------------------------------------------------------
 
+void* NkeSocketObject::operator new( size_t size )
+{
+    assert( preemption_enabled() );
+    
+    NkeSocketObjectMemoryHeader*  header = NULL;
+    NkeSocketObjectsCache*        cache = &NkeSocketObject::ObjectsCache[ NkeCurrentCpuSlot() ];
+    
+    if( cache->lock ){
+        
+        IOSimpleLockLock( cache->lock );
+        { // start of the lock
+            
+            header = cache->head;
+            if( header ){
+                
+                cache->head = header->nextCached;
+                cache->count -= 0x1;
+            }
+            
+        } // end of the lock
+        IOSimpleLockUnlock( cache->lock );
+    }
+    
+    if( header ){
+        
+        assert( header->size == size );
+        OSIncrementAtomic64( &NkeSocketObject::ObjectsCacheHits );
+        
+    } else {
+        
+        OSIncrementAtomic64( &NkeSocketObject::ObjectsCacheMisses );
+        
+        header = (NkeSocketObjectMemoryHeader*)IOMalloc( sizeof( *header ) + size );
+        assert( header );
+        if( ! header ){
+            
+            DBG_PRINT_ERROR(("IOMalloc() failed\n"));
+            return NULL;
+        }
+        
+        header->rwLock = NULL;
+        header->injectionMutex = NULL;
+        header->size = size;
+    }
+    
+    header->nextCached = NULL;
+    
+    //
+    // OSObject's operator new returns a zeroed memory, the constructors rely on this
+    //
+    bzero( header + 0x1, size );
+    
+    return (void*)( header + 0x1 );
+}
+
+//--------------------------------------------------------------------
+
+void NkeSocketObject::operator delete( void* memory, size_t size )
+{
+    assert( preemption_enabled() );
+    
+    NkeSocketObjectMemoryHeader*  header = NkeSocketObject::MemoryToHeader( memory );
+    NkeSocketObjectsCache*        cache = &NkeSocketObject::ObjectsCache[ NkeCurrentCpuSlot() ];
+    bool                          cached = false;
+    
+    assert( header->size == size );
+    
+    //
+    // an object which init() failed doesn't have the locks and is not cached
+    //
+    if( cache->lock && header->rwLock && header->injectionMutex ){
+        
+        IOSimpleLockLock( cache->lock );
+        { // start of the lock
+            
+            if( cache->count < NKE_SOCKET_OBJECTS_CACHE_DEPTH ){
+                
+                header->nextCached = cache->head;
+                cache->head = header;
+                cache->count += 0x1;
+                cached = true;
+            }
+            
+        } // end of the lock
+        IOSimpleLockUnlock( cache->lock );
+    }
+    
+    if( ! cached )
+        NkeSocketObject::DestroyObjectMemory( header );
+}
+
+//--------------------------------------------------------------------
+
+void NkeSocketObject::DestroyObjectMemory( __in NkeSocketObjectMemoryHeader* header )
+{
+    if( header->injectionMutex )
+        IOLockFree( header->injectionMutex );
+    
+    if( header->rwLock )
+        IORWLockFree( header->rwLock );
+    
+    IOFree( header, sizeof( *header ) + header->size );
+}
+
+//--------------------------------------------------------------------
+
+void NkeSocketObject::PurgeObjectsCache()
+{
+    for( int i = 0x0; i < NKE_PER_CPU_SLOTS; ++i ){
+        
+        NkeSocketObjectsCache*        cache = &NkeSocketObject::ObjectsCache[ i ];
+        NkeSocketObjectMemoryHeader*  header;
+        
+        if( ! cache->lock )
+            continue;
+        
+        IOSimpleLockLock( cache->lock );
+        { // start of the lock
+            
+            header = cache->head;
+            cache->head = NULL;
+            cache->count = 0x0;
+            
+        } // end of the lock
+        IOSimpleLockUnlock( cache->lock );
+        
+        while( header ){
+            
+            NkeSocketObjectMemoryHeader*  next = header->nextCached;
+            
+            NkeSocketObject::DestroyObjectMemory( header );
+            header = next;
+        } // end while
+        
+    } // end for
+}
+
+//--------------------------------------------------------------------
+
+void NkeSocketObject::GetStatistics( __inout NkeFilterStatistics* statistics )
+{
+    statistics->socketObjectsCacheHits = NkeSocketObject::ObjectsCacheHits;
+    statistics->socketObjectsCacheMisses = NkeSocketObject::ObjectsCacheMisses;
+    statistics->quotaInboundThrottlings = NkeSocketObject::QuotaInboundThrottlings;
+    statistics->quotaOutboundBlocks = NkeSocketObject::QuotaOutboundBlocks;
+    statistics->inspectionTruncatedNotifications = NkeSocketObject::InspectionTruncatedNotifications;
+    statistics->inspectionBytesNotCopied = NkeSocketObject::InspectionBytesNotCopied;
+    
+    if( NkeSocketObject::PendingPktAllocator ){
+        
+        statistics->pendingPacketsInUse = NkeSocketObject::PendingPktAllocator->getElementsInUse();
+        statistics->pendingPacketsHighWaterMark = NkeSocketObject::PendingPktAllocator->getElementsHighWaterMark();
+        statistics->pendingPacketsSlabs = NkeSocketObject::PendingPktAllocator->getSlabsCount();
+        statistics->pendingPacketsDepotAccesses = NkeSocketObject::PendingPktAllocator->getDepotAccesses();
+    }
+    
+    if( NkeSocketObject::DeadlineTimerWheel )
+        statistics->pendingPacketsDeadlinesExpired = NkeSocketObject::DeadlineTimerWheel->getExpiredCount();
+}
+
+//--------------------------------------------------------------------
+
 NkeSocketObject* NkeSocketObject::withSocket(
     __in socket_t so,
     __in mbuf_tag_id_t gidtag,
@@ -445,8 +833,9 @@ NkeSocketObject* NkeSocketObject::withSocket(
     socketObj->gidtag = gidtag;
     socketObj->lockCount = 0x1;
     socketObj->capturingMode = NkeCapturingModeAll; // by default capture all new connections' data
-    socketObj->socketId.socket = (UInt64)so;
-    socketObj->socketId.socketSequence = OSIncrementAtomic( &NkeSocketObject::gSocketSequence );
+    socketObj->socketId.slotIndex = NKE_INVALID_SLOT_INDEX; // set when the object is inserted in the list
+    socketObj->socketId.generation = 0x0;
+    socketObj->coalescingTimer.socketObject = socketObj;
     
     //
     // get the receive buffer size,
@@ -469,36 +858,89 @@ NkeSocketObject* NkeSocketObject::withSocket(
 
 //--------------------------------------------------------------------
 
-void
-NkeSocketObject::insertInSocketsList()
+errno_t
+NkeSocketObject::insertInSocketsList( __in NkeSocketStub* stub )
 {
     assert( 0x0 == this->flags.insertedInSocketsList );
     assert( NkeSocketObject::SocketObjectsCounter > 0x0 );
     assert( preemption_enabled() );
-    assert( ! NkeIsSocketObjectInList( this->socket ) );
+    assert( stub->socket == this->socket );
+    
+    errno_t    error = KERN_SUCCESS;
+    UInt32     hashIndex = NkeSocketObject::SocketToHashIndex( this->socket );
     
     this->LockExclusive();
     IORWLockWrite( NkeSocketObject::SocketsListLock );
     { // start of the lock
         
+        //
+        // the stub might be promoted concurrently by data callbacks for the both directions,
+        // the lock serializes the promotions so only one object is inserted
+        //
+        if( NULL != stub->object ){
+            
+            error = EEXIST;
+            goto __exit;
+        }
+        
+        assert( ! NkeIsSocketObjectInList( this->socket ) );
+        
+        //
+        // the addresses set by the bind and connect callbacks before the promotion, the callbacks
+        // write the stub under the lock so an address set concurrently is either copied here or
+        // set in the object by the callback
+        //
+        if( 0x0 != stub->localAddress.hdr.sa_len )
+            this->setLocalAddress( &stub->localAddress.hdr );
+        
+        if( 0x0 != stub->remoteAddress.hdr.sa_len )
+            this->setRemoteAddress( &stub->remoteAddress.hdr );
+        
         if( 0x0 == this->flags.insertedInSocketsList ){
             
-            TAILQ_INSERT_HEAD( &NkeSocketObject::SocketsList,
-                               this,
-                               socketListEntry );
+            error = this->acquireSocketSlot();
+            if( KERN_SUCCESS != error ){
+                
+                DBG_PRINT_ERROR(("acquireSocketSlot() failed with an error %d\n", error));
+                goto __exit;
+            }
+            
+            //
+            // the flag is checked by the lock-free readers so it is set before the object
+            // becomes visible, the readers traverse the lists without acquiring the lock
+            // so the object is published after its list entries have been initialized
+            //
+            this->flags.insertedInSocketsList = 0x1;
+            
+            TAILQ_INSERT_HEAD_WITH_BARRIER( &NkeSocketObject::SocketsList,
+                                            this,
+                                            socketListEntry );
+            
+            TAILQ_INSERT_HEAD_WITH_BARRIER( &NkeSocketObject::SocketsHash[ hashIndex ],
+                                            this,
+                                            socketHashEntry );
             
             //
             // inserted in the list of sockets,
             // all objects in the list are retained
             //
-            this->flags.insertedInSocketsList = 0x1;
             this->retain();
             
+            //
+            // the object is fully initialized, make it visible to the callbacks
+            // that read the stub without the lock
+            //
+            NkeMemoryBarrier();
+            stub->object = this;
+            
         } // end if( 0x0 == this->flags.insertedInSocketsList )
         
     } // end of the lock
+__exit:
     IORWLockUnlock( NkeSocketObject::SocketsListLock );
     this->UnlockExclusive();
+    
+    return error;
 }
 
 //--------------------------------------------------------------------
@@ -513,6 +955,8 @@ NkeSocketObject::removeFromSocketsList()
     bool  wasInSocketsList = false;
     bool  wasInSocketsToReportList = false;
     
+    UInt32     hashIndex = NkeSocketObject::SocketToHashIndex( this->socket );
+    
     //
     // the flags are under the socket lock protection while the list entry is protected by its own lock
     //
@@ -522,10 +966,20 @@ NkeSocketObject::removeFromSocketsList()
         
         if( this->flags.insertedInSocketsList ){
             
+            //
+            // TAILQ_REMOVE doesn't change the removed entry's forward link so a lock-free reader
+            // that is positioned at the entry continues traversing the list
+            //
             TAILQ_REMOVE( &NkeSocketObject::SocketsList,
                           this,
                           socketListEntry );
             
+            TAILQ_REMOVE( &NkeSocketObject::SocketsHash[ hashIndex ],
+                          this,
+                          socketHashEntry );
+            
+            this->releaseSocketSlot();
+            
             this->flags.insertedInSocketsList = 0x0;
             wasInSocketsList = true;
         }
@@ -548,15 +1002,34 @@ NkeSocketObject::removeFromSocketsList()
     IORWLockUnlock( NkeSocketObject::SocketsListToReportLock );
     
     //
-    // ATTENTION! after relising the this pointer might be invalid!
-    // Do not touch the object past this point!
+    // the SocketsList reference is transferred to the retired objects list, the lock-free readers
+    // might still be holding the object's pointer, the reference is released after a grace period
     //
+    if( wasInSocketsList ){
+        
+        bool  startGracePeriod;
+        
+        IOLockLock( NkeSocketObject::RetiredSocketsListLock );
+        { // start of the lock
+            
+            TAILQ_INSERT_TAIL( &NkeSocketObject::RetiredSocketsList, this, retiredSocketListEntry );
+            NkeSocketObject::RetiredSocketsCount += 0x1;
+            startGracePeriod = ( NKE_RETIRED_SOCKETS_THRESHOLD == NkeSocketObject::RetiredSocketsCount );
+            
+        } // end of the lock
+        IOLockUnlock( NkeSocketObject::RetiredSocketsListLock );
+        
+        //
+        // wake up the injection thread to not accumulate too many retired objects
+        //
+        if( startGracePeriod )
+            wakeup( &NkeSocketObject::RetiredSocketsCount );
+    }
     
     //
-    // the list retained the object
+    // ATTENTION! after relising the this pointer might be invalid!
+    // Do not touch the object past this point!
     //
-    if( wasInSocketsList )
-        this->release();
     
     if( wasInSocketsToReportList )
         this->release();
@@ -564,43 +1037,398 @@ NkeSocketObject::removeFromSocketsList()
 
 //--------------------------------------------------------------------
 
-NkeSocketObject*
-NkeSocketObject::GetSocketObjectRef( __in socket_t so )
-/*
- if the value is not known provide NULL for so and INVALID_SOCKET_HANDLE for handle,
- a caller must release the returned object
- */
+void
+NkeSocketObject::ReleaseRetiredObjects()
 {
-    assert( NULL != so );
+    assert( preemption_enabled() );
     
-    NkeSocketObject*  sockObj;
+    TAILQ_HEAD( NkeRetiredSocketsListHead, NkeSocketObject ) localRetiredList;
+    TAILQ_INIT( &localRetiredList );
     
-    IORWLockRead( NkeSocketObject::SocketsListLock );
+    IOLockLock( NkeSocketObject::RetiredSocketsListLock );
     { // start of the lock
         
-        TAILQ_FOREACH( sockObj, &NkeSocketObject::SocketsList, socketListEntry)
-        {
-            assert( sockObj->flags.insertedInSocketsList );
+        while( ! TAILQ_EMPTY( &NkeSocketObject::RetiredSocketsList ) ){
             
-            if( sockObj->socket == so )
-                break;
-        } // end TAILQ_FOREACH
-        
-        if( sockObj ){
+            NkeSocketObject*  sockObj = TAILQ_FIRST( &NkeSocketObject::RetiredSocketsList );
             
-            assert( 0x0 != sockObj->socketId.socketSequence );
-            assert( (UInt64)so ==  sockObj->socketId.socket );
-            sockObj->retain();
+            TAILQ_REMOVE( &NkeSocketObject::RetiredSocketsList, sockObj, retiredSocketListEntry );
+            TAILQ_INSERT_TAIL( &localRetiredList, sockObj, retiredSocketListEntry );
         }
         
-    } // end of the lock
-    IORWLockUnlock( NkeSocketObject::SocketsListLock );
+        NkeSocketObject::RetiredSocketsCount = 0x0;
         
+    } // end of the lock
+    IOLockUnlock( NkeSocketObject::RetiredSocketsListLock );
+    
+    if( TAILQ_EMPTY( &localRetiredList ) )
+        return;
+    
+    //
+    // all the objects have been removed from the lists before the grace period starts,
+    // so no reader can access them after the grace period ends
+    //
+    NkeEpoch::WaitForGracePeriod();
+    
+    while( ! TAILQ_EMPTY( &localRetiredList ) ){
+        
+        NkeSocketObject*  sockObj = TAILQ_FIRST( &localRetiredList );
+        
+        TAILQ_REMOVE( &localRetiredList, sockObj, retiredSocketListEntry );
+        
+        //
+        // the SocketsList retained the object
+        //
+        sockObj->release();
+    } // end while
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketObject*
+NkeSocketObject::GetSocketObjectRef( __in socket_t so )
+/*
+ if the value is not known provide NULL for so and INVALID_SOCKET_HANDLE for handle,
+ a caller must release the returned object
+ */
+{
+    assert( NULL != so );
+    
+    NkeSocketObject*  sockObj;
+    UInt32            hashIndex = NkeSocketObject::SocketToHashIndex( so );
+    UInt32            epochToken;
+    
+    //
+    // the hash table is traversed without any lock, the objects are not released
+    // until the read section is exited
+    //
+    epochToken = NkeEpoch::EnterReadSection();
+    { // start of the read section
+        
+        TAILQ_FOREACH( sockObj, &NkeSocketObject::SocketsHash[ hashIndex ], socketHashEntry )
+        {
+            //
+            // skip the objects removed concurrently, a removed object might have
+            // the same socket value as a new one if the socket memory has been reused
+            //
+            if( sockObj->socket == so && sockObj->flags.insertedInSocketsList )
+                break;
+        } // end TAILQ_FOREACH
+        
+        if( sockObj ){
+            
+            assert( 0x0 != sockObj->socketId.generation );
+            sockObj->retain();
+        }
+        
+    } // end of the read section
+    NkeEpoch::ExitReadSection( epochToken );
+        
+    return sockObj;
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketStub*
+NkeSocketObject::AllocateSocketStub(
+    __in socket_t so,
+    __in mbuf_tag_id_t gidtag,
+    __in sa_family_t sa_family
+    )
+{
+    NkeSocketStub*   stub;
+    
+    assert( NkeSocketObject::gOSMallocTag );
+    
+    stub = (NkeSocketStub*)OSMalloc( sizeof( *stub ), NkeSocketObject::gOSMallocTag );
+    assert( stub );
+    if( ! stub ){
+        
+        DBG_PRINT_ERROR(("OSMalloc() for a socket stub failed\n"));
+        return NULL;
+    }
+    
+    bzero( stub, sizeof( *stub ) );
+    
+    stub->socket = so;
+    stub->gidtag = gidtag;
+    stub->sa_family = sa_family;
+    
+#if defined( DBG )
+    stub->signature = SOCKET_STUB_SIGNATURE;
+#endif // DBG
+    
+    return stub;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::FreeSocketStub( __in NkeSocketStub* stub )
+{
+    assert( SOCKET_STUB_SIGNATURE == stub->signature );
+    
+#if defined( DBG )
+    stub->signature = 0x0;
+#endif // DBG
+    
+    OSFree( stub, sizeof( *stub ), NkeSocketObject::gOSMallocTag );
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketObject*
+NkeSocketObject::PromoteSocketStub( __in NkeSocketStub* stub )
+{
+    assert( preemption_enabled() );
+    
+    NkeSocketObject*  sockObj = NkeSocketStubToSocketObject( stub );
+    
+    if( sockObj )
+        return sockObj;
+    
+    sockObj = NkeSocketObject::withSocket( stub->socket, stub->gidtag, stub->sa_family );
+    assert( sockObj );
+    if( ! sockObj ){
+        
+        DBG_PRINT_ERROR(("NkeSocketObject::withSocket failed\n"));
+        return NULL;
+    }
+    
+    errno_t  error;
+    
+    error = sockObj->insertInSocketsList( stub );
+    
+    //
+    // release the object, the sockets list takes its own reference
+    //
+    sockObj->release();
+    NKE_DBG_MAKE_POINTER_INVALID( sockObj );
+    
+    if( KERN_SUCCESS != error && EEXIST != error ){
+        
+        DBG_PRINT_ERROR(("sockObj->insertInSocketsList() failed with an error %d\n", error));
+        return NULL;
+    }
+    
+    //
+    // either this or a concurrent promotion has set the object
+    //
+    assert( stub->object );
+    return NkeSocketStubToSocketObject( stub );
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::SetSocketStubAddress(
+    __in NkeSocketStub* stub,
+    __in bool local,
+    __in const struct sockaddr* address
+    )
+{
+    NkeSocketObject*  sockObj = NkeSocketStubToSocketObject( stub );
+    
+    if( ! sockObj ){
+        
+        if( sizeof( stub->localAddress ) < address->sa_len ){
+            
+            DBG_PRINT_ERROR(("an address length %d is too big\n", (int)address->sa_len ));
+            return;
+        }
+        
+        //
+        // the promotion copies the stub's addresses under the lock, the object is
+        // checked again as the stub might have been promoted after the unlocked check
+        //
+        IORWLockWrite( NkeSocketObject::SocketsListLock );
+        { // start of the lock
+            
+            sockObj = stub->object;
+            if( ! sockObj )
+                bcopy( address, local ? &stub->localAddress : &stub->remoteAddress, address->sa_len );
+            
+        } // end of the lock
+        IORWLockUnlock( NkeSocketObject::SocketsListLock );
+        
+        if( ! sockObj )
+            return;
+    }
+    
+    if( local )
+        sockObj->setLocalAddress( address );
+    else
+        sockObj->setRemoteAddress( address );
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketObject*
+NkeSocketObject::GetSocketObjectRefById( __in const NkeSocketID* socketId )
+/*
+ a caller must release the returned object
+ */
+{
+    NkeSocketObject*  sockObj = NULL;
+    UInt32            slotIndex = socketId->slotIndex;
+    UInt32            epochToken;
+    
+    //
+    // the number of carved slots never decreases and a chunk is never freed
+    // while the driver is loaded, so the slot can be accessed without SocketsListLock
+    //
+    if( slotIndex >= NkeSocketObject::SocketSlotsCarved || 0x0 == socketId->generation )
+        return NULL;
+    
+    NkeSocketSlot*  slot = NkeSocketObject::SlotIndexToSlot( slotIndex );
+    
+    epochToken = NkeEpoch::EnterReadSection();
+    { // start of the read section
+        
+        //
+        // releaseSocketSlot clears the object before changing the generation, so if the
+        // generation is the same before and after the object has been read the object
+        // is the one the ID has been issued for, the generation check rejects IDs for
+        // closed sockets even if the slot has been reused
+        //
+        UInt32  generation = slot->generation;
+        NkeMemoryBarrier();
+        
+        NkeSocketObject*  slotObject = slot->object;
+        NkeMemoryBarrier();
+        
+        if( slotObject &&
+            generation == socketId->generation &&
+            generation == slot->generation ){
+            
+            sockObj = slotObject;
+            
+            assert( sockObj->socketId.slotIndex == slotIndex );
+            sockObj->retain();
+        }
+        
+    } // end of the read section
+    NkeEpoch::ExitReadSection( epochToken );
+    
     return sockObj;
 }
 
 //--------------------------------------------------------------------
 
+errno_t
+NkeSocketObject::acquireSocketSlot()
+{
+    assert( preemption_enabled() );
+    assert( NKE_INVALID_SLOT_INDEX == this->socketId.slotIndex );
+    
+    UInt32    slotIndex;
+    
+    if( NKE_INVALID_SLOT_INDEX != NkeSocketObject::SocketSlotsFreeHead ){
+        
+        slotIndex = NkeSocketObject::SocketSlotsFreeHead;
+        NkeSocketObject::SocketSlotsFreeHead = NkeSocketObject::SlotIndexToSlot( slotIndex )->nextFreeSlot;
+        
+    } else {
+        
+        //
+        // there is no free slot, take a new one from the chunks
+        //
+        UInt32    chunkIndex = NkeSocketObject::SocketSlotsCarved / NKE_SOCKET_SLOTS_PER_CHUNK;
+        
+        if( chunkIndex >= NKE_SOCKET_SLOTS_CHUNKS ){
+            
+            DBG_PRINT_ERROR(("the socket slots table is full\n"));
+            return ENOMEM;
+        }
+        
+        if( NULL == NkeSocketObject::SocketSlots[ chunkIndex ] ){
+            
+            NkeSocketSlot*  chunk;
+            
+            chunk = (NkeSocketSlot*)IOMalloc( sizeof( NkeSocketSlot ) * NKE_SOCKET_SLOTS_PER_CHUNK );
+            assert( chunk );
+            if( ! chunk ){
+                
+                DBG_PRINT_ERROR(("IOMalloc() for a slots chunk failed\n"));
+                return ENOMEM;
+            }
+            
+            bzero( chunk, sizeof( NkeSocketSlot ) * NKE_SOCKET_SLOTS_PER_CHUNK );
+            
+            for( int i = 0x0; i < NKE_SOCKET_SLOTS_PER_CHUNK; ++i ){
+                
+                chunk[ i ].generation = 0x1;
+                chunk[ i ].nextFreeSlot = NKE_INVALID_SLOT_INDEX;
+            }
+            
+            NkeSocketObject::SocketSlots[ chunkIndex ] = chunk;
+        }
+        
+        slotIndex = NkeSocketObject::SocketSlotsCarved;
+        
+        //
+        // the chunk must be visible before the slot index is treated as a valid one
+        // by GetSocketObjectRefById
+        //
+        NkeMemoryBarrier();
+        NkeSocketObject::SocketSlotsCarved += 0x1;
+    }
+    
+    NkeSocketSlot*  slot = NkeSocketObject::SlotIndexToSlot( slotIndex );
+    
+    assert( NULL == slot->object && 0x0 != slot->generation );
+    
+    slot->nextFreeSlot = NKE_INVALID_SLOT_INDEX;
+    
+    this->socketId.slotIndex = slotIndex;
+    this->socketId.generation = slot->generation;
+    
+    //
+    // publish the object for the lock-free readers
+    //
+    NkeMemoryBarrier();
+    slot->object = this;
+    
+    return KERN_SUCCESS;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::releaseSocketSlot()
+{
+    assert( preemption_enabled() );
+    assert( NKE_INVALID_SLOT_INDEX != this->socketId.slotIndex );
+    
+    UInt32          slotIndex = this->socketId.slotIndex;
+    NkeSocketSlot*  slot = NkeSocketObject::SlotIndexToSlot( slotIndex );
+    
+    assert( this == slot->object );
+    
+    //
+    // the object is cleared before the generation is changed, GetSocketObjectRefById relies on this order
+    //
+    slot->object = NULL;
+    NkeMemoryBarrier();
+    
+    //
+    // invalidate all IDs issued for the slot, skip the 0x0 value on wrap around
+    //
+    UInt32  generation = slot->generation + 0x1;
+    if( 0x0 == generation )
+        generation = 0x1;
+    
+    slot->generation = generation;
+    
+    //
+    // the socket ID is left intact as it is still used for notifications about the closed socket
+    //
+    slot->nextFreeSlot = NkeSocketObject::SocketSlotsFreeHead;
+    NkeSocketObject::SocketSlotsFreeHead = slotIndex;
+}
+
+//--------------------------------------------------------------------
+
 void NkeSocketObject::LockShared()
 {
     assert( this->rwLock );
@@ -795,11 +1623,8 @@ NkeSocketObject::allocatePkt(
         return NULL;
     }
     
-    //
-    // use new OSMalloc call which makes it easier to track memory allocations under Tiger
-    //
-    assert( NkeSocketObject::gOSMallocTag );
-    pkt = (NkeSocketObject::PendingPktQueueItem*)OSMalloc( sizeof(*pkt), NkeSocketObject::gOSMallocTag );
+    assert( NkeSocketObject::PendingPktAllocator );
+    pkt = (NkeSocketObject::PendingPktQueueItem*)NkeSocketObject::PendingPktAllocator->allocate();
     assert( pkt );
     if( ! pkt )
         return NULL;
@@ -834,6 +1659,8 @@ NkeSocketObject::allocatePkt(
     pkt->control = mbufControl;
     pkt->totalbytes = totalbytes;
     pkt->dataInbound = isInboundData;
+    pkt->socketObject = this;
+    pkt->reportedPackets = 0x1;
 #if DBG
     pkt->dataIndex = OSIncrementAtomic( &gPendingDataNextIndex );
 #else
@@ -1099,27 +1926,61 @@ NkeSocketObject::FltData(
         assert( pendingPkt );
 		if( NULL != pendingPkt ){
             
-            NkeSocketFilterNotification     notification;
+            NkeDataSlice    slices[ kt_NkeSocketDataSlicesNumber ];
             bool   wait = false;
+            bool   quotaWait = false;
             bool   sendNotification = true;
             bool   releaseBuffers = false;
+            UInt32 prefixBytesReserved = 0x0;
+            UInt32 dataIndex = pendingPkt->dataIndex;
+            UInt32 dataSize = 0x0;
+            UInt32 copiedSize = 0x0;
             
-            INIT_SOCKET_NOTIFICATION( notification,
-                                      this,
-                                      isInboundData ? NkeSocketFilterEventDataIn : NkeSocketFilterEventDataOut );
-            
-            notification.eventData.inputoutput.dataIndex = pendingPkt->dataIndex;
+            slices[ 0 ].length = 0x0;
             
             mbuf_t  mbuf = data ? *data : NULL;
             
-            if( mbuf ){
+            //
+            // the policy is resolved before the first packet's data is copied
+            // so the inspection prefix applies from the connection's start
+            //
+            if( 0x0 == this->capturePolicyGeneration ){
+                
+                this->LockExclusive();
+                { // start of the lock
+                    
+                    this->resolveCapturePolicy();
+                    
+                } // end of the lock
+                this->UnlockExclusive();
+            }
+            
+            //
+            // the data is not copied if the packet is going to be coalesced or to wait behind
+            // not reported packets, this is checked without the lock and rechecked under the lock,
+            // the stream ring is written only by DeliverWaitingNotifications() so the data
+            // is copied in the ring order
+            //
+            bool    reportNow = ( 0x0 == this->packetsWaitingForReporting &&
+                                  0x0 == this->capturePolicy.coalescingMaxBytes &&
+                                  ! this->isStreamRingMode( isInboundData ) );
+            bool    deliverNotifications = false;
+            
+            if( mbuf && reportNow ){
+                
+                dataSize = (UInt32)mbuf_pkthdr_len( mbuf );
+                
+                UInt32  bytesToCopy = this->reserveInspectedBytes( isInboundData,
+                                                                   dataSize,
+                                                                   &prefixBytesReserved );
                 
-                notification.eventData.inputoutput.dataSize = mbuf_pkthdr_len( mbuf );
+                error = gSocketFilter->copyDataToSlices( mbuf, bytesToCopy, slices ); //Here, packet data gets copied to the shared slices
+                if( 0x0 == error )
+                    copiedSize = bytesToCopy;
                 
-                error = gSocketFilter->copyDataToBuffers( mbuf, notification.eventData.inputoutput.buffers ); //Here, packet data gets copied to buffers
                 if( error ){
                     
-                    assert( UINT8_MAX == notification.eventData.inputoutput.buffers[0] );
+                    assert( 0x0 == slices[ 0 ].length );
                     
                     //
                     // disable the notification sending, the notification will be sent when there will be enough
@@ -1136,7 +1997,17 @@ NkeSocketObject::FltData(
                 //
                 // queue the item into the input/output queue for processing
                 //
-                TAILQ_INSERT_TAIL( &this->pendingQueue, pendingPkt, pendingQueueEntry );
+                TAILQ_INSERT_TAIL( &this->pendingQueues[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ],
+                                   pendingPkt,
+                                   pendingQueueEntry );
+                this->indexPendingPkt( pendingPkt );
+                
+                //
+                // start waiting for the verdict, the timer is cancelled when the packet is removed from the queue
+                //
+                this->resolveCapturePolicy();
+                pendingPkt->allowDataOnDeadline = ( 0x0 != this->capturePolicy.allowDataOnTimeout );
+                NkeSocketObject::DeadlineTimerWheel->arm( &pendingPkt->deadlineTimer, this->capturePolicy.verdictTimeout );
                 
                 //
                 // the following should be done under the exclusive lock(!) AFTER the pending packet
@@ -1148,7 +2019,28 @@ NkeSocketObject::FltData(
                 //
                 pendingPkt->flags.errorWhileAllocatingBuffers = (error) ? 0x1 : 0x0;
                 pendingPkt->flags.notReportedEntryInFront = (0x0 != this->packetsWaitingForReporting) ? 0x1 : 0x0;
-                if( error || 0x0 != this->packetsWaitingForReporting ){
+                
+                //
+                // the packets are coalesced while the window is open or there is nothing to wait for,
+                // the coalesced packets are not held by the backpressure below
+                //
+                bool  coalesce = ( ! error &&
+                                   0x0 != this->capturePolicy.coalescingMaxBytes &&
+                                   ( 0x0 != this->coalescingPackets ||
+                                     0x0 == this->packetsWaitingForReporting ) );
+                
+                if( coalesce ){
+                    
+                    sendNotification = false;
+                    
+                    //
+                    // the data might have been copied if the policy has been changed concurrently
+                    //
+                    releaseBuffers = ( 0x0 != slices[ 0 ].length );
+                    
+                    deliverNotifications = this->addToCoalescingWindow( pendingPkt );
+                    
+                } else if( error || 0x0 != this->packetsWaitingForReporting || ! reportNow ){
                     
                     sendNotification = false;
                     releaseBuffers = true;
@@ -1173,51 +2065,52 @@ NkeSocketObject::FltData(
                     } else {
                         
                         assert( NkeSocketDataDirectionIn == direction );
-                        if( this->acquireDetachingLock() ){
-                            
-                            int     reserve = 0x1; // 0x0 is invalid value, EINVAL is returned
-                            errno_t optErr; 
-                            
-                            //
-                            // say the system to start receive window collapsing, when the data will be sent
-                            // to dissectors the window size will be restored
-                            //
-                            optErr = sock_setsockopt( this->socket, SOL_SOCKET, SO_RCVBUF, &reserve, sizeof(reserve));
-                            assert( 0x0 == optErr );
-                            
-                            this->releaseDetachingLock();
-                        } // end if( this->acquireDetachingLock() )
+                        
+                        //
+                        // say the system to start receive window collapsing, when the data will be sent
+                        // to dissectors the window size will be restored
+                        //
+                        this->setReceiveBufferCollapsed( true );
                     }
                     
                     pendingPkt->needToBeReported = true;
+                    
+                    //
+                    // the packet is at the queue's tail, so it is the first not reported only if all packets
+                    // in front of it have been reported
+                    //
+                    if( NULL == this->firstUnreportedPkts[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ] )
+                        this->firstUnreportedPkts[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ] = pendingPkt;
+                    
                     if( 0x0 == OSIncrementAtomic( &this->packetsWaitingForReporting ) ){
                         
                         //
                         // insert in the list of sockets that wait for data to be delivered
                         //
-                        IORWLockWrite( NkeSocketObject::SocketsListToReportLock );
-                        { // start of the lock
-                            
-                            if( ! this->insertedInSocketsListToReport ){
-                                
-                                //
-                                // all objects in the list are refrenced to avoid premature object destroying
-                                //
-                                this->retain();
-                                
-                                //
-                                // insert in the list
-                                //
-                                TAILQ_INSERT_TAIL( &NkeSocketObject::SocketsListToReport, this, socketsListToReportEntry );
-                                this->insertedInSocketsListToReport = true;
-                            } // end if( ! this->insertedInSocketsListToReport )
-                            
-                        } // end of the lock
-                        IORWLockUnlock( NkeSocketObject::SocketsListToReportLock );
+                        this->insertInSocketsListToReport();
                     } // if( 0x0 == OSIncrementAtomic( &this->packetsWaitingForReporting ) )
                     
                 } // end if( error )
                 
+                //
+                // check the socket's quota, only this socket is throttled when its pending data
+                // grows as the verdicts are late, the other sockets keep flowing
+                //
+                if( isInboundData ){
+                    
+                    if( ! this->inboundThrottled &&
+                        this->isPendingDataOver( true, NKE_PENDING_BYTES_SOFT_LIMIT, NKE_PENDING_PACKETS_SOFT_LIMIT ) ){
+                        
+                        this->inboundThrottled = true;
+                        this->setReceiveBufferCollapsed( true );
+                        OSIncrementAtomic64( &NkeSocketObject::QuotaInboundThrottlings );
+                    }
+                    
+                } else if( this->isPendingDataOver( false, NKE_PENDING_BYTES_HARD_LIMIT, NKE_PENDING_PACKETS_HARD_LIMIT ) ){
+                    
+                    quotaWait = true;
+                }
+                
                 pendingPkt->flags.waitWasAsserted = (wait) ? 0x1 : 0x0;
 #if DBG
                 this->verifyPendingPacketsQueue( false );
@@ -1236,18 +2129,7 @@ NkeSocketObject::FltData(
                 
                 assert( ! wait );
                 
-                NkeIOUserClient* userClient = gSocketFilter->getUserClient();
-                if( userClient ){
-                    
-                    error = userClient->socketFilterNotification( &notification );
-                    gSocketFilter->releaseUserClient();
-                    NKE_DBG_MAKE_POINTER_INVALID( userClient );
-                    
-                } else {
-                    
-                    error = ENOENT;
-                }
-                
+                error = this->sendDataNotification( isInboundData, dataIndex, 0x1, dataSize, copiedSize, slices );
                 if( error ){
                     
                     //
@@ -1255,7 +2137,7 @@ NkeSocketObject::FltData(
                     // release all acquired buffers, TO DO - the process might hang as the queued packet will block the socket calls
                     //
                     releaseBuffers = true;
-                    DBG_PRINT_ERROR(("socketFilterNotification() failed\n"));
+                    DBG_PRINT_ERROR(("sendDataNotification() failed\n"));
                     
                     //
                     // TO DO - place the packet in the list of packets waiting for reporting
@@ -1266,7 +2148,18 @@ NkeSocketObject::FltData(
             
             if( releaseBuffers ){
                 
-                gSocketFilter->releaseDataBuffersAndDeliverNotifications( notification.eventData.inputoutput.buffers );
+                //
+                // the data will be copied again when the packet is reported
+                //
+                this->releaseInspectedBytes( isInboundData, prefixBytesReserved );
+                gSocketFilter->releaseDataSlicesAndDeliverNotifications( slices );
+                
+            } else if( deliverNotifications ){
+                
+                //
+                // the coalescing window has been closed
+                //
+                NkeSocketObject::DeliverWaitingNotifications();
                 
             } // end if( releaseBuffers )
             
@@ -1288,6 +2181,27 @@ NkeSocketObject::FltData(
                               "NkeSocketObject::FltData()", // wait message
                               &ts );                        // sleep interval
             } // while( wait && (! waitEntry.waitSatisfied ) )
+            
+            //
+            // the outbound quota has been exceeded, block the writer until the pending data
+            // drops under the soft limit, the wakeup comes from the injection or the purge
+            //
+            if( quotaWait ){
+                
+                OSIncrementAtomic64( &NkeSocketObject::QuotaOutboundBlocks );
+                
+                while( 0x0 == this->flags.f_sock_evt_disconnecting &&
+                       this->isPendingDataOver( false, NKE_PENDING_BYTES_SOFT_LIMIT, NKE_PENDING_PACKETS_SOFT_LIMIT ) ){
+                    
+                    struct timespec ts = { 1, 0 };       // one second
+                    
+                    (void)msleep( &this->totalPendingBytesOut,  // wait channel
+                                  NULL,                         // mutex
+                                  PUSER,                        // priority
+                                  "NkeSocketObject::FltData()", // wait message
+                                  &ts );                        // sleep interval
+                } // end while
+            } // end if( quotaWait )
 			
 			error = EJUSTRETURN;
 		}
@@ -1348,8 +2262,9 @@ NkeSocketObject::DeliverWaitingNotifications()
         if( ! sockObj )
             break;
         
-        NkeSocketFilterNotification     notification;
-        bool  releaseBuffers = false;
+        NkeDataSlice    slices[ kt_NkeSocketDataSlicesNumber ];
+        bool    releaseBuffers = false;
+        UInt32  prefixBytesReserved = 0x0;
         
         //
         // send notifications, do this under the lock to avoid pending packet and mbuf destroying
@@ -1360,11 +2275,10 @@ NkeSocketObject::DeliverWaitingNotifications()
             NkeSocketObject::PendingPktQueueItem*	pendingPkt;
             
             //
-            // iterate the queue looking for matching entries,
-            // TO DO - it might be more optimal to have a separate list for these entries
-            // instead wondering from the back skipping reported entries
+            // start from the first not reported packet, all packets after it in the both queues
+            // are also not reported, the reported packets in front are skipped
             //
-            TAILQ_FOREACH( pendingPkt, &sockObj->pendingQueue, pendingQueueEntry)
+            while( NULL != ( pendingPkt = sockObj->getFirstUnreportedPkt() ) )
             {
                 //
                 // if releaseBuffers is true then the previous notification failed but instead
@@ -1373,49 +2287,69 @@ NkeSocketObject::DeliverWaitingNotifications()
                 //
                 assert( ! releaseBuffers );
                 
-                //
-                // should the packet be reported?
-                // all packtes that require reporting are at the tail of the list
-                //
-                if( ! pendingPkt->needToBeReported )
-                    continue;
-                
+                assert( pendingPkt->needToBeReported );
                 assert( sockObj->packetsWaitingForReporting > 0x0 );
                 assert( pendingPkt->data );
                 
-                if( pendingPkt->data ){
+                //
+                // the flag is set by the timer wheel concurrently so it is sampled once,
+                // a packet whose deadline has expired is not reported as its verdict
+                // is not waited for, the capture policy decides its destiny
+                //
+                bool    deadlineExpired = pendingPkt->deadlineTimerExpired;
+                UInt32  packetsNumber = 0x0;
+                
+                if( pendingPkt->data && ! deadlineExpired ){
                     
                     //
-                    // now report the packet
+                    // now report the packet and the following packets of the same direction in one notification
                     //
+                    mbuf_t  batchData[ NKE_COALESCING_MAX_PACKETS ];
+                    UInt32  batchBytes;
+                    
+                    packetsNumber = sockObj->getReportingBatch( pendingPkt, batchData, &batchBytes );
+                    assert( packetsNumber > 0x0 );
                     
-                    INIT_SOCKET_NOTIFICATION( notification,
-                                              sockObj,
-                                              (( pendingPkt->dataInbound ) ? NkeSocketFilterEventDataIn : NkeSocketFilterEventDataOut) );
+                    slices[ 0 ].length = 0x0;
+                    
+                    //
+                    // the data that doesn't fit the stream ring is truncated to the ring length,
+                    // the ring is allocated with the direction's first reported data
+                    //
+                    bool    streamRingMode = sockObj->isStreamRingMode( pendingPkt->dataInbound );
+                    UInt32  dataBytes = batchBytes;
+                    UInt32  bytesToCopy = 0x0;
                     
-                    notification.eventData.inputoutput.dataIndex = pendingPkt->dataIndex;
-                    notification.eventData.inputoutput.dataSize = mbuf_pkthdr_len( pendingPkt->data );
+                    prefixBytesReserved = 0x0;
+                    error = streamRingMode ? sockObj->prepareStreamRing( pendingPkt->dataInbound, &dataBytes ) : KERN_SUCCESS;
                     
                     // Copy data to communication buffers
                     // This is where data becomes visible to the user-space client
                     // TODO - Learn more about what that data is such as to parse packet
-                    error = gSocketFilter->copyDataToBuffers( pendingPkt->data, notification.eventData.inputoutput.buffers );
+                    if( 0x0 == error ){
+                        
+                        bytesToCopy = sockObj->reserveInspectedBytes( pendingPkt->dataInbound, dataBytes, &prefixBytesReserved );
+                        
+                        if( streamRingMode )
+                            error = sockObj->copyDataToStreamRing( pendingPkt->dataInbound, batchData, packetsNumber, bytesToCopy );
+                        else
+                            error = gSocketFilter->copyDataToSlices( batchData, packetsNumber, bytesToCopy, slices );
+                    }
+                    
                     if( 0x0 == error ){
                         
                         //
                         // notify the client
                         //
-                        NkeIOUserClient* userClient = gSocketFilter->getUserClient();
-                        if( userClient ){
-                            
-                            error = userClient->socketFilterNotification( &notification );
-                            gSocketFilter->releaseUserClient();
-                            NKE_DBG_MAKE_POINTER_INVALID( userClient );
-                            
-                        } else {
-                            
-                            error = ENOENT;
-                        }
+                        error = sockObj->sendDataNotification( pendingPkt->dataInbound,
+                                                               pendingPkt->dataIndex,
+                                                               packetsNumber,
+                                                               batchBytes,
+                                                               bytesToCopy,
+                                                               streamRingMode ? NULL : slices );
+                        
+                        if( ! error && streamRingMode )
+                            sockObj->commitStreamRingData( pendingPkt->dataInbound, bytesToCopy );
                         
                         if( error ){
                             
@@ -1423,9 +2357,9 @@ NkeSocketObject::DeliverWaitingNotifications()
                             // process an error,
                             // release all acquired buffers,
                             //
-                            // there is a subtle moment - there will be a deadlock if releaseDataBuffersAndDeliverNotifications() is called
+                            // there is a subtle moment - there will be a deadlock if releaseDataSlicesAndDeliverNotifications() is called
                             // with the socket object lock acquired for write and then try to reacquire the same lock,
-                            // so postpone the releaseDataBuffers call
+                            // so postpone the releaseDataSlices call
                             //
                             releaseBuffers = true;
                         }
@@ -1434,9 +2368,10 @@ NkeSocketObject::DeliverWaitingNotifications()
                     if( error ){
                         
                         //
-                        // error, something went wrong or there was not enough buffers
+                        // error, something went wrong or there was not enough memory for the slices
+                        // or the stream ring space, the slices are released later if the notification failed
                         //
-                        assert( UINT8_MAX == notification.eventData.inputoutput.buffers[0] );
+                        assert( releaseBuffers || 0x0 == slices[ 0 ].length );
                     } // end if( error )
                     
                 } // end if( pendingPkt->data )
@@ -1447,63 +2382,70 @@ NkeSocketObject::DeliverWaitingNotifications()
                     //
                     // the packet reporting failed,
                     // the buffers pool has been depleted,
-                    // reinsert in the list if the deadline has not been reached
+                    // reinsert in the list, the packet will be
+                    // processed again when buffers are released
+                    // or when its deadline expires
                     //
-                    if( pendingPkt->isDeadlineTimerExpired() ){
-                        
-                        //
-                        // disable the packet delivery
-                        //
-                        assert( pendingPkt->deadlineTimerExpired );
-                        pendingPkt->allowData = false;
-                        
-                    } else {
-                        
-                        reinsertInList = true;
-                        break;
-                    }
-
+                    assert( ! deadlineExpired );
+                    sockObj->releaseInspectedBytes( pendingPkt->dataInbound, prefixBytesReserved );
+                    reinsertInList = true;
+                    break;
+                    
                 } // end if( error )
                 
                 //
-                // the packet was reported, decrease the waiting packet counter
+                // a packet without data or with an expired deadline is released from reporting alone
                 //
-                pendingPkt->needToBeReported = false;
-                OSDecrementAtomic( &sockObj->packetsWaitingForReporting );
+                if( 0x0 == packetsNumber )
+                    packetsNumber = 0x1;
+                
+                if( deadlineExpired )
+                    pendingPkt->allowData = pendingPkt->allowDataOnDeadline;
                 
                 //
-                // wake up a waiting thread in case of outbound data or restore
-                // the receive windows size for incoming traffic
+                // the verdict for the first packet is applied to all reported packets
                 //
-                if( pendingPkt->waitEntry ){
+                pendingPkt->reportedPackets = packetsNumber;
+                
+                NkeSocketObject::PendingPktQueueItem*	lastReportedPkt = NULL;
+                
+                for( UInt32 i = 0x0; i < packetsNumber; ++i ){
+                    
+                    assert( pendingPkt && pendingPkt->needToBeReported );
+                    
+                    //
+                    // the packet was reported, decrease the waiting packet counter
+                    //
+                    pendingPkt->needToBeReported = false;
+                    OSDecrementAtomic( &sockObj->packetsWaitingForReporting );
+                    sockObj->firstUnreportedPkts[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ] =
+                        TAILQ_NEXT( pendingPkt, pendingQueueEntry );
                     
-                    assert( ! pendingPkt->dataInbound );
-                    assert( false == pendingPkt->waitEntry->waitSatisfied );
+                    //
+                    // wake up a waiting thread in case of outbound data
+                    //
+                    if( pendingPkt->waitEntry ){
+                        
+                        assert( ! pendingPkt->dataInbound );
+                        assert( false == pendingPkt->waitEntry->waitSatisfied );
+                        
+                        pendingPkt->waitEntry->waitSatisfied = true;
+                        wakeup( pendingPkt->waitEntry );
+                        pendingPkt->waitEntry = NULL;
+                    } // end if( pendingPkt->waitEntry )
                     
-                    pendingPkt->waitEntry->waitSatisfied = true;
-                    wakeup( pendingPkt->waitEntry );
-                    pendingPkt->waitEntry = NULL;
-                } // end if( pendingPkt->waitEntry )
+                    lastReportedPkt = pendingPkt;
+                    pendingPkt = TAILQ_NEXT( pendingPkt, pendingQueueEntry );
+                } // end for
+                
+                pendingPkt = lastReportedPkt;
                 
                 //
-                // set the socket receive buffer, this implicitly allows the TCP to move the right window boundary
+                // set the socket receive buffer, this implicitly allows the TCP to move the right window boundary,
+                // the buffer stays collapsed while the socket is over its quota
                 //
-                if( pendingPkt->dataInbound ){
-                    
-                    errno_t sockErr;
-                    
-                    sockErr = sock_setsockopt( sockObj->socket,
-                                               SOL_SOCKET,
-                                               SO_RCVBUF,
-                                               &sockObj->origReceiveBufferSize,
-                                               sizeof(sockObj->origReceiveBufferSize));
-                    assert( ! sockErr );
-                    if( sockErr ){
-                        
-                        DBG_PRINT_ERROR(( "restoring the socket receive buffer has failed for so=0x%p, error=%d\n",
-                                          sockObj->socket, sockErr));
-                    }
-                } // end if( pendingPkt->dataInbound )
+                if( pendingPkt->dataInbound && ! sockObj->inboundThrottled )
+                    sockObj->setReceiveBufferCollapsed( false );
                 
 #if DBG
                 { // start of the test
@@ -1514,7 +2456,9 @@ NkeSocketObject::DeliverWaitingNotifications()
                     NkeSocketObject::PendingPktQueueItem*	pendingPktTmp;
                     bool  needToBeReported = false;
                     
-                    TAILQ_FOREACH( pendingPktTmp, &sockObj->pendingQueue, pendingQueueEntry)
+                    TAILQ_FOREACH( pendingPktTmp,
+                                   &sockObj->pendingQueues[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ],
+                                   pendingQueueEntry)
                     {
                         
                         if( pendingPkt == pendingPktTmp ){
@@ -1528,7 +2472,7 @@ NkeSocketObject::DeliverWaitingNotifications()
                     } // end TAILQ_FOREACH_REVERSE
                 } // end of the test
 #endif // DBG
-            } // end TAILQ_FOREACH
+            } // end while
             
 #if DBG
             sockObj->verifyPendingPacketsQueue( false );
@@ -1538,16 +2482,16 @@ NkeSocketObject::DeliverWaitingNotifications()
         
         //
         // release buffers before reinserting the socket object in the list - this breaks the infinite
-        // recursion condition when releaseDataBuffersAndDeliverNotifications calls DeliverWaitingNotifications for the same
+        // recursion condition when releaseDataSlicesAndDeliverNotifications calls DeliverWaitingNotifications for the same
         // objects until a call stack is depleted, the watchdog thread should periodically call
         // DeliverWaitingNotifications to circumvent a situation when some buffers were freed before
-        // the call to releaseDataBuffersAndDeliverNotifications is made here
+        // the call to releaseDataSlicesAndDeliverNotifications is made here
         //
         if( releaseBuffers ){
             
             assert( error );
             
-            gSocketFilter->releaseDataBuffersAndDeliverNotifications( notification.eventData.inputoutput.buffers );
+            gSocketFilter->releaseDataSlicesAndDeliverNotifications( slices );
             releaseBuffers = false;
         }
         
@@ -1701,35 +2645,47 @@ void NkeSocketObject::reinjectDeferredData( __in NkeSocketObject::NkeSocketDataD
         { // start of the lock
             
             NkeSocketObject::PendingPktQueueItem*	pendingPkt;
-            NkeSocketObject::PendingPktQueueItem*	pendingPktNext;
             
 #if DBG
             this->verifyPendingPacketsQueue( false );
 #endif // DBG
             
             //
-            // iterate the queue looking for matching entries; if we find a match, 
-            // remove it from queue and put it on packets_to_inject; because we're 
-            // removing elements from tl_deferred_data, we can't use TAILQ_FOREACH
+            // a queue is stopped when its head can't be injected, the packets of the stopped
+            // queue are held but the other queue is processed further unless the ordering barrier
+            // is raised in which case the both queues are stopped to preserve the arrival order
             //
-            for( pendingPkt = TAILQ_FIRST( &this->pendingQueue ); pendingPkt != NULL; pendingPkt = pendingPktNext ){
+            bool  orderedInjection = ( NkeSocketDataAll == injectType && this->isOrderingBarrierRaised() );
+            bool  queueStopped[ NKE_PENDING_QUEUES_NUMBER ];
+            
+            queueStopped[ NKE_PENDING_QUEUE_INBOUND ] = ( NkeSocketDataOutbound == injectType );
+            queueStopped[ NKE_PENDING_QUEUE_OUTBOUND ] = ( NkeSocketDataInbound == injectType );
+            
+            //
+            // take the earliest head of the not stopped queues; if it can be injected,
+            // remove it from its queue and put it on packets_to_inject
+            //
+            while( true ){
                 
-                //
-                // get the next element pointer before we potentially corrupt it
-                //
-                pendingPktNext = TAILQ_NEXT( pendingPkt, pendingQueueEntry );
+                NkeSocketObject::PendingPktQueueItem*	inboundPkt = NULL;
+                NkeSocketObject::PendingPktQueueItem*	outboundPkt = NULL;
+                
+                if( ! queueStopped[ NKE_PENDING_QUEUE_INBOUND ] )
+                    inboundPkt = TAILQ_FIRST( &this->pendingQueues[ NKE_PENDING_QUEUE_INBOUND ] );
+                
+                if( ! queueStopped[ NKE_PENDING_QUEUE_OUTBOUND ] )
+                    outboundPkt = TAILQ_FIRST( &this->pendingQueues[ NKE_PENDING_QUEUE_OUTBOUND ] );
+                
+                if( inboundPkt && outboundPkt )
+                    pendingPkt = NkeSocketObject::IsPktBefore( inboundPkt, outboundPkt ) ? inboundPkt : outboundPkt;
+                else
+                    pendingPkt = inboundPkt ? inboundPkt : outboundPkt;
+                
+                if( NULL == pendingPkt )
+                    break;
+                
+                bool  canBeInjected = true;
                 
-                //
-                // should the packet be injected or not according to the injection type?
-                //
-                if( NkeSocketDataAll != injectType ){
-                    
-                    if( (true == pendingPkt->dataInbound && NkeSocketDataInbound != injectType) ||
-                        (false == pendingPkt->dataInbound && NkeSocketDataOutbound != injectType))
-                        continue;
-                    
-                } // end if( NkeInjectAll != injectType )
-               
                 //
                 // not reported packets are not injected,
                 // all not reported packets are at the tail
@@ -1738,8 +2694,9 @@ void NkeSocketObject::reinjectDeferredData( __in NkeSocketObject::NkeSocketDataD
                 // by DeliverWaitingNotifications and then again
                 // picked up here with needToBeReported set tot true
                 //
-                if( pendingPkt->needToBeReported )
-                    break;
+                if( pendingPkt->needToBeReported ){
+                    
+                    canBeInjected = false;
                 
                 //
                 // if a packet's timer has expired then force processing
@@ -1748,34 +2705,46 @@ void NkeSocketObject::reinjectDeferredData( __in NkeSocketObject::NkeSocketDataD
                 // deplenish the mbuf pool and if were not removed would stop network subsystem
                 // from accepting or sending new data
                 //
-                if( ! pendingPkt->isDeadlineTimerExpired() ){
+                } else if( ! pendingPkt->deadlineTimerExpired ){
                     
                     //
-                    // not reported packets are not injected,
-                    // all not reported packets are at the tail
-                    // so stop processing the current queue
+                    // a packet without a verdict holds the following packets of its queue
                     //
                     if( ! pendingPkt->responseReceived )
-                        break;
+                        canBeInjected = false;
                     
                 } else {
                     
                     //
-                    // the packet's timer expired
+                    // the packet's timer expired, without a verdict the capture policy decides
                     //
                     assert( ! pendingPkt->needToBeReported );
                     this->deadlinedPackets += 0x1; // the counter is just for a debug purpose
+                    
+                    if( ! pendingPkt->responseReceived )
+                        pendingPkt->allowData = pendingPkt->allowDataOnDeadline;
+                }
+                
+                if( ! canBeInjected ){
+                    
+                    if( orderedInjection )
+                        break;
+                    
+                    queueStopped[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ] = true;
+                    continue;
                 }
                 
                 //
-                // TO DO -look for a match, if we find it, move it from the deferred 
-                // data queue to our local queue
+                // move the packet from the deferred data queue to our local queue
                 //
-                {
-                    TAILQ_REMOVE( &this->pendingQueue, pendingPkt, pendingQueueEntry );
-                    TAILQ_INSERT_TAIL( &packetsToInject, pendingPkt, pendingQueueEntry );
-                } 
-            } // end for
+                NkeSocketObject::DeadlineTimerWheel->cancel( &pendingPkt->deadlineTimer );
+                this->unindexPendingPkt( pendingPkt );
+                TAILQ_REMOVE( &this->pendingQueues[ NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) ],
+                              pendingPkt,
+                              pendingQueueEntry );
+                TAILQ_INSERT_TAIL( &packetsToInject, pendingPkt, pendingQueueEntry );
+                
+            } // end while
             // we're done with the global list, so release our lock on it
         } // end of the lock
         this->UnlockExclusive();
@@ -1871,7 +2840,7 @@ void NkeSocketObject::reinjectDeferredData( __in NkeSocketObject::NkeSocketDataD
             //
             // free the queue entry
             //
-            OSFree( pendingPkt, sizeof(*pendingPkt), gOSMallocTag);
+            NkeSocketObject::PendingPktAllocator->deallocate( pendingPkt );
             
         } // end while
         
@@ -1880,6 +2849,8 @@ void NkeSocketObject::reinjectDeferredData( __in NkeSocketObject::NkeSocketDataD
     } // end of the injection
     IOLockUnlock( this->injectionMutex );
     
+    this->releaseQuotaBackpressure();
+    
     //this->releaseDetachingLock();
     
 	// we don't need to do anything to tidy up packets_to_inject because 
@@ -1912,29 +2883,25 @@ NkeSocketObject::setDeferredDataProperties(
         this->verifyPendingPacketsQueue( false );
 #endif // DBG
         
-        //
-        // iterate the queue looking for matching entries
-        //
-        TAILQ_FOREACH( pendingPkt, &this->pendingQueue, pendingQueueEntry )
-        {
+        if( NkeSocketDataPropertyTypeStreamConsumed == property->type ){
             
             //
-            // all not reported packets are at the tail
-            // so stop processing the current queue
+            // the ring space is not related to any packet
             //
-            if( pendingPkt->needToBeReported ){
-                
-                assert( !shouldBeApplied || 0x0 != this->deadlinedPackets );
-                break;
-            }
+            this->consumeStreamRing( 0x0 != property->value.streamConsumed.inbound, property->value.streamConsumed.position );
+            pendingPkt = NULL;
             
-            //
-            // should the property be applyed to the packet 
-            //
-            if( pendingPkt->dataIndex != property->dataIndex )
-                continue;
+        } else {
             
-            assert( ! pendingPkt->needToBeReported );
+            pendingPkt = this->findPendingPkt( property->dataIndex );
+        }
+        
+        //
+        // a not reported packet has not been seen by the service, all not reported
+        // packets are at the tail, the property can't be for any of them
+        //
+        assert( !( shouldBeApplied && pendingPkt && pendingPkt->needToBeReported ) || 0x0 != this->deadlinedPackets );
+        if( pendingPkt && ! pendingPkt->needToBeReported ){
             
 #if DBG
             wasApplied = true;
@@ -1944,25 +2911,553 @@ NkeSocketObject::setDeferredDataProperties(
             switch( property->type ){
                     
                 case NkeSocketDataPropertyTypePermission:
+                {
+                    //
+                    // the verdict is for all packets reported in one notification, they follow
+                    // the packet in its queue as they were coalesced from one direction
+                    //
+                    NkeSocketObject::PendingPktQueueItem*  reportedPkt = pendingPkt;
                     
-                    pendingPkt->allowData = property->value.permission.allowData ? true : false;
-                    pendingPkt->responseReceived = true;
+                    for( UInt32 i = 0x0; i < pendingPkt->reportedPackets && reportedPkt; ++i ){
+                        
+                        //
+                        // a packet of the batch might have been injected on its deadline
+                        //
+                        if( reportedPkt->needToBeReported )
+                            break;
+                        
+                        reportedPkt->allowData = property->value.permission.allowData ? true : false;
+                        reportedPkt->responseReceived = true;
+                        
+                        reportedPkt = TAILQ_NEXT( reportedPkt, pendingQueueEntry );
+                    } // end for
                     break;
+                }
                     
                 default:
                     
                     DBG_PRINT_ERROR(( "unknown property %d\n", (int)property->type  ));
                     break;
             } // end switch
+        }
+        
+        assert( !( shouldBeApplied && !wasApplied) || 0x0 != this->deadlinedPackets );
+
+    } // end of the lock
+    this->UnlockExclusive();
+}
+
+//--------------------------------------------------------------------
+
+bool
+NkeSocketObject::growPendingIndex()
+//
+// reallocates the index and reindexes all pending packets,
+// must be called with the exclusive lock held
+//
+{
+    PendingPktQueueItem**   newIndex;
+    UInt32                  newSize;
+    UInt32                  newUnindexed = 0x0;
+    PendingPktQueueItem*    pendingPkt;
+    
+    newSize = this->pendingIndex ? ( 0x2 * this->pendingIndexSize ) : NKE_PENDING_INDEX_INITIAL_SIZE;
+    if( newSize > NKE_PENDING_INDEX_MAXIMUM_SIZE )
+        return false;
+    
+    newIndex = (PendingPktQueueItem**)IOMalloc( newSize * sizeof( newIndex[ 0x0 ] ) );
+    assert( newIndex );
+    if( ! newIndex ){
+        
+        DBG_PRINT_ERROR(("IOMalloc() for the pending index failed\n"));
+        return false;
+    }
+    
+    bzero( newIndex, newSize * sizeof( newIndex[ 0x0 ] ) );
+    
+    for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i ){
+        
+        TAILQ_FOREACH( pendingPkt, &this->pendingQueues[ i ], pendingQueueEntry )
+        {
+            PendingPktQueueItem**  slot = &newIndex[ pendingPkt->dataIndex & ( newSize - 0x1 ) ];
+            
+            if( NULL == *slot )
+                *slot = pendingPkt;
+            else
+                newUnindexed += 0x1;
+            
+        } // end TAILQ_FOREACH
+    } // end for
+    
+    if( this->pendingIndex )
+        IOFree( this->pendingIndex, this->pendingIndexSize * sizeof( this->pendingIndex[ 0x0 ] ) );
+    
+    this->pendingIndex = newIndex;
+    this->pendingIndexSize = newSize;
+    this->pendingUnindexedPackets = newUnindexed;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::indexPendingPkt( __in PendingPktQueueItem* pkt )
+{
+    if( this->pendingIndex ){
+        
+        PendingPktQueueItem**  slot = &this->pendingIndex[ pkt->dataIndex & ( this->pendingIndexSize - 0x1 ) ];
+        
+        if( NULL == *slot ){
+            
+            *slot = pkt;
+            return;
+        }
+    }
+    
+    //
+    // there is no index yet or there is a collision, the grown index includes the packet
+    // as it has been already inserted in a pending queue
+    //
+    if( this->growPendingIndex() )
+        return;
+    
+    this->pendingUnindexedPackets += 0x1;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::unindexPendingPkt( __in PendingPktQueueItem* pkt )
+{
+    if( this->pendingIndex ){
+        
+        PendingPktQueueItem**  slot = &this->pendingIndex[ pkt->dataIndex & ( this->pendingIndexSize - 0x1 ) ];
+        
+        if( pkt == *slot ){
+            
+            *slot = NULL;
+            return;
+        }
+    }
+    
+    assert( this->pendingUnindexedPackets > 0x0 );
+    this->pendingUnindexedPackets -= 0x1;
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketObject::PendingPktQueueItem*
+NkeSocketObject::findPendingPkt( __in SInt32 dataIndex )
+{
+    PendingPktQueueItem*  pendingPkt;
+    
+    if( this->pendingIndex ){
+        
+        pendingPkt = this->pendingIndex[ dataIndex & ( this->pendingIndexSize - 0x1 ) ];
+        if( pendingPkt && dataIndex == pendingPkt->dataIndex )
+            return pendingPkt;
+    }
+    
+    //
+    // the packet has been injected or purged, or it has not got a slot
+    //
+    if( 0x0 == this->pendingUnindexedPackets )
+        return NULL;
+    
+    for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i ){
+        
+        TAILQ_FOREACH( pendingPkt, &this->pendingQueues[ i ], pendingQueueEntry )
+        {
+            if( dataIndex == pendingPkt->dataIndex )
+                return pendingPkt;
+            
+        } // end TAILQ_FOREACH
+    } // end for
+    
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+
+NkeSocketObject::PendingPktQueueItem*
+NkeSocketObject::getFirstUnreportedPkt()
+{
+    PendingPktQueueItem*  inboundPkt = this->firstUnreportedPkts[ NKE_PENDING_QUEUE_INBOUND ];
+    PendingPktQueueItem*  outboundPkt = this->firstUnreportedPkts[ NKE_PENDING_QUEUE_OUTBOUND ];
+    
+    if( inboundPkt && outboundPkt )
+        return NkeSocketObject::IsPktBefore( inboundPkt, outboundPkt ) ? inboundPkt : outboundPkt;
+    
+    return inboundPkt ? inboundPkt : outboundPkt;
+}
+
+//--------------------------------------------------------------------
+
+bool
+NkeSocketObject::isOrderingBarrierRaised()
+{
+    //
+    // the pre-event flags are set before the event is processed by the filter, so the packets
+    // injected while processing the event are already ordered
+    //
+    return ( 0x1 == this->flags.f_sock_evt_pre_shutdown ||
+             0x1 == this->flags.f_sock_evt_pre_closing ||
+             0x1 == this->flags.f_sock_evt_pre_disconnecting );
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::resolveCapturePolicy()
+{
+    bool  remoteAddressValid = this->isRemoteAddressValid();
+    
+    if( 0x0 != this->capturePolicyGeneration &&
+        this->capturePolicyGeneration == gSocketFilter->getCapturePoliciesGeneration() &&
+        this->capturePolicyWithRemotePort == remoteAddressValid )
+        return;
+    
+    //
+    // the ports are saved in the host byte order
+    //
+    UInt16  localPort = 0x0;
+    UInt16  remotePort = 0x0;
+    
+    if( this->isLocalAddressValid() )
+        localPort = ( AF_INET == this->sa_family ) ? this->localAddress.addr4.sin_port : this->localAddress.addr6.sin6_port;
+    
+    if( remoteAddressValid )
+        remotePort = ( AF_INET == this->sa_family ) ? this->remoteAddress.addr4.sin_port : this->remoteAddress.addr6.sin6_port;
+    
+    this->capturePolicyGeneration = gSocketFilter->getCapturePolicy( localPort, remotePort, &this->capturePolicy );
+    this->capturePolicyWithRemotePort = remoteAddressValid;
+    
+    assert( 0x0 != this->capturePolicy.verdictTimeout );
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::insertInSocketsListToReport()
+{
+    IORWLockWrite( NkeSocketObject::SocketsListToReportLock );
+    { // start of the lock
+        
+        if( ! this->insertedInSocketsListToReport ){
+            
+            //
+            // all objects in the list are refrenced to avoid premature object destroying
+            //
+            this->retain();
+            
+            //
+            // insert in the list
+            //
+            TAILQ_INSERT_TAIL( &NkeSocketObject::SocketsListToReport, this, socketsListToReportEntry );
+            this->insertedInSocketsListToReport = true;
+        } // end if( ! this->insertedInSocketsListToReport )
+        
+    } // end of the lock
+    IORWLockUnlock( NkeSocketObject::SocketsListToReportLock );
+}
+
+//--------------------------------------------------------------------
+
+bool
+NkeSocketObject::addToCoalescingWindow( __in PendingPktQueueItem* pkt )
+{
+    bool  windowClosed = false;
+    
+    assert( 0x0 != this->capturePolicy.coalescingMaxBytes );
+    assert( ! pkt->needToBeReported );
+    
+    //
+    // a window contains data for one direction only, so a verdict is given for a contiguous range of a queue
+    //
+    if( 0x0 != this->coalescingPackets && this->coalescingInbound != pkt->dataInbound ){
+        
+        this->closeCoalescingWindow();
+        windowClosed = true;
+    }
+    
+    pkt->needToBeReported = true;
+    
+    if( NULL == this->firstUnreportedPkts[ NkeSocketObject::PendingQueueIndex( pkt->dataInbound ) ] )
+        this->firstUnreportedPkts[ NkeSocketObject::PendingQueueIndex( pkt->dataInbound ) ] = pkt;
+    
+    OSIncrementAtomic( &this->packetsWaitingForReporting );
+    
+    if( 0x0 == this->coalescingPackets ){
+        
+        //
+        // open a new window, the armed timer references the object
+        //
+        this->coalescingInbound = pkt->dataInbound;
+        this->coalescingWindow += 0x1;
+        this->coalescingTimer.window = this->coalescingWindow;
+        
+        this->retain();
+        NkeSocketObject::CoalescingTimerWheel->arm( &this->coalescingTimer.entry,
+                                                    ( this->capturePolicy.coalescingMaxMicroseconds + 999 ) / 1000 );
+    }
+    
+    this->coalescingPackets += 0x1;
+    this->coalescingBytes += pkt->data ? (UInt32)mbuf_pkthdr_len( pkt->data ) : 0x0;
+    
+    if( this->coalescingBytes >= this->capturePolicy.coalescingMaxBytes ||
+        this->coalescingPackets >= NKE_COALESCING_MAX_PACKETS ){
+        
+        this->closeCoalescingWindow();
+        windowClosed = true;
+    }
+    
+    return windowClosed;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::closeCoalescingWindow()
+{
+    assert( 0x0 != this->coalescingPackets );
+    
+    this->coalescingPackets = 0x0;
+    this->coalescingBytes = 0x0;
+    
+    //
+    // the object is inserted before the timer reference is released, so the release is not the last one,
+    // an expired timer is not cancelled and its reference is released by CoalescingWindowsExpired()
+    //
+    this->insertInSocketsListToReport();
+    
+    if( NkeSocketObject::CoalescingTimerWheel->cancel( &this->coalescingTimer.entry ) )
+        this->release();
+}
+
+//--------------------------------------------------------------------
+
+UInt32
+NkeSocketObject::getReportingBatch(
+    __in PendingPktQueueItem* firstPkt,
+    __out mbuf_t* batchData,
+    __out UInt32* batchBytes
+    )
+{
+    UInt32  packetsNumber = 0x0;
+    
+    *batchBytes = 0x0;
+    
+    if( ! firstPkt->data )
+        return 0x0;
+    
+    batchData[ packetsNumber++ ] = firstPkt->data;
+    *batchBytes = (UInt32)mbuf_pkthdr_len( firstPkt->data );
+    
+    //
+    // the following packets of the same direction are added until a packet of the other direction
+    // arrived in between, the reporting order across the directions is preserved this way
+    //
+    PendingPktQueueItem*  otherPkt = this->firstUnreportedPkts[ NkeSocketObject::PendingQueueIndex( ! firstPkt->dataInbound ) ];
+    PendingPktQueueItem*  pkt;
+    
+    for( pkt = TAILQ_NEXT( firstPkt, pendingQueueEntry );
+         NULL != pkt && packetsNumber < NKE_COALESCING_MAX_PACKETS;
+         pkt = TAILQ_NEXT( pkt, pendingQueueEntry ) ){
+        
+        assert( pkt->needToBeReported );
+        
+        if( otherPkt && NkeSocketObject::IsPktBefore( otherPkt, pkt ) )
+            break;
+        
+        if( ! pkt->data || pkt->deadlineTimerExpired )
+            break;
+        
+        UInt32  size = (UInt32)mbuf_pkthdr_len( pkt->data );
+        
+        if( ( *batchBytes + size ) > this->capturePolicy.coalescingMaxBytes )
+            break;
+        
+        batchData[ packetsNumber++ ] = pkt->data;
+        *batchBytes += size;
+    } // end for
+    
+    return packetsNumber;
+}
+
+//--------------------------------------------------------------------
+
+//
+// called by the timer wheel with its lock held, the packet can't be removed from the queue
+// concurrently as the removal cancels the timer and the cancellation waits for the wheel lock
+//
+void
+NkeSocketObject::DeadlineTimerExpired( __in NkeTimerWheelEntry* entry, __in void* context )
+{
+    PendingPktQueueItem*  pendingPkt = (PendingPktQueueItem*)( (vm_address_t)entry - __offsetof( PendingPktQueueItem, deadlineTimer ) );
+    NkeSocketObject*      sockObj = pendingPkt->socketObject;
+    
+    pendingPkt->deadlineTimerExpired = true;
+    
+    IOSimpleLockLock( NkeSocketObject::DeadlinedSocketsListLock );
+    { // start of the lock
+        
+        if( ! sockObj->insertedInDeadlinedSocketsList ){
+            
+            sockObj->retain();
+            TAILQ_INSERT_TAIL( &NkeSocketObject::DeadlinedSocketsList, sockObj, deadlinedSocketsListEntry );
+            sockObj->insertedInDeadlinedSocketsList = true;
+        }
+        
+    } // end of the lock
+    IOSimpleLockUnlock( NkeSocketObject::DeadlinedSocketsListLock );
+}
+
+//--------------------------------------------------------------------
+
+//
+// called by the timer wheel thread without any lock held after the expired timers have been processed
+//
+void
+NkeSocketObject::ProcessDeadlinedSockets( __in void* context )
+{
+    assert( preemption_enabled() );
+    
+    //
+    // the expired packets waiting for being reported are released from the reporting at first
+    // as a not reported packet is not injected
+    //
+    NkeSocketObject::DeliverWaitingNotifications();
+    
+    while( true ){
+        
+        NkeSocketObject*  sockObj = NULL;
+        
+        IOSimpleLockLock( NkeSocketObject::DeadlinedSocketsListLock );
+        { // start of the lock
+            
+            sockObj = TAILQ_FIRST( &NkeSocketObject::DeadlinedSocketsList );
+            if( sockObj ){
+                
+                TAILQ_REMOVE( &NkeSocketObject::DeadlinedSocketsList, sockObj, deadlinedSocketsListEntry );
+                sockObj->insertedInDeadlinedSocketsList = false;
+            }
+            
+        } // end of the lock
+        IOSimpleLockUnlock( NkeSocketObject::DeadlinedSocketsListLock );
+        
+        if( ! sockObj )
+            break;
+        
+        //
+        // the object might have been removed from the list and its data purged after the deadline expired
+        //
+        if( 0x1 == sockObj->flags.insertedInSocketsList )
+            sockObj->reinjectDeferredData( NkeSocketDataAll );
+        
+        //
+        // the object was referenced when it was inserted in the list
+        //
+        sockObj->release();
+        
+    } // end while
+}
+
+//--------------------------------------------------------------------
+
+//
+// called by the timer wheel with its lock held, the socket's lock can't be acquired as the socket's
+// lock is held when the timer is cancelled, the window is closed by CoalescingWindowsExpired()
+//
+void
+NkeSocketObject::CoalescingTimerExpired( __in NkeTimerWheelEntry* entry, __in void* context )
+{
+    NkeSocketObject*  sockObj = ((CoalescingTimer*)entry)->socketObject;
+    bool              inserted = false;
+    
+    IOSimpleLockLock( NkeSocketObject::ExpiredWindowsSocketsListLock );
+    { // start of the lock
+        
+        //
+        // the armed timer's reference is transferred to the list
+        //
+        if( ! sockObj->insertedInExpiredWindowsSocketsList ){
+            
+            TAILQ_INSERT_TAIL( &NkeSocketObject::ExpiredWindowsSocketsList, sockObj, expiredWindowsSocketsListEntry );
+            sockObj->insertedInExpiredWindowsSocketsList = true;
+            inserted = true;
+        }
+        
+        sockObj->expiredCoalescingWindow = ((CoalescingTimer*)entry)->window;
+        
+    } // end of the lock
+    IOSimpleLockUnlock( NkeSocketObject::ExpiredWindowsSocketsListLock );
+    
+    //
+    // the timer has been armed again for a new window before the list was drained, the list
+    // is drained by this thread so the list's reference keeps the object and the release is not the last one
+    //
+    if( ! inserted )
+        sockObj->release();
+}
+
+//--------------------------------------------------------------------
+
+//
+// called by the timer wheel thread without any lock held after the expired timers have been processed
+//
+void
+NkeSocketObject::CoalescingWindowsExpired( __in void* context )
+{
+    assert( preemption_enabled() );
+    
+    while( true ){
+        
+        NkeSocketObject*  sockObj = NULL;
+        UInt32            expiredWindow = 0x0;
+        
+        IOSimpleLockLock( NkeSocketObject::ExpiredWindowsSocketsListLock );
+        { // start of the lock
             
-            // we have finished
+            sockObj = TAILQ_FIRST( &NkeSocketObject::ExpiredWindowsSocketsList );
+            if( sockObj ){
+                
+                TAILQ_REMOVE( &NkeSocketObject::ExpiredWindowsSocketsList, sockObj, expiredWindowsSocketsListEntry );
+                sockObj->insertedInExpiredWindowsSocketsList = false;
+                expiredWindow = sockObj->expiredCoalescingWindow;
+            }
+            
+        } // end of the lock
+        IOSimpleLockUnlock( NkeSocketObject::ExpiredWindowsSocketsListLock );
+        
+        if( ! sockObj )
             break;
-        } // end TAILQ_FOREACH
         
-        assert( !( shouldBeApplied && !wasApplied) || 0x0 != this->deadlinedPackets );
-
-    } // end of the lock
-    this->UnlockExclusive();
+        sockObj->LockExclusive();
+        { // start of the lock
+            
+            //
+            // the window might have been closed by its size or purged after the timer expired,
+            // a window opened after that has its own timer
+            //
+            if( 0x0 != sockObj->coalescingPackets && expiredWindow == sockObj->coalescingWindow ){
+                
+                sockObj->coalescingPackets = 0x0;
+                sockObj->coalescingBytes = 0x0;
+                sockObj->insertInSocketsListToReport();
+            }
+            
+        } // end of the lock
+        sockObj->UnlockExclusive();
+        
+        //
+        // the reference was held by the armed timer
+        //
+        sockObj->release();
+        
+    } // end while
+    
+    NkeSocketObject::DeliverWaitingNotifications();
 }
 
 //--------------------------------------------------------------------
@@ -1979,28 +3474,49 @@ NkeSocketObject::verifyPendingPacketsQueue( __in bool lock )
         this->LockExclusive();
     { // start of the lock
         
-        bool    needToBeReportedWasFound = false;
-        NkeSocketObject::PendingPktQueueItem*	pendingPkt;
-        
-        //
-        // iterate the queue looking for matching entries
-        //
-        TAILQ_FOREACH( pendingPkt, &this->pendingQueue, pendingQueueEntry )
-        {
+        for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i ){
+            
+            bool    needToBeReportedWasFound = false;
+            NkeSocketObject::PendingPktQueueItem*	pendingPkt;
+#if defined( DBG )
+            NkeSocketObject::PendingPktQueueItem*	previousPkt = NULL;
+#endif // DBG
             
             //
-            // all not reported packets are at the tail
-            // so stop processing the current queue
-            //            
-            assert( !( needToBeReportedWasFound && !pendingPkt->needToBeReported ) );
-            if( needToBeReportedWasFound && !pendingPkt->needToBeReported ){
+            // iterate the queue looking for matching entries
+            //
+            TAILQ_FOREACH( pendingPkt, &this->pendingQueues[ i ], pendingQueueEntry )
+            {
                 
-                DBG_PRINT_ERROR(( "verifyPendingPacketsQueue failed the pending queue check for so=%p\n", this->socket ));
-            }
+                //
+                // all not reported packets are at the tail
+                // so stop processing the current queue
+                //
+                assert( !( needToBeReportedWasFound && !pendingPkt->needToBeReported ) );
+                if( needToBeReportedWasFound && !pendingPkt->needToBeReported ){
+                    
+                    DBG_PRINT_ERROR(( "verifyPendingPacketsQueue failed the pending queue check for so=%p\n", this->socket ));
+                }
+                
+                assert( !( !needToBeReportedWasFound && pendingPkt->needToBeReported ) ||
+                        pendingPkt == this->firstUnreportedPkts[ i ] );
+                
+                //
+                // the packets of a queue are in the arrival order
+                //
+                assert( NkeSocketObject::PendingQueueIndex( pendingPkt->dataInbound ) == i );
+#if defined( DBG )
+                assert( !( previousPkt && NkeSocketObject::IsPktBefore( pendingPkt, previousPkt ) ) );
+                previousPkt = pendingPkt;
+#endif // DBG
+                
+                needToBeReportedWasFound = pendingPkt->needToBeReported;
+                
+            } // end TAILQ_FOREACH
             
-            needToBeReportedWasFound = pendingPkt->needToBeReported;
+            assert( needToBeReportedWasFound || NULL == this->firstUnreportedPkts[ i ] );
             
-        } // end TAILQ_FOREACH
+        } // end for
         
     } // end of the lock
     if( lock )
@@ -2017,86 +3533,104 @@ void NkeSocketObject::purgePendingQueue(
     //
     // serialize with the injection stream
     //
+    bool  coalescingTimerCancelled = false;
+    
     IOLockLock( this->injectionMutex );
     {
         this->LockExclusive();
         { // start of the lock
             
-            NkeSocketObject::PendingPktQueueItem*  pendingPkt;
-            NkeSocketObject::PendingPktQueueItem*  pendingPktNext;
+            //
+            // the coalescing window is discarded with its packets
+            //
+            if( 0x0 != this->coalescingPackets &&
+                ( NkeSocketDataAll == purgeType ||
+                  ( this->coalescingInbound ? NkeSocketDataInbound : NkeSocketDataOutbound ) == purgeType ) ){
+                
+                this->coalescingPackets = 0x0;
+                this->coalescingBytes = 0x0;
+                coalescingTimerCancelled = NkeSocketObject::CoalescingTimerWheel->cancel( &this->coalescingTimer.entry );
+            }
             
-            for( pendingPkt = TAILQ_FIRST(&this->pendingQueue); pendingPkt != NULL; pendingPkt = pendingPktNext )
-            {
-                //
-                // get the next element pointer before we potentially corrupt it
-                //
-                pendingPktNext = TAILQ_NEXT( pendingPkt, pendingQueueEntry );
+            for( int i = 0x0; i < NKE_PENDING_QUEUES_NUMBER; ++i ){
                 
-                //
-                // should the packet be purged or not according to the type?
-                //
-                if( NkeSocketDataAll != purgeType ){
-                    
-                    if( (true == pendingPkt->dataInbound && NkeSocketDataInbound != purgeType) ||
-                       (false == pendingPkt->dataInbound && NkeSocketDataOutbound != purgeType))
-                        continue;
-                    
-                } // end if( NkeInjectAll != purgeType )
+                NkeSocketObject::PendingPktQueueItem*  pendingPkt;
+                NkeSocketObject::PendingPktQueueItem*  pendingPktNext;
                 
                 //
-                // look for a match, if we find it, move it from the deferred 
-                // data queue to our local queue
+                // should the queue be purged or not according to the type?
                 //
+                if( ( NKE_PENDING_QUEUE_INBOUND == i && NkeSocketDataOutbound == purgeType ) ||
+                    ( NKE_PENDING_QUEUE_OUTBOUND == i && NkeSocketDataInbound == purgeType ) )
+                    continue;
                 
-                if( pendingPkt->dataInbound ){
-                    NKE_COMM_LOG ( NET_PACKET_FLOW, ("****INBOUND PACKET FREED FROM PENDING QUEUE socket_t is 0x%p, mbuf is 0x%p\n", this->socket, pendingPktNext->data));
-                } else {
-                    NKE_COMM_LOG ( NET_PACKET_FLOW, ("****OUTBOUND PACKET FREED FROM PENDING QUEUE socket_t is 0x%p, mbuf is 0x%p\n", this->socket, pendingPktNext->data));
-                }
-                
-                //
-                // wake up a waiting thread
-                //
-                if( pendingPkt->waitEntry ){
+                for( pendingPkt = TAILQ_FIRST( &this->pendingQueues[ i ] ); pendingPkt != NULL; pendingPkt = pendingPktNext )
+                {
+                    //
+                    // get the next element pointer before we potentially corrupt it
+                    //
+                    pendingPktNext = TAILQ_NEXT( pendingPkt, pendingQueueEntry );
                     
-                    assert( ! pendingPkt->dataInbound );
-                    assert( false == pendingPkt->waitEntry->waitSatisfied );
+                    //
+                    // look for a match, if we find it, move it from the deferred 
+                    // data queue to our local queue
+                    //
                     
-                    pendingPkt->waitEntry->waitSatisfied = true;
-                    wakeup( pendingPkt->waitEntry );
-                    pendingPkt->waitEntry = NULL;
-                } // end if( pendingPkt->waitEntry )
-                
-                if( pendingPkt->needToBeReported ){
+                    if( pendingPkt->dataInbound ){
+                        NKE_COMM_LOG ( NET_PACKET_FLOW, ("****INBOUND PACKET FREED FROM PENDING QUEUE socket_t is 0x%p, mbuf is 0x%p\n", this->socket, pendingPkt->data));
+                    } else {
+                        NKE_COMM_LOG ( NET_PACKET_FLOW, ("****OUTBOUND PACKET FREED FROM PENDING QUEUE socket_t is 0x%p, mbuf is 0x%p\n", this->socket, pendingPkt->data));
+                    }
                     
                     //
-                    // the packet will not be reported as data is being purged
+                    // wake up a waiting thread
                     //
-                    assert( this->packetsWaitingForReporting > 0x0 );
-                    OSDecrementAtomic( &this->packetsWaitingForReporting );
-                    pendingPkt->needToBeReported = false;
-                }
-                
-                if( pendingPkt->dataInbound ){
+                    if( pendingPkt->waitEntry ){
+                        
+                        assert( ! pendingPkt->dataInbound );
+                        assert( false == pendingPkt->waitEntry->waitSatisfied );
+                        
+                        pendingPkt->waitEntry->waitSatisfied = true;
+                        wakeup( pendingPkt->waitEntry );
+                        pendingPkt->waitEntry = NULL;
+                    } // end if( pendingPkt->waitEntry )
                     
-                    OSDecrementAtomic( &this->numberOfPendingInPackets );		// decrement packet count
-                    OSAddAtomic( (-1)*pendingPkt->totalbytes, &this->totalPendingBytesIn );
-                    assert( this->numberOfPendingInPackets >= 0x0 );
-                    assert( this->totalPendingBytesIn >= 0x0 );
+                    if( pendingPkt->needToBeReported ){
+                        
+                        //
+                        // the packet will not be reported as data is being purged
+                        //
+                        assert( this->packetsWaitingForReporting > 0x0 );
+                        OSDecrementAtomic( &this->packetsWaitingForReporting );
+                        pendingPkt->needToBeReported = false;
+                    }
                     
-                } else {
+                    if( pendingPkt->dataInbound ){
+                        
+                        OSDecrementAtomic( &this->numberOfPendingInPackets );		// decrement packet count
+                        OSAddAtomic( (-1)*pendingPkt->totalbytes, &this->totalPendingBytesIn );
+                        assert( this->numberOfPendingInPackets >= 0x0 );
+                        assert( this->totalPendingBytesIn >= 0x0 );
+                        
+                    } else {
+                        
+                        OSDecrementAtomic( &this->numberOfPendingOutPackets );		// decrement packet count
+                        OSAddAtomic( (-1)*pendingPkt->totalbytes, &this->totalPendingBytesOut );
+                        assert( this->numberOfPendingOutPackets >= 0x0 );
+                        assert( this->totalPendingBytesOut >= 0x0 );
+                    }
                     
-                    OSDecrementAtomic( &this->numberOfPendingOutPackets );		// decrement packet count
-                    OSAddAtomic( (-1)*pendingPkt->totalbytes, &this->totalPendingBytesOut );
-                    assert( this->numberOfPendingOutPackets >= 0x0 );
-                    assert( this->totalPendingBytesOut >= 0x0 );
-                }
-                
-                TAILQ_REMOVE( &this->pendingQueue, pendingPkt, pendingQueueEntry );
-                my_mbuf_freem( &pendingPkt->data );
-                my_mbuf_freem( &pendingPkt->control );
-                OSFree( pendingPkt, sizeof(*pendingPkt), NkeSocketObject::gOSMallocTag );
-                NKE_DBG_MAKE_POINTER_INVALID( pendingPkt );
+                    if( pendingPkt == this->firstUnreportedPkts[ i ] )
+                        this->firstUnreportedPkts[ i ] = TAILQ_NEXT( pendingPkt, pendingQueueEntry );
+                    
+                    NkeSocketObject::DeadlineTimerWheel->cancel( &pendingPkt->deadlineTimer );
+                    this->unindexPendingPkt( pendingPkt );
+                    TAILQ_REMOVE( &this->pendingQueues[ i ], pendingPkt, pendingQueueEntry );
+                    my_mbuf_freem( &pendingPkt->data );
+                    my_mbuf_freem( &pendingPkt->control );
+                    NkeSocketObject::PendingPktAllocator->deallocate( pendingPkt );
+                    NKE_DBG_MAKE_POINTER_INVALID( pendingPkt );
+                } // end for
             } // end for
             
             this->wakeupWaitingFotInjectionCompletion();
@@ -2106,6 +3640,14 @@ void NkeSocketObject::purgePendingQueue(
         
     } // end of the synchronization
     IOLockUnlock( this->injectionMutex );
+    
+    this->releaseQuotaBackpressure();
+    
+    //
+    // the reference was held by the armed timer
+    //
+    if( coalescingTimerCancelled )
+        this->release();
 }
 
 //--------------------------------------------------------------------
@@ -2191,6 +3733,283 @@ NkeSocketObject::wakeupWaitingFotInjectionCompletion()
 
 //--------------------------------------------------------------------
 
+void
+NkeSocketObject::setReceiveBufferCollapsed( __in bool collapse )
+{
+    if( ! this->acquireDetachingLock() )
+        return;
+    
+    int      reserve = 0x1; // 0x0 is invalid value, EINVAL is returned
+    int      size = collapse ? reserve : (int)this->origReceiveBufferSize;
+    errno_t  sockErr;
+    
+    sockErr = sock_setsockopt( this->socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+    assert( ! sockErr );
+    if( sockErr ){
+        
+        DBG_PRINT_ERROR(( "setting the socket receive buffer to %d has failed for so=0x%p, error=%d\n",
+                          size, this->socket, sockErr));
+    }
+    
+    this->releaseDetachingLock();
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::releaseQuotaBackpressure()
+{
+    assert( preemption_enabled() );
+    
+    //
+    // a blocked writer rechecks the quota when it is woken up
+    //
+    if( ! this->isPendingDataOver( false, NKE_PENDING_BYTES_SOFT_LIMIT, NKE_PENDING_PACKETS_SOFT_LIMIT ) )
+        wakeup( &this->totalPendingBytesOut );
+    
+    if( ! this->inboundThrottled ||
+        this->isPendingDataOver( true, NKE_PENDING_BYTES_SOFT_LIMIT / 0x2, NKE_PENDING_PACKETS_SOFT_LIMIT / 0x2 ) )
+        return;
+    
+    this->LockExclusive();
+    { // start of the lock
+        
+        if( this->inboundThrottled &&
+            ! this->isPendingDataOver( true, NKE_PENDING_BYTES_SOFT_LIMIT / 0x2, NKE_PENDING_PACKETS_SOFT_LIMIT / 0x2 ) ){
+            
+            this->inboundThrottled = false;
+            
+            //
+            // the packets waiting for buffers to be reported keep the window collapsed,
+            // it is restored when they are reported
+            //
+            if( NULL == this->firstUnreportedPkts[ NKE_PENDING_QUEUE_INBOUND ] )
+                this->setReceiveBufferCollapsed( false );
+        }
+        
+    } // end of the lock
+    this->UnlockExclusive();
+}
+
+//--------------------------------------------------------------------
+
+UInt32
+NkeSocketObject::reserveInspectedBytes( __in bool inbound, __in UInt32 dataSize, __out UInt32* prefixBytesReserved )
+{
+    //
+    // the policy is read without the lock, a concurrent policy change affects only the current data
+    //
+    UInt32  prefixBytes = this->capturePolicy.inspectionPrefixBytes;
+    
+    *prefixBytesReserved = 0x0;
+    
+    if( 0x0 == prefixBytes )
+        return dataSize;
+    
+    if( 0x0 != this->capturePolicy.inspectionPrefixPerNotification )
+        return ( dataSize < prefixBytes ) ? dataSize : prefixBytes;
+    
+    volatile SInt32*  inspected = &this->inspectedBytes[ NkeSocketObject::PendingQueueIndex( inbound ) ];
+    SInt32            oldInspected;
+    UInt32            bytes;
+    
+    do{
+        
+        oldInspected = *inspected;
+        if( (UInt32)oldInspected >= prefixBytes )
+            return 0x0;
+        
+        bytes = prefixBytes - (UInt32)oldInspected;
+        if( bytes > dataSize )
+            bytes = dataSize;
+        
+    } while( ! OSCompareAndSwap( oldInspected, oldInspected + (SInt32)bytes, inspected ) );
+    
+    *prefixBytesReserved = bytes;
+    return bytes;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::releaseInspectedBytes( __in bool inbound, __in UInt32 prefixBytesReserved )
+{
+    if( 0x0 == prefixBytesReserved )
+        return;
+    
+    assert( this->inspectedBytes[ NkeSocketObject::PendingQueueIndex( inbound ) ] >= (SInt32)prefixBytesReserved );
+    OSAddAtomic( -(SInt32)prefixBytesReserved, &this->inspectedBytes[ NkeSocketObject::PendingQueueIndex( inbound ) ] );
+}
+
+//--------------------------------------------------------------------
+
+errno_t
+NkeSocketObject::sendDataNotification(
+    __in bool inbound,
+    __in UInt32 dataIndex,
+    __in UInt32 packetsNumber,
+    __in UInt32 dataSize,
+    __in UInt32 copiedSize,
+    __in_opt const NkeDataSlice* slices
+    )
+{
+    assert( copiedSize <= dataSize );
+    
+    //
+    // a compact notification has room for the used slices only so they are counted before the reservation
+    //
+    UInt32  slicesNumber = 0x0;
+    
+    if( slices ){
+        
+        while( slicesNumber < kt_NkeSocketDataSlicesNumber && 0x0 != slices[ slicesNumber ].length )
+            slicesNumber += 0x1;
+    }
+    
+    NkeIOUserClient* userClient = gSocketFilter->getUserClient();
+    if( ! userClient )
+        return ENOENT;
+    
+    NkeSocketFilterReservation    reservation;
+    NkeSocketFilterNotification*  notification;
+    
+    notification = NkeSocketFilter::ReserveSocketNotification( userClient,
+                                                               this,
+                                                               inbound ? NkeSocketFilterEventDataIn : NkeSocketFilterEventDataOut,
+                                                               slicesNumber,
+                                                               &reservation );
+    if( notification ){
+        
+        NkeSocketFilterEventIoData*  ioData = &notification->eventData.inputoutput;
+        
+        ioData->dataSize = dataSize;
+        ioData->dataIndex = dataIndex;
+        ioData->packetsNumber = packetsNumber;
+        ioData->copiedSize = copiedSize;
+        ioData->truncated = ( copiedSize < dataSize ) ? 0x1 : 0x0;
+        
+        if( ! slices ){
+            
+            //
+            // the data has been copied at the ring's write position
+            //
+            StreamRing*  stream = &this->streamRings[ NkeSocketObject::PendingQueueIndex( inbound ) ];
+            
+            ioData->streamRing = stream->ring;
+            ioData->streamPosition = stream->writePosition;
+        }
+        
+        if( 0x0 != slicesNumber )
+            memcpy( ioData->slices, slices, slicesNumber * sizeof( NkeDataSlice ) );
+        
+        userClient->commitSocketFilterNotification( &reservation );
+    }
+    
+    gSocketFilter->releaseUserClient();
+    NKE_DBG_MAKE_POINTER_INVALID( userClient );
+    
+    if( ! notification )
+        return ENOMEM;
+    
+    if( copiedSize < dataSize ){
+        
+        OSIncrementAtomic64( &NkeSocketObject::InspectionTruncatedNotifications );
+        OSAddAtomic64( dataSize - copiedSize, &NkeSocketObject::InspectionBytesNotCopied );
+    }
+    
+    return KERN_SUCCESS;
+}
+
+//--------------------------------------------------------------------
+
+errno_t
+NkeSocketObject::prepareStreamRing( __in bool inbound, __inout UInt32* dataSize )
+{
+    StreamRing*  stream = &this->streamRings[ NkeSocketObject::PendingQueueIndex( inbound ) ];
+    
+    if( 0x0 == stream->ring.length ){
+        
+        assert( 0x0 != this->capturePolicy.streamRingBytes );
+        assert( 0x0 == stream->writePosition && 0x0 == stream->consumedPosition );
+        
+        if( ! gSocketFilter->allocateStreamRing( this->capturePolicy.streamRingBytes, &stream->ring ) ){
+            
+            stream->ring.length = 0x0;
+            return ENOMEM;
+        }
+    }
+    
+    if( *dataSize > stream->ring.length )
+        *dataSize = stream->ring.length;
+    
+    return KERN_SUCCESS;
+}
+
+//--------------------------------------------------------------------
+
+errno_t
+NkeSocketObject::copyDataToStreamRing(
+    __in bool inbound,
+    __in const mbuf_t* mbufs,
+    __in UInt32 mbufsNumber,
+    __in UInt32 bytesToCopy
+    )
+{
+    StreamRing*  stream = &this->streamRings[ NkeSocketObject::PendingQueueIndex( inbound ) ];
+    
+    assert( 0x0 != stream->ring.length && bytesToCopy <= stream->ring.length );
+    assert( stream->consumedPosition <= stream->writePosition );
+    
+    //
+    // the data waits until the client has consumed enough of the ring
+    //
+    if( ( stream->writePosition - stream->consumedPosition + bytesToCopy ) > stream->ring.length )
+        return ENOMEM;
+    
+    errno_t  error = KERN_SUCCESS;
+    
+    if( 0x0 != bytesToCopy )
+        error = gSocketFilter->copyDataToStreamRing( &stream->ring,
+                                                     (UInt32)( stream->writePosition % stream->ring.length ),
+                                                     mbufs,
+                                                     mbufsNumber,
+                                                     bytesToCopy );
+    return error;
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::commitStreamRingData( __in bool inbound, __in UInt32 bytesCopied )
+{
+    StreamRing*  stream = &this->streamRings[ NkeSocketObject::PendingQueueIndex( inbound ) ];
+    
+    stream->writePosition += bytesCopied;
+    assert( ( stream->writePosition - stream->consumedPosition ) <= stream->ring.length );
+}
+
+//--------------------------------------------------------------------
+
+void
+NkeSocketObject::consumeStreamRing( __in bool inbound, __in UInt64 position )
+{
+    StreamRing*  stream = &this->streamRings[ NkeSocketObject::PendingQueueIndex( inbound ) ];
+    
+    //
+    // the position comes from the client so it is validated, the consumed position never moves back
+    //
+    if( position < stream->consumedPosition || position > stream->writePosition ){
+        
+        DBG_PRINT_ERROR(("an invalid stream position 0x%llx, the consumed position 0x%llx, the write position 0x%llx\n",
+                         position, stream->consumedPosition, stream->writePosition));
+        return;
+    }
+    
+    stream->consumedPosition = position;
+}
+
+//--------------------------------------------------------------------
+
 /*
  checkTag - see if there is a tag associated with the mbuf_t with the matching bitmap bits set in the
     memory associated with the tag. Use global gidtag as id Tag to look for
@@ -2442,7 +4261,11 @@ NkeSocketObject::acquireDetachingLockForRemoval()
     
     assert( this->lockCount >= 0x0 );
     
-    do { // wait for any existing client invocations to return
+    //
+    // usually there is no invocation in progress and the detach doesn't wait, a wakeup
+    // issued between the check and the sleep is lost so the wait is with a timeout
+    //
+    while( this->lockCount != 0 ){ // wait for any existing client invocations to return
         
         struct timespec ts = { 1, 0 };       // one second
         (void)msleep( &this->lockCount,      // wait channel
@@ -2453,7 +4276,7 @@ NkeSocketObject::acquireDetachingLockForRemoval()
         
         assert( this->lockCount >= 0x0 );
         
-    } while( this->lockCount != 0 );
+    } // end while
 }
 
 //--------------------------------------------------------------------
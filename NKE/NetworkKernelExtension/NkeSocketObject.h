@@ -14,14 +14,71 @@
 #include <libkern/OSMalloc.h>
 
 #include "NkeCommon.h"
+#include "NkeEpoch.h"
+#include "NkeSlabAllocator.h"
+#include "NkeTimerWheel.h"
 
 //--------------------------------------------------------------------
 
 #define INVALID_SOCKET_HANDLE       0x0
 #define SO_EVENTS_LOG_SIZE          20
 #define SOCKET_OBJECT_SIGNATURE     0xABCD2345
+#define SOCKET_STUB_SIGNATURE       0xABCD3456
 #define NKE_SOCKTAG_ID_TYPE         0x1
 
+//
+// the sockets hash table size, must be a power of 2
+//
+#define NKE_SOCKETS_HASH_SIZE       0x1000
+
+//
+// the socket slots table geometry, the table consists of chunks that are allocated on demand
+// and are never freed until the driver is unloaded, the slot index is
+// ( chunkIndex * NKE_SOCKET_SLOTS_PER_CHUNK + indexInChunk )
+//
+#define NKE_SOCKET_SLOTS_PER_CHUNK  0x400
+#define NKE_SOCKET_SLOTS_CHUNKS     0x100
+#define NKE_INVALID_SLOT_INDEX      0xFFFFFFFF
+
+//
+// the number of retired objects that triggers the early grace period wait by the injection thread
+//
+#define NKE_RETIRED_SOCKETS_THRESHOLD   0x400
+
+//
+// the maximum number of freed objects kept for reuse by each processor's slot of the recycling cache
+//
+#define NKE_SOCKET_OBJECTS_CACHE_DEPTH  0x20
+
+//
+// the pending packets index geometry, the index is allocated with the first pending packet
+// and is doubled on a collision, must be a power of 2
+//
+#define NKE_PENDING_INDEX_INITIAL_SIZE  0x40
+#define NKE_PENDING_INDEX_MAXIMUM_SIZE  0x1000
+
+//
+// the pending queues, there is a queue for each data direction
+//
+#define NKE_PENDING_QUEUE_INBOUND       0x0
+#define NKE_PENDING_QUEUE_OUTBOUND      0x1
+#define NKE_PENDING_QUEUES_NUMBER       0x2
+
+//
+// the maximum number of packets reported in one notification, bounds the coalescing window
+//
+#define NKE_COALESCING_MAX_PACKETS      0x40
+
+//
+// the per-socket pending data quotas, the inbound stream is throttled by collapsing the receive
+// window when the soft limit is reached, the outbound writer is blocked when the hard limit is reached,
+// the outbound writer is released under the soft limit and the inbound stream under a half of it
+//
+#define NKE_PENDING_BYTES_SOFT_LIMIT      0x40000
+#define NKE_PENDING_BYTES_HARD_LIMIT      0x80000
+#define NKE_PENDING_PACKETS_SOFT_LIMIT    0x100
+#define NKE_PENDING_PACKETS_HARD_LIMIT    0x200
+
 //
 // values to use with the memory allocated by the tag function, to indicate which processing has been
 // performed already
@@ -38,17 +95,62 @@ typedef enum NkeSocketDataDirection{
 
 //--------------------------------------------------------------------
 
+class NkeSocketObject;
+
+//
+// a socket filter's cookie, the attach callback allocates only the stub, the full NkeSocketObject
+// is created when the socket is connected or the first data arrives, so the listening sockets
+// and the connections closed before being established never create the object,
+// a stub without an object is not in the SocketsList and is not reported to the service
+//
+typedef struct _NkeSocketStub{
+    
+#if defined( DBG )
+    SInt32                      signature;
+#endif // DBG
+    
+    socket_t                    socket;
+    mbuf_tag_id_t               gidtag;
+    sa_family_t                 sa_family;
+    
+    //
+    // the addresses as provided by the bind and connect callbacks, in the network byte order,
+    // a valid address has a non zero sa_len, copied to the object on promotion, protected by SocketsListLock
+    //
+    NkeSocketObjectAddress      localAddress;
+    NkeSocketObjectAddress      remoteAddress;
+    
+    //
+    // set once when the stub is promoted, the pointer is not referenced, the object
+    // is kept alive by the SocketsList reference until the detach callback
+    //
+    NkeSocketObject* volatile   object;
+    
+} NkeSocketStub;
+
+//--------------------------------------------------------------------
+
 //
 // IMPORTANT
 // the lock hierarchy, in order of acquiring
 //   - the socket object lock ( rwLock ) is acquired first
 //   - the socket list lock ( SocketsListLock )
 //
+// the SocketsList, the hash table and the slot table are modified with SocketsListLock
+// being acquired exclusively, the readers access them lock-free inside the NkeEpoch
+// read section, an object removed from the SocketsList is retired and the list's
+// reference is released after a grace period
+//
 
 class NkeSocketObject: public OSObject{
     
     OSDeclareDefaultStructors( NkeSocketObject );
     
+    //
+    // the host benchmarks measure the private paths through this class, see HostBenchmarks
+    //
+    friend class NkeSocketObjectBenchmarkAccess;
+    
 private:
     
     //
@@ -62,17 +164,128 @@ private:
     static bool     Initialized;
     
     //
-    // all socket objects are anchored in the double linked list, protected by SocketsListLock,
-    // all objects in the list are retained, the list is protected by SocketsListLock
+    // all socket objects are anchored in the double linked list, all objects in the list are retained,
+    // the writers acquire SocketsListLock, the readers traverse the list inside the NkeEpoch read section
     //
     static TAILQ_HEAD( NkeSocketsListHead, NkeSocketObject ) SocketsList;
     TAILQ_ENTRY(NkeSocketObject)   socketListEntry;
     
     //
-    // a RW lock to protect SocketsList
+    // a RW lock to protect SocketsList from concurrent writers, the readers do not acquire the lock
     //
     static IORWLock*       SocketsListLock;
     
+    //
+    // an index for the objects in SocketsList keyed by a socket_t value, used to find
+    // an object by a socket without scanning the SocketsList, an object is in the hash
+    // table iff it is in the SocketsList, the hash table doesn't hold a reference
+    //
+    static TAILQ_HEAD( NkeSocketsHashBucketHead, NkeSocketObject ) SocketsHash[ NKE_SOCKETS_HASH_SIZE ];
+    TAILQ_ENTRY(NkeSocketObject)   socketHashEntry;
+    
+    //
+    // objects removed from the SocketsList that might still be accessed by the lock-free readers,
+    // the SocketsList reference is transferred to the list and released after a grace period,
+    // the socketListEntry and socketHashEntry can't be reused as they might be being traversed
+    //
+    static TAILQ_HEAD( NkeRetiredSocketsListHead, NkeSocketObject ) RetiredSocketsList;
+    TAILQ_ENTRY(NkeSocketObject)   retiredSocketListEntry;
+    
+    //
+    // protects RetiredSocketsList and RetiredSocketsCount
+    //
+    static IOLock*         RetiredSocketsListLock;
+    static SInt32          RetiredSocketsCount;
+    
+    //
+    // a slot table entry, a slot is occupied by an object while the object is in the SocketsList,
+    // the slot index and the generation make up the NkeSocketID reported to the service
+    //
+    typedef struct _NkeSocketSlot{
+        
+        //
+        // NULL if the slot is free, the object is not referenced by the slot
+        //
+        NkeSocketObject* volatile   object;
+        
+        //
+        // incremented each time the slot is freed, never 0x0
+        //
+        volatile UInt32     generation;
+        
+        //
+        // a next free slot if the slot is in the free slots list
+        //
+        UInt32              nextFreeSlot;
+        
+    } NkeSocketSlot;
+    
+    //
+    // the slot table chunks, the free slots list and the number of slots ever taken from the chunks,
+    // all are protected by SocketsListLock
+    //
+    static NkeSocketSlot*  SocketSlots[ NKE_SOCKET_SLOTS_CHUNKS ];
+    static UInt32          SocketSlotsFreeHead;
+    static UInt32          SocketSlotsCarved;
+    
+    //
+    // a header that precedes the object's memory, the object's locks are allocated once and
+    // are kept in the header when the memory is returned to the recycling cache so a recycled
+    // object doesn't allocate them again
+    //
+    typedef struct _NkeSocketObjectMemoryHeader{
+        
+        struct _NkeSocketObjectMemoryHeader*  nextCached;
+        IORWLock*                             rwLock;
+        IOLock*                               injectionMutex;
+        vm_size_t                             size;
+        
+    } __attribute__((aligned(16))) NkeSocketObjectMemoryHeader;
+    
+    //
+    // the recycling cache, the memory of freed objects is kept in the list of the processor's
+    // slot the object was freed on, an allocation takes from the list of the current processor's slot,
+    // the cache is bounded by NKE_SOCKET_OBJECTS_CACHE_DEPTH for each slot
+    //
+    typedef struct _NkeSocketObjectsCache{
+        
+        IOSimpleLock*                  lock;
+        NkeSocketObjectMemoryHeader*   head;
+        UInt32                         count;
+        
+    } __attribute__((aligned(64))) NkeSocketObjectsCache;
+    
+    static NkeSocketObjectsCache   ObjectsCache[ NKE_PER_CPU_SLOTS ];
+    
+    //
+    // the number of allocations satisfied from the cache and from the general allocator
+    //
+    static volatile SInt64         ObjectsCacheHits;
+    static volatile SInt64         ObjectsCacheMisses;
+    
+    //
+    // the number of times the sockets exceeded their pending data quotas
+    //
+    static volatile SInt64         QuotaInboundThrottlings;
+    static volatile SInt64         QuotaOutboundBlocks;
+    
+    //
+    // the data not copied for the client because of the inspection prefix
+    //
+    static volatile SInt64         InspectionTruncatedNotifications;
+    static volatile SInt64         InspectionBytesNotCopied;
+    
+    static NkeSocketObjectMemoryHeader* MemoryToHeader( __in void* memory )
+    {
+        return ((NkeSocketObjectMemoryHeader*)memory) - 0x1;
+    }
+    
+    //
+    // frees the memory and the locks kept by the recycling cache
+    //
+    static void DestroyObjectMemory( __in NkeSocketObjectMemoryHeader* header );
+    static void PurgeObjectsCache();
+    
     //
     // used to temporary link objects by InjectionThreadRoutine
     //
@@ -98,11 +311,41 @@ private:
     static OSMallocTag		gOSMallocTag;
     
     //
-    // a sequence ID generator, used to distinguish two objects when one is a closed socket and another is a new one
-    // that reuses a memory freed by the closed socket, because of asynchronous processing the parser might reply
-    // with the packets sendt to a closed socket, without a sequence ID they would be applied to a new socket
+    // the pending packets are allocated at the data rate, a general allocator is too
+    // slow for this, so the packets are taken from the per-CPU magazines
     //
-    static SInt32           gSocketSequence;
+    static NkeSlabAllocator*   PendingPktAllocator;
+    
+    //
+    // tracks the verdict deadlines of all pending packets
+    //
+    static NkeTimerWheel*      DeadlineTimerWheel;
+    
+    //
+    // the objects with packets whose deadline has expired, the list is filled by the timer wheel's
+    // expiry callback and drained after the wheel's pass, an object in the list is referenced,
+    // protected by DeadlinedSocketsListLock
+    //
+    static TAILQ_HEAD( NkeDeadlinedSocketsListHead, NkeSocketObject ) DeadlinedSocketsList;
+    static IOSimpleLock*       DeadlinedSocketsListLock;
+    TAILQ_ENTRY(NkeSocketObject)   deadlinedSocketsListEntry;
+    bool                           insertedInDeadlinedSocketsList;
+    
+    //
+    // closes the coalescing windows on the time limit
+    //
+    static NkeTimerWheel*      CoalescingTimerWheel;
+    
+    //
+    // the objects whose coalescing timer has expired, filled by the wheel's expiry callback and drained
+    // after the wheel's pass, the list holds the reference taken for the armed timer, expiredCoalescingWindow
+    // is the window the last expired timer was armed for, protected by ExpiredWindowsSocketsListLock
+    //
+    static TAILQ_HEAD( NkeExpiredWindowsSocketsListHead, NkeSocketObject ) ExpiredWindowsSocketsList;
+    static IOSimpleLock*       ExpiredWindowsSocketsListLock;
+    TAILQ_ENTRY(NkeSocketObject)   expiredWindowsSocketsListEntry;
+    bool                           insertedInExpiredWindowsSocketsList;
+    UInt32                         expiredCoalescingWindow;
     
 private:
     
@@ -111,6 +354,43 @@ private:
     //
     static void InjectionThreadRoutine( void* context );
     
+    //
+    // the deadline timer wheel's callbacks
+    //
+    static void DeadlineTimerExpired( __in NkeTimerWheelEntry* entry, __in void* context );
+    static void ProcessDeadlinedSockets( __in void* context );
+    static void CoalescingTimerExpired( __in NkeTimerWheelEntry* entry, __in void* context );
+    static void CoalescingWindowsExpired( __in void* context );
+    
+    //
+    // returns an index for the SocketsHash bucket
+    //
+    static UInt32 SocketToHashIndex( __in socket_t so )
+    {
+        //
+        // the Fibonacci hashing, the low bits of the socket address are
+        // mostly zeros because of the allocator's alignment
+        //
+        return (UInt32)( ( ((UInt64)so) * 0x9E3779B97F4A7C15ULL ) >> 0x20 ) & ( NKE_SOCKETS_HASH_SIZE - 0x1 );
+    }
+    
+    static NkeSocketSlot* SlotIndexToSlot( __in UInt32 slotIndex )
+    {
+        assert( slotIndex < NkeSocketObject::SocketSlotsCarved );
+        return &NkeSocketObject::SocketSlots[ slotIndex / NKE_SOCKET_SLOTS_PER_CHUNK ][ slotIndex % NKE_SOCKET_SLOTS_PER_CHUNK ];
+    }
+    
+    //
+    // the functions must be called with SocketsListLock acquired exclusively
+    //
+    errno_t acquireSocketSlot();
+    void releaseSocketSlot();
+    
+    //
+    // releases the retired objects after a grace period
+    //
+    static void ReleaseRetiredObjects();
+    
 private:
     
     //
@@ -223,9 +503,9 @@ private:
     
     //
     // the PendingPktQueueItem record is used to store packet information when a packet is made pending.
-    // The item is queued to the pendingQueue regardless of direction. The dataInbound flag determines
-    // which direction the pending packet will be processed. In a more complicated case it might be useful
-    // to implement separate queues
+    // The item is queued to the pending queue for its direction, the dataInbound flag determines
+    // which direction the pending packet will be processed. The dataIndex order is the arrival order
+    // across both queues
     //
     typedef struct _PendingPktQueueItem {
         TAILQ_ENTRY(_PendingPktQueueItem) pendingQueueEntry; /* link to next and prev queued entry or NULL */
@@ -238,7 +518,8 @@ private:
         bool                    dataInbound;
         bool                    needToBeReported; // true if the data has to be reported, increases packetsWaitingForReporting counter
         bool                    responseReceived; // true if the service has made a decision for this packet
-        bool                    deadlineTimerExpired; // true if the packet has not been processed in a reasonable time interval ( like 60 secs )
+        volatile bool           deadlineTimerExpired; // true if the packet has not got a verdict in the capture policy's timeout, set by the timer wheel
+        bool                    allowDataOnDeadline; // the capture policy's decision for a packet without a verdict when the deadline expires
         sflt_data_flag_t		sflt_flags;
         struct{
             UInt32              errorWhileAllocatingBuffers: 0x1; // a debug info, do not use it for control transfer
@@ -246,19 +527,9 @@ private:
             UInt32              waitWasAsserted: 0x1;             // a debug info, do not use it for control transfer
         }                       flags;
         WaitEntry*              waitEntry; // might be NULL if there is no waiting thread, set to a signal state after the data is reported
-        
-        //
-        // the timeout is set to 60 secs
-        //
-        bool isDeadlineTimerExpired() {
-            
-            if( this->deadlineTimerExpired )
-                return true;
-            
-            this->deadlineTimerExpired = ( mach_absolute_time() > (this->allocationTime + 60LL*1000000000LL) );
-            
-            return this->deadlineTimerExpired;
-        };
+        NkeTimerWheelEntry      deadlineTimer; // armed while the packet is in a pending queue
+        NkeSocketObject*        socketObject; // not referenced, the packet is removed before the object is freed
+        UInt32                  reportedPackets; // a number of packets reported with this one in one notification, the verdict applies to all of them
         
     } PendingPktQueueItem;
     
@@ -266,7 +537,40 @@ private:
     // a head for the list of mbuffer items, protected by rwLock
     //
     TAILQ_HEAD( PktPendingQueueHead, _PendingPktQueueItem );
-    PktPendingQueueHead         pendingQueue;
+    
+    //
+    // the inbound and the outbound queues, a packet waiting for a verdict blocks the injection
+    // of the following packets of the same direction only, the other direction's packets are
+    // injected independently until the ordering barrier is raised, see isOrderingBarrierRaised()
+    //
+    PktPendingQueueHead         pendingQueues[ NKE_PENDING_QUEUES_NUMBER ];
+    
+    static int PendingQueueIndex( __in bool dataInbound )
+    {
+        return dataInbound ? NKE_PENDING_QUEUE_INBOUND : NKE_PENDING_QUEUE_OUTBOUND;
+    }
+    
+    //
+    // returns true if the first packet has arrived before the second one, the dataIndex wraps around
+    //
+    static bool IsPktBefore( __in PendingPktQueueItem* first, __in PendingPktQueueItem* second )
+    {
+        return ( (SInt32)( (UInt32)first->dataIndex - (UInt32)second->dataIndex ) < 0x0 );
+    }
+    
+    //
+    // the pending packets addressed by dataIndex, a packet is kept in the slot
+    // ( dataIndex & ( pendingIndexSize - 0x1 ) ), a packet that lost the slot
+    // because of a collision is found by scanning the pending queues, protected by rwLock
+    //
+    PendingPktQueueItem**       pendingIndex;
+    UInt32                      pendingIndexSize;
+    
+    //
+    // the number of pending packets that are not in pendingIndex,
+    // if this is zero the queues are not scanned for a missed dataIndex
+    //
+    UInt32                      pendingUnindexedPackets;
     
     //
     // a counter for deferred packets waiting for being reported, i.e. with needToBeReported set to true
@@ -274,7 +578,31 @@ private:
     SInt32                      packetsWaitingForReporting;
     
     //
-    // a RW lock to protect pendingQueue and other fields
+    // the first packet in each pending queue with needToBeReported set to true or NULL,
+    // all packets after it are also waiting for being reported, protected by rwLock
+    //
+    PendingPktQueueItem*        firstUnreportedPkts[ NKE_PENDING_QUEUES_NUMBER ];
+    
+    //
+    // the coalescing window, the packets in the window are not reported and the object is not
+    // in SocketsListToReport until the window is closed, protected by rwLock, the timer
+    // holds a reference to the object while it is armed, coalescingWindow is increased for
+    // each opened window and the timer's window is the window it has been armed for
+    //
+    typedef struct _CoalescingTimer{
+        NkeTimerWheelEntry      entry; // must be the first member
+        NkeSocketObject*        socketObject;
+        UInt32                  window;
+    } CoalescingTimer;
+    
+    CoalescingTimer             coalescingTimer;
+    UInt32                      coalescingWindow;
+    UInt32                      coalescingPackets;
+    UInt32                      coalescingBytes;
+    bool                        coalescingInbound;
+    
+    //
+    // a RW lock to protect pendingQueues and other fields
     //
     IORWLock*                   rwLock;
     
@@ -298,6 +626,44 @@ private:
     //
     NkeCapturingMode            capturingMode;
     
+    //
+    // the capture policy selected by the socket's ports, protected by rwLock, the policy is selected
+    // again when the filter's policies change or when the remote address becomes known
+    //
+    NkeCapturePolicy            capturePolicy;
+    UInt32                      capturePolicyGeneration;
+    bool                        capturePolicyWithRemotePort;
+    
+    //
+    // true if the inbound stream exceeded the quota and the receive window is collapsed, protected by rwLock
+    //
+    bool                        inboundThrottled;
+    
+    //
+    // the bytes of each direction copied for the client, counted against the inspection prefix,
+    // indexed by PendingQueueIndex(), changed by atomic operations
+    //
+    volatile SInt32             inspectedBytes[ 0x2 ];
+    
+    //
+    // the stream rings indexed by PendingQueueIndex(), a ring is allocated when the first data of the direction
+    // is reported in the ring and is released with the object, the stream positions count the copied bytes,
+    // protected by rwLock
+    //
+    typedef struct _StreamRing{
+        
+        NkeDataSlice  ring;
+        
+        //
+        // the position of the next byte to copy and the position up to which the client has consumed the ring
+        //
+        UInt64        writePosition;
+        UInt64        consumedPosition;
+        
+    } StreamRing;
+    
+    StreamRing                  streamRings[ 0x2 ];
+    
 private:
     
     //
@@ -311,6 +677,118 @@ private:
     
     void verifyPendingPacketsQueue( __in bool lock );
     
+    //
+    // the pending index management, must be called with the exclusive lock held,
+    // a packet is indexed after it has been inserted in a pending queue and unindexed
+    // before it is removed from the queue
+    //
+    void indexPendingPkt( __in PendingPktQueueItem* pkt );
+    void unindexPendingPkt( __in PendingPktQueueItem* pkt );
+    PendingPktQueueItem* findPendingPkt( __in SInt32 dataIndex );
+    bool growPendingIndex();
+    
+    //
+    // returns the earliest packet waiting for being reported, the packets are reported
+    // in the arrival order across both directions, must be called with the lock held
+    //
+    PendingPktQueueItem* getFirstUnreportedPkt();
+    
+    //
+    // true if the packets must be injected in the arrival order across both directions,
+    // this is required when the connection is being shut down or closed
+    //
+    bool isOrderingBarrierRaised();
+    
+    //
+    // refreshes capturePolicy, must be called with the exclusive lock held
+    //
+    void resolveCapturePolicy();
+    
+    //
+    // the coalescing window management, must be called with the exclusive lock held,
+    // addToCoalescingWindow() returns true if the window has been closed and the
+    // notifications should be delivered after the lock is released
+    //
+    bool addToCoalescingWindow( __in PendingPktQueueItem* pkt );
+    void closeCoalescingWindow();
+    
+    //
+    // returns a number of packets starting with the first not reported packet that are reported in
+    // one notification, the packets' data is returned in the batchData array of NKE_COALESCING_MAX_PACKETS
+    // entries, must be called with the exclusive lock held
+    //
+    UInt32 getReportingBatch( __in PendingPktQueueItem* firstPkt, __out mbuf_t* batchData, __out UInt32* batchBytes );
+    
+    //
+    // inserts the object in SocketsListToReport if it is not there, the list references the object
+    //
+    void insertInSocketsListToReport();
+    
+    //
+    // true if the pending data of the direction has reached one of the limits
+    //
+    bool isPendingDataOver( __in bool inbound, __in SInt32 bytesLimit, __in SInt32 packetsLimit )
+    {
+        if( inbound )
+            return ( this->totalPendingBytesIn >= bytesLimit || this->numberOfPendingInPackets >= packetsLimit );
+        
+        return ( this->totalPendingBytesOut >= bytesLimit || this->numberOfPendingOutPackets >= packetsLimit );
+    }
+    
+    //
+    // collapses or restores the socket receive buffer, the TCP window stops moving
+    // its right side while the buffer is collapsed
+    //
+    void setReceiveBufferCollapsed( __in bool collapse );
+    
+    //
+    // lifts the quota throttling if the pending data has drained, must be called without any lock held
+    //
+    void releaseQuotaBackpressure();
+    
+    //
+    // returns a number of the data bytes to copy for the client, the bytes counted against the direction's
+    // prefix are returned in prefixBytesReserved and must be given back by releaseInspectedBytes()
+    // if the data is not reported
+    //
+    UInt32 reserveInspectedBytes( __in bool inbound, __in UInt32 dataSize, __out UInt32* prefixBytesReserved );
+    void releaseInspectedBytes( __in bool inbound, __in UInt32 prefixBytesReserved );
+    
+    //
+    // builds a data notification in place in the client's queue, the slices are NULL for the data
+    // copied in the stream ring at its write position, so the notification is sent before
+    // commitStreamRingData(), ENOENT is returned if there is no client, ENOMEM if the queue is full
+    //
+    errno_t sendDataNotification( __in bool inbound,
+                                  __in UInt32 dataIndex,
+                                  __in UInt32 packetsNumber,
+                                  __in UInt32 dataSize,
+                                  __in UInt32 copiedSize,
+                                  __in_opt const NkeDataSlice* slices );
+    
+    //
+    // true if the direction's data is reported in the stream ring, must be called with the lock held
+    //
+    bool isStreamRingMode( __in bool inbound )
+    {
+        return ( 0x0 != this->streamRings[ PendingQueueIndex( inbound ) ].ring.length ||
+                 0x0 != this->capturePolicy.streamRingBytes );
+    }
+    
+    //
+    // the stream ring management, must be called with the exclusive lock held,
+    // prepareStreamRing() allocates the ring if required and reduces dataSize to the ring length,
+    // copyDataToStreamRing() returns ENOMEM if the client has not consumed enough of the ring,
+    // the write position is advanced by commitStreamRingData() after the notification has been sent
+    //
+    errno_t prepareStreamRing( __in bool inbound, __inout UInt32* dataSize );
+    errno_t copyDataToStreamRing( __in bool inbound,
+                                  __in const mbuf_t* mbufs,
+                                  __in UInt32 mbufsNumber,
+                                  __in UInt32 bytesToCopy );
+    void commitStreamRingData( __in bool inbound, __in UInt32 bytesCopied );
+    void consumeStreamRing( __in bool inbound, __in UInt64 position );
+    
 public:
     
     typedef enum _NkeSocketDataDirectionType{
@@ -354,8 +832,15 @@ protected:
     virtual bool init();
     virtual void free();
     
+    //
+    // the memory is allocated from and returned to the recycling cache
+    //
+    static void operator delete( void* memory, size_t size );
+    
 public:
     
+    static void* operator new( size_t size );
+    
 #if defined( DBG )
     SInt32          signature;
 #endif // DBG
@@ -369,9 +854,15 @@ public:
     static NkeSocketObject* withSocket( __in socket_t so, __in mbuf_tag_id_t gidtag, __in sa_family_t sa_family );
     
     //
-    // insert an object in the list and takes a reference
+    // fills in the socket objects related statistics
     //
-    void insertInSocketsList();
+    static void GetStatistics( __inout NkeFilterStatistics* statistics );
+    
+    //
+    // insert an object in the list and takes a reference, assigns the socket ID and sets
+    // the stub's object, EEXIST is returned if the stub has been already promoted
+    //
+    errno_t insertInSocketsList( __in NkeSocketStub* stub );
     
     //
     // undoes insertInSocketsList
@@ -382,6 +873,30 @@ public:
     
     static NkeSocketObject* GetSocketObjectRef( __in socket_t so );
     
+    //
+    // the stub is allocated by the attach callback and freed by the detach callback
+    //
+    static NkeSocketStub* AllocateSocketStub( __in socket_t so, __in mbuf_tag_id_t gidtag, __in sa_family_t sa_family );
+    static void FreeSocketStub( __in NkeSocketStub* stub );
+    
+    //
+    // returns the stub's object creating it if necessary, the returned object is not referenced,
+    // NULL is returned if the object can't be created
+    //
+    static NkeSocketObject* PromoteSocketStub( __in NkeSocketStub* stub );
+    
+    //
+    // sets the address in the stub's object or saves it in the stub that has not been promoted,
+    // the stub is written under SocketsListLock so the promotion doesn't miss the address
+    //
+    static void SetSocketStubAddress( __in NkeSocketStub* stub, __in bool local, __in const struct sockaddr* address );
+    
+    //
+    // returns a referenced object for the ID reported to the service or NULL
+    // if the socket has been closed
+    //
+    static NkeSocketObject* GetSocketObjectRefById( __in const NkeSocketID* socketId );
+    
     void logSocketPreEvent( __in sflt_event_t event );
     void logSocketPostEvent( __in sflt_event_t event );
     
@@ -430,7 +945,6 @@ public:
     sa_family_t getProtocolFamily() { return this->sa_family; }
     
     void getSocketId( __inout NkeSocketID* outSocketId ){ *outSocketId = this->socketId; };
-    UInt64 getSocketSequence() { return this->socketId.socketSequence; };
     
     void markAsDisconnected() { this->disconnected = true; };
     bool isDisconnected() { return this->disconnected; };
@@ -452,27 +966,39 @@ NkeIsSocketObjectInList( __in socket_t so )
 
 //--------------------------------------------------------------------
 
-//
-// the returned object is not referenced
-//
 inline
-NkeSocketObject* NkeCookieToSocketObject( __in void* cookie )
+NkeSocketStub* NkeCookieToSocketStub( __in void* cookie )
 {
-    NkeSocketObject*   sockObj = (NkeSocketObject*)cookie;
+    NkeSocketStub*   stub = (NkeSocketStub*)cookie;
     
-    assert( SOCKET_OBJECT_SIGNATURE == sockObj->signature );
+    assert( SOCKET_STUB_SIGNATURE == stub->signature );
     
-    return sockObj;
+    return stub;
 }
 
 //--------------------------------------------------------------------
 
 inline
-void* NkeSocketObjectToCookie( __in NkeSocketObject* sockObj )
+void* NkeSocketStubToCookie( __in NkeSocketStub* stub )
 {    
-    assert( SOCKET_OBJECT_SIGNATURE == sockObj->signature );
+    assert( SOCKET_STUB_SIGNATURE == stub->signature );
+    
+    return (void*)stub;
+}
+
+//--------------------------------------------------------------------
+
+//
+// the returned object is not referenced, NULL is returned if the stub has not been promoted
+//
+inline
+NkeSocketObject* NkeSocketStubToSocketObject( __in NkeSocketStub* stub )
+{
+    NkeSocketObject*   sockObj = stub->object;
+    
+    assert( ! sockObj || SOCKET_OBJECT_SIGNATURE == sockObj->signature );
     
-    return (void*)sockObj;
+    return sockObj;
 }
 
 //--------------------------------------------------------------------
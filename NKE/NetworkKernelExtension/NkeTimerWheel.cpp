@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <kern/clock.h>
+#include <sys/proc.h>
+#include "NkeTimerWheel.h"
+
+//--------------------------------------------------------------------
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors( NkeTimerWheel, OSObject )
+
+//--------------------------------------------------------------------
+
+//
+// a maximal distance to the expiration tick that fits in the wheel
+//
+#define NKE_TIMER_WHEEL_RANGE   ( ((UInt64)0x1) << ( NKE_TIMER_WHEEL_SLOT_BITS * NKE_TIMER_WHEEL_LEVELS ) )
+
+//
+// a wakeup tick for the idle wheel
+//
+#define NKE_TIMER_WHEEL_NO_WAKEUP   ((UInt64)(-1LL))
+
+//--------------------------------------------------------------------
+
+NkeTimerWheel* NkeTimerWheel::withCallbacks( __in NkeTimerWheelExpiryCallback expiryCallback,
+                                             __in NkeTimerWheelPassCallback passCallback,
+                                             __in void* context )
+{
+    assert( expiryCallback );
+    
+    NkeTimerWheel*  newWheel = new NkeTimerWheel();
+    assert( newWheel );
+    if( ! newWheel ){
+        
+        DBG_PRINT_ERROR(("operator new failed\n"));
+        return NULL;
+    }
+    
+    if( ! newWheel->init() ){
+        
+        DBG_PRINT_ERROR(("init() failed\n"));
+        newWheel->release();
+        return NULL;
+    }
+    
+    newWheel->expiryCallback = expiryCallback;
+    newWheel->passCallback = passCallback;
+    newWheel->context = context;
+    
+    //
+    // the callbacks must be set before the thread starts
+    //
+    thread_t   thread;
+    kern_return_t  error = kernel_thread_start( ( thread_continue_t ) &NkeTimerWheel::ThreadRoutine,
+                                                newWheel,
+                                                &thread );
+    assert( KERN_SUCCESS == error );
+    if( KERN_SUCCESS != error ){
+        
+        DBG_PRINT_ERROR(("kernel_thread_start() failed with an error %d\n", error));
+        newWheel->release();
+        return NULL;
+    }
+    
+    //
+    // release the thread object
+    //
+    thread_deallocate( thread );
+    
+    newWheel->threadStarted = true;
+    
+    return newWheel;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeTimerWheel::init()
+{
+    if( ! super::init() ){
+        
+        assert( !"super::init() failed" );
+        DBG_PRINT_ERROR(( "super::init() failed\n" ));
+        return false;
+    }
+    
+    for( int level = 0x0; level < NKE_TIMER_WHEEL_LEVELS; ++level ){
+        
+        for( int slot = 0x0; slot < NKE_TIMER_WHEEL_SLOTS; ++slot )
+            TAILQ_INIT( &this->slots[ level ][ slot ] );
+    } // end for
+    
+    this->lock = IOLockAlloc();
+    assert( this->lock );
+    if( ! this->lock ){
+        
+        DBG_PRINT_ERROR(("this->lock = IOLockAlloc() failed\n"));
+        return false;
+    }
+    
+    nanoseconds_to_absolutetime( (uint64_t)NKE_TIMER_WHEEL_TICK_MS * 1000000ULL, &this->tickInterval );
+    clock_get_uptime( &this->startTime );
+    
+    this->currentTick = 0x0;
+    this->wakeupTick = NKE_TIMER_WHEEL_NO_WAKEUP;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeTimerWheel::free()
+{
+    //
+    // the thread references the object so it must have been stopped
+    //
+    assert( ! this->threadStarted || this->threadExited );
+    
+    if( this->lock ){
+        
+        IOLockFree( this->lock );
+        this->lock = NULL;
+    }
+    
+    super::free();
+}
+
+//--------------------------------------------------------------------
+
+void NkeTimerWheel::stop()
+{
+    if( ! this->threadStarted )
+        return;
+    
+    IOLockLock( this->lock );
+    { // start of the lock
+        
+        this->terminate = true;
+        wakeup( &this->wakeupTick );
+        
+        while( ! this->threadExited ){
+            
+            (void)msleep( &this->threadExited,                 // wait channel
+                          (lck_mtx_t*)IOLockGetMachLock( this->lock ), // mutex
+                          PUSER,                               // priority
+                          "NkeTimerWheel::stop()",             // wait message
+                          NULL );                              // sleep interval
+        } // end while
+        
+    } // end of the lock
+    IOLockUnlock( this->lock );
+}
+
+//--------------------------------------------------------------------
+
+UInt64 NkeTimerWheel::getTickForTime( __in uint64_t absoluteTime )
+{
+    if( absoluteTime <= this->startTime )
+        return 0x0;
+    
+    return ( absoluteTime - this->startTime ) / this->tickInterval;
+}
+
+//--------------------------------------------------------------------
+
+void NkeTimerWheel::insertEntry( __in NkeTimerWheelEntry* entry )
+{
+    //
+    // a cascaded entry might expire on the current tick, its slot is processed after the cascade
+    //
+    assert( entry->expirationTick >= this->currentTick );
+    
+    UInt64  delta = entry->expirationTick - this->currentTick;
+    int     level = 0x0;
+    
+    if( delta >= NKE_TIMER_WHEEL_RANGE ){
+        
+        delta = NKE_TIMER_WHEEL_RANGE - 0x1;
+        entry->expirationTick = this->currentTick + delta;
+    }
+    
+    //
+    // the level is the lowest one where the distance fits in a single turn of the level's wheel
+    //
+    while( level < ( NKE_TIMER_WHEEL_LEVELS - 0x1 ) &&
+           delta >= ( ((UInt64)0x1) << ( NKE_TIMER_WHEEL_SLOT_BITS * ( level + 0x1 ) ) ) ){
+        
+        ++level;
+    } // end while
+    
+    UInt32  slot = (UInt32)( ( entry->expirationTick >> ( NKE_TIMER_WHEEL_SLOT_BITS * level ) ) & NKE_TIMER_WHEEL_SLOT_MASK );
+    
+    entry->slot = &this->slots[ level ][ slot ];
+    TAILQ_INSERT_TAIL( entry->slot, entry, slotListEntry );
+}
+
+//--------------------------------------------------------------------
+
+void NkeTimerWheel::removeEntry( __in NkeTimerWheelEntry* entry )
+{
+    assert( entry->armed && entry->slot );
+    
+    TAILQ_REMOVE( entry->slot, entry, slotListEntry );
+    entry->slot = NULL;
+}
+
+//--------------------------------------------------------------------
+
+void NkeTimerWheel::arm( __inout NkeTimerWheelEntry* entry, __in UInt32 timeoutMs )
+{
+    uint64_t  now;
+    
+    clock_get_uptime( &now );
+    
+    //
+    // the current tick is partially elapsed so one more tick is added to not expire earlier
+    //
+    UInt64  ticks = ( timeoutMs + NKE_TIMER_WHEEL_TICK_MS - 0x1 ) / NKE_TIMER_WHEEL_TICK_MS + 0x1;
+    
+    IOLockLock( this->lock );
+    { // start of the lock
+        
+        if( entry->armed ){
+            
+            this->removeEntry( entry );
+            
+        } else {
+            
+            if( 0x0 == this->armedCount ){
+                
+                //
+                // the wheel is empty so it can be advanced to the current time without processing the ticks
+                //
+                UInt64  nowTick = this->getTickForTime( now );
+                
+                if( nowTick > this->currentTick )
+                    this->currentTick = nowTick;
+            }
+            
+            this->armedCount += 0x1;
+        }
+        
+        entry->expirationTick = this->getTickForTime( now ) + ticks;
+        entry->armed = true;
+        
+        //
+        // the thread might have processed the ticks past the time sampled before the lock was acquired
+        //
+        if( entry->expirationTick <= this->currentTick )
+            entry->expirationTick = this->currentTick + 0x1;
+        
+        this->insertEntry( entry );
+        
+        //
+        // wake up the thread if it sleeps past the new expiration tick
+        //
+        if( entry->expirationTick < this->wakeupTick )
+            wakeup( &this->wakeupTick );
+            
+    } // end of the lock
+    IOLockUnlock( this->lock );
+}
+
+//--------------------------------------------------------------------
+
+bool NkeTimerWheel::cancel( __inout NkeTimerWheelEntry* entry )
+{
+    bool  wasArmed = false;
+    
+    IOLockLock( this->lock );
+    { // start of the lock
+        
+        if( entry->armed ){
+            
+            this->removeEntry( entry );
+            
+            entry->armed = false;
+            wasArmed = true;
+            
+            assert( this->armedCount > 0x0 );
+            this->armedCount -= 0x1;
+        }
+        
+    } // end of the lock
+    IOLockUnlock( this->lock );
+    
+    return wasArmed;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeTimerWheel::processTick( __in UInt64 tick )
+{
+    assert( tick == this->currentTick );
+    
+    //
+    // when a level's wheel completes a turn the next slot of the upper level is cascaded,
+    // the cascaded entries are placed in the lower levels relative to the current tick
+    //
+    for( int level = 0x1; level < NKE_TIMER_WHEEL_LEVELS; ++level ){
+        
+        if( 0x0 != ( tick & ( ( ((UInt64)0x1) << ( NKE_TIMER_WHEEL_SLOT_BITS * level ) ) - 0x1 ) ) )
+            break;
+        
+        UInt32  slot = (UInt32)( ( tick >> ( NKE_TIMER_WHEEL_SLOT_BITS * level ) ) & NKE_TIMER_WHEEL_SLOT_MASK );
+        NkeTimerWheelSlot  cascaded;
+        
+        TAILQ_INIT( &cascaded );
+        TAILQ_CONCAT( &cascaded, &this->slots[ level ][ slot ], slotListEntry );
+        
+        while( ! TAILQ_EMPTY( &cascaded ) ){
+            
+            NkeTimerWheelEntry*  entry = TAILQ_FIRST( &cascaded );
+            
+            TAILQ_REMOVE( &cascaded, entry, slotListEntry );
+            this->insertEntry( entry );
+        } // end while
+    } // end for
+    
+    NkeTimerWheelSlot*  expired = &this->slots[ 0x0 ][ tick & NKE_TIMER_WHEEL_SLOT_MASK ];
+    bool                fired = false;
+    
+    while( ! TAILQ_EMPTY( expired ) ){
+        
+        NkeTimerWheelEntry*  entry = TAILQ_FIRST( expired );
+        
+        assert( entry->armed && entry->expirationTick <= tick );
+        
+        TAILQ_REMOVE( expired, entry, slotListEntry );
+        
+        entry->slot = NULL;
+        entry->armed = false;
+        
+        assert( this->armedCount > 0x0 );
+        this->armedCount -= 0x1;
+        this->expiredCount += 0x1;
+        
+        this->expiryCallback( entry, this->context );
+        fired = true;
+    } // end while
+    
+    return fired;
+}
+
+//--------------------------------------------------------------------
+
+UInt64 NkeTimerWheel::getNextWorkTick()
+{
+    if( 0x0 == this->armedCount )
+        return NKE_TIMER_WHEEL_NO_WAKEUP;
+    
+    //
+    // look for a non empty slot on the lowest level before the next cascade
+    //
+    UInt64  tick = this->currentTick + 0x1;
+    
+    do{
+        
+        if( ! TAILQ_EMPTY( &this->slots[ 0x0 ][ tick & NKE_TIMER_WHEEL_SLOT_MASK ] ) )
+            return tick;
+        
+        if( 0x0 == ( tick & NKE_TIMER_WHEEL_SLOT_MASK ) )
+            break;
+        
+        ++tick;
+        
+    } while( true );
+    
+    return tick;
+}
+
+//--------------------------------------------------------------------
+
+void NkeTimerWheel::ThreadRoutine( __in NkeTimerWheel* wheel )
+{
+    IOLockLock( wheel->lock );
+    
+    while( ! wheel->terminate ){
+        
+        uint64_t  now;
+        bool      fired = false;
+        
+        clock_get_uptime( &now );
+        
+        UInt64  nowTick = wheel->getTickForTime( now );
+        
+        while( wheel->currentTick < nowTick ){
+            
+            wheel->currentTick += 0x1;
+            
+            if( wheel->processTick( wheel->currentTick ) )
+                fired = true;
+        } // end while
+        
+        if( fired && wheel->passCallback ){
+            
+            //
+            // the expired entries are processed by the callback without the wheel lock,
+            // the callback is allowed to arm and cancel the timers
+            //
+            IOLockUnlock( wheel->lock );
+            {
+                wheel->passCallback( wheel->context );
+            }
+            IOLockLock( wheel->lock );
+            
+            continue;
+        }
+        
+        wheel->wakeupTick = wheel->getNextWorkTick();
+        
+        struct timespec   ts;
+        struct timespec*  timeout = NULL;
+        
+        if( NKE_TIMER_WHEEL_NO_WAKEUP != wheel->wakeupTick ){
+            
+            uint64_t  wakeupTime = wheel->startTime + wheel->wakeupTick * wheel->tickInterval;
+            uint64_t  interval = 0x0;
+            
+            if( wakeupTime > now )
+                absolutetime_to_nanoseconds( wakeupTime - now, &interval );
+            
+            ts.tv_sec = (long)( interval / 1000000000ULL );
+            ts.tv_nsec = (long)( interval % 1000000000ULL );
+            
+            //
+            // a zero timeout is an infinite wait for msleep
+            //
+            if( 0x0 == ts.tv_sec && 0x0 == ts.tv_nsec )
+                ts.tv_nsec = 0x1;
+            
+            timeout = &ts;
+        }
+        
+        (void)msleep( &wheel->wakeupTick,                     // wait channel
+                      (lck_mtx_t*)IOLockGetMachLock( wheel->lock ), // mutex
+                      PUSER,                                  // priority
+                      "NkeTimerWheel::ThreadRoutine()",       // wait message
+                      timeout );                              // sleep interval
+        
+        wheel->wakeupTick = NKE_TIMER_WHEEL_NO_WAKEUP;
+        
+    } // end while
+    
+    wheel->threadExited = true;
+    wakeup( &wheel->threadExited );
+    
+    IOLockUnlock( wheel->lock );
+    
+    thread_terminate( current_thread() );
+}
+
+//--------------------------------------------------------------------
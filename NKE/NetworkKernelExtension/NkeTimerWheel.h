@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKETIMERWHEEL_H
+#define _NKETIMERWHEEL_H
+
+#include <sys/queue.h>
+#include "NkeCommon.h"
+
+//--------------------------------------------------------------------
+
+//
+// the wheel resolution in milliseconds
+//
+#define NKE_TIMER_WHEEL_TICK_MS       0xA
+
+//
+// the wheel geometry, each level has NKE_TIMER_WHEEL_SLOTS slots, a slot on the level L
+// spans NKE_TIMER_WHEEL_SLOTS^L ticks, the four levels cover about 46 hours with 10 ms ticks,
+// a longer timeout is clamped to the wheel range
+//
+#define NKE_TIMER_WHEEL_SLOT_BITS     0x6
+#define NKE_TIMER_WHEEL_SLOTS         ( 0x1 << NKE_TIMER_WHEEL_SLOT_BITS )
+#define NKE_TIMER_WHEEL_SLOT_MASK     ( NKE_TIMER_WHEEL_SLOTS - 0x1 )
+#define NKE_TIMER_WHEEL_LEVELS        0x4
+
+//--------------------------------------------------------------------
+
+//
+// a timer, embedded in the object it tracks, the object must not be freed while the timer is armed
+//
+typedef struct _NkeTimerWheelEntry{
+    
+    TAILQ_ENTRY( _NkeTimerWheelEntry )  slotListEntry;
+    
+    //
+    // a slot the timer is linked in, valid while the timer is armed
+    //
+    struct _NkeTimerWheelSlot*          slot;
+    
+    //
+    // a tick on which the timer expires
+    //
+    UInt64      expirationTick;
+    
+    //
+    // true while the timer is in a wheel's slot, protected by the wheel lock
+    //
+    bool        armed;
+    
+} NkeTimerWheelEntry;
+
+typedef TAILQ_HEAD( _NkeTimerWheelSlot, _NkeTimerWheelEntry ) NkeTimerWheelSlot;
+
+//
+// called for each expired timer with the wheel lock held, must not acquire any lock
+// that might be held while arm() or cancel() are called
+//
+typedef void (*NkeTimerWheelExpiryCallback)( __in NkeTimerWheelEntry* entry, __in void* context );
+
+//
+// called without any lock held after the timers expired on a wheel turn have been processed
+//
+typedef void (*NkeTimerWheelPassCallback)( __in void* context );
+
+//--------------------------------------------------------------------
+
+//
+// a hierarchical timing wheel, arming and cancelling are O(1), the timers are moved to a lower level
+// when the lower level's wheel completes a turn, a wheel thread processes the ticks and sleeps until
+// there is a non empty slot or a cascade, or indefinitely if there is no armed timer
+//
+
+class NkeTimerWheel: public OSObject{
+    
+    OSDeclareDefaultStructors( NkeTimerWheel );
+    
+private:
+    
+    NkeTimerWheelSlot   slots[ NKE_TIMER_WHEEL_LEVELS ][ NKE_TIMER_WHEEL_SLOTS ];
+    
+    //
+    // protects the slots and the fields below
+    //
+    IOLock*             lock;
+    
+    //
+    // the last processed tick, the ticks are counted from startTime
+    //
+    UInt64              currentTick;
+    uint64_t            startTime;
+    uint64_t            tickInterval;
+    
+    UInt32              armedCount;
+    
+    //
+    // a tick the wheel thread sleeps until, also a wait channel for the thread
+    //
+    UInt64              wakeupTick;
+    
+    bool                terminate;
+    bool                threadStarted;
+    bool                threadExited;
+    
+    NkeTimerWheelExpiryCallback   expiryCallback;
+    NkeTimerWheelPassCallback     passCallback;
+    void*                         context;
+    
+    volatile SInt64     expiredCount;
+    
+    static void ThreadRoutine( __in NkeTimerWheel* wheel );
+    
+    UInt64 getTickForTime( __in uint64_t absoluteTime );
+    
+    //
+    // the following functions must be called with the lock held
+    //
+    void insertEntry( __in NkeTimerWheelEntry* entry );
+    void removeEntry( __in NkeTimerWheelEntry* entry );
+    UInt64 getNextWorkTick();
+    
+    //
+    // returns true if any timer expired
+    //
+    bool processTick( __in UInt64 tick );
+    
+protected:
+    
+    virtual bool init();
+    virtual void free();
+    
+public:
+    
+    static NkeTimerWheel* withCallbacks( __in NkeTimerWheelExpiryCallback expiryCallback,
+                                         __in NkeTimerWheelPassCallback passCallback,
+                                         __in void* context );
+    
+    //
+    // arms or rearms the timer, the timer expires not earlier than timeoutMs milliseconds,
+    // the lateness is bounded by two ticks and the wheel thread's scheduling latency
+    //
+    void arm( __inout NkeTimerWheelEntry* entry, __in UInt32 timeoutMs );
+    
+    //
+    // returns true if the timer was armed, after the function returns the callback
+    // will not be called for the timer
+    //
+    bool cancel( __inout NkeTimerWheelEntry* entry );
+    
+    //
+    // stops the wheel thread, must be called before the last reference is released,
+    // the armed timers will not expire after the call
+    //
+    void stop();
+    
+    UInt64 getExpiredCount(){ return this->expiredCount; }
+};
+
+//--------------------------------------------------------------------
+
+#endif // _NKETIMERWHEEL_H
@@ -16,6 +16,21 @@
 // If the driver interface is changed the NkeDriverInterfaceVersion must be increased!
 //
 
+//
+// the version is passed by a client to kt_NkeUserClientOpen, a client built for another version
+// is rejected, the version 0x2 introduced the socket IDs made of a slot index and a generation,
+// the version 0x3 introduced the filter statistics, the version 0x4 added the pending packets
+// allocator statistics, the version 0x5 introduced the capture policies, the version 0x6
+// introduced the coalesced data notifications, the version 0x7 added the pending data quota
+// statistics, the version 0x8 introduced the data arena slices, the version 0x9 made the data
+// arena geometry a load-time tunable, the version 0xa added the inspection prefix, the version
+// 0xb added the stream rings, the version 0xc added the data arena resizing, the version 0xd
+// mapped the whole data arena with one memory type, the version 0xe added the compact
+// notifications, the version 0xf added the wakeup moderation statistics, the version 0x10
+// introduced the socket filter queues
+//
+#define NkeDriverInterfaceVersion  0x10
+
 //--------------------------------------------------------------------
 
 // Because of 32 bit driver and 64 bit service the alignment and pack attribute is required for all structures
@@ -29,9 +44,15 @@
 //--------------------------------------------------------------------
 
 enum {
+    //
+    // the input is NkeDriverInterfaceVersion, the kt_NkeOpenFlagXXX flags and the number of
+    // the socket filter queues, the output is the size and the maximal number of the data arena buffers
+    //
     kt_NkeUserClientOpen = 0x0,             // 0x0
     kt_NkeUserClientClose,                  // 0x1
     kt_NkeUserClientSocketFilterResponse,   // 0x2
+    kt_NkeUserClientGetStatistics,          // 0x3
+    kt_NkeUserClientSetCapturePolicies,     // 0x4
     
     //
     // the number of methods
@@ -46,42 +67,64 @@ enum {
 
 //--------------------------------------------------------------------
 
+//
+// the notifications are compact, see NkeSocketFilterNotification
+//
+#define kt_NkeOpenFlagCompactNotifications  0x1
+
+//--------------------------------------------------------------------
+
+//
+// the maximal number of the socket filter queues a client can request from kt_NkeUserClientOpen,
+// the notifications of a socket are always enqueued in the same queue so a client can consume
+// each queue in its own thread and still receive the socket's notifications in order, the
+// notifications not related to a socket are enqueued in each queue
+//
+#define kt_NkeSocketFilterQueuesMax  0x8
+
 typedef enum{
     kt_NkeNotifyTypeUnknown = 0x0,
     kt_NkeNotifyTypeSocketFilter,
     
+    //
+    // the socket filter queue with an index I has the type kt_NkeNotifyTypeSocketFilter + I,
+    // the type is used for IOConnectSetNotificationPort and IOConnectMapMemory
+    //
+    kt_NkeNotifyTypeSocketFilterLast = kt_NkeNotifyTypeSocketFilter + kt_NkeSocketFilterQueuesMax - 0x1,
+    
     //
     // always the last
     //
     kt_NkeNotifyTypeMax
     
     // but this is not the end of the story
-    // [ kt_NkeAclTypeSocketDataBase, kt_NkeAclTypeSocketDataBase + kt_NkeSocketBuffersNumber ) is a range reserved for socket buffers!
+    // kt_NkeAclTypeSocketData is reserved for the data arena!
     
 } NkeNotifyType;
 
 //
-// there are kt_NkeSocketBuffersNumber buffer, this value is a starting base for IOConnectMapMemory,
-// this out of range values can't be added to NkeNotifyType as kt_NkeNotifyTypeMax is used for a shared
-// queue implementation
+// the memory type for IOConnectMapMemory that maps the whole data arena, the slice offsets are
+// from the mapping start, this out of range value can't be added to NkeNotifyType as kt_NkeNotifyTypeMax
+// is used for a shared queue implementation
 //
-#define kt_NkeAclTypeSocketDataBase  (kt_NkeNotifyTypeMax+0x1000)
+#define kt_NkeAclTypeSocketData  (kt_NkeNotifyTypeMax+0x1000)
 
 //--------------------------------------------------------------------
 
 typedef struct _NkeSocketID
 {
     //
-    // a socket handle ( a socket address currently )
+    // an index of the socket's slot in the driver's slot table
     //
-    UInt64                      socket;
+    UInt32                      slotIndex;
     
     //
-    // a socket sequence to distinguish socket reusage and to not apply properties to reused socket
+    // a slot generation, changes each time the slot is reused so a closed socket's ID never
+    // matches a new socket occupying the same slot, a valid generation is never 0x0
     //
-    UInt64                      socketSequence;
+    UInt32                      generation;
     
-} NkeSocketID;
+} NKE_ALIGNMENT NkeSocketID;
 
 typedef union _NkeSocketObjectAddress {
     struct sockaddr     hdr;
@@ -100,6 +143,7 @@ typedef enum _NkeSocketFilterEvent{
     NkeSocketFilterEventBound,
     NkeSocketFilterEventDataIn,
     NkeSocketFilterEventDataOut,
+    NkeSocketFilterEventDataArenaResized,
     
     // Always the last, used to prevent the compiler from shrinking the enumerator size to 16 bytes
     NkeSocketFilterEventMax = 0xFFFFFFFF
@@ -111,6 +155,11 @@ typedef enum _NkeSocketFilterEvent{
 //   NkeSocketFilterEventXXXXXData
 //   Data
 //
+// if the client opened the driver with kt_NkeOpenFlagCompactNotifications a notification is
+// truncated after its event's data, the events with a reserved field only have no data, a data
+// notification ends after the last slice with a non zero length, the size field is the truncated
+// size, a compact notification copied in a zeroed NkeSocketFilterNotification is the full notification
+//
 
 typedef struct _NkeSocketFilterEventConnectedData{
     sa_family_t sa_family; // Socket address family
@@ -160,8 +209,49 @@ typedef struct _NkeSocketFilterEventBoundData{
     
 } NKE_ALIGNMENT NkeSocketFilterEventBoundData;
 
-#define kt_NkeSocketBuffersNumber  40 // the maximum number 254
-// static char StaticAssert_NkeSocketBuffersNumber[ (kt_NkeSocketBuffersNumber <= 254) ? 0 : -1 ];
+//
+// a data arena buffer has been added or removed, the notification is not related to a socket,
+// the client's mapping of the arena doesn't have the added buffer's memory so the client must
+// map the arena again before using a slice in the buffer, the notification is received before
+// any slice in the added buffer, the memory of a removed buffer is freed when the client unmaps
+// the arena mapping it has been mapped with, each socket filter queue receives the notification
+// before the slices in the added buffer are reported by this queue, a queue might receive a notification
+// the other queues have not received if the notification was not enqueued in all queues, the client
+// maps the arena again if the generation is greater than the generation of the changes its mapping has
+//
+typedef struct _NkeSocketFilterEventDataArenaResizedData{
+    
+    UInt32  bufferIndex;
+    UInt32  bufferActive;
+    UInt32  activeBuffersNumber;
+    
+    //
+    // increased for each reported change, starts from 0x1 when the driver is loaded
+    //
+    UInt32  generation;
+    
+} NKE_ALIGNMENT NkeSocketFilterEventDataArenaResizedData;
+
+//
+// the data arena consists of buffers of equal size and is mapped by a single call to IOConnectMapMemory
+// for kt_NkeAclTypeSocketData, the buffers size and number are set when the driver is loaded and are
+// returned by kt_NkeUserClientOpen, the defaults are used if the driver's personality doesn't provide
+// the NkeDataBufferSize and NkeDataBuffersNumber properties, the arena starts with NkeDataBuffersNumber
+// buffers and grows up to NkeDataBuffersNumberMax buffers, kt_NkeUserClientOpen returns the maximal
+// number, the mapping's size is the buffer size multiplied by the maximal number
+//
+#define kt_NkeSocketBuffersNumberDefault  40
+#define kt_NkeSocketBufferSizeDefault     0x10000
+#define kt_NkeSocketBuffersNumberMaxDefault  160
+
+//
+// the buffer size is a multiple of kt_NkeSocketBufferSizeMin, the arena size
+// is limited by kt_NkeSocketDataArenaSizeMax
+//
+#define kt_NkeSocketBuffersNumberMax      0x4000
+#define kt_NkeSocketBufferSizeMin         0x4000
+#define kt_NkeSocketBufferSizeMax         0x400000
+#define kt_NkeSocketDataArenaSizeMax      0x40000000
 
 #ifndef UINT8_MAX
     #define UINT8_MAX         255
@@ -172,6 +262,20 @@ typedef struct _NkeSocketFilterEventBoundData{
 #endif // UINT32_MAX
 
 
+//
+// a part of the data arena, the offset is from the arena start, a slice doesn't cross a buffer
+// boundary so it is in the buffer ( offset / bufferSize ), a slice is returned
+// to the driver by NkeSocketFilterServiceResponse when the client is done with the data
+//
+typedef struct _NkeDataSlice{
+    
+    UInt32  offset;
+    UInt32  length;
+    
+} NKE_ALIGNMENT NkeDataSlice;
+
+#define kt_NkeSocketDataSlicesNumber  0x8
+
 typedef struct _NkeSocketFilterEventIoData{
     // Structure for trailing data that follows event
     
@@ -188,11 +292,33 @@ typedef struct _NkeSocketFilterEventIoData{
     UInt32  dataIndex;
     
     //
-    // data are placed in the buffers that are mapped by a call to IOConnectMapMemory
-    // contains buffer indices, the terminating element has 0xFF value
-    // if there is no terminating element the data occupies all buffers
+    // a number of pending packets the data has been coalesced from, the packets are consecutive
+    // packets of the same direction starting with dataIndex, a verdict for dataIndex applies to all of them
     //
-    UInt8   buffers[ kt_NkeSocketBuffersNumber ];
+    UInt32  packetsNumber;
+    
+    //
+    // a number of the data bytes copied in the slices, the copied bytes are the data start,
+    // truncated is set if copiedSize is less than dataSize because of the inspection prefix
+    //
+    UInt32  copiedSize;
+    UInt8   truncated;
+    
+    //
+    // if streamRing has a non zero length the data has been copied in the direction's stream ring
+    // instead of the slices, the copied bytes start at the stream position streamPosition, a byte
+    // at the stream position P is at the ring's offset ( P % streamRing.length ), the bytes of
+    // the consecutive notifications follow each other in the ring, the ring space is returned by
+    // NkeSocketDataPropertyTypeStreamConsumed
+    //
+    NkeDataSlice  streamRing;
+    UInt64        streamPosition;
+    
+    //
+    // the data is placed in the slices one after another, the terminating slice has
+    // a zero length, if there is no terminating slice the data occupies all slices
+    //
+    NkeDataSlice  slices[ kt_NkeSocketDataSlicesNumber ];
     
 } NKE_ALIGNMENT NkeSocketFilterEventIoData;
 
@@ -238,6 +364,7 @@ typedef struct _NkeSocketFilterNotification{
         NkeSocketFilterEventClosingData         closing;
         NkeSocketFilterEventBoundData           bound;
         NkeSocketFilterEventIoData              inputoutput; // NkeSocketFilterEventDataIn OR NkeSocketFilterEventDataOut
+        NkeSocketFilterEventDataArenaResizedData  arenaResized;
     }  eventData;
     
 } NKE_ALIGNMENT NkeSocketFilterNotification;
@@ -246,6 +373,7 @@ typedef struct _NkeSocketFilterNotification{
 typedef enum _NkeSocketDataPropertyType{
     NkeSocketDataPropertyTypeUnknown = 0x0,
     NkeSocketDataPropertyTypePermission = 0x1,
+    NkeSocketDataPropertyTypeStreamConsumed = 0x2,
     
     //
     // just to help a compiler to infer data type
@@ -277,11 +405,6 @@ typedef struct _NkeSocketDataProperty{
     //
     NkeSocketID                 socketId;
     
-    //
-    // a socket sequence to distinguish socket reusage and to not apply properties to reused socket
-    //
-    UInt64                      socketSequence;
-    
     union{
         
         //
@@ -291,11 +414,20 @@ typedef struct _NkeSocketDataProperty{
             uint8_t allowData;
         } permission;
         
+        //
+        // NkeSocketDataPropertyTypeStreamConsumed, the client has consumed the direction's stream ring
+        // up to the stream position, the dataIndex is ignored
+        //
+        struct {
+            UInt64  position;
+            uint8_t inbound;
+        } streamConsumed;
+        
     } value;
     
 } NKE_ALIGNMENT NkeSocketDataProperty;
 
-#define kt_NkeSocketDataPropertiesNumber kt_NkeSocketBuffersNumber
+#define kt_NkeSocketDataPropertiesNumber 40
 
 typedef struct _NkeSocketFilterServiceResponse
 {
@@ -306,10 +438,159 @@ typedef struct _NkeSocketFilterServiceResponse
     NkeSocketDataProperty  property[ kt_NkeSocketDataPropertiesNumber ];
     
     //
-    // the terminating value is UIN8_MAX or the entire array is processed
+    // the terminating slice has a zero length or the entire array is processed
     //
-    UInt8   buffersToRelease[ kt_NkeSocketBuffersNumber ];
+    NkeDataSlice  slicesToRelease[ kt_NkeSocketDataSlicesNumber ];
     
 } NKE_ALIGNMENT NkeSocketFilterServiceResponse;
 
+//--------------------------------------------------------------------
+
+//
+// returned by kt_NkeUserClientGetStatistics, the counters are cumulative since the driver was loaded
+//
+typedef struct _NkeFilterStatistics
+{
+    //
+    // the socket objects recycling cache, the allocations satisfied from the cache
+    // and the allocations that went to the general allocator
+    //
+    UInt64  socketObjectsCacheHits;
+    UInt64  socketObjectsCacheMisses;
+    
+    //
+    // the pending packets allocator, the packets being currently allocated, the maximum
+    // number of packets allocated at the same time, the slabs allocated for the packets
+    // and the number of times the per-CPU magazines have been refilled or spilled
+    //
+    UInt64  pendingPacketsInUse;
+    UInt64  pendingPacketsHighWaterMark;
+    UInt64  pendingPacketsSlabs;
+    UInt64  pendingPacketsDepotAccesses;
+    
+    //
+    // the pending packets whose verdict timeout expired before the packet was injected
+    //
+    UInt64  pendingPacketsDeadlinesExpired;
+    
+    //
+    // the number of times a socket exceeded its pending data quota, the inbound streams
+    // are throttled by the receive window and the outbound writers are blocked
+    //
+    UInt64  quotaInboundThrottlings;
+    UInt64  quotaOutboundBlocks;
+    
+    //
+    // the data arena, the bytes allocated for slices, the maximum bytes allocated at the same time
+    // and the number of times a slice was not allocated and the data reporting was postponed
+    //
+    UInt64  dataArenaBytesInUse;
+    UInt64  dataArenaBytesHighWaterMark;
+    UInt64  dataArenaAllocationFailures;
+    
+    //
+    // the data arena resizing, the checks that followed failed allocations, the buffers added
+    // and removed and the buffers currently active
+    //
+    UInt64  dataArenaExhaustionEvents;
+    UInt64  dataArenaBuffersAdded;
+    UInt64  dataArenaBuffersRemoved;
+    UInt64  dataArenaActiveBuffers;
+    
+    //
+    // the notifications with the data truncated by the inspection prefix and the data bytes not copied
+    //
+    UInt64  inspectionTruncatedNotifications;
+    UInt64  inspectionBytesNotCopied;
+    
+    //
+    // the notifications enqueued for the client and the queue bytes they occupied including
+    // the queue entries headers, the events per megabyte of the queue is their ratio
+    //
+    UInt64  notificationsEnqueued;
+    UInt64  notificationsBytesEnqueued;
+    
+    //
+    // the data available messages sent to the client, the messages deferred by the wakeup moderation
+    // and the total and maximal time in microseconds the deferred messages were delayed for
+    //
+    UInt64  notificationWakeups;
+    UInt64  notificationWakeupsDeferred;
+    UInt64  notificationWakeupsDelayMicroseconds;
+    UInt64  notificationWakeupsMaxDelayMicroseconds;
+    
+} NKE_ALIGNMENT NkeFilterStatistics;
+
+//--------------------------------------------------------------------
+
+//
+// a capture policy defines how long a pending packet waits for a verdict and what is done with
+// the packet when the time is out, a policy applies to a socket if the socket's local or remote
+// port is in the [ firstPort, lastPort ] range, the ports are in the host byte order
+//
+typedef struct _NkeCapturePolicy
+{
+    UInt16  firstPort;
+    UInt16  lastPort;
+    
+    //
+    // the verdict timeout in milliseconds, 0x0 is an invalid value
+    //
+    UInt32  verdictTimeout;
+    
+    //
+    // the coalescing window, consecutive packets of the same direction are reported in one notification
+    // until the window holds coalescingMaxBytes or coalescingMaxMicroseconds elapse since the first packet,
+    // the time is rounded up to the driver's timer resolution, a zero coalescingMaxBytes disables coalescing,
+    // coalescingMaxBytes can't exceed kt_NkeCoalescingMaxBytes
+    //
+    UInt32  coalescingMaxBytes;
+    UInt32  coalescingMaxMicroseconds;
+    
+    //
+    // if not zero only the first inspectionPrefixBytes of each direction of a connection are copied
+    // for the client, or the first inspectionPrefixBytes of each notification's data if
+    // inspectionPrefixPerNotification is not zero, the verdict applies to all the notification's data,
+    // inspectionPrefixBytes can't exceed kt_NkeInspectionPrefixMaxBytes
+    //
+    UInt32  inspectionPrefixBytes;
+    UInt8   inspectionPrefixPerNotification;
+    
+    //
+    // if not zero each direction of a connection has a stream ring of streamRingBytes in the data arena
+    // and the data is reported in the ring, the size is in the range [ kt_NkeStreamRingMinBytes,
+    // kt_NkeSocketBufferSizeMax ] and is reduced to the data buffer size, the data that doesn't fit
+    // the ring is truncated, a direction that has a ring keeps reporting in it if the policy changes
+    //
+    UInt32  streamRingBytes;
+    
+    //
+    // if not zero the packet is injected when the verdict timeout expires, else the packet is dropped
+    //
+    UInt8   allowDataOnTimeout;
+    
+} NKE_ALIGNMENT NkeCapturePolicy;
+
+#define kt_NkeCapturePoliciesNumber  0x10
+#define kt_NkeCoalescingMaxBytes     0x40000
+#define kt_NkeInspectionPrefixMaxBytes  0x40000000
+#define kt_NkeStreamRingMinBytes        0x1000
+
+//
+// set by kt_NkeUserClientSetCapturePolicies, the policies are matched in the array order,
+// the default policy applies if there is no match, the policies replace the previous set and apply
+// to the packets that become pending after the call
+//
+typedef struct _NkeCapturePolicies
+{
+    NkeCapturePolicy  defaultPolicy;
+    
+    //
+    // a number of valid entries in the policies array
+    //
+    UInt32            count;
+    NkeCapturePolicy  policies[ kt_NkeCapturePoliciesNumber ];
+    
+} NKE_ALIGNMENT NkeCapturePolicies;
+
 #endif//_NKEUSERTOKERNEL_H
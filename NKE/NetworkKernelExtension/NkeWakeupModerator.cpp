@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#include <kern/clock.h>
+#include <sys/proc.h>
+#include "NkeWakeupModerator.h"
+
+//--------------------------------------------------------------------
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors( NkeWakeupModerator, OSObject )
+
+//--------------------------------------------------------------------
+
+volatile SInt64 NkeWakeupModerator::Wakeups = 0x0;
+volatile SInt64 NkeWakeupModerator::WakeupsDeferred = 0x0;
+volatile SInt64 NkeWakeupModerator::WakeupsDelayMicroseconds = 0x0;
+volatile SInt64 NkeWakeupModerator::WakeupsMaxDelayMicroseconds = 0x0;
+
+//--------------------------------------------------------------------
+
+NkeWakeupModerator* NkeWakeupModerator::withCallback( __in NkeWakeupModeratorCallback callback, __in void* context )
+{
+    assert( callback );
+    
+    NkeWakeupModerator*  newModerator = new NkeWakeupModerator();
+    assert( newModerator );
+    if( ! newModerator ){
+        
+        DBG_PRINT_ERROR(("operator new failed\n"));
+        return NULL;
+    }
+    
+    if( ! newModerator->init() ){
+        
+        DBG_PRINT_ERROR(("init() failed\n"));
+        newModerator->release();
+        return NULL;
+    }
+    
+    newModerator->callback = callback;
+    newModerator->context = context;
+    
+    //
+    // the callback must be set before the thread starts
+    //
+    thread_t   thread;
+    kern_return_t  error = kernel_thread_start( ( thread_continue_t ) &NkeWakeupModerator::ThreadRoutine,
+                                                newModerator,
+                                                &thread );
+    assert( KERN_SUCCESS == error );
+    if( KERN_SUCCESS != error ){
+        
+        DBG_PRINT_ERROR(("kernel_thread_start() failed with an error %d\n", error));
+        newModerator->release();
+        return NULL;
+    }
+    
+    //
+    // release the thread object
+    //
+    thread_deallocate( thread );
+    
+    newModerator->threadStarted = true;
+    
+    return newModerator;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeWakeupModerator::init()
+{
+    if( ! super::init() ){
+        
+        assert( !"super::init() failed" );
+        DBG_PRINT_ERROR(( "super::init() failed\n" ));
+        return false;
+    }
+    
+    this->lock = IOLockAlloc();
+    assert( this->lock );
+    if( ! this->lock ){
+        
+        DBG_PRINT_ERROR(("this->lock = IOLockAlloc() failed\n"));
+        return false;
+    }
+    
+    nanoseconds_to_absolutetime( (uint64_t)NKE_WAKEUP_MODERATION_MAX_DELAY_US * 1000ULL, &this->maxDelay );
+    
+    //
+    // the events are considered sparse until their rate has been measured
+    //
+    uint64_t  now;
+    
+    clock_get_uptime( &now );
+    
+    this->averageInterval = this->maxDelay;
+    this->lastEventTime = now;
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+void NkeWakeupModerator::free()
+{
+    //
+    // the thread references the object so it must have been stopped
+    //
+    assert( ! this->threadStarted || this->threadExited );
+    
+    if( this->lock ){
+        
+        IOLockFree( this->lock );
+        this->lock = NULL;
+    }
+    
+    super::free();
+}
+
+//--------------------------------------------------------------------
+
+void NkeWakeupModerator::stop()
+{
+    if( ! this->threadStarted )
+        return;
+    
+    IOLockLock( this->lock );
+    { // start of the lock
+        
+        this->terminate = true;
+        wakeup( (void*)&this->deferredState );
+        
+        while( ! this->threadExited ){
+            
+            (void)msleep( &this->threadExited,                 // wait channel
+                          (lck_mtx_t*)IOLockGetMachLock( this->lock ), // mutex
+                          PUSER,                               // priority
+                          "NkeWakeupModerator::stop()",        // wait message
+                          NULL );                              // sleep interval
+        } // end while
+        
+    } // end of the lock
+    IOLockUnlock( this->lock );
+}
+
+//--------------------------------------------------------------------
+
+//
+// the deferred wakeup's state is split in the events number and the generation
+//
+#define NKE_DEFERRED_EVENTS( _state )      ( (UInt32)( _state ) )
+#define NKE_DEFERRED_GENERATION( _state )  ( (UInt32)( ( _state ) >> 32 ) )
+#define NKE_DEFERRED_STATE( _generation, _events )  ( ( (UInt64)( _generation ) << 32 ) | (UInt64)( _events ) )
+
+//--------------------------------------------------------------------
+
+void NkeWakeupModerator::updateAverageInterval( __in uint64_t now )
+{
+    UInt64  lastTime;
+    
+    //
+    // the producers take the time concurrently so the last event's time never goes back,
+    // an event that is older than the last one has a zero interval
+    //
+    do{
+        
+        lastTime = this->lastEventTime;
+        if( now <= lastTime )
+            break;
+        
+    } while( ! OSCompareAndSwap64( lastTime, now, &this->lastEventTime ) );
+    
+    uint64_t  interval = ( now > lastTime ) ? ( now - lastTime ) : 0x0;
+    
+    //
+    // an exponential moving average with a weight of 1/8, an idle period moves the average
+    // to the sparse events by no more than the delay bound
+    //
+    if( interval > this->maxDelay )
+        interval = this->maxDelay;
+    
+    UInt64  average;
+    
+    do{
+        
+        average = this->averageInterval;
+        
+    } while( ! OSCompareAndSwap64( average, average - average / 0x8 + interval / 0x8, &this->averageInterval ) );
+}
+
+//--------------------------------------------------------------------
+
+//
+// must be called with the lock held
+//
+bool NkeWakeupModerator::completeDeferredWakeup( __in UInt32 generation, __in uint64_t now )
+{
+    UInt64  state;
+    
+    //
+    // the producers add the events concurrently
+    //
+    do{
+        
+        state = this->deferredState;
+        if( generation != NKE_DEFERRED_GENERATION( state ) || 0x0 == NKE_DEFERRED_EVENTS( state ) )
+            return false;
+        
+    } while( ! OSCompareAndSwap64( state, NKE_DEFERRED_STATE( generation + 0x1, 0x0 ), &this->deferredState ) );
+    
+    uint64_t  delay = 0x0;
+    
+    absolutetime_to_nanoseconds( now - this->firstDeferredEventTime, &delay );
+    delay = delay / 1000ULL;
+    
+    OSIncrementAtomic64( &NkeWakeupModerator::Wakeups );
+    OSAddAtomic64( (SInt64)delay, &NkeWakeupModerator::WakeupsDelayMicroseconds );
+    
+    SInt64  maxDelay;
+    
+    do{
+        
+        maxDelay = NkeWakeupModerator::WakeupsMaxDelayMicroseconds;
+        if( (SInt64)delay <= maxDelay )
+            break;
+            
+    } while( ! OSCompareAndSwap64( (UInt64)maxDelay, (UInt64)delay,
+                                  (volatile UInt64*)&NkeWakeupModerator::WakeupsMaxDelayMicroseconds ) );
+    
+    return true;
+}
+
+//--------------------------------------------------------------------
+
+bool NkeWakeupModerator::eventEnqueued( __in bool queueWasEmpty )
+{
+    bool      wakeupNow = false;
+    uint64_t  now;
+    UInt64    state;
+    
+    clock_get_uptime( &now );
+    
+    this->updateAverageInterval( now );
+    
+    //
+    // the event is added to the deferred wakeup, the thread sends the wakeup on the delay bound
+    // or the idle period, the producer that reaches the threshold completes the wakeup
+    //
+    do{
+        
+        state = this->deferredState;
+        if( 0x0 == NKE_DEFERRED_EVENTS( state ) )
+            break;
+        
+    } while( ! OSCompareAndSwap64( state, state + 0x1, &this->deferredState ) );
+    
+    if( 0x0 != NKE_DEFERRED_EVENTS( state ) ){
+        
+        if( NKE_DEFERRED_EVENTS( state ) + 0x1 < this->eventsThreshold )
+            return false;
+        
+        IOLockLock( this->lock );
+        { // start of the lock
+            
+            wakeupNow = this->completeDeferredWakeup( NKE_DEFERRED_GENERATION( state ), now );
+            
+        } // end of the lock
+        IOLockUnlock( this->lock );
+        
+        return wakeupNow;
+    }
+    
+    //
+    // the queue was not empty and there is no deferred wakeup, the client has been woken up
+    // and drains the queue until it is empty so it will find the event
+    //
+    if( ! queueWasEmpty )
+        return false;
+    
+    UInt64  average = this->averageInterval;
+    UInt64  expectedEvents = this->maxDelay / ( average ? average : 0x1 );
+    
+    if( expectedEvents < NKE_WAKEUP_MODERATION_MIN_EVENTS ){
+        
+        //
+        // the sparse events are not delayed
+        //
+        OSIncrementAtomic64( &NkeWakeupModerator::Wakeups );
+        return true;
+    }
+    
+    IOLockLock( this->lock );
+    { // start of the lock
+        
+        //
+        // a wakeup armed concurrently is sent after this event has been published so it covers the event
+        //
+        state = this->deferredState;
+        if( 0x0 == NKE_DEFERRED_EVENTS( state ) ){
+            
+            this->eventsThreshold = ( expectedEvents < NKE_WAKEUP_MODERATION_MAX_EVENTS ) ?
+                                    (UInt32)expectedEvents : NKE_WAKEUP_MODERATION_MAX_EVENTS;
+            this->firstDeferredEventTime = now;
+            
+            //
+            // the producers change the state only if it has the events so the swap does not fail,
+            // the swap is a barrier for the threshold
+            //
+            if( OSCompareAndSwap64( state, NKE_DEFERRED_STATE( NKE_DEFERRED_GENERATION( state ), 0x1 ), &this->deferredState ) ){
+                
+                OSIncrementAtomic64( &NkeWakeupModerator::WakeupsDeferred );
+                wakeup( (void*)&this->deferredState );
+            }
+        }
+        
+    } // end of the lock
+    IOLockUnlock( this->lock );
+    
+    return false;
+}
+
+//--------------------------------------------------------------------
+
+void NkeWakeupModerator::ThreadRoutine( __in NkeWakeupModerator* moderator )
+{
+    IOLockLock( moderator->lock );
+    
+    while( ! moderator->terminate ){
+        
+        struct timespec   ts;
+        struct timespec*  timeout = NULL;
+        UInt64            state = moderator->deferredState;
+        
+        if( 0x0 != NKE_DEFERRED_EVENTS( state ) ){
+            
+            uint64_t  now;
+            uint64_t  deadline = moderator->firstDeferredEventTime + moderator->maxDelay;
+            uint64_t  idleDeadline = moderator->lastEventTime +
+                                     moderator->averageInterval * NKE_WAKEUP_MODERATION_IDLE_INTERVALS;
+            
+            if( idleDeadline < deadline )
+                deadline = idleDeadline;
+            
+            clock_get_uptime( &now );
+            
+            if( now >= deadline ){
+                
+                //
+                // a producer might have completed the wakeup or added an event, the state is sampled again
+                //
+                if( moderator->completeDeferredWakeup( NKE_DEFERRED_GENERATION( state ), now ) ){
+                    
+                    //
+                    // the callback sends the message under the queue's lock, the producers calling
+                    // eventEnqueued() are not blocked while the message is being sent
+                    //
+                    IOLockUnlock( moderator->lock );
+                    {
+                        moderator->callback( moderator->context );
+                    }
+                    IOLockLock( moderator->lock );
+                }
+                
+                continue;
+            }
+            
+            uint64_t  interval = 0x0;
+            
+            absolutetime_to_nanoseconds( deadline - now, &interval );
+            
+            ts.tv_sec = (long)( interval / 1000000000ULL );
+            ts.tv_nsec = (long)( interval % 1000000000ULL );
+            
+            //
+            // a zero timeout is an infinite wait for msleep
+            //
+            if( 0x0 == ts.tv_sec && 0x0 == ts.tv_nsec )
+                ts.tv_nsec = 0x1;
+            
+            timeout = &ts;
+        }
+        
+        (void)msleep( (void*)&moderator->deferredState,         // wait channel
+                      (lck_mtx_t*)IOLockGetMachLock( moderator->lock ), // mutex
+                      PUSER,                                    // priority
+                      "NkeWakeupModerator::ThreadRoutine()",    // wait message
+                      timeout );                                // sleep interval
+                      
+    } // end while
+    
+    moderator->threadExited = true;
+    wakeup( &moderator->threadExited );
+    
+    IOLockUnlock( moderator->lock );
+    
+    thread_terminate( current_thread() );
+}
+
+//--------------------------------------------------------------------
+
+void NkeWakeupModerator::GetStatistics( __inout NkeFilterStatistics* statistics )
+{
+    statistics->notificationWakeups = NkeWakeupModerator::Wakeups;
+    statistics->notificationWakeupsDeferred = NkeWakeupModerator::WakeupsDeferred;
+    statistics->notificationWakeupsDelayMicroseconds = NkeWakeupModerator::WakeupsDelayMicroseconds;
+    statistics->notificationWakeupsMaxDelayMicroseconds = NkeWakeupModerator::WakeupsMaxDelayMicroseconds;
+}
+
+//--------------------------------------------------------------------
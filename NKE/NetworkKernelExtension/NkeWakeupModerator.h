@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2012 Slava Imameev. All rights reserved.
+ */
+
+#ifndef _NKEWAKEUPMODERATOR_H
+#define _NKEWAKEUPMODERATOR_H
+
+#include <IOKit/IOLocks.h>
+
+#include "NkeCommon.h"
+#include "NkeUserToKernel.h"
+
+//--------------------------------------------------------------------
+
+//
+// a deferred wakeup is never delayed for more than NKE_WAKEUP_MODERATION_MAX_DELAY_US
+// after the first event it covers
+//
+#define NKE_WAKEUP_MODERATION_MAX_DELAY_US    500
+
+//
+// the limits for the number of events a deferred wakeup waits for
+//
+#define NKE_WAKEUP_MODERATION_MIN_EVENTS      0x2
+#define NKE_WAKEUP_MODERATION_MAX_EVENTS      0x40
+
+//
+// a deferred wakeup is sent if there is no event for NKE_WAKEUP_MODERATION_IDLE_INTERVALS
+// average intervals between the events
+//
+#define NKE_WAKEUP_MODERATION_IDLE_INTERVALS  0x4
+
+//--------------------------------------------------------------------
+
+//
+// called by the moderator's thread without the moderator's lock to send a deferred wakeup
+//
+typedef void (*NkeWakeupModeratorCallback)( __in void* context );
+
+//--------------------------------------------------------------------
+
+//
+// moderates the data available messages sent to a client like a network adapter moderates
+// its interrupts, the client is woken up at once when the events are sparse, when the events
+// arrive faster than the delay bound a wakeup is deferred until the expected number of events
+// has been enqueued, the events stop for a few average intervals or the delay bound expires,
+// the thresholds follow the average interval between the events
+//
+
+class NkeWakeupModerator: public OSObject{
+    
+    OSDeclareDefaultStructors( NkeWakeupModerator );
+
+private:
+    
+    //
+    // the deferred wakeup's state, the low 32 bits are the number of the events the client has not been
+    // woken up for or zero if there is no deferred wakeup, the high 32 bits are the wakeup's generation
+    // increased when the wakeup completes, the producers add the events by a compare and swap, the wakeup
+    // is armed and completed under the lock, also a wait channel for the thread
+    //
+    volatile UInt64     deferredState;
+    
+    //
+    // the times are in the absolute time units, the producers update lastEventTime and averageInterval
+    // by a compare and swap
+    //
+    volatile UInt64     lastEventTime;
+    volatile UInt64     averageInterval;
+    uint64_t            maxDelay;
+    
+    //
+    // protects the fields below and serializes arming and completing the deferred wakeup,
+    // eventsThreshold is set before the wakeup is armed so the producers read it without the lock
+    //
+    IOLock*             lock;
+    
+    volatile UInt32     eventsThreshold;
+    uint64_t            firstDeferredEventTime;
+    
+    bool                terminate;
+    bool                threadStarted;
+    bool                threadExited;
+    
+    NkeWakeupModeratorCallback  callback;
+    void*               context;
+    
+    static volatile SInt64  Wakeups;
+    static volatile SInt64  WakeupsDeferred;
+    static volatile SInt64  WakeupsDelayMicroseconds;
+    static volatile SInt64  WakeupsMaxDelayMicroseconds;
+    
+    static void ThreadRoutine( __in NkeWakeupModerator* moderator );
+    
+    //
+    // adds the interval from the last event to the moving average
+    //
+    void updateAverageInterval( __in uint64_t now );
+    
+    //
+    // must be called with the lock held, clears the deferred wakeup of the generation and accounts its delay,
+    // returns false if the wakeup has been completed already
+    //
+    bool completeDeferredWakeup( __in UInt32 generation, __in uint64_t now );
+
+protected:
+    
+    virtual bool init();
+    virtual void free();
+
+public:
+    
+    static NkeWakeupModerator* withCallback( __in NkeWakeupModeratorCallback callback, __in void* context );
+    
+    //
+    // called for each published event by the producer that published it, queueWasEmpty is true
+    // if the client might have found the queue empty, returns true if the caller must wake up the client
+    //
+    bool eventEnqueued( __in bool queueWasEmpty );
+    
+    //
+    // stops the thread, must be called before the last reference is released,
+    // the callback is not called after the function returns
+    //
+    void stop();
+    
+    static void GetStatistics( __inout NkeFilterStatistics* statistics );
+};
+
+//--------------------------------------------------------------------
+
+#endif // _NKEWAKEUPMODERATOR_H
@@ -10,8 +10,9 @@
 
 //--------------------------------------------------------------------
 
-// The returned connection must be closed by calling IOServiceClose
-kern_return_t NkeOpenDlDriver(io_connect_t* connection)
+// The returned connection must be closed by calling IOServiceClose, queuesNumber is the number
+// of the socket filter queues, bufferSize and buffersNumber receive the shared data buffers geometry
+kern_return_t NkeOpenDlDriver(io_connect_t* connection, uint32_t queuesNumber, uint32_t* bufferSize, uint32_t* buffersNumber)
 {
     kern_return_t   kr;
     io_iterator_t   iterator;
@@ -51,13 +52,26 @@ kern_return_t NkeOpenDlDriver(io_connect_t* connection)
         return kr;
     }
     
-    kr = IOConnectCallScalarMethod( *connection, kt_NkeUserClientOpen, NULL, 0, NULL, NULL);
+    // The notifications are compact, see main.cpp for how they are dequeued
+    uint64_t input[ 3 ] = { NkeDriverInterfaceVersion, kt_NkeOpenFlagCompactNotifications, queuesNumber };
+    uint64_t geometry[ 2 ] = { 0, 0 };
+    uint32_t geometryCount = 2;
+    
+    kr = IOConnectCallScalarMethod( *connection, kt_NkeUserClientOpen, input, 3, geometry, &geometryCount);
+    if (kr == kIOReturnUnsupported) {
+        (void)IOServiceClose( *connection );
+        printf("NetworkKernelExtension interface version mismatch\n");
+        return kr;
+    }
     if (kr != KERN_SUCCESS) {
         (void)IOServiceClose( *connection );
         printf(("NetworkKernelExtension service is busy\n"));
         return kr;
     }
     
+    *bufferSize = (uint32_t)geometry[ 0 ];
+    *buffersNumber = (uint32_t)geometry[ 1 ];
+    
     return kr;
     
 }
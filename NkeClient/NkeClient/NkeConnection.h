@@ -24,6 +24,6 @@
 
 #include "../../NKE/NetworkKernelExtension/NkeUserToKernel.h"
 
-kern_return_t NkeOpenDlDriver(io_connect_t* connection);
+kern_return_t NkeOpenDlDriver(io_connect_t* connection, uint32_t queuesNumber, uint32_t* bufferSize, uint32_t* buffersNumber);
 
 #endif /* defined(__NkeClient__NkeConnection__) */
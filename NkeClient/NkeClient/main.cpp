@@ -21,11 +21,28 @@
 
 //-------------------------------------------------------------
 
+// The number of the socket filter queues, each queue is consumed by its own thread,
+// the notifications of a socket are always in the same queue
+#define NKE_CLIENT_QUEUES_NUMBER 4
+
 io_connect_t    connection;
+uint32_t        dataBufferSize;
+uint32_t        dataBuffersNumber;
+
+// The data arena, a slice is at arenaAddress + slice.offset, the arena is mapped again
+// under the write lock once per resize, arenaGeneration is the generation of the last
+// resize notification the mapping covers, this client doesn't read the slices' data, it only
+// returns the slices, a thread reading the data must hold the read lock while it does
+mach_vm_address_t   arenaAddress = 0;
+mach_vm_size_t      arenaSize = 0;
+uint32_t            arenaGeneration = 0;
+pthread_rwlock_t    arenaLock = PTHREAD_RWLOCK_INITIALIZER;
+
+volatile bool       quit = false;
 
 //-------------------------------------------------------------
 
-void NkeSocketHandler(io_connect_t connection); // Previously IOReturn
+void NkeSocketHandler(uintptr_t queueIndex); // Previously IOReturn
 const char* NkeEventToString(NkeSocketFilterEvent   event);
 void NkeInitTermios(void);
 void NkeResetTermios(void);
@@ -37,15 +54,29 @@ int main(int argc, const char * argv[])
 {
     
     kern_return_t   kr;
-    pthread_t       nkeSocketThread;
+    pthread_t       nkeSocketThreads[ NKE_CLIENT_QUEUES_NUMBER ];
     int error;
     
     // Connect to NKE filter driver
-    kr = NkeOpenDlDriver( &connection );
+    kr = NkeOpenDlDriver( &connection, NKE_CLIENT_QUEUES_NUMBER, &dataBufferSize, &dataBuffersNumber );
     if (KERN_SUCCESS != kr) {
         return (-1);
     }
     
+    // Map the data arena into process address space
+    // Will call clientMemoryForType() inside our user client class
+    kr = IOConnectMapMemory( connection,
+                             kt_NkeAclTypeSocketData,
+                             mach_task_self(),
+                             &arenaAddress,
+                             &arenaSize,
+                             kIOMapAnywhere );
+    if( kr != kIOReturnSuccess ){
+        printf("failed to map the data arena (%d)\n",kr);
+        IOServiceClose(connection);
+        return (-1);
+    }
+    
     // Open device node for sending ioctls
     int fd = open("/dev/archon", O_RDWR);
     if (fd < 0) {
@@ -61,21 +92,33 @@ int main(int argc, const char * argv[])
     }
     close(fd);
     
-    // Create thread for handling socket notifications
-    error = pthread_create(&nkeSocketThread, (pthread_attr_t *)0,
-                            (void* (*)(void*))NkeSocketHandler, (void *)connection);
+    NkeInitTermios();
+    printf("Press 'q' to handle remaining notifications and exit...\n");
+    
+    // Create a thread for handling socket notifications for each queue
+    for( uintptr_t i = 0; i < NKE_CLIENT_QUEUES_NUMBER; ++i ){
+        
+        error = pthread_create(&nkeSocketThreads[ i ], (pthread_attr_t *)0,
+                                (void* (*)(void*))NkeSocketHandler, (void *)i);
 
-    if (error) {
-        perror("pthread_create( SocketNotificationHandler )");
-        nkeSocketThread = NULL;
+        if (error) {
+            perror("pthread_create( SocketNotificationHandler )");
+            nkeSocketThreads[ i ] = NULL;
+        }
     }
 
-    if (nkeSocketThread) {
-        pthread_join(nkeSocketThread, (void **)&kr);
+    // The first queue's thread checks for 'q'
+    if (nkeSocketThreads[ 0 ]) {
+        pthread_join(nkeSocketThreads[ 0 ], (void **)&kr);
     }
+    
+    quit = true;
 
     printf("Back in main thread!\n");
     
+    // Reset termios to previous configuration
+    NkeResetTermios();
+    
     // Open device node for sending ioctls
     fd = open("/dev/archon", O_RDWR);
     if (fd < 0) {
@@ -90,8 +133,30 @@ int main(int argc, const char * argv[])
     }
     close(fd);
     
+    // Unmap the data arena on exit
+    pthread_rwlock_wrlock(&arenaLock);
+    if( arenaAddress ){
+        kr = IOConnectUnmapMemory( connection,
+                                  kt_NkeAclTypeSocketData,
+                                  mach_task_self(),
+                                  arenaAddress );
+        if( kr != kIOReturnSuccess ){
+            printf("failed to unmap the data arena (%d)\n", kr);
+        }
+        arenaAddress = 0;
+    }
+    pthread_rwlock_unlock(&arenaLock);
+    
+    // The driver sends kt_NkeStopListeningToMessages in each queue when
+    // the connection is closed, this wakes up the other queues' threads
     IOServiceClose(connection);
     
+    for( int i = 1; i < NKE_CLIENT_QUEUES_NUMBER; ++i ){
+        if (nkeSocketThreads[ i ]) {
+            pthread_join(nkeSocketThreads[ i ], NULL);
+        }
+    }
+    
     return 0;
 }
 
@@ -114,7 +179,7 @@ void NkeResetTermios(void)
 
 //-------------------------------------------------------------
 
-void NkeSocketHandler(io_connect_t connection)
+void NkeSocketHandler(uintptr_t queueIndex)
 {
     kern_return_t       kr; // Used throughout function
     uint32_t            dataSize;
@@ -123,8 +188,7 @@ void NkeSocketHandler(io_connect_t connection)
     mach_vm_address_t   address = NULL;
     mach_vm_size_t      size = 0x0;
     mach_port_t         recvPort; // Port for receiving filter notifications
-//    mach_vm_address_t   sharedBuffers[ kt_NkeSocketBuffersNumber ];
-//    mach_vm_size_t      sharedBuffersSize[ kt_NkeSocketBuffersNumber ];
+    uint32_t            queueType = kt_NkeNotifyTypeSocketFilter + (uint32_t)queueIndex;
     
     // Allocate a Mach port to receive notifications from the IODataQueue
     if( !( recvPort = IODataQueueAllocateNotificationPort() ) ){
@@ -132,32 +196,9 @@ void NkeSocketHandler(io_connect_t connection)
         kr = kIOReturnError;
         goto __exit;
     }
-    
-//    // Initialize shared buffers
-//    for( int i = 0; i < kt_NkeSocketBuffersNumber; ++i ){
-//        sharedBuffers[ i ] = NULL;
-//        sharedBuffersSize[ i ] = 0;
-//    }
-//
-//    // Map kernel buffers into process address space
-//    for( int i = 0; i < kt_NkeSocketBuffersNumber; ++i ){
-//
-//        // Will call clientMemoryForType() inside our user client class
-//        kr = IOConnectMapMemory( connection,
-//                                 kt_NkeAclTypeSocketDataBase + i,
-//                                 mach_task_self(),
-//                                 &sharedBuffers[ i ],
-//                                 &sharedBuffersSize[ i ],
-//                                 kIOMapAnywhere );
-//
-//        if( kr != kIOReturnSuccess ){
-//            printf("failed to map memory (%d)\n",kr);
-//            goto __exit;
-//        }
-//    }
 
     // Will call registerNotificationPort() inside our user client class
-    kr = IOConnectSetNotificationPort(connection, kt_NkeNotifyTypeSocketFilter, recvPort, 0);
+    kr = IOConnectSetNotificationPort(connection, queueType, recvPort, 0);
     if( kr != kIOReturnSuccess ){
         printf("failed to register notification port (%d)\n", kr);
         goto __exit;
@@ -166,7 +207,7 @@ void NkeSocketHandler(io_connect_t connection)
     // Map a buffer used to deliver events from the filter, a data queue is implemented over it,
     // Will call clientMemoryForType() inside our user client class
     kr = IOConnectMapMemory( connection,
-                            kt_NkeNotifyTypeSocketFilter,
+                            queueType,
                             mach_task_self(),
                             &address,
                             &size,
@@ -179,49 +220,95 @@ void NkeSocketHandler(io_connect_t connection)
     queueMappedMemory = (IODataQueueMemory *)address;
     queueMappedMemorySize = size;
     
-    // Set up exit condition
-    bool quit;
-    quit = false;
-    NkeInitTermios();
-    printf("Press 'q' to handle remaining notifications and exit...\n");
-    
     // While loop for filter notifications (queueMappedMemory and recvPort must be non-NULL)
     while( kIOReturnSuccess == IODataQueueWaitForAvailableData(queueMappedMemory, recvPort) && !quit ) {
         
         // Check for 'q' on stdin
-        char command = getchar();
-        printf("command is: %c\n", command);
-        if (command == 'q') {
-            quit = true;
+        if( 0 == queueIndex ){
+            char command = getchar();
+            printf("command is: %c\n", command);
+            if (command == 'q') {
+                quit = true;
+            }
         }
         
         // While loop for handling available filter notifications
         while( IODataQueueDataAvailable(queueMappedMemory) ){
             
+            // A compact notification is shorter than the structure, the zeroed tail
+            // makes it the full notification with a terminating slice
             NkeSocketFilterNotification notification;
+            bzero(&notification, sizeof(notification));
             dataSize = sizeof(notification);
             
             // Extract event descriptor from data queue
             kr = IODataQueueDequeue(queueMappedMemory, &notification, &dataSize);
             if( kr == kIOReturnSuccess ){
+                
+                // The connection has been closed
+                if( dataSize == sizeof(uint32_t) && *(uint32_t*)&notification == (uint32_t)kt_NkeStopListeningToMessages ){
+                    quit = true;
+                    break;
+                }
+                
                 time_t current = time(NULL);
                 
-                printf("NKE event: %s", NkeEventToString( notification.event ) );
+                printf("NKE event %u: %s", (unsigned int)queueIndex, NkeEventToString( notification.event ) );
                 printf("\t%s\n", ctime(&current));
                 
+                if( notification.event == NkeSocketFilterEventDataArenaResized ){
+                    
+                    // The mapping doesn't have the memory of an added buffer, map the arena again,
+                    // the arena is mapped by the first thread that receives a notification with
+                    // a generation the mapping doesn't cover
+                    pthread_rwlock_wrlock(&arenaLock);
+                    
+                    if( arenaAddress && notification.eventData.arenaResized.generation > arenaGeneration ){
+                        arenaGeneration = notification.eventData.arenaResized.generation;
+                        
+                        IOConnectUnmapMemory( connection, kt_NkeAclTypeSocketData, mach_task_self(), arenaAddress );
+                        arenaAddress = 0;
+                        arenaSize = 0;
+                        
+                        kr = IOConnectMapMemory( connection,
+                                                 kt_NkeAclTypeSocketData,
+                                                 mach_task_self(),
+                                                 &arenaAddress,
+                                                 &arenaSize,
+                                                 kIOMapAnywhere );
+                        if( kr != kIOReturnSuccess ){
+                            printf("failed to map the data arena (%d)\n", kr);
+                        }
+                    }
+                    
+                    pthread_rwlock_unlock(&arenaLock);
+                }
+                
                 if( notification.event == NkeSocketFilterEventDataIn || notification.event == NkeSocketFilterEventDataOut ){
                     
                     // Create a response to the filter
                     NkeSocketFilterServiceResponse response;
                     bzero(&response, sizeof( response ));
                     
-                    memcpy( response.buffersToRelease, notification.eventData.inputoutput.buffers, sizeof( response.buffersToRelease ) );
+                    memcpy( response.slicesToRelease, notification.eventData.inputoutput.slices, sizeof( response.slicesToRelease ) );
                     response.property[ 0 ].type = NkeSocketDataPropertyTypePermission;
                     response.property[ 0 ].socketId = notification.socketId;
                     response.property[ 0 ].dataIndex = notification.eventData.inputoutput.dataIndex;
                     response.property[ 0 ].value.permission.allowData = 0x1;
                     
-                    response.property[ 1 ].type = NkeSocketDataPropertyTypeUnknown; // a terminating entry
+                    // The data reported in a stream ring has been consumed
+                    int last = 1;
+                    if( 0x0 != notification.eventData.inputoutput.streamRing.length ){
+                        
+                        response.property[ 1 ].type = NkeSocketDataPropertyTypeStreamConsumed;
+                        response.property[ 1 ].socketId = notification.socketId;
+                        response.property[ 1 ].value.streamConsumed.position = notification.eventData.inputoutput.streamPosition +
+                                                                                notification.eventData.inputoutput.copiedSize;
+                        response.property[ 1 ].value.streamConsumed.inbound = ( notification.event == NkeSocketFilterEventDataIn ) ? 0x1 : 0x0;
+                        last = 2;
+                    }
+                    
+                    response.property[ last ].type = NkeSocketDataPropertyTypeUnknown; // a terminating entry
                     
                     // Send to the driver (the driver will inject data synchronously)
                     size_t notUsed = sizeof(response);
@@ -247,27 +334,9 @@ void NkeSocketHandler(io_connect_t connection)
     
 __exit:
     
-    // Reset termios to previous configuration
-    NkeResetTermios();
-    
-//    // Unmap memory buffers on exit
-//    for( int i = 0; i < kt_NkeSocketBuffersNumber; ++i ){
-//
-//        if( !sharedBuffers[ i ] )
-//            continue;
-//
-//        kr = IOConnectUnmapMemory( connection,
-//                                   kt_NkeAclTypeSocketDataBase + i,
-//                                   mach_task_self(),
-//                                   sharedBuffers[ i ] );
-//        if( kr != kIOReturnSuccess ){
-//            printf("failed to unmap memory (%d)\n", kr);
-//        }
-//    }
-    
     if( address ){
         kr = IOConnectUnmapMemory( connection,
-                                  kt_NkeNotifyTypeSocketFilter,
+                                  queueType,
                                   mach_task_self(),
                                   address );
         if( kr != kIOReturnSuccess ){
@@ -301,6 +370,7 @@ const char* NkeEventToString( NkeSocketFilterEvent event )
         case NkeSocketFilterEventBound: return "NkeSocketFilterEventBound";
         case NkeSocketFilterEventDataIn: return "NkeSocketFilterEventDataIn";
         case NkeSocketFilterEventDataOut: return "NkeSocketFilterEventDataOut";
+        case NkeSocketFilterEventDataArenaResized: return "NkeSocketFilterEventDataArenaResized";
         default: return "UNKNOWN";
     }
 }